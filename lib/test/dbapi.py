@@ -21,9 +21,13 @@
 #    misrepresented as being the original software.
 # 3. This notice may not be removed or altered from any source distribution.
 
+import os
+import shutil
+import tempfile
 import unittest
 import sys
 import threading
+import time
 import pysqlite2.dbapi2 as sqlite
 
 class ModuleTests(unittest.TestCase):
@@ -622,6 +626,82 @@ class ThreadTests(unittest.TestCase):
         if len(errors) > 0:
             self.fail("\n".join(errors))
 
+class SerializedConnectionTests(unittest.TestCase):
+    def setUp(self):
+        self.con = sqlite.connect(":memory:", serialized=True)
+        self.con.execute("create table test(id integer primary key, name text)")
+        self.con.commit()
+
+    def tearDown(self):
+        self.con.close()
+
+    def CheckSerialized(self):
+        self.assertEqual(self.con.serialized, True)
+        con = sqlite.connect(":memory:")
+        self.assertEqual(con.serialized, False)
+
+    def CheckSharedBetweenThreads(self):
+        def run(n, errors):
+            try:
+                cur = self.con.cursor()
+                for i in range(20):
+                    cur.execute("insert into test(name) values (?)", ("%d-%d" % (n, i),))
+                    cur.execute("select count(*) from test where name like ?", ("%d-%%" % n,))
+                    if cur.fetchone()[0] != i + 1:
+                        errors.append("wrong count in thread %d" % n)
+                self.con.commit()
+            except Exception, e:
+                errors.append(str(e))
+
+        errors = []
+        threads = [threading.Thread(target=run, args=(n, errors)) for n in range(5)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        if len(errors) > 0:
+            self.fail("\n".join(errors))
+        self.assertEqual(self.con.execute("select count(*) from test").fetchone()[0], 100)
+
+    def CheckReentrant(self):
+        # a function that uses the connection while a statement of the same
+        # thread holds the lock
+        def names():
+            return self.con.execute("select count(*) from test").fetchone()[0]
+        self.con.create_function("names", 0, names)
+        self.con.execute("insert into test(name) values ('a')")
+        self.assertEqual(self.con.execute("select names()").fetchone()[0], 1)
+
+    def CheckRegisterWhileQuerying(self):
+        self.con.executemany("insert into test(name) values (?)", [(str(i),) for i in range(200)])
+        self.con.commit()
+        def query(errors):
+            try:
+                for i in range(20):
+                    rows = self.con.cursor().execute("select name from test").fetchall()
+                    if len(rows) != 200:
+                        errors.append("wrong row count")
+            except Exception, e:
+                errors.append(str(e))
+        def register(errors):
+            try:
+                for i in range(20):
+                    self.con.create_function("f%d" % i, 1, lambda x: x)
+                    self.con.create_collation("c%d" % i, cmp)
+                    self.con.cursor()
+            except Exception, e:
+                errors.append(str(e))
+
+        errors = []
+        threads = [threading.Thread(target=query, args=(errors,)) for n in range(2)]
+        threads.append(threading.Thread(target=register, args=(errors,)))
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        if len(errors) > 0:
+            self.fail("\n".join(errors))
+
 class ConstructorTests(unittest.TestCase):
     def CheckDate(self):
         d = sqlite.Date(2004, 10, 28)
@@ -711,6 +791,564 @@ class ExtensionTests(unittest.TestCase):
         result = con.execute("select foo from test").fetchone()[0]
         self.assertEqual(result, 5, "Basic test of Connection.executescript")
 
+class PreparedStatementTests(unittest.TestCase):
+    def setUp(self):
+        self.con = sqlite.connect(":memory:")
+        self.con.execute("create table test(id integer, name text)")
+
+    def tearDown(self):
+        self.con.close()
+
+    def CheckExecuteAndFetch(self):
+        stmt = self.con("select ?, ?")
+        self.assertEqual(stmt.execute((1, "a")).fetchone(), (1, u"a"))
+        self.assertEqual(stmt.fetchone(), None)
+        self.assertEqual(stmt.execute((2, "b")).fetchall(), [(2, u"b")])
+
+    def CheckExecutemany(self):
+        ins = self.con("insert into test(id, name) values (?, ?)")
+        ins.executemany([(1, "a"), (2, "b"), (3, "c")])
+        sel = self.con("select id from test order by id")
+        self.assertEqual([row[0] for row in sel.execute()], [1, 2, 3])
+
+    def CheckExecutemanySelect(self):
+        stmt = self.con("select ?")
+        self.assertRaises(sqlite.ProgrammingError, stmt.executemany, [(1,), (2,)])
+
+    def CheckBindThenExecute(self):
+        stmt = self.con("select :x * 2")
+        stmt.bind({"x": 21})
+        self.assertEqual(stmt.execute().fetchone(), (42,))
+        self.assertEqual(stmt.execute().fetchone(), (42,))
+
+    def CheckReset(self):
+        self.con.executemany("insert into test(id) values (?)", [(1,), (2,)])
+        stmt = self.con("select id from test order by id")
+        self.assertEqual(stmt.execute().fetchone(), (1,))
+        stmt.reset()
+        self.assertEqual(stmt.fetchone(), None)
+
+    def CheckTextFactory(self):
+        self.con.text_factory = str
+        self.assertEqual(self.con("select 'x'").execute().fetchone(), ("x",))
+
+    def CheckKeepsConnectionAlive(self):
+        stmt = sqlite.connect(":memory:")("select 1")
+        self.assertEqual(stmt.execute().fetchone(), (1,))
+
+    def CheckClosedConnection(self):
+        stmt = self.con("select 1")
+        self.con.close()
+        self.assertRaises(sqlite.ProgrammingError, stmt.execute)
+
+    def CheckCachedStatementsDontKeepConnectionAlive(self):
+        con = sqlite.connect(":memory:")
+        refs = sys.getrefcount(con)
+        con.execute("select 1").fetchall()
+        con.execute("select 2").fetchall()
+        self.assertEqual(sys.getrefcount(con), refs)
+
+    def CheckReadOnlyNoTransaction(self):
+        self.con.commit()
+        self.con("select id from test").execute().fetchall()
+        self.assertFalse(self.con.in_transaction)
+        self.con("insert into test(id) values (1)").execute()
+        self.assertTrue(self.con.in_transaction)
+
+    def CheckFetchAcrossRollback(self):
+        self.con.executemany("insert into test(id) values (?)", [(1,), (2,), (3,)])
+        stmt = self.con("select id from test order by id")
+        self.assertEqual(stmt.execute().fetchone(), (1,))
+        self.con.rollback()
+        self.assertRaises(sqlite.InterfaceError, stmt.fetchone)
+        self.assertEqual(stmt.fetchone(), None)
+
+class ConnectionPoolTests(unittest.TestCase):
+    def setUp(self):
+        self.pool = sqlite.ConnectionPool(":memory:", size=2)
+
+    def tearDown(self):
+        self.pool.close()
+
+    def CheckReuse(self):
+        con = self.pool.acquire()
+        con.execute("create table test(x)")
+        con.commit()
+        self.pool.release(con)
+        self.assertTrue(self.pool.acquire() is con)
+
+    def CheckCounts(self):
+        self.assertEqual(self.pool.idle, 1)
+        a = self.pool.acquire()
+        b = self.pool.acquire()
+        self.assertEqual((self.pool.idle, self.pool.in_use), (0, 2))
+        self.pool.release(a)
+        self.pool.release(b)
+        self.assertEqual((self.pool.idle, self.pool.in_use), (2, 0))
+
+    def CheckExhausted(self):
+        self.pool.acquire()
+        self.pool.acquire()
+        self.assertRaises(sqlite.OperationalError, self.pool.acquire, 0.01)
+
+    def CheckReleaseRollsBack(self):
+        con = self.pool.acquire()
+        con.execute("create table test(x)")
+        con.commit()
+        con.execute("insert into test(x) values (1)")
+        self.pool.release(con)
+        con = self.pool.acquire()
+        self.assertEqual(con.execute("select count(*) from test").fetchone()[0], 0)
+
+    def CheckReleaseForeign(self):
+        con = sqlite.connect(":memory:")
+        self.assertRaises(sqlite.ProgrammingError, self.pool.release, con)
+
+    def CheckClosedConnectionIsDropped(self):
+        con = self.pool.acquire()
+        con.close()
+        self.pool.release(con)
+        self.assertEqual(self.pool.idle, 0)
+        self.assertFalse(self.pool.acquire() is con)
+
+    def CheckBrokenIdleConnectionIsReplaced(self):
+        con = self.pool.acquire()
+        self.pool.release(con)
+        # used behind the pool's back, it is left in a transaction
+        con.execute("create table test(x)")
+        self.assertTrue(con.in_transaction)
+        other = self.pool.acquire()
+        self.assertFalse(other is con)
+        self.assertRaises(sqlite.ProgrammingError, con.cursor)
+
+    def CheckConcurrentOpenKeepsSize(self):
+        opened = []
+        class SlowConnection(sqlite.Connection):
+            def __init__(self, *args, **kwargs):
+                time.sleep(0.05)
+                sqlite.Connection.__init__(self, *args, **kwargs)
+                opened.append(self)
+        pool = sqlite.ConnectionPool(":memory:", size=2, factory=SlowConnection,
+                                     check_same_thread=False)
+        acquired = []
+        def acquire():
+            try:
+                acquired.append(pool.acquire(0.3))
+            except sqlite.OperationalError:
+                pass
+        threads = [threading.Thread(target=acquire) for i in range(6)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(len(acquired), 2)
+        self.assertEqual(len(opened), 2)
+        self.assertEqual(pool.in_use, 2)
+        for con in acquired:
+            pool.release(con)
+        pool.close()
+
+    def CheckMaxIdle(self):
+        pool = sqlite.ConnectionPool(":memory:", max_idle=1)
+        con = pool.acquire()
+        pool.release(con)
+        time.sleep(2.1)
+        self.assertFalse(pool.acquire() is con)
+        self.assertRaises(sqlite.ProgrammingError, con.cursor)
+
+    def CheckHandOverToThread(self):
+        con = self.pool.acquire()
+        con.execute("create table test(x)")
+        con.commit()
+        self.pool.release(con)
+
+        errors = []
+        def run():
+            try:
+                con2 = self.pool.acquire()
+                con2.execute("insert into test(x) values (1)")
+                con2.commit()
+                self.pool.release(con2)
+            except Exception, e:
+                errors.append(str(e))
+        t = threading.Thread(target=run)
+        t.start()
+        t.join()
+        if errors:
+            self.fail("\n".join(errors))
+        con = self.pool.acquire()
+        self.assertEqual(con.execute("select count(*) from test").fetchone()[0], 1)
+
+    def CheckWaitsForRelease(self):
+        a = self.pool.acquire()
+        b = self.pool.acquire()
+        t = threading.Timer(0.05, self.pool.release, (a,))
+        t.start()
+        self.assertTrue(self.pool.acquire(1.0) is a)
+        t.join()
+
+    def CheckClosedPool(self):
+        self.pool.close()
+        self.assertRaises(sqlite.ProgrammingError, self.pool.acquire)
+
+class TempDirTestCase(unittest.TestCase):
+    """A test case that keeps its database files in a temporary directory,
+    which tearDown() removes with everything in it."""
+    def setUp(self):
+        self.tempdir = tempfile.mkdtemp(prefix="pysqlite-test-")
+
+    def tearDown(self):
+        shutil.rmtree(self.tempdir, ignore_errors=True)
+
+    def tempPath(self, name):
+        return os.path.join(self.tempdir, name)
+
+class ConnectionRouterTests(TempDirTestCase):
+    def setUp(self):
+        TempDirTestCase.setUp(self)
+        self.path = self.tempPath("router.db")
+        self.router = sqlite.ConnectionRouter(self.path, readers=2)
+        self.router.execute("create table test(x)")
+
+    def tearDown(self):
+        self.router.close()
+        TempDirTestCase.tearDown(self)
+
+    def CheckNeedsWAL(self):
+        self.assertRaises(sqlite.NotSupportedError, sqlite.ConnectionRouter, ":memory:")
+
+    def CheckWriteThenRead(self):
+        self.router.execute("insert into test(x) values (?)", (1,))
+        self.router.executemany("insert into test(x) values (?)", [(2,), (3,)])
+        self.assertEqual(self.router.execute("select x from test order by x"), [(1,), (2,), (3,)])
+        self.assertEqual(self.router.readers.in_use, 0)
+
+    def CheckReadOnlyByStatement(self):
+        """A read-only WITH query is routed by what it does, not how it starts."""
+        self.router.execute("insert into test(x) values (5)")
+        rows = self.router.execute("with t(y) as (select x from test) select y from t")
+        self.assertEqual(rows, [(5,)])
+
+    def CheckFailedWriteIsRolledBack(self):
+        self.router.execute("create table u(x unique)")
+        self.router.execute("insert into u(x) values (1)")
+        self.assertRaises(sqlite.IntegrityError, self.router.execute, "insert into u(x) values (1)")
+        self.router.execute("insert into u(x) values (2)")
+        self.assertEqual(self.router.execute("select count(*) from u"), [(2,)])
+
+    def CheckParallelReaders(self):
+        self.router.executemany("insert into test(x) values (?)", [(i,) for i in range(100)])
+        errors = []
+        def run():
+            try:
+                for i in range(20):
+                    rows = self.router.execute("select count(*) from test")
+                    if rows != [(100,)]:
+                        errors.append(repr(rows))
+            except Exception, e:
+                errors.append(str(e))
+        threads = [threading.Thread(target=run) for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        if errors:
+            self.fail("\n".join(errors))
+
+class BulkLoadTests(TempDirTestCase):
+    def setUp(self):
+        TempDirTestCase.setUp(self)
+        self.path = self.tempPath("bulk.db")
+        self.con = sqlite.connect(self.path)
+        self.con.execute("create table test(id integer primary key, name text, value real)")
+        self.con.commit()
+
+    def tearDown(self):
+        self.con.close()
+        TempDirTestCase.tearDown(self)
+
+    def CheckLoad(self):
+        rows = ((i, u"name%d" % i, i / 2.0) for i in xrange(10000))
+        self.assertEqual(self.con.bulk_load("test", rows, workers=3, chunk_size=100), 10000)
+        self.assertEqual(self.con.execute("select count(*), sum(id), max(name) from test").fetchone(),
+                         (10000, sum(range(10000)), u"name9999"))
+        self.assertEqual(self.con.execute("select value from test where id=7").fetchone(), (3.5,))
+
+    def CheckColumns(self):
+        self.con.bulk_load("test", [("a", 1), ("b", 2)], columns=["name", "value"])
+        self.assertEqual(self.con.execute("select id, name, value from test order by id").fetchall(),
+                         [(1, u"a", 1.0), (2, u"b", 2.0)])
+
+    def CheckEmpty(self):
+        self.assertEqual(self.con.bulk_load("test", []), 0)
+
+    def CheckErrors(self):
+        self.assertRaises(sqlite.ProgrammingError, self.con.bulk_load, "test", [(1, "a", 1.0), (2, "b")])
+        self.assertRaises(sqlite.InterfaceError, self.con.bulk_load, "test", [(1, "a", object())])
+        self.assertRaises(sqlite.IntegrityError, self.con.bulk_load, "test", [(1, "a", 1.0), (1, "b", 2.0)])
+        self.assertRaises(sqlite.OperationalError, self.con.bulk_load, "nosuchtable", [(1,)])
+        self.assertEqual(self.con.execute("select count(*) from test").fetchone(), (0,))
+
+class ShardSetTests(TempDirTestCase):
+    def setUp(self):
+        TempDirTestCase.setUp(self)
+        self.paths = [self.tempPath("shard%d.db" % i) for i in range(4)]
+        for i, path in enumerate(self.paths):
+            con = sqlite.connect(path)
+            con.execute("create table test(id, name)")
+            con.executemany("insert into test(id, name) values (?, ?)",
+                            [(n, u"name%d" % n) for n in range(i, 40, 4)])
+            con.commit()
+            con.close()
+        self.shards = sqlite.ShardSet(self.paths, threads=3)
+
+    def tearDown(self):
+        self.shards.close()
+        TempDirTestCase.tearDown(self)
+
+    def CheckConcatenated(self):
+        rows = list(self.shards.execute("select id from test where id < ? order by id", (8,)))
+        self.assertEqual(rows, [(0,), (4,), (1,), (5,), (2,), (6,), (3,), (7,)])
+
+    def CheckMergeSorted(self):
+        rows = list(self.shards.execute("select name, id from test order by id", key=1))
+        self.assertEqual([row[1] for row in rows], range(40))
+        self.assertEqual(rows[5], (u"name5", 5))
+
+    def CheckTypes(self):
+        row = list(self.shards.execute("select ?, ?, ?, ?, ? from test limit 1",
+                                       (None, 2**40, 1.5, u"\xe4", buffer("a\0b"))))[0]
+        self.assertEqual(row[:4], (None, 2**40, 1.5, u"\xe4"))
+        self.assertEqual(str(row[4]), "a\0b")
+
+    def CheckErrors(self):
+        self.assertRaises(sqlite.OperationalError, self.shards.execute, "select * from nosuchtable")
+        self.assertRaises(sqlite.ProgrammingError, self.shards.execute, "select ?", (1, 2))
+        self.assertRaises(sqlite.ProgrammingError, self.shards.execute, "select id from test", key=1)
+        self.assertEqual(self.shards.threads, 3)
+        self.shards.close()
+        self.assertRaises(sqlite.ProgrammingError, self.shards.execute, "select 1")
+
+    def CheckManyBatches(self):
+        # more rows per shard than are copied at a time
+        rows = list(self.shards.execute("""
+            with recursive n(x) as (select 0 union all select x + 1 from n where x < 999)
+            select x * 4 + ? from n""", (0,)))
+        self.assertEqual(len(rows), 4 * 1000)
+        self.assertEqual(rows[999], (3996,))
+        rows = list(self.shards.execute("""
+            with recursive n(x) as (select 0 union all select x + 1 from n where x < 999)
+            select x from n""", key=0))
+        self.assertEqual([row[0] for row in rows[::4]], range(1000))
+
+    def CheckNewQueryEndsResult(self):
+        first = self.shards.execute("select id from test order by id", key=0)
+        self.assertEqual(first.next(), (0,))
+        second = self.shards.execute("select id from test where id < 2 order by id", key=0)
+        self.assertRaises(sqlite.ProgrammingError, first.next)
+        self.assertEqual(list(second), [(0,), (1,)])
+
+    def CheckBusyWaits(self):
+        self.assertEqual(self.shards.busy_waits, 0)
+        con = sqlite.connect(self.paths[0], isolation_level=None, check_same_thread=False)
+        con.execute("begin exclusive")
+        timer = threading.Timer(0.1, con.rollback)
+        timer.start()
+        try:
+            rows = list(self.shards.execute("select id from test"))
+        finally:
+            timer.join()
+            con.close()
+        self.assertEqual(len(rows), 40)
+        self.assertTrue(self.shards.busy_waits > 0)
+        self.assertTrue(self.shards.busy_time > 0.0)
+
+class WALCheckpointerTests(TempDirTestCase):
+    def setUp(self):
+        TempDirTestCase.setUp(self)
+        self.path = self.tempPath("checkpoint.db")
+        self.con = sqlite.connect(self.path, isolation_level=None)
+        self.con.execute("pragma journal_mode=wal")
+        self.con.execute("create table test(x)")
+
+    def tearDown(self):
+        self.con.close()
+        TempDirTestCase.tearDown(self)
+
+    def waitFor(self, condition):
+        deadline = time.time() + 5.0
+        while not condition() and time.time() < deadline:
+            time.sleep(0.01)
+        return condition()
+
+    def CheckIdleCheckpoint(self):
+        checkpointer = sqlite.WALCheckpointer(self.path, interval=0.02)
+        try:
+            self.con.execute("insert into test(x) values (1)")
+            self.assertTrue(self.waitFor(lambda: checkpointer.frames > 0))
+            self.assertTrue(checkpointer.checkpoints > 0)
+            self.assertTrue(checkpointer.checkpoint_time >= checkpointer.last_checkpoint_time >= 0)
+        finally:
+            checkpointer.close()
+
+    def CheckTruncateLargeWal(self):
+        checkpointer = sqlite.WALCheckpointer(self.path, interval=0.02, max_wal_size=20000, autocheckpoint=0)
+        try:
+            checkpointer.register(self.con)
+            for i in range(100):
+                self.con.execute("insert into test(x) values (?)", ("x" * 100,))
+            self.assertTrue(self.waitFor(lambda: os.path.getsize(self.path + "-wal") <= 20000))
+            self.assertTrue(checkpointer.frames > 0)
+        finally:
+            checkpointer.close()
+
+    def CheckRestartedWalIsNotRestartedAgain(self):
+        checkpointer = sqlite.WALCheckpointer(self.path, interval=0.02, max_wal_size=20000,
+                                              mode="restart", autocheckpoint=0, timeout=0.05)
+        try:
+            checkpointer.register(self.con)
+            for i in range(100):
+                self.con.execute("insert into test(x) values (?)", ("x" * 100,))
+            self.assertTrue(self.waitFor(lambda: checkpointer.frames >= 100))
+            time.sleep(0.1)
+            # RESTART starts the WAL over, but leaves the file as large as it was
+            self.assertTrue(os.path.getsize(self.path + "-wal") > 20000)
+
+            # a reader makes RESTART wait, but not PASSIVE
+            reader = sqlite.connect(self.path)
+            reader.execute("select count(*) from test").fetchall()
+            busy = checkpointer.busy_checkpoints
+            checkpoints = checkpointer.checkpoints
+            self.con.execute("insert into test(x) values (1)")
+            self.assertTrue(self.waitFor(lambda: checkpointer.checkpoints >= checkpoints + 3))
+            self.assertEqual(checkpointer.busy_checkpoints, busy)
+            reader.close()
+        finally:
+            checkpointer.close()
+
+    def CheckArgs(self):
+        self.assertRaises(sqlite.NotSupportedError, sqlite.WALCheckpointer, ":memory:")
+        self.assertRaises(ValueError, sqlite.WALCheckpointer, self.path, interval=0)
+        self.assertRaises(ValueError, sqlite.WALCheckpointer, self.path, interval=0.0005)
+        self.assertRaises(ValueError, sqlite.WALCheckpointer, self.path, mode="passive")
+        checkpointer = sqlite.WALCheckpointer(self.path, max_wal_size=1024, mode="restart")
+        self.assertEqual(checkpointer.database, self.path)
+        self.assertEqual(checkpointer.max_wal_size, 1024)
+        self.assertEqual(checkpointer.autocheckpoint, -1)
+        checkpointer.close()
+        checkpointer.close()
+        self.assertRaises(sqlite.ProgrammingError, checkpointer.register, self.con)
+
+class AsyncConnectionTests(unittest.TestCase):
+    def setUp(self):
+        self.con = sqlite.AsyncConnection(":memory:")
+
+    def tearDown(self):
+        try:
+            self.con.close().result()
+        except sqlite.ProgrammingError:
+            pass
+
+    def CheckExecute(self):
+        self.con.execute("create table test(x)")
+        self.con.executemany("insert into test(x) values (?)", ((i,) for i in range(3)))
+        res = self.con.execute("select x from test order by x")
+        self.assertEqual(res.result(), [(0,), (1,), (2,)])
+        self.assertTrue(res.done())
+
+    def CheckError(self):
+        res = self.con.execute("select * from nosuchtable")
+        self.assertRaises(sqlite.OperationalError, res.result)
+
+    def CheckQueuedJobsRunInOrder(self):
+        results = [self.con.execute("select ?", (i,)) for i in range(50)]
+        self.assertEqual(results[-1].result(), [(49,)])
+        self.assertEqual([r.result()[0][0] for r in results], range(50))
+        self.assertEqual(self.con.pending, 0)
+
+    def CheckWakeupAndDispatch(self):
+        import select
+        called = []
+        res = self.con.execute("select 42")
+        res.add_done_callback(lambda r: called.append(r.result()))
+        r, w, x = select.select([self.con], [], [], 5.0)
+        self.assertEqual(r, [self.con])
+        self.assertTrue(res in self.con.dispatch())
+        self.assertEqual(called, [[(42,)]])
+        self.assertEqual(select.select([self.con], [], [], 0)[0], [])
+
+        late = []
+        res.add_done_callback(late.append)
+        self.assertEqual(late, [res])
+
+    def CheckCommitRollback(self):
+        self.con.execute("create table test(x)")
+        self.con.commit()
+        self.con.execute("insert into test(x) values (1)")
+        self.con.rollback()
+        self.assertEqual(self.con.execute("select count(*) from test").result(), [(0,)])
+
+    def CheckClosed(self):
+        self.con.close().result()
+        self.assertRaises(sqlite.ProgrammingError, self.con.execute, "select 1")
+
+    def CheckGroupCommit(self):
+        self.con.execute("create table test(x unique)")
+        self.con.commit()
+        units = [self.con.submit(["insert into test(x) values (%d)" % i,
+                                  ("insert into test(x) values (?)", (i + 10,))])
+                 for i in range(5)]
+        for unit in units:
+            self.assertEqual(unit.result(), None)
+        res = self.con.execute("select count(*) from test")
+        self.assertEqual(res.result(), [(10,)])
+
+    def CheckGroupCommitFailedUnit(self):
+        self.con.commit_window = 0.05
+        self.con.execute("create table test(x unique)")
+        self.con.commit()
+        good = self.con.submit(["insert into test(x) values (1)"])
+        bad = self.con.submit(["insert into test(x) values (2)", "insert into test(x) values (1)"])
+        other = self.con.submit([("insert into test(x) values (?)", (3,))])
+        self.assertEqual(good.result(), None)
+        self.assertRaises(sqlite.IntegrityError, bad.result)
+        self.assertEqual(other.result(), None)
+        res = self.con.execute("select x from test order by x")
+        self.assertEqual(res.result(), [(1,), (3,)])
+
+    def CheckGroupRejectsNonDML(self):
+        self.assertRaises(sqlite.ProgrammingError, self.con.submit, ["create table test(x)"])
+        self.assertRaises(sqlite.ProgrammingError, self.con.submit, [("commit", ())])
+        self.assertRaises(sqlite.ProgrammingError, self.con.submit, ["select 1", u"vacuum"])
+
+    def CheckGroupRefusesOpenTransaction(self):
+        self.con.execute("create table test(x)")
+        self.con.commit()
+        self.con.execute("insert into test(x) values (1)")
+        unit = self.con.submit(["insert into test(x) values (2)"])
+        self.assertRaises(sqlite.ProgrammingError, unit.result)
+        self.con.commit()
+        res = self.con.execute("select x from test")
+        self.assertEqual(res.result(), [(1,)])
+
+    def CheckDroppedConnectionStopsWorker(self):
+        if not os.path.isdir("/proc/self/fd"):
+            return
+        before = len(os.listdir("/proc/self/fd"))
+        for i in range(10):
+            con = sqlite.AsyncConnection(":memory:")
+            res = con.execute("select 1")
+            del con
+            self.assertEqual(res.result(), [(1,)])
+        self.assertEqual(len(os.listdir("/proc/self/fd")), before)
+
+    def CheckCommitWindowArgs(self):
+        con = sqlite.AsyncConnection(":memory:", commit_window=0.01, commit_batch=2)
+        self.assertEqual(con.commit_window, 0.01)
+        self.assertEqual(con.commit_batch, 2)
+        self.assertEqual([con.submit(["select 1"]).result() for i in range(3)], [None] * 3)
+        con.close().result()
+
 class ClosedConTests(unittest.TestCase):
     def setUp(self):
         pass
@@ -864,11 +1502,19 @@ def suite():
     connection_suite = unittest.makeSuite(ConnectionTests, "Check")
     cursor_suite = unittest.makeSuite(CursorTests, "Check")
     thread_suite = unittest.makeSuite(ThreadTests, "Check")
+    serialized_suite = unittest.makeSuite(SerializedConnectionTests, "Check")
     constructor_suite = unittest.makeSuite(ConstructorTests, "Check")
     ext_suite = unittest.makeSuite(ExtensionTests, "Check")
+    prepared_suite = unittest.makeSuite(PreparedStatementTests, "Check")
+    pool_suite = unittest.makeSuite(ConnectionPoolTests, "Check")
+    router_suite = unittest.makeSuite(ConnectionRouterTests, "Check")
+    bulk_suite = unittest.makeSuite(BulkLoadTests, "Check")
+    shard_suite = unittest.makeSuite(ShardSetTests, "Check")
+    checkpoint_suite = unittest.makeSuite(WALCheckpointerTests, "Check")
+    async_suite = unittest.makeSuite(AsyncConnectionTests, "Check")
     closed_con_suite = unittest.makeSuite(ClosedConTests, "Check")
     closed_cur_suite = unittest.makeSuite(ClosedCurTests, "Check")
-    return unittest.TestSuite((module_suite, connection_suite, cursor_suite, thread_suite, constructor_suite, ext_suite, closed_con_suite, closed_cur_suite))
+    return unittest.TestSuite((module_suite, connection_suite, cursor_suite, thread_suite, serialized_suite, constructor_suite, ext_suite, prepared_suite, pool_suite, router_suite, bulk_suite, shard_suite, checkpoint_suite, async_suite, closed_con_suite, closed_cur_suite))
 
 def test():
     runner = unittest.TextTestRunner()
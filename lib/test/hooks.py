@@ -21,7 +21,7 @@
 #    misrepresented as being the original software.
 # 3. This notice may not be removed or altered from any source distribution.
 
-import os, unittest
+import os, time, unittest
 import pysqlite2.dbapi2 as sqlite
 
 class CollationTests(unittest.TestCase):
@@ -105,6 +105,66 @@ class CollationTests(unittest.TestCase):
             if not e.args[0].startswith("no such collation sequence"):
                 self.fail("wrong OperationalError raised")
 
+class KeyCollationTests(unittest.TestCase):
+    def setUp(self):
+        self.con = sqlite.connect(":memory:", isolation_level=None)
+        self.con.execute("create table test(x)")
+        self.words = ["pear", "Apple", "banana", "apple", "Cherry", "", "cherry", "Banana"]
+        self.con.executemany("insert into test(x) values (?)", [(w,) for w in self.words * 3])
+
+    def tearDown(self):
+        self.con.close()
+
+    def fetch(self, collation):
+        return [row[0] for row in self.con.execute("select x from test order by x collate %s" % collation)]
+
+    def CheckOrder(self):
+        self.con.create_key_collation("nocase_key", lambda x: x.lower())
+        self.assertEqual([x.lower() for x in self.fetch("nocase_key")],
+                         sorted(x.lower() for x in self.words * 3))
+
+    def CheckKeyComputedOncePerText(self):
+        calls = []
+        def key(x):
+            calls.append(x)
+            return x[::-1]
+        self.con.create_key_collation("reverse_key", key)
+        self.assertEqual(self.fetch("reverse_key"), sorted(self.words * 3, key=lambda x: x[::-1]))
+        self.assertEqual(sorted(calls), sorted(self.words))
+
+    def CheckSmallCache(self):
+        self.con.create_key_collation("small_key", lambda x: x.lower(), cache_size=2)
+        self.assertEqual([x.lower() for x in self.fetch("small_key")],
+                         sorted(x.lower() for x in self.words * 3))
+
+    def CheckUnicodeKey(self):
+        self.con.execute("delete from test")
+        self.con.executemany("insert into test(x) values (?)", [(u"\xe9t\xe9",), (u"zoo",), (u"\u4e00",)])
+        self.con.create_key_collation("unicode_key", lambda x: x.decode("utf-8"))
+        self.assertEqual(self.fetch("unicode_key"), [u"zoo", u"\xe9t\xe9", u"\u4e00"])
+
+    def CheckKeyErrorFallsBackToText(self):
+        def key(x):
+            if x == "pear":
+                raise ValueError
+            return "a" + x
+        self.con.create_key_collation("failing_key", key)
+        self.assertEqual(self.fetch("failing_key")[-3:], ["pear"] * 3)
+
+    def CheckNotCallable(self):
+        try:
+            self.con.create_key_collation("X", 42)
+            self.fail("should have raised a TypeError")
+        except TypeError, e:
+            self.assertEqual(e.args[0], "parameter must be callable")
+
+    def CheckReplacesCollation(self):
+        self.con.create_collation("mycoll", cmp)
+        self.con.create_key_collation("mycoll", lambda x: "".join(chr(255 - ord(c)) for c in x) + "\xff")
+        self.assertEqual(self.fetch("mycoll"), sorted(self.words * 3, reverse=True))
+        self.con.create_collation("mycoll", None)
+        self.assertRaises(sqlite.OperationalError, self.fetch, "mycoll")
+
 class ProgressTests(unittest.TestCase):
     def CheckProgressHandlerUsed(self):
         """
@@ -175,10 +235,80 @@ class ProgressTests(unittest.TestCase):
         con.execute("select 1 union select 2 union select 3").fetchall()
         self.assertEqual(action, 0, "progress handler was not cleared")
 
+class StepBudgetTests(unittest.TestCase):
+    long_query = """
+        with recursive c(x) as (select 1 union all select x + 1 from c where x < 100000)
+        select count(*) from c
+        """
+
+    def setUp(self):
+        self.con = sqlite.connect(":memory:")
+        self.calls = []
+
+    def tearDown(self):
+        self.con.close()
+
+    def callback(self):
+        self.calls.append(None)
+        return 0
+
+    def CheckInstructions(self):
+        self.con.set_step_budget(self.callback, instructions=10000)
+        self.assertEqual(self.con.execute(self.long_query).fetchone(), (100000,))
+        few_calls = len(self.calls)
+        self.calls = []
+        self.con.set_step_budget(self.callback, instructions=100)
+        self.con.execute(self.long_query).fetchone()
+        self.assertTrue(0 < few_calls < len(self.calls))
+
+    def CheckMilliseconds(self):
+        checks = []
+        self.con.set_step_budget(lambda: checks.append(None), instructions=1000)
+        self.con.execute(self.long_query).fetchone()
+        self.con.set_step_budget(self.callback, milliseconds=1)
+        started = time.time()
+        self.con.execute(self.long_query).fetchone()
+        elapsed = time.time() - started
+        # the callback is only called when a millisecond has passed
+        self.assertTrue(len(self.calls) <= elapsed * 1000 + 1)
+        self.assertTrue(len(self.calls) < len(checks))
+
+    def CheckBudgetPerStep(self):
+        self.con.set_step_budget(self.callback, instructions=100000)
+        for i in range(100):
+            self.con.execute("select 1").fetchone()
+        self.assertEqual(self.calls, [])
+
+    def CheckAbort(self):
+        self.con.set_step_budget(lambda: 1, instructions=1000)
+        self.assertRaises(sqlite.OperationalError, self.con.execute, self.long_query)
+
+    def CheckClear(self):
+        self.con.set_step_budget(self.callback, instructions=100)
+        self.con.set_step_budget(None)
+        self.con.execute(self.long_query).fetchone()
+        self.con.set_step_budget(self.callback, instructions=100)
+        self.con.set_progress_handler(lambda: 0, 100)
+        self.con.execute(self.long_query).fetchone()
+        self.assertEqual(self.calls, [])
+
+    def CheckClearKeepsProgressHandler(self):
+        progress = []
+        self.con.set_progress_handler(lambda: progress.append(None), 100)
+        self.con.set_step_budget(None)
+        self.con.execute(self.long_query).fetchone()
+        self.assertTrue(len(progress) > 0)
+
+    def CheckArgs(self):
+        self.assertRaises(ValueError, self.con.set_step_budget, self.callback)
+        self.assertRaises(ValueError, self.con.set_step_budget, self.callback, instructions=-1)
+
 def suite():
     collation_suite = unittest.makeSuite(CollationTests, "Check")
+    key_collation_suite = unittest.makeSuite(KeyCollationTests, "Check")
     progress_suite = unittest.makeSuite(ProgressTests, "Check")
-    return unittest.TestSuite((collation_suite, progress_suite))
+    step_budget_suite = unittest.makeSuite(StepBudgetTests, "Check")
+    return unittest.TestSuite((collation_suite, key_collation_suite, progress_suite, step_budget_suite))
 
 def test():
     runner = unittest.TextTestRunner()
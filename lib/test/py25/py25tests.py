@@ -68,6 +68,28 @@ class ContextTests(unittest.TestCase):
             pass
         self.assertEqual(did_rollback, True)
 
+    def CheckSavepointRelease(self):
+        """Does leaving a savepoint normally keep its changes?"""
+        self.con.commit()
+        with self.con.savepoint():
+            self.con.execute("insert into test(c) values ('foo')")
+        self.con.rollback()
+        count = self.con.execute("select count(*) from test").fetchone()[0]
+        self.assertEqual(count, 1)
+
+    def CheckSavepointRollback(self):
+        """Does an exception only undo the changes within the savepoint?"""
+        with self.con:
+            self.con.execute("insert into test(c) values (1)")
+            try:
+                with self.con.savepoint():
+                    self.con.execute("insert into test(c) values (2)")
+                    self.con.execute("insert into test(c) values (1)")
+            except sqlite.IntegrityError:
+                pass
+        values = [row[0] for row in self.con.execute("select c from test")]
+        self.assertEqual(values, [1])
+
 def suite():
     ctx_suite = unittest.makeSuite(ContextTests, "Check")
     return unittest.TestSuite((ctx_suite,))
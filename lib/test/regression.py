@@ -22,6 +22,9 @@
 # 3. This notice may not be removed or altered from any source distribution.
 
 import datetime
+import os
+import shutil
+import tempfile
 import unittest
 import pysqlite2.dbapi2 as sqlite
 
@@ -62,6 +65,164 @@ class RegressionTests(unittest.TestCase):
 
         con.rollback()
 
+    def CheckStatementCacheByteBudget(self):
+        """
+        A byte budget smaller than any statement must still leave the
+        connection fully usable; statements are simply evicted early.
+        """
+        con = sqlite.connect(":memory:", cached_statements_bytes=1)
+        con.execute("create table test(x)")
+        con.executemany("insert into test(x) values (?)", [(x,) for x in xrange(10)])
+        for i in range(20):
+            row = con.execute("select count(*) from test where x >= ?" + " " * i, (5,)).fetchone()
+            self.assertEqual(row[0], 5)
+        con.rollback()
+        self.assertRaises(TypeError, sqlite.connect, ":memory:", cached_statements_bytes="x")
+
+    def _cached_statement_bytes(self, con, prefix):
+        try:
+            rows = con.execute("select sql, mem from sqlite_stmt").fetchall()
+        except sqlite.OperationalError:
+            # SQLite was built without the sqlite_stmt virtual table
+            return None
+        rows = [row for row in rows if row[0].startswith(prefix)]
+        return len(rows), sum(row[1] for row in rows)
+
+    def CheckStatementCacheStaysWithinByteBudget(self):
+        """
+        The cached statements must never need more memory than the byte
+        budget, also after a schema change made them grow.
+        """
+        tempdir = tempfile.mkdtemp(prefix="pysqlite-test-")
+        path = os.path.join(tempdir, "cache.db")
+        con = sqlite.connect(path, cached_statements_bytes=12000)
+        try:
+            if self._cached_statement_bytes(con, "") is None:
+                return
+            con.execute("create table test(x)")
+            con.commit()
+            sql = "select * from test where x >= ?"
+            for i in range(20):
+                con.execute(sql + " " * i, (5,)).fetchone()
+            count, total = self._cached_statement_bytes(con, sql)
+            self.assertTrue(0 < count < 20)
+            self.assertTrue(total <= 12000)
+            con.commit()
+
+            # another connection adds columns, so that the cached statements
+            # are recompiled into bigger programs
+            other = sqlite.connect(path)
+            for i in range(5):
+                other.execute("alter table test add column c%d" % i)
+            other.commit()
+            other.close()
+            for i in range(20):
+                con.execute(sql + " " * i, (5,)).fetchone()
+                count, total = self._cached_statement_bytes(con, sql)
+                self.assertTrue(0 < count < 20)
+                self.assertTrue(total <= 12000)
+        finally:
+            con.close()
+            shutil.rmtree(tempdir, ignore_errors=True)
+
+    def CheckSchemaChangeInvalidatesDependentStatements(self):
+        """
+        Dropping and recreating a table must only throw out the cached
+        statements that use it; statements on other tables keep working.
+        """
+        con = sqlite.connect(":memory:")
+        con.execute("create table a(x)")
+        con.execute("create table b(y)")
+        con.execute("insert into a(x) values (1)")
+        con.execute("insert into b(y) values (2)")
+        self.assertEqual(con.execute("select * from a").fetchall(), [(1,)])
+        self.assertEqual(con.execute("select * from b").fetchall(), [(2,)])
+
+        con.execute("drop table a")
+        self.assertRaises(sqlite.OperationalError, con.execute, "select * from a")
+        self.assertEqual(con.execute("select * from b").fetchall(), [(2,)])
+
+        con.executescript("create table a(x, z); insert into a values (3, 4);")
+        cur = con.execute("select * from a")
+        self.assertEqual(cur.fetchall(), [(3, 4)])
+        self.assertEqual(len(cur.description), 2)
+
+    def _cached_statements(self, con):
+        try:
+            return [row[0] for row in con.execute("select sql from sqlite_stmt")]
+        except sqlite.OperationalError:
+            # SQLite was built without the sqlite_stmt virtual table
+            return None
+
+    def CheckSchemaChangeEvictsOnlyDependentStatements(self):
+        con = sqlite.connect(":memory:")
+        if self._cached_statements(con) is None:
+            return
+        con.execute("create table a(x)")
+        con.execute("create table b(y)")
+        con.execute("create view v as select x from a")
+        con.execute("select x from a").fetchall()
+        con.execute("select x from v").fetchall()
+        con.execute("select y from b").fetchall()
+        con.commit()
+
+        con.execute("drop view v")
+        con.execute("drop table a")
+        cached = self._cached_statements(con)
+        self.assertFalse("select x from a" in cached)
+        self.assertFalse("select x from v" in cached)
+        self.assertTrue("select y from b" in cached)
+
+        con.executescript("create table a(x);")
+        con.execute("select x from a").fetchall()
+        con.executescript("alter table a add column z;")
+        cached = self._cached_statements(con)
+        self.assertFalse("select x from a" in cached)
+        self.assertTrue("select y from b" in cached)
+
+    def CheckSchemaChangeEvictsJoinOfManyTables(self):
+        con = sqlite.connect(":memory:")
+        if self._cached_statements(con) is None:
+            return
+        names = ["t%d" % i for i in range(12)]
+        for name in names:
+            con.execute("create table %s(a, b, c)" % name)
+        join = "select * from " + ", ".join(names)
+        con.execute(join).fetchall()
+        con.execute("select a, b, c from t0").fetchall()
+        con.commit()
+        con.execute("drop table T11")
+        cached = self._cached_statements(con)
+        self.assertFalse(join in cached)
+        self.assertTrue("select a, b, c from t0" in cached)
+
+    def CheckNoStatementCache(self):
+        con = sqlite.connect(":memory:", cached_statements=0)
+        con.execute("create table a(x)")
+        con.execute("insert into a(x) values (1)")
+        self.assertEqual(con.execute("select x from a").fetchall(), [(1,)])
+        con.execute("drop table a")
+        con.execute("create table a(y)")
+        self.assertEqual(con.execute("select * from a").fetchall(), [])
+
+    def CheckAttachDetachEvictStatements(self):
+        con = sqlite.connect(":memory:")
+        if self._cached_statements(con) is None:
+            return
+        con.execute("create table b(y)")
+        con.execute("select y from b").fetchall()
+        con.execute("attach ':memory:' as aux")
+        self.assertFalse("select y from b" in self._cached_statements(con))
+
+        con.execute("create table aux.t(z)")
+        con.execute("select z from aux.t").fetchall()
+        con.execute("select y from b").fetchall()
+        con.commit()
+        con.execute("detach aux")
+        cached = self._cached_statements(con)
+        self.assertFalse("select z from aux.t" in cached)
+        self.assertTrue("select y from b" in cached)
+
     def CheckColumnNameWithSpaces(self):
         cur = self.con.cursor()
         cur.execute('select 1 as "foo bar [datetime]"')
@@ -219,6 +380,42 @@ class RegressionTests(unittest.TestCase):
         except:
             self.fail("should have raised InterfaceError")
 
+    def CheckStatementOutlivesConnection(self):
+        """
+        Statements unlink themselves from the connection's list of live
+        statements. One that outlives its connection must not touch it.
+        """
+        con = sqlite.connect(":memory:")
+        stmt = con("select 1")
+        del con
+        del stmt
+
+    def CheckManyCursorsAcrossRollback(self):
+        con = sqlite.connect(":memory:")
+        con.execute("create table foo(x)")
+        for i in xrange(500):
+            con.cursor().execute("insert into foo(x) values (?)", (i,))
+        cur = con.execute("select x from foo")
+        con.rollback()
+        self.assertRaises(sqlite.InterfaceError, cur.fetchall)
+
+    def CheckFetchAcrossCommit(self):
+        """
+        A commit resets all statements. Fetching from a cursor afterwards must
+        not step its statement again, or the statement cache would hand out a
+        running statement to the next cursor. Like after a rollback, the
+        cursor raises instead of silently ending.
+        """
+        con = sqlite.connect(":memory:")
+        con.execute("create table foo(x)")
+        con.commit()
+        cur = con.execute("select count(*) from foo where x=?", (1,))
+        con.commit()
+        self.assertEqual(cur.fetchone(), (0,))
+        self.assertRaises(sqlite.InterfaceError, cur.fetchone)
+        cur2 = con.execute("select count(*) from foo where x=?", (2,))
+        self.assertEqual(cur2.fetchone(), (0,))
+
     def CheckAutoCommit(self):
         """
         Verifies that creating a connection in autocommit mode works.
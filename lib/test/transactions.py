@@ -148,6 +148,27 @@ class TransactionTests(unittest.TestCase):
         # NO self.con2.rollback() HERE!!!
         self.con1.commit()
 
+    def CheckBusyMetrics(self):
+        self.cur1.execute("create table test(i)")
+        self.con1.commit()
+        self.cur1.execute("insert into test(i) values (5)")
+        self.assertEqual(self.con2.busy_waits, 0)
+        self.assertRaises(sqlite.OperationalError, self.cur2.execute, "insert into test(i) values (5)")
+        self.assertTrue(self.con2.busy_waits > 0)
+        self.assertTrue(0.05 < self.con2.busy_time < 1.0)
+
+    def CheckTransactionTimeout(self):
+        self.cur1.execute("create table test(i)")
+        self.con1.commit()
+        self.cur1.execute("insert into test(i) values (5)")
+        self.assertEqual(self.con2.transaction_timeout, None)
+        self.con2.transaction_timeout = 0
+        self.assertRaises(sqlite.OperationalError, self.cur2.execute, "insert into test(i) values (5)")
+        self.assertEqual(self.con2.busy_waits, 0)
+        self.con2.rollback()
+        self.assertEqual(self.con2.transaction_timeout, None)
+        self.assertRaises(ValueError, setattr, self.con2, "transaction_timeout", -1)
+
     def CheckRollbackCursorConsistency(self):
         """
         Checks if cursors on the connection are set into a "reset" state
@@ -192,10 +213,119 @@ class SpecialCommandTests(unittest.TestCase):
         self.cur.close()
         self.con.close()
 
+class SavepointTests(unittest.TestCase):
+    def setUp(self):
+        self.con = sqlite.connect(":memory:")
+        self.con.execute("create table test(i)")
+        self.con.commit()
+
+    def tearDown(self):
+        self.con.close()
+
+    def count(self):
+        return self.con.execute("select count(*) from test").fetchone()[0]
+
+    def CheckReleaseCommitsOwnTransaction(self):
+        sp = self.con.savepoint().__enter__()
+        self.failUnlessEqual(self.con.in_transaction, True)
+        self.con.execute("insert into test(i) values (1)")
+        sp.release()
+        self.failUnlessEqual(self.con.in_transaction, False)
+        self.con.rollback()
+        self.failUnlessEqual(self.count(), 1)
+
+    def CheckRollbackUndoesOnlyNestedChanges(self):
+        self.con.execute("insert into test(i) values (1)")
+        sp = self.con.savepoint().__enter__()
+        self.con.execute("insert into test(i) values (2)")
+        sp.rollback()
+        self.failUnlessEqual(self.con.in_transaction, True)
+        self.failUnlessEqual(self.count(), 1)
+        self.con.commit()
+        self.failUnlessEqual(self.count(), 1)
+
+    def CheckNestedNamesAreDistinct(self):
+        outer = self.con.savepoint().__enter__()
+        inner = self.con.savepoint().__enter__()
+        self.failIfEqual(outer.name, inner.name)
+        self.con.execute("insert into test(i) values (1)")
+        inner.rollback()
+        self.con.execute("insert into test(i) values (2)")
+        outer.release()
+        self.failUnlessEqual([r[0] for r in self.con.execute("select i from test")], [2])
+
+    def CheckDefaultNameChosenOnEnter(self):
+        outer = self.con.savepoint()
+        inner = self.con.savepoint()
+        self.failUnlessEqual(inner.name, None)
+        outer.__enter__()
+        inner.__enter__()
+        self.failIfEqual(outer.name, inner.name)
+        inner.release()
+        outer.release()
+
+    def CheckCommitDeactivatesSavepoints(self):
+        sp = self.con.savepoint().__enter__()
+        self.failUnlessEqual(sp.active, True)
+        self.con.commit()
+        self.failUnlessEqual(sp.active, False)
+        self.assertRaises(sqlite.ProgrammingError, sp.release)
+        sp = self.con.savepoint().__enter__()
+        self.con.rollback()
+        self.failUnlessEqual(sp.active, False)
+        self.assertRaises(sqlite.ProgrammingError, sp.rollback)
+        sp.__enter__()
+        sp.release()
+
+    def CheckManyNames(self):
+        for i in range(100):
+            sp = self.con.savepoint("sp_%d" % i).__enter__()
+            self.con.execute("insert into test(i) values (?)", (i,))
+            sp.release()
+        del sp
+        self.failUnlessEqual(self.count(), 100)
+        try:
+            prepared = self.con.execute("select count(*) from sqlite_stmt where sql like 'SAVEPOINT %'").fetchone()[0]
+        except sqlite.OperationalError:
+            # SQLite was built without the sqlite_stmt virtual table
+            return
+        self.failUnless(prepared <= 16)
+
+    def CheckStatementsAreReused(self):
+        for i in range(3):
+            sp = self.con.savepoint("sp").__enter__()
+            self.con.execute("insert into test(i) values (?)", (i,))
+            sp.release()
+        self.failUnlessEqual(self.count(), 3)
+
+    def CheckInvalidName(self):
+        try:
+            self.con.savepoint("a b")
+            self.fail("should have raised a ProgrammingError")
+        except sqlite.ProgrammingError:
+            pass
+
+    def CheckReleaseInactive(self):
+        sp = self.con.savepoint()
+        try:
+            sp.release()
+            self.fail("should have raised a ProgrammingError")
+        except sqlite.ProgrammingError:
+            pass
+
+    def CheckEnterTwice(self):
+        sp = self.con.savepoint().__enter__()
+        try:
+            sp.__enter__()
+            self.fail("should have raised a ProgrammingError")
+        except sqlite.ProgrammingError:
+            pass
+
 def suite():
     default_suite = unittest.makeSuite(TransactionTests, "Check")
     special_command_suite = unittest.makeSuite(SpecialCommandTests, "Check")
-    return unittest.TestSuite((default_suite, special_command_suite))
+    savepoint_suite = unittest.makeSuite(SavepointTests, "Check")
+    return unittest.TestSuite((default_suite, special_command_suite, savepoint_suite))
 
 def test():
     runner = unittest.TextTestRunner()
@@ -22,7 +22,7 @@
 #    misrepresented as being the original software.
 # 3. This notice may not be removed or altered from any source distribution.
 
-import unittest
+import os, sys, unittest
 import pysqlite2.dbapi2 as sqlite
 
 def func_returntext():
@@ -238,6 +238,146 @@ class FunctionTests(unittest.TestCase):
         val = cur.fetchone()[0]
         self.assertEqual(val, 1)
 
+    def CheckDeterministic(self):
+        calls = []
+        def f(x):
+            calls.append(x)
+            return x
+        self.con.create_function("nondeterministic", 1, f)
+        self.con.create_function("deterministic", 1, f, deterministic=True)
+        self.con.execute("create table test(x)")
+        self.con.executemany("insert into test(x) values (?)", [(1,), (2,), (3,)])
+        self.con.execute("select nondeterministic(42) from test").fetchall()
+        self.assertEqual(len(calls), 3)
+        calls[:] = []
+        self.con.execute("select deterministic(42) from test").fetchall()
+        self.assertEqual(len(calls), 1)
+        self.con.execute("create index test_index on test(deterministic(x))")
+        self.assertRaises(sqlite.OperationalError, self.con.execute,
+                          "create index test_index2 on test(nondeterministic(x))")
+
+    def CheckStatementCache(self):
+        calls = []
+        def classify(code):
+            calls.append(code)
+            return code.upper()
+        self.con.create_function("classify", 1, classify, deterministic=True, cache_size=10)
+        self.con.execute("create table test(code)")
+        self.con.executemany("insert into test(code) values (?)", [(c,) for c in "abcabcabca"])
+        rows = self.con.execute("select classify(code) from test").fetchall()
+        self.assertEqual("".join(row[0] for row in rows), "ABCABCABCA")
+        self.assertEqual(len(calls), 3)
+        self.assertEqual(self.con.function_cache_info("CLASSIFY"), (7, 3, 3))
+        # the next statement starts with an empty cache
+        self.con.execute("select classify(code) from test").fetchall()
+        self.assertEqual(len(calls), 6)
+
+    def CheckConnectionCache(self):
+        calls = []
+        def double(x):
+            calls.append(x)
+            return 2 * x
+        self.con.create_function("double", 1, double, deterministic=True, cache_size=2, cache_scope="connection")
+        for i in range(3):
+            self.assertEqual(self.con.execute("select double(21)").fetchone(), (42,))
+        self.assertEqual(calls, [21])
+        self.con.execute("select double(1), double(2), double(3)").fetchall()
+        hits, misses, size = self.con.function_cache_info("double")
+        self.assertEqual((hits, misses), (2, 4))
+        self.assertTrue(size <= 2)
+
+    def CheckUnhashableArguments(self):
+        self.con.create_function("blobsize", 1, len, deterministic=True, cache_size=10)
+        row = self.con.execute("select blobsize(?), blobsize(?)", (buffer("abc"), buffer("abc"))).fetchone()
+        self.assertEqual(row, (3, 3))
+        self.assertEqual(self.con.function_cache_info("blobsize"), (0, 2, 0))
+
+    def CheckCacheKeepsTypesApart(self):
+        self.con.create_function("typename", 1, lambda x: type(x).__name__, deterministic=True, cache_size=10)
+        row = self.con.execute("select typename(1), typename(1.0), typename(2.0), typename(2)").fetchone()
+        self.assertEqual(row, ("int", "float", "float", "int"))
+
+    def CheckCacheArgs(self):
+        self.assertRaises(ValueError, self.con.create_function, "f", 1, len, cache_size=10)
+        self.assertRaises(ValueError, self.con.create_function, "f", 1, len,
+                          deterministic=True, cache_size=10, cache_scope="forever")
+        self.assertRaises(sqlite.ProgrammingError, self.con.function_cache_info, "isint")
+
+    def CheckTextWithNul(self):
+        self.con.create_function("echo", 1, lambda x: x)
+        self.con.create_function("textlen", 1, len)
+        row = self.con.execute("select textlen(cast(x'610062' as text)), hex(echo(cast(x'610062' as text)))").fetchone()
+        self.assertEqual(row, (3, "610062"))
+
+    def CheckKeptArguments(self):
+        kept = []
+        def keep(*args):
+            kept.append(args)
+            return len(args)
+        self.con.create_function("keep", -1, keep)
+        self.con.execute("select keep(1, 2), keep(3), keep(4, 5)").fetchall()
+        self.assertEqual(sorted(kept), [(1, 2), (3,), (4, 5)])
+
+    def CheckAuxdata(self):
+        parsed = []
+        def field(ctx, record, spec):
+            fields = ctx.get_auxdata(1)
+            if fields is None:
+                parsed.append(spec)
+                fields = [int(f) for f in spec.split(",")]
+                ctx.set_auxdata(1, fields)
+            return ",".join(record.split(",")[f] for f in fields)
+        self.con.create_function("field", 2, field, context=True)
+        self.con.execute("create table records(r, spec)")
+        self.con.executemany("insert into records(r, spec) values (?, ?)", [("a,b,c", "2,0")] * 10)
+        rows = self.con.execute("select field(r, '2,0') from records").fetchall()
+        self.assertEqual(rows, [(u"c,a",)] * 10)
+        self.assertEqual(parsed, ["2,0"])
+
+        # auxdata isn't kept for arguments that aren't constant
+        del parsed[:]
+        self.con.execute("select field(r, spec) from records").fetchall()
+        self.assertEqual(len(parsed), 10)
+
+    def CheckContextOutsideCall(self):
+        kept = []
+        def keep(ctx, x):
+            kept.append(ctx)
+            return x
+        self.con.create_function("keep", 1, keep, context=True)
+        self.con.execute("select keep(1), keep(2)").fetchall()
+        self.assertEqual(len(kept), 2)
+        self.assertRaises(sqlite.ProgrammingError, kept[0].get_auxdata, 0)
+
+    def CheckContextArgumentIndex(self):
+        self.con.create_function("aux", 1, lambda ctx, x: ctx.set_auxdata(1, x), context=True)
+        self.assertRaises(sqlite.OperationalError, self.con.execute, "select aux(1)")
+
+    def CheckContextNoCache(self):
+        self.assertRaises(ValueError, self.con.create_function, "aux", 1, lambda ctx, x: x,
+                          deterministic=True, cache_size=10, context=True)
+
+    def CheckRedefinedFunctionIsReleased(self):
+        def first(x):
+            return 1
+        def second(x):
+            return 2
+        refs = sys.getrefcount(first)
+        self.con.create_function("redefined", 1, first)
+        self.assertEqual(sys.getrefcount(first), refs + 1)
+        self.con.create_function("REDEFINED", 1, second)
+        self.assertEqual(sys.getrefcount(first), refs)
+        self.assertEqual(self.con.execute("select redefined(0)").fetchone(), (2,))
+
+        # the one argument version is kept when another arity is added
+        self.con.create_function("redefined", 2, lambda x, y: 1)
+        self.assertEqual(self.con.execute("select redefined(0), redefined(0, 0)").fetchone(), (2, 1))
+
+        # a function SQLite rejects is not kept either
+        refs = sys.getrefcount(second)
+        self.assertRaises(sqlite.OperationalError, self.con.create_function, "toomany", 1000, second)
+        self.assertEqual(sys.getrefcount(second), refs)
+
 class AggregateTests(unittest.TestCase):
     def setUp(self):
         self.con = sqlite.connect(":memory:")
@@ -399,11 +539,400 @@ class AuthorizerTests(unittest.TestCase):
             return
         self.fail("should have raised an exception due to missing privileges")
 
+class AuthorizerRuleTests(unittest.TestCase):
+    def setUp(self):
+        self.con = sqlite.connect(":memory:", isolation_level=None)
+        self.con.executescript("""
+            create table t1 (c1, c2);
+            create table t2 (c1, c2);
+            insert into t1 (c1, c2) values (1, 2);
+            insert into t2 (c1, c2) values (4, 5);
+            """)
+
+        # prepared before the rules are set, and must not bypass them
+        self.con.execute("select c2 from t2")
+
+    def tearDown(self):
+        self.con.close()
+
+    def CheckDeny(self):
+        self.con.set_authorizer_rules([(sqlite.SQLITE_READ, "T2", sqlite.SQLITE_DENY)])
+        self.assertEqual(self.con.execute("select c2 from t1").fetchall(), [(2,)])
+        try:
+            self.con.execute("select c2 from t2")
+            self.fail("should have raised an exception due to missing privileges")
+        except sqlite.DatabaseError, e:
+            self.assertTrue(e.args[0].endswith("prohibited"))
+
+    def CheckIgnore(self):
+        self.con.set_authorizer_rules([(sqlite.SQLITE_READ, "t2", sqlite.SQLITE_IGNORE)])
+        self.assertEqual(self.con.execute("select c1, c2 from t2").fetchall(), [(None, None)])
+
+    def CheckFirstMatchWins(self):
+        self.con.set_authorizer_rules([(sqlite.SQLITE_INSERT, "t1", sqlite.SQLITE_OK),
+                                       (None, "t1", sqlite.SQLITE_DENY),
+                                       (sqlite.SQLITE_INSERT, None, sqlite.SQLITE_DENY)])
+        self.con.execute("insert into t1 (c1, c2) values (3, 4)")
+        self.assertRaises(sqlite.DatabaseError, self.con.execute, "delete from t1")
+        self.assertRaises(sqlite.DatabaseError, self.con.execute, "insert into t2 (c1, c2) values (3, 4)")
+
+    def CheckFallback(self):
+        calls = []
+        def fallback(action, arg1, arg2, dbname, source):
+            calls.append((action, arg1))
+            return sqlite.SQLITE_OK
+        self.con.set_authorizer_rules([(sqlite.SQLITE_READ, None, sqlite.SQLITE_OK)], fallback)
+        self.con.execute("select c1 from t1")
+        self.assertEqual(calls, [(sqlite.SQLITE_SELECT, None)])
+
+    def CheckReplacedByCallback(self):
+        self.con.set_authorizer_rules([(None, None, sqlite.SQLITE_DENY)])
+        self.assertRaises(sqlite.DatabaseError, self.con.execute, "select c1 from t1")
+        self.con.set_authorizer(lambda *args: sqlite.SQLITE_OK)
+        self.assertEqual(self.con.execute("select c1 from t1").fetchall(), [(1,)])
+
+    def CheckInvalidRules(self):
+        self.assertRaises(TypeError, self.con.set_authorizer_rules, [(sqlite.SQLITE_READ, "t1")])
+        self.assertRaises(ValueError, self.con.set_authorizer_rules, [(1000, "t1", sqlite.SQLITE_DENY)])
+        self.assertRaises(ValueError, self.con.set_authorizer_rules, [(sqlite.SQLITE_READ, "t1", 42)])
+        self.assertRaises(TypeError, self.con.set_authorizer_rules, [], 42)
+
+class WindowSum(object):
+    lookups = 0
+    inverses = 0
+
+    def __init__(self):
+        self.total = 0
+
+    def __getattribute__(self, name):
+        if name == "step":
+            WindowSum.lookups += 1
+        return object.__getattribute__(self, name)
+
+    def step(self, value):
+        self.total += value
+
+    def inverse(self, value):
+        WindowSum.inverses += 1
+        self.total -= value
+
+    def value(self):
+        return self.total
+
+    def finalize(self):
+        return self.total
+
+class WindowValueError(WindowSum):
+    def value(self):
+        1/0
+
+class WindowFunctionTests(unittest.TestCase):
+    def setUp(self):
+        self.con = sqlite.connect(":memory:")
+        try:
+            self.con.create_window_function("winsum", 1, WindowSum)
+        except sqlite.NotSupportedError:
+            self.skip = True
+            return
+        self.skip = False
+        self.con.create_window_function("winerror", 1, WindowValueError)
+        self.con.execute("create table test(x)")
+        self.con.executemany("insert into test(x) values (?)", [(i,) for i in range(1, 11)])
+        WindowSum.lookups = WindowSum.inverses = 0
+
+    def tearDown(self):
+        self.con.close()
+
+    def CheckSlidingWindow(self):
+        if self.skip:
+            return
+        rows = self.con.execute("""
+            select winsum(x) over (order by x rows between 2 preceding and current row)
+            from test order by x
+            """).fetchall()
+        self.assertEqual([row[0] for row in rows], [1, 3, 6, 9, 12, 15, 18, 21, 24, 27])
+        self.assertEqual(WindowSum.inverses, 7)
+        self.assertEqual(WindowSum.lookups, 1)
+
+    def CheckAsAggregate(self):
+        if self.skip:
+            return
+        self.assertEqual(self.con.execute("select winsum(x) from test").fetchone(), (55,))
+        self.assertEqual(WindowSum.lookups, 1)
+
+    def CheckValueError(self):
+        if self.skip:
+            return
+        self.assertRaises(sqlite.OperationalError, self.con.execute,
+                          "select winerror(x) over (order by x) from test")
+
+class VirtualTable(object):
+    schema = "create table x(id integer, name text)"
+    rows = [(i, u"name%d" % i) for i in range(100)]
+
+    def __init__(self, *args):
+        self.args = args
+        self.filters = []
+        VirtualTable.instance = self
+
+    def best_index(self, constraints, orderbys):
+        used = [constraint == (0, sqlite.SQLITE_INDEX_CONSTRAINT_EQ) for constraint in constraints]
+        if True in used:
+            return used, 1, "id", False, 1.0
+        return None
+
+    def open(self):
+        return VirtualTableCursor(self)
+
+class VirtualTableCursor(object):
+    def __init__(self, table):
+        self.table = table
+
+    def filter(self, index_num, index_str, args):
+        self.table.filters.append((index_num, index_str, args))
+        if index_num == 1:
+            return [row for row in self.table.rows if row[0] == args[0]]
+        return iter(self.table.rows)
+
+class GeneratedVirtualTable(VirtualTable):
+    def open(self):
+        return GeneratedVirtualTableCursor(self)
+
+class GeneratedVirtualTableCursor(VirtualTableCursor):
+    def filter(self, index_num, index_str, args):
+        GeneratedVirtualTable.pulled = 0
+        return self.generate()
+
+    def generate(self):
+        for row in self.table.rows:
+            GeneratedVirtualTable.pulled += 1
+            yield row
+
+class BrokenVirtualTable(VirtualTable):
+    def open(self):
+        1/0
+
+class VirtualTableTests(unittest.TestCase):
+    def setUp(self):
+        self.con = sqlite.connect(":memory:")
+        self.con.create_module("pydata", VirtualTable)
+        self.con.execute("create virtual table test using pydata(a, b)")
+
+    def tearDown(self):
+        self.con.close()
+
+    def CheckArguments(self):
+        self.assertEqual(VirtualTable.instance.args, (u"a", u"b"))
+
+    def CheckFullScan(self):
+        row = self.con.execute("select count(*), max(name) from test").fetchone()
+        self.assertEqual(row, (100, u"name99"))
+        self.assertEqual(VirtualTable.instance.filters, [(0, None, ())])
+
+    def CheckPushdown(self):
+        rows = self.con.execute("select name from test where id = ?", (42,)).fetchall()
+        self.assertEqual(rows, [(u"name42",)])
+        self.assertEqual(VirtualTable.instance.filters, [(1, "id", (42,))])
+
+    def CheckJoin(self):
+        self.con.execute("create table keys(k)")
+        self.con.executemany("insert into keys(k) values (?)", [(3,), (5,)])
+        rows = self.con.execute("select name from keys cross join test where id = k order by k").fetchall()
+        self.assertEqual(rows, [(u"name3",), (u"name5",)])
+        self.assertEqual([f[0] for f in VirtualTable.instance.filters], [1, 1])
+
+    def CheckValueTypes(self):
+        VirtualTable.rows = [(2 ** 40, 1.5), (3, buffer("blob")), (None,)]
+        try:
+            rows = self.con.execute("select id, name from test").fetchall()
+        finally:
+            del VirtualTable.rows
+        self.assertEqual(rows, [(2 ** 40, 1.5), (3, buffer("blob")), (None, None)])
+
+    def CheckUnsupportedValue(self):
+        VirtualTable.rows = [(1, u"a"), (2, object())]
+        try:
+            self.con.execute("select * from test").fetchall()
+            self.fail("should have raised an OperationalError")
+        except sqlite.OperationalError, e:
+            self.assertTrue("unsupported type in column 1" in e.args[0])
+        finally:
+            del VirtualTable.rows
+
+    def CheckRowsPulledInBatches(self):
+        self.con.create_module("generated", GeneratedVirtualTable)
+        self.con.execute("create virtual table generated_test using generated")
+        rows = self.con.execute("select id from generated_test limit 1").fetchall()
+        self.assertEqual(rows, [(0,)])
+        self.assertEqual(GeneratedVirtualTable.pulled, 64)
+        row = self.con.execute("select count(*), max(name) from generated_test").fetchone()
+        self.assertEqual(row, (100, u"name99"))
+        self.assertEqual(GeneratedVirtualTable.pulled, 100)
+
+    def CheckError(self):
+        self.con.create_module("broken", BrokenVirtualTable)
+        self.con.execute("create virtual table broken_test using broken")
+        try:
+            self.con.execute("select * from broken_test")
+            self.fail("should have raised an OperationalError")
+        except sqlite.OperationalError, e:
+            self.assertTrue("division" in e.args[0])
+
+class NativeFunctionTests(unittest.TestCase):
+    def setUp(self):
+        self.con = sqlite.connect(":memory:")
+        self.con.enable_native_functions()
+
+    def tearDown(self):
+        self.con.close()
+
+    def value(self, sql, *args):
+        return self.con.execute(sql, args).fetchone()[0]
+
+    def CheckMath(self):
+        self.assertAlmostEqual(self.value("select sqrt(2)"), 2 ** 0.5)
+        self.assertEqual(self.value("select power(2, 10)"), 1024.0)
+        self.assertAlmostEqual(self.value("select ln(exp(2))"), 2.0)
+        self.assertEqual(self.value("select log10(1000)"), 3.0)
+        self.assertEqual(self.value("select floor(-2.5)"), -3.0)
+        self.assertEqual(self.value("select ceil(2.1)"), 3.0)
+        self.assertEqual(self.value("select floor(7)"), 7)
+        self.assertEqual(self.value("select sign(-0.5)"), -1)
+
+    def CheckMathDomain(self):
+        self.assertEqual(self.value("select sqrt(-1)"), None)
+        self.assertEqual(self.value("select ln(0)"), None)
+        self.assertEqual(self.value("select power(0, -1)"), None)
+        self.assertEqual(self.value("select sqrt(NULL)"), None)
+
+    def CheckPad(self):
+        self.assertEqual(self.value("select lpad('7', 3, '0')"), u"007")
+        self.assertEqual(self.value("select rpad('ab', 7, 'xyz')"), u"abxyzxy")
+        self.assertEqual(self.value("select lpad('hello', 2)"), u"he")
+        self.assertEqual(self.value("select rpad(?, 3, ?)", u"\xe9", u"\xfc"), u"\xe9\xfc\xfc")
+        self.assertEqual(self.value("select lpad('x', 3, '')"), u"x")
+        self.assertEqual(self.value("select lpad('a', 5, cast(x'80' as text))"), u"a")
+        self.assertEqual(self.value("select rpad('abc', 2, cast(x'8080' as text))"), u"ab")
+
+    def CheckSplitPart(self):
+        self.assertEqual(self.value("select split_part('a,b,c', ',', 2)"), u"b")
+        self.assertEqual(self.value("select split_part('a::b::c', '::', -1)"), u"c")
+        self.assertEqual(self.value("select split_part('a,,c', ',', 2)"), u"")
+        self.assertEqual(self.value("select split_part('a,b,c', ',', 4)"), u"")
+
+    def CheckReverse(self):
+        self.assertEqual(self.value("select reverse(?)", u"h\xe9llo"), u"oll\xe9h")
+
+    def CheckRegexp(self):
+        if not hasattr(os, "uname"):
+            return
+        self.con.execute("create table log(msg)")
+        self.con.executemany("insert into log(msg) values (?)", [("error 42",), ("ok",), ("error x",)])
+        rows = self.con.execute("select msg from log where msg regexp ? order by msg", ("^error [0-9]+$",)).fetchall()
+        self.assertEqual(rows, [(u"error 42",)])
+        rows = self.con.execute("select regexp(msg, 'error 42') from log order by msg").fetchall()
+        self.assertEqual(rows, [(1,), (0,), (0,)])
+        self.assertEqual(self.value("select NULL regexp 'a'"), None)
+
+    def CheckRegexpInvalid(self):
+        if not hasattr(os, "uname"):
+            return
+        self.assertRaises(sqlite.OperationalError, self.value, "select 'a' regexp '('")
+
+    def CheckHashes(self):
+        import hashlib, zlib
+        for data in ["", "foo", "x" * 55, "x" * 56, "\x00\xff" * 100]:
+            self.assertEqual(self.value("select md5(?)", buffer(data)), hashlib.md5(data).hexdigest())
+            self.assertEqual(self.value("select sha1(?)", buffer(data)), hashlib.sha1(data).hexdigest())
+            self.assertEqual(self.value("select crc32(?)", buffer(data)), zlib.crc32(data) & 0xffffffff)
+        self.assertEqual(self.value("select md5('foo')"), hashlib.md5("foo").hexdigest())
+
+    def CheckDates(self):
+        self.assertEqual(self.value("select add_days('2012-02-28', 1)"), u"2012-02-29")
+        self.assertEqual(self.value("select add_days('2011-01-01 10:30:00', -1)"), u"2010-12-31 10:30:00")
+        self.assertEqual(self.value("select add_months('2011-01-31', 1)"), u"2011-02-28")
+        self.assertEqual(self.value("select add_months('2011-05-15', -17)"), u"2009-12-15")
+        self.assertEqual(self.value("select days_between('2000-01-01', '2011-03-01')"), 4077)
+        self.assertEqual(self.value("select add_days('2011-02-30', 1)"), None)
+        self.assertEqual(self.value("select days_between('yesterday', '2011-03-01')"), None)
+
+class CApiTests(unittest.TestCase):
+    """
+    Uses the C API through ctypes, the way another extension module would.
+    """
+    def setUp(self):
+        try:
+            import ctypes
+        except ImportError:
+            self.capi = None
+            return
+        from pysqlite2 import _sqlite
+
+        sql_function = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_int, ctypes.POINTER(ctypes.c_void_p))
+        compare = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_int, ctypes.c_char_p, ctypes.c_int, ctypes.c_char_p)
+        class CAPI(ctypes.Structure):
+            _fields_ = [("version", ctypes.c_int),
+                        ("get_db", ctypes.PYFUNCTYPE(ctypes.c_void_p, ctypes.py_object)),
+                        ("create_function", ctypes.PYFUNCTYPE(ctypes.c_int, ctypes.py_object, ctypes.c_char_p,
+                                                              ctypes.c_int, ctypes.c_int, ctypes.c_void_p, sql_function,
+                                                              ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p)),
+                        ("create_collation", ctypes.PYFUNCTYPE(ctypes.c_int, ctypes.py_object, ctypes.c_char_p,
+                                                               ctypes.c_void_p, compare, ctypes.c_void_p))]
+        get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+        get_pointer.restype = ctypes.c_void_p
+        get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+        self.capi = CAPI.from_address(get_pointer(_sqlite.capi, "pysqlite2._sqlite.capi"))
+
+        lib = ctypes.CDLL(_sqlite.__file__)
+        lib.sqlite3_value_int64.restype = ctypes.c_longlong
+        lib.sqlite3_value_int64.argtypes = [ctypes.c_void_p]
+        lib.sqlite3_result_int64.argtypes = [ctypes.c_void_p, ctypes.c_longlong]
+        def twice(context, argc, argv):
+            lib.sqlite3_result_int64(context, 2 * lib.sqlite3_value_int64(argv[0]))
+        def reverse(user_data, size1, text1, size2, text2):
+            return -cmp(text1[:size1], text2[:size2])
+        self.twice = sql_function(twice)
+        self.reverse = compare(reverse)
+
+        self.con = sqlite.connect(":memory:")
+
+    def tearDown(self):
+        if self.capi:
+            self.con.close()
+
+    def CheckGetDb(self):
+        if not self.capi:
+            return
+        self.assertEqual(self.capi.version, 1)
+        self.assertTrue(self.capi.get_db(self.con))
+        self.assertRaises(TypeError, self.capi.get_db, 42)
+        self.con.close()
+        self.assertRaises(sqlite.ProgrammingError, self.capi.get_db, self.con)
+
+    def CheckCreateFunction(self):
+        if not self.capi:
+            return
+        self.assertEqual(self.capi.create_function(self.con, "twice", 1, 0, None, self.twice, None, None, None), 0)
+        self.assertEqual(self.con.execute("select twice(21)").fetchone()[0], 42)
+
+    def CheckCreateCollation(self):
+        if not self.capi:
+            return
+        self.assertEqual(self.capi.create_collation(self.con, "rev", None, self.reverse, None), 0)
+        rows = self.con.execute("select x from (select 'a' as x union select 'c' union select 'b') order by x collate rev").fetchall()
+        self.assertEqual(rows, [(u"c",), (u"b",), (u"a",)])
+
 def suite():
     function_suite = unittest.makeSuite(FunctionTests, "Check")
     aggregate_suite = unittest.makeSuite(AggregateTests, "Check")
+    window_suite = unittest.makeSuite(WindowFunctionTests, "Check")
+    vtable_suite = unittest.makeSuite(VirtualTableTests, "Check")
+    native_suite = unittest.makeSuite(NativeFunctionTests, "Check")
+    capi_suite = unittest.makeSuite(CApiTests, "Check")
     authorizer_suite = unittest.makeSuite(AuthorizerTests, "Check")
-    return unittest.TestSuite((function_suite, aggregate_suite, authorizer_suite))
+    authorizer_rule_suite = unittest.makeSuite(AuthorizerRuleTests, "Check")
+    return unittest.TestSuite((function_suite, aggregate_suite, window_suite, vtable_suite, native_suite, capi_suite,
+                               authorizer_suite, authorizer_rule_suite))
 
 def test():
     runner = unittest.TextTestRunner()
@@ -24,7 +24,7 @@ else:
 OPT = "-O2"
 
 # pysqlite sources + SQLite amalgamation
-SRC = "src/module.c src/connection.c src/cursor.c src/cache.c src/microprotocols.c src/prepare_protocol.c src/statement.c src/util.c src/row.c amalgamation/sqlite3.c"
+SRC = "src/module.c src/connection.c src/cursor.c src/cache.c src/microprotocols.c src/prepare_protocol.c src/statement.c src/util.c src/row.c src/savepoint.c src/pool.c src/router.c src/async.c src/shard.c src/loader.c src/checkpoint.c src/vtable.c src/functions.c src/context.c src/capi.c amalgamation/sqlite3.c"
 
 # You will need to fetch these from
 # https://pyext-cross.pysqlite.googlecode.com/hg/
@@ -39,7 +39,10 @@ PYSQLITE_EXPERIMENTAL = False
 
 sources = ["src/module.c", "src/connection.c", "src/cursor.c", "src/cache.c",
            "src/microprotocols.c", "src/prepare_protocol.c", "src/statement.c",
-           "src/util.c", "src/row.c"]
+           "src/util.c", "src/row.c", "src/savepoint.c",
+           "src/pool.c", "src/router.c", "src/async.c", "src/shard.c",
+           "src/loader.c", "src/checkpoint.c", "src/vtable.c",
+           "src/functions.c", "src/context.c", "src/capi.c"]
 
 if PYSQLITE_EXPERIMENTAL:
     sources.append("src/backup.c")
@@ -182,6 +185,7 @@ def get_setup_args():
                        (["pysqlite2.test.py25"], [])[sys.version_info < (2, 5)],
             scripts=[],
             data_files = data_files,
+            headers = ["src/capi.h"],
 
             ext_modules = [Extension( name="pysqlite2._sqlite",
                                       sources=sources,
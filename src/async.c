@@ -0,0 +1,997 @@
+/* async.c - connections owned by a worker thread
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "module.h"
+#include "async.h"
+#include "cursor.h"
+#include "util.h"
+#include "sqlitecompat.h"
+
+#include <errno.h>
+#ifndef MS_WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define ASYNC_EXECUTE 1
+#define ASYNC_EXECUTEMANY 2
+#define ASYNC_COMMIT 3
+#define ASYNC_ROLLBACK 4
+#define ASYNC_CLOSE 5
+#define ASYNC_UNIT 6
+
+/* how often the worker looks for more units of work during the commit window */
+#define ASYNC_WINDOW_STEP 0.001
+
+static PyObject* async_submit(pysqlite_AsyncConnection* self, int op, PyObject* sql, PyObject* parameters);
+
+static pysqlite_AsyncResult* async_result_new(int op, PyObject* sql, PyObject* parameters)
+{
+    pysqlite_AsyncResult* self;
+
+    self = PyObject_New(pysqlite_AsyncResult, &pysqlite_AsyncResultType);
+    if (!self) {
+        return NULL;
+    }
+
+    self->op = op;
+    Py_XINCREF(sql);
+    self->sql = sql;
+    Py_XINCREF(parameters);
+    self->parameters = parameters;
+    self->value = NULL;
+    self->exc_type = NULL;
+    self->exc_value = NULL;
+    self->exc_tb = NULL;
+    self->done = 0;
+    self->dispatched = 0;
+    self->callbacks = PyList_New(0);
+    self->lock = PyThread_allocate_lock();
+
+    if (!self->callbacks || !self->lock) {
+        Py_DECREF(self);
+        return (pysqlite_AsyncResult*)PyErr_NoMemory();
+    }
+    PyThread_acquire_lock(self->lock, NOWAIT_LOCK);
+
+    return self;
+}
+
+static void pysqlite_async_result_dealloc(pysqlite_AsyncResult* self)
+{
+    Py_XDECREF(self->sql);
+    Py_XDECREF(self->parameters);
+    Py_XDECREF(self->value);
+    Py_XDECREF(self->exc_type);
+    Py_XDECREF(self->exc_value);
+    Py_XDECREF(self->exc_tb);
+    Py_XDECREF(self->callbacks);
+
+    if (self->lock) {
+        if (!self->done) {
+            PyThread_release_lock(self->lock);
+        }
+        PyThread_free_lock(self->lock);
+    }
+
+    PyObject_Del(self);
+}
+
+static PyObject* pysqlite_async_result_done(pysqlite_AsyncResult* self, PyObject* args)
+{
+    return PyBool_FromLong(self->done);
+}
+
+static PyObject* pysqlite_async_result_result(pysqlite_AsyncResult* self, PyObject* args)
+{
+    if (!self->done) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        PyThread_release_lock(self->lock);
+        Py_END_ALLOW_THREADS
+    }
+
+    if (self->exc_type) {
+        Py_INCREF(self->exc_type);
+        Py_XINCREF(self->exc_value);
+        Py_XINCREF(self->exc_tb);
+        PyErr_Restore(self->exc_type, self->exc_value, self->exc_tb);
+        return NULL;
+    }
+
+    Py_INCREF(self->value);
+    return self->value;
+}
+
+static PyObject* pysqlite_async_result_add_done_callback(pysqlite_AsyncResult* self, PyObject* args)
+{
+    PyObject* callback;
+    PyObject* ret;
+
+    if (!PyArg_ParseTuple(args, "O:add_done_callback", &callback)) {
+        return NULL;
+    }
+
+    if (self->dispatched) {
+        /* too late to be called by dispatch(), so call it right away */
+        ret = PyObject_CallFunctionObjArgs(callback, (PyObject*)self, NULL);
+        if (!ret) {
+            return NULL;
+        }
+        Py_DECREF(ret);
+    } else if (PyList_Append(self->callbacks, callback) != 0) {
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* Marks a job as done and wakes up whoever waits in result(). */
+static void async_finish(pysqlite_AsyncResult* job)
+{
+    job->done = 1;
+    PyThread_release_lock(job->lock);
+}
+
+/* Stores the current exception as the outcome of a job. */
+static void async_set_exception(pysqlite_AsyncResult* job)
+{
+    Py_CLEAR(job->value);
+    Py_CLEAR(job->exc_type);
+    Py_CLEAR(job->exc_value);
+    Py_CLEAR(job->exc_tb);
+    PyErr_Fetch(&job->exc_type, &job->exc_value, &job->exc_tb);
+    PyErr_NormalizeException(&job->exc_type, &job->exc_value, &job->exc_tb);
+}
+
+/*
+ * Runs the statements of one unit of work within a savepoint. If one of them
+ * fails, the unit's changes are rolled back and the exception becomes its
+ * outcome; the other units in the transaction are not affected.
+ *
+ * Returns 0, or -1 with an exception set if the surrounding transaction is
+ * lost as well.
+ */
+static int async_run_unit(pysqlite_AsyncConnection* self, pysqlite_AsyncResult* job)
+{
+    PyObject* connection = (PyObject*)self->connection;
+    PyObject* execute;
+    PyObject* savepoint;
+    PyObject* iter;
+    PyObject* item;
+    PyObject* ret;
+
+    savepoint = PyObject_CallMethod(connection, "savepoint", "s", "pysqlite_group_unit");
+    if (!savepoint) {
+        return -1;
+    }
+    ret = PyObject_CallMethod(savepoint, "__enter__", "");
+    if (!ret) {
+        Py_DECREF(savepoint);
+        return -1;
+    }
+    Py_DECREF(ret);
+
+    /* statements are either SQL strings or (sql, parameters) tuples */
+    execute = PyObject_GetAttrString(connection, "execute");
+    iter = execute ? PyObject_GetIter(job->sql) : NULL;
+    while (iter && (item = PyIter_Next(iter))) {
+        if (PyTuple_Check(item)) {
+            ret = PyObject_Call(execute, item, NULL);
+        } else {
+            ret = PyObject_CallFunctionObjArgs(execute, item, NULL);
+        }
+        Py_DECREF(item);
+        if (!ret) {
+            break;
+        }
+        Py_DECREF(ret);
+    }
+    Py_XDECREF(iter);
+    Py_XDECREF(execute);
+
+    if (sqlite3_get_autocommit(self->connection->db)) {
+        /* submit() only lets DML through, but don't build on a transaction
+         * that is gone */
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(pysqlite_OperationalError, "the unit of work ended the group's transaction");
+        }
+        Py_DECREF(savepoint);
+        return -1;
+    }
+
+    if (!PyErr_Occurred()) {
+        ret = PyObject_CallMethod(savepoint, "release", "");
+    } else {
+        async_set_exception(job);
+        ret = PyObject_CallMethod(savepoint, "rollback", "");
+    }
+    Py_DECREF(savepoint);
+    if (!ret) {
+        return -1;
+    }
+    Py_DECREF(ret);
+
+    if (!job->exc_type) {
+        Py_INCREF(Py_None);
+        job->value = Py_None;
+    }
+
+    return 0;
+}
+
+/*
+ * Runs the units of work queue[start:end] in a single transaction and
+ * commits it once. Only then are the units marked as done, so a submitter
+ * learns about success only after the shared COMMIT went through.
+ */
+static void async_run_group(pysqlite_AsyncConnection* self, PyObject* queue, Py_ssize_t start, Py_ssize_t end)
+{
+    pysqlite_AsyncResult* job;
+    PyObject* ret = NULL;
+    PyObject* exc_type, *exc_value, *exc_tb;
+    Py_ssize_t i;
+    int began = 0;
+
+    if (self->connection->inTransaction) {
+        /* a commit of the group would commit the earlier jobs, too, and a
+         * failed group would roll them back */
+        PyErr_SetString(pysqlite_ProgrammingError,
+                        "Cannot run units of work while a transaction is open. Commit or roll back first.");
+    } else {
+        ret = _pysqlite_connection_begin(self->connection);
+        began = ret != NULL;
+    }
+
+    for (i = start; ret && i < end; i++) {
+        if (async_run_unit(self, (pysqlite_AsyncResult*)PyList_GET_ITEM(queue, i)) != 0) {
+            Py_CLEAR(ret);
+        }
+    }
+
+    if (ret) {
+        Py_DECREF(ret);
+        ret = pysqlite_connection_commit(self->connection, NULL);
+    }
+
+    if (ret) {
+        Py_DECREF(ret);
+    } else {
+        /* the transaction is gone, and with it the work of every unit */
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        if (began) {
+            ret = pysqlite_connection_rollback(self->connection, NULL);
+            Py_XDECREF(ret);
+            PyErr_Clear();
+        }
+
+        for (i = start; i < end; i++) {
+            job = (pysqlite_AsyncResult*)PyList_GET_ITEM(queue, i);
+            Py_XINCREF(exc_type);
+            Py_XINCREF(exc_value);
+            Py_XINCREF(exc_tb);
+            PyErr_Restore(exc_type, exc_value, exc_tb);
+            async_set_exception(job);
+        }
+        Py_XDECREF(exc_type);
+        Py_XDECREF(exc_value);
+        Py_XDECREF(exc_tb);
+    }
+
+    for (i = start; i < end; i++) {
+        async_finish((pysqlite_AsyncResult*)PyList_GET_ITEM(queue, i));
+    }
+}
+
+/*
+ * Runs one job in the worker thread and stores its outcome.
+ *
+ * Returns 1 if the worker should stop afterwards, 0 otherwise.
+ */
+static int async_run(pysqlite_AsyncConnection* self, pysqlite_AsyncResult* job)
+{
+    PyObject* connection = (PyObject*)self->connection;
+    PyObject* cursor;
+    PyObject* value = NULL;
+    int stop = 0;
+
+    switch (job->op) {
+        case ASYNC_EXECUTE:
+        case ASYNC_EXECUTEMANY:
+            if (job->parameters) {
+                cursor = PyObject_CallMethod(connection, job->op == ASYNC_EXECUTE ? "execute" : "executemany",
+                                             "OO", job->sql, job->parameters);
+            } else {
+                cursor = PyObject_CallMethod(connection, "execute", "O", job->sql);
+            }
+            if (cursor) {
+                if (job->op == ASYNC_EXECUTE) {
+                    value = PyObject_CallMethod(cursor, "fetchall", "");
+                } else {
+                    Py_INCREF(Py_None);
+                    value = Py_None;
+                }
+                Py_DECREF(cursor);
+            }
+            break;
+        case ASYNC_COMMIT:
+            value = pysqlite_connection_commit(self->connection, NULL);
+            break;
+        case ASYNC_ROLLBACK:
+            value = pysqlite_connection_rollback(self->connection, NULL);
+            break;
+        case ASYNC_CLOSE:
+            value = pysqlite_connection_close(self->connection, NULL);
+            stop = 1;
+            break;
+    }
+
+    if (value) {
+        job->value = value;
+    } else {
+        async_set_exception(job);
+    }
+    async_finish(job);
+
+    return stop;
+}
+
+/* Returns the number of units of work at the head of the queue. */
+static Py_ssize_t async_count_units(pysqlite_AsyncConnection* self, Py_ssize_t start)
+{
+    Py_ssize_t i;
+
+    for (i = start; i < PyList_GET_SIZE(self->queue); i++) {
+        if (((pysqlite_AsyncResult*)PyList_GET_ITEM(self->queue, i))->op != ASYNC_UNIT) {
+            break;
+        }
+        if (self->commit_batch > 0 && i - start >= self->commit_batch) {
+            break;
+        }
+    }
+
+    return i - start;
+}
+
+/*
+ * Gives other threads up to commit_window seconds to queue more units of
+ * work behind the ones at queue[start:], so they can share one transaction.
+ */
+static void async_wait_for_units(pysqlite_AsyncConnection* self, Py_ssize_t start)
+{
+    double waited = 0.0;
+    Py_ssize_t units;
+
+    while (waited < self->commit_window) {
+        units = async_count_units(self, start);
+        if (self->commit_batch > 0 && units >= self->commit_batch) {
+            break;
+        }
+        /* something else is queued behind the units; don't hold it up */
+        if (start + units < PyList_GET_SIZE(self->queue)) {
+            break;
+        }
+        pysqlite_sleep(ASYNC_WINDOW_STEP);
+        waited += ASYNC_WINDOW_STEP;
+    }
+}
+
+/*
+ * The worker thread. It sleeps until work is submitted, then runs all queued
+ * jobs in one go and signals their completion with a single byte on the
+ * wakeup pipe.
+ */
+static void async_worker(void* arg)
+{
+    pysqlite_AsyncConnection* self = (pysqlite_AsyncConnection*)arg;
+    PyGILState_STATE gilstate;
+    pysqlite_AsyncResult* job;
+    Py_ssize_t i, j, n;
+    int stop = 0;
+
+    gilstate = PyGILState_Ensure();
+
+    /* from now on, the connection belongs to this thread */
+    self->connection->thread_ident = PyThread_get_thread_ident();
+    self->worker_ident = self->connection->thread_ident;
+
+    while (!stop) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->work, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+        self->signalled = 0;
+
+        /* jobs queued while we run the batch are picked up, too */
+        for (i = 0; i < PyList_GET_SIZE(self->queue) && !stop; i += n) {
+            job = (pysqlite_AsyncResult*)PyList_GET_ITEM(self->queue, i);
+            if (job->op == ASYNC_UNIT) {
+                async_wait_for_units(self, i);
+                n = async_count_units(self, i);
+                async_run_group(self, self->queue, i, i + n);
+            } else {
+                n = 1;
+                stop = async_run(self, job);
+            }
+            for (j = i; j < i + n; j++) {
+                if (PyList_Append(self->finished, PyList_GET_ITEM(self->queue, j)) != 0) {
+                    PyErr_Clear();
+                }
+            }
+        }
+
+        if (i > 0) {
+            if (PyList_SetSlice(self->queue, 0, i, NULL) != 0) {
+                PyErr_Clear();
+            }
+#ifndef MS_WINDOWS
+            /* the pipe is non-blocking; if it is full, there's a wakeup
+             * pending anyway */
+            if (self->wakeup_fds[1] >= 0) {
+                (void)write(self->wakeup_fds[1], "x", 1);
+            }
+#endif
+        }
+    }
+
+    /* once running is released, self may be gone */
+    if (self->orphaned) {
+        PyThread_release_lock(self->running);
+        Py_DECREF(self);
+    } else {
+        PyThread_release_lock(self->running);
+    }
+
+    PyGILState_Release(gilstate);
+}
+
+static int pysqlite_async_connection_init(pysqlite_AsyncConnection* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* factory = NULL;
+    PyObject* connection;
+    PyObject* item;
+#ifndef MS_WINDOWS
+    int i;
+#endif
+
+    if (self->queue) {
+        PyErr_SetString(pysqlite_ProgrammingError, "AsyncConnection.__init__ can only be called once.");
+        return -1;
+    }
+
+    self->wakeup_fds[0] = -1;
+    self->wakeup_fds[1] = -1;
+
+    kwargs = kwargs ? PyDict_Copy(kwargs) : PyDict_New();
+    if (!kwargs) {
+        return -1;
+    }
+
+    self->commit_window = 0.0;
+    item = PyDict_GetItemString(kwargs, "commit_window");
+    if (item) {
+        self->commit_window = PyFloat_AsDouble(item);
+        if (PyErr_Occurred() || PyDict_DelItemString(kwargs, "commit_window") != 0) {
+            Py_DECREF(kwargs);
+            return -1;
+        }
+    }
+
+    self->commit_batch = 0;
+    item = PyDict_GetItemString(kwargs, "commit_batch");
+    if (item) {
+        self->commit_batch = (int)PyInt_AsLong(item);
+        if (PyErr_Occurred() || PyDict_DelItemString(kwargs, "commit_batch") != 0) {
+            Py_DECREF(kwargs);
+            return -1;
+        }
+    }
+
+    factory = PyDict_GetItemString(kwargs, "factory");
+    if (!factory) {
+        factory = (PyObject*)&pysqlite_ConnectionType;
+    }
+
+    connection = PyObject_Call(factory, args, kwargs);
+    Py_DECREF(kwargs);
+    if (!connection) {
+        return -1;
+    }
+    if (!PyObject_TypeCheck(connection, &pysqlite_ConnectionType)) {
+        Py_DECREF(connection);
+        PyErr_SetString(PyExc_TypeError, "factory must return a Connection");
+        return -1;
+    }
+    self->connection = (pysqlite_Connection*)connection;
+
+    self->queue = PyList_New(0);
+    self->finished = PyList_New(0);
+    if (!self->queue || !self->finished) {
+        return -1;
+    }
+
+    self->work = PyThread_allocate_lock();
+    self->running = PyThread_allocate_lock();
+    if (!self->work || !self->running) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    PyThread_acquire_lock(self->work, NOWAIT_LOCK);
+    self->signalled = 0;
+
+#ifndef MS_WINDOWS
+    if (pipe(self->wakeup_fds) != 0) {
+        self->wakeup_fds[0] = -1;
+        self->wakeup_fds[1] = -1;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    for (i = 0; i < 2; i++) {
+        (void)fcntl(self->wakeup_fds[i], F_SETFL, fcntl(self->wakeup_fds[i], F_GETFL) | O_NONBLOCK);
+    }
+#endif
+
+    PyEval_InitThreads();
+
+    self->worker_ident = 0;
+    self->orphaned = 0;
+    PyThread_acquire_lock(self->running, NOWAIT_LOCK);
+    if (PyThread_start_new_thread(async_worker, (void*)self) == -1) {
+        /* nothing to wait for in dealloc */
+        PyThread_release_lock(self->running);
+        PyErr_SetString(pysqlite_OperationalError, "cannot start worker thread");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void pysqlite_async_connection_dealloc(pysqlite_AsyncConnection* self)
+{
+    PyObject* job;
+
+    if (self->running && !PyThread_acquire_lock(self->running, NOWAIT_LOCK)) {
+        /* the worker still runs; have it close the connection and stop */
+        if (!self->closed) {
+            job = async_submit(self, ASYNC_CLOSE, NULL, NULL);
+            if (job) {
+                self->closed = 1;
+                Py_DECREF(job);
+            } else {
+                PyErr_Clear();
+            }
+        }
+
+        if (self->worker_ident == PyThread_get_thread_ident()) {
+            /* can't wait for ourselves; the worker releases us when done.
+             * The dealloc of a subclass drops its type reference after this
+             * returns, and again when the worker releases us. */
+            _Py_NewReference((PyObject*)self);
+            if (PyType_HasFeature(Py_TYPE(self), Py_TPFLAGS_HEAPTYPE)) {
+                Py_INCREF(Py_TYPE(self));
+            }
+            self->orphaned = 1;
+            return;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->running, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+
+    Py_XDECREF(self->connection);
+    Py_XDECREF(self->queue);
+    Py_XDECREF(self->finished);
+
+    if (self->work) {
+        PyThread_free_lock(self->work);
+    }
+    if (self->running) {
+        PyThread_free_lock(self->running);
+    }
+
+#ifndef MS_WINDOWS
+    /* the descriptors are only valid once __init__ got this far */
+    if (self->queue && self->wakeup_fds[0] >= 0) {
+        close(self->wakeup_fds[0]);
+        close(self->wakeup_fds[1]);
+    }
+#endif
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Queues a job for the worker and returns its result object. */
+static PyObject* async_submit(pysqlite_AsyncConnection* self, int op, PyObject* sql, PyObject* parameters)
+{
+    pysqlite_AsyncResult* job;
+
+    if (!self->queue) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base AsyncConnection.__init__ not called.");
+        return NULL;
+    }
+
+    if (self->closed) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Cannot operate on a closed database.");
+        return NULL;
+    }
+
+    job = async_result_new(op, sql, parameters);
+    if (!job) {
+        return NULL;
+    }
+
+    if (PyList_Append(self->queue, (PyObject*)job) != 0) {
+        Py_DECREF(job);
+        return NULL;
+    }
+
+    if (!self->signalled) {
+        self->signalled = 1;
+        PyThread_release_lock(self->work);
+    }
+
+    return (PyObject*)job;
+}
+
+static PyObject* pysqlite_async_connection_execute(pysqlite_AsyncConnection* self, PyObject* args)
+{
+    PyObject* sql;
+    PyObject* parameters = NULL;
+
+    if (!PyArg_ParseTuple(args, "O|O:execute", &sql, &parameters)) {
+        return NULL;
+    }
+
+    return async_submit(self, ASYNC_EXECUTE, sql, parameters);
+}
+
+static PyObject* pysqlite_async_connection_executemany(pysqlite_AsyncConnection* self, PyObject* args)
+{
+    PyObject* sql;
+    PyObject* seq;
+
+    if (!PyArg_ParseTuple(args, "OO:executemany", &sql, &seq)) {
+        return NULL;
+    }
+
+    /* the worker must not iterate over a generator that belongs to us */
+    seq = PySequence_List(seq);
+    if (!seq) {
+        return NULL;
+    }
+
+    args = async_submit(self, ASYNC_EXECUTEMANY, sql, seq);
+    Py_DECREF(seq);
+
+    return args;
+}
+
+static PyObject* pysqlite_async_connection_commit(pysqlite_AsyncConnection* self, PyObject* args)
+{
+    return async_submit(self, ASYNC_COMMIT, NULL, NULL);
+}
+
+static PyObject* pysqlite_async_connection_rollback(pysqlite_AsyncConnection* self, PyObject* args)
+{
+    return async_submit(self, ASYNC_ROLLBACK, NULL, NULL);
+}
+
+/*
+ * Checks that a unit of work only has statements that can run within the
+ * group's transaction and a savepoint. Anything else, like DDL, BEGIN or
+ * VACUUM, may end the transaction and is rejected.
+ *
+ * Returns 0, or -1 with an exception set.
+ */
+static int async_check_unit(PyObject* statements)
+{
+    PyObject* sql;
+    PyObject* sql_str;
+    Py_ssize_t i;
+    pysqlite_StatementKind kind;
+
+    for (i = 0; i < PyList_GET_SIZE(statements); i++) {
+        sql = PyList_GET_ITEM(statements, i);
+        if (PyTuple_Check(sql) && PyTuple_GET_SIZE(sql) > 0) {
+            sql = PyTuple_GET_ITEM(sql, 0);
+        }
+
+        if (PyString_Check(sql)) {
+            kind = pysqlite_detect_statement_type(PyString_AsString(sql));
+        } else if (PyUnicode_Check(sql)) {
+            sql_str = PyUnicode_AsUTF8String(sql);
+            if (!sql_str) {
+                return -1;
+            }
+            kind = pysqlite_detect_statement_type(PyString_AsString(sql_str));
+            Py_DECREF(sql_str);
+        } else {
+            /* execute() reports the wrong type when the unit runs */
+            continue;
+        }
+
+        switch (kind) {
+            case STATEMENT_SELECT:
+            case STATEMENT_INSERT:
+            case STATEMENT_UPDATE:
+            case STATEMENT_DELETE:
+            case STATEMENT_REPLACE:
+                break;
+            default:
+                PyErr_SetString(pysqlite_ProgrammingError,
+                                "Units of work can only contain SELECT, INSERT, UPDATE, DELETE and REPLACE statements.");
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static PyObject* pysqlite_async_connection_submit(pysqlite_AsyncConnection* self, PyObject* args)
+{
+    PyObject* statements;
+
+    if (!PyArg_ParseTuple(args, "O:submit", &statements)) {
+        return NULL;
+    }
+
+    statements = PySequence_List(statements);
+    if (!statements) {
+        return NULL;
+    }
+
+    if (async_check_unit(statements) != 0) {
+        Py_DECREF(statements);
+        return NULL;
+    }
+
+    args = async_submit(self, ASYNC_UNIT, statements, NULL);
+    Py_DECREF(statements);
+
+    return args;
+}
+
+static PyObject* pysqlite_async_connection_close(pysqlite_AsyncConnection* self, PyObject* args)
+{
+    PyObject* result;
+
+    result = async_submit(self, ASYNC_CLOSE, NULL, NULL);
+    if (result) {
+        self->closed = 1;
+    }
+
+    return result;
+}
+
+static PyObject* pysqlite_async_connection_fileno(pysqlite_AsyncConnection* self, PyObject* args)
+{
+    if (!self->queue) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base AsyncConnection.__init__ not called.");
+        return NULL;
+    }
+
+    if (self->wakeup_fds[0] < 0) {
+        PyErr_SetString(pysqlite_NotSupportedError, "no wakeup descriptor on this platform");
+        return NULL;
+    }
+
+    return PyInt_FromLong(self->wakeup_fds[0]);
+}
+
+static PyObject* pysqlite_async_connection_dispatch(pysqlite_AsyncConnection* self, PyObject* args)
+{
+    PyObject* finished;
+    PyObject* ret;
+    pysqlite_AsyncResult* result;
+    Py_ssize_t i, j;
+#ifndef MS_WINDOWS
+    char buf[64];
+#endif
+
+    if (!self->finished) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base AsyncConnection.__init__ not called.");
+        return NULL;
+    }
+
+#ifndef MS_WINDOWS
+    if (self->wakeup_fds[0] >= 0) {
+        while (read(self->wakeup_fds[0], buf, sizeof(buf)) > 0) {
+        }
+    }
+#endif
+
+    finished = self->finished;
+    self->finished = PyList_New(0);
+    if (!self->finished) {
+        self->finished = finished;
+        return NULL;
+    }
+
+    for (i = 0; i < PyList_GET_SIZE(finished); i++) {
+        result = (pysqlite_AsyncResult*)PyList_GET_ITEM(finished, i);
+        result->dispatched = 1;
+        for (j = 0; j < PyList_GET_SIZE(result->callbacks); j++) {
+            ret = PyObject_CallFunctionObjArgs(PyList_GET_ITEM(result->callbacks, j), (PyObject*)result, NULL);
+            if (ret) {
+                Py_DECREF(ret);
+            } else if (_enable_callback_tracebacks) {
+                PyErr_Print();
+            } else {
+                PyErr_Clear();
+            }
+        }
+        (void)PyList_SetSlice(result->callbacks, 0, PyList_GET_SIZE(result->callbacks), NULL);
+    }
+
+    return finished;
+}
+
+static PyObject* pysqlite_async_connection_get_pending(pysqlite_AsyncConnection* self, void* unused)
+{
+    return PyInt_FromSsize_t(self->queue ? PyList_GET_SIZE(self->queue) : 0);
+}
+
+static PyMethodDef async_result_methods[] = {
+    {"done", (PyCFunction)pysqlite_async_result_done, METH_NOARGS,
+        PyDoc_STR("Returns True once the job has run.")},
+    {"result", (PyCFunction)pysqlite_async_result_result, METH_NOARGS,
+        PyDoc_STR("Waits for the job and returns its result or raises its exception.")},
+    {"add_done_callback", (PyCFunction)pysqlite_async_result_add_done_callback, METH_VARARGS,
+        PyDoc_STR("Registers a callable to be called by AsyncConnection.dispatch().")},
+    {NULL, NULL}
+};
+
+static PyMethodDef async_connection_methods[] = {
+    {"execute", (PyCFunction)pysqlite_async_connection_execute, METH_VARARGS,
+        PyDoc_STR("Queues a statement; the result is the list of rows.")},
+    {"executemany", (PyCFunction)pysqlite_async_connection_executemany, METH_VARARGS,
+        PyDoc_STR("Queues a statement to be executed for each set of parameters.")},
+    {"commit", (PyCFunction)pysqlite_async_connection_commit, METH_NOARGS,
+        PyDoc_STR("Queues a commit.")},
+    {"rollback", (PyCFunction)pysqlite_async_connection_rollback, METH_NOARGS,
+        PyDoc_STR("Queues a rollback.")},
+    {"submit", (PyCFunction)pysqlite_async_connection_submit, METH_VARARGS,
+        PyDoc_STR("Queues a unit of work to be committed together with others.")},
+    {"close", (PyCFunction)pysqlite_async_connection_close, METH_NOARGS,
+        PyDoc_STR("Queues closing the connection and stopping the worker.")},
+    {"fileno", (PyCFunction)pysqlite_async_connection_fileno, METH_NOARGS,
+        PyDoc_STR("Returns a descriptor that becomes readable when jobs have finished.")},
+    {"dispatch", (PyCFunction)pysqlite_async_connection_dispatch, METH_NOARGS,
+        PyDoc_STR("Calls the callbacks of finished jobs and returns their results.")},
+    {NULL, NULL}
+};
+
+static struct PyMemberDef async_connection_members[] =
+{
+    {"commit_window", T_DOUBLE, offsetof(pysqlite_AsyncConnection, commit_window), 0},
+    {"commit_batch", T_INT, offsetof(pysqlite_AsyncConnection, commit_batch), 0},
+    {NULL}
+};
+
+static PyGetSetDef async_connection_getset[] = {
+    {"pending",  (getter)pysqlite_async_connection_get_pending, (setter)0},
+    {NULL}
+};
+
+static char async_connection_doc[] =
+PyDoc_STR("A connection that runs its statements in a worker thread.");
+
+static char async_result_doc[] =
+PyDoc_STR("The pending result of an AsyncConnection job.");
+
+PyTypeObject pysqlite_AsyncResultType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        MODULE_NAME ".AsyncResult",                     /* tp_name */
+        sizeof(pysqlite_AsyncResult),                   /* tp_basicsize */
+        0,                                              /* tp_itemsize */
+        (destructor)pysqlite_async_result_dealloc,      /* tp_dealloc */
+        0,                                              /* tp_print */
+        0,                                              /* tp_getattr */
+        0,                                              /* tp_setattr */
+        0,                                              /* tp_compare */
+        0,                                              /* tp_repr */
+        0,                                              /* tp_as_number */
+        0,                                              /* tp_as_sequence */
+        0,                                              /* tp_as_mapping */
+        0,                                              /* tp_hash */
+        0,                                              /* tp_call */
+        0,                                              /* tp_str */
+        0,                                              /* tp_getattro */
+        0,                                              /* tp_setattro */
+        0,                                              /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT,                             /* tp_flags */
+        async_result_doc,                               /* tp_doc */
+        0,                                              /* tp_traverse */
+        0,                                              /* tp_clear */
+        0,                                              /* tp_richcompare */
+        0,                                              /* tp_weaklistoffset */
+        0,                                              /* tp_iter */
+        0,                                              /* tp_iternext */
+        async_result_methods,                           /* tp_methods */
+        0,                                              /* tp_members */
+        0,                                              /* tp_getset */
+        0,                                              /* tp_base */
+        0,                                              /* tp_dict */
+        0,                                              /* tp_descr_get */
+        0,                                              /* tp_descr_set */
+        0,                                              /* tp_dictoffset */
+        (initproc)0,                                    /* tp_init */
+        0,                                              /* tp_alloc */
+        0,                                              /* tp_new */
+        0                                               /* tp_free */
+};
+
+PyTypeObject pysqlite_AsyncConnectionType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        MODULE_NAME ".AsyncConnection",                 /* tp_name */
+        sizeof(pysqlite_AsyncConnection),               /* tp_basicsize */
+        0,                                              /* tp_itemsize */
+        (destructor)pysqlite_async_connection_dealloc,  /* tp_dealloc */
+        0,                                              /* tp_print */
+        0,                                              /* tp_getattr */
+        0,                                              /* tp_setattr */
+        0,                                              /* tp_compare */
+        0,                                              /* tp_repr */
+        0,                                              /* tp_as_number */
+        0,                                              /* tp_as_sequence */
+        0,                                              /* tp_as_mapping */
+        0,                                              /* tp_hash */
+        0,                                              /* tp_call */
+        0,                                              /* tp_str */
+        0,                                              /* tp_getattro */
+        0,                                              /* tp_setattro */
+        0,                                              /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,         /* tp_flags */
+        async_connection_doc,                           /* tp_doc */
+        0,                                              /* tp_traverse */
+        0,                                              /* tp_clear */
+        0,                                              /* tp_richcompare */
+        0,                                              /* tp_weaklistoffset */
+        0,                                              /* tp_iter */
+        0,                                              /* tp_iternext */
+        async_connection_methods,                       /* tp_methods */
+        async_connection_members,                       /* tp_members */
+        async_connection_getset,                        /* tp_getset */
+        0,                                              /* tp_base */
+        0,                                              /* tp_dict */
+        0,                                              /* tp_descr_get */
+        0,                                              /* tp_descr_set */
+        0,                                              /* tp_dictoffset */
+        (initproc)pysqlite_async_connection_init,       /* tp_init */
+        0,                                              /* tp_alloc */
+        0,                                              /* tp_new */
+        0                                               /* tp_free */
+};
+
+extern int pysqlite_async_setup_types(void)
+{
+    int rc;
+
+    pysqlite_AsyncConnectionType.tp_new = PyType_GenericNew;
+    rc = PyType_Ready(&pysqlite_AsyncConnectionType);
+    if (rc < 0) {
+        return rc;
+    }
+    return PyType_Ready(&pysqlite_AsyncResultType);
+}
@@ -0,0 +1,101 @@
+/* async.h - definitions for connections owned by a worker thread
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef PYSQLITE_ASYNC_H
+#define PYSQLITE_ASYNC_H
+#include "Python.h"
+
+#include "pythread.h"
+#include "connection.h"
+
+typedef struct
+{
+    PyObject_HEAD
+
+    /* what to do: one of the ASYNC_* constants, and its arguments */
+    int op;
+    PyObject* sql;
+    PyObject* parameters;
+
+    /* the outcome, once done is set */
+    PyObject* value;
+    PyObject* exc_type;
+    PyObject* exc_value;
+    PyObject* exc_tb;
+    int done;
+
+    /* held until the job is done; result() waits on it */
+    PyThread_type_lock lock;
+
+    /* called with the result object by AsyncConnection.dispatch() */
+    PyObject* callbacks;
+    int dispatched;
+} pysqlite_AsyncResult;
+
+typedef struct
+{
+    PyObject_HEAD
+
+    /* the connection; only the worker thread uses it */
+    pysqlite_Connection* connection;
+
+    /* results whose jobs the worker has not run yet */
+    PyObject* queue;
+
+    /* results that are done, but whose callbacks were not called yet */
+    PyObject* finished;
+
+    /* locked while the worker has nothing to do; "signalled" is set when
+     * it was released for new work */
+    PyThread_type_lock work;
+    int signalled;
+
+    /* held while the worker thread runs */
+    PyThread_type_lock running;
+
+    /* the worker thread's identity once it has started, or 0. The worker
+     * doesn't own a reference; dealloc closes the connection and waits for
+     * the worker instead. If the last reference goes away in the worker
+     * itself, orphaned is set and the worker releases the object when it
+     * ends. */
+    long worker_ident;
+    int orphaned;
+
+    /* the worker writes a byte to wakeup_fds[1] after each batch of jobs */
+    int wakeup_fds[2];
+
+    /* group commit: how long the worker waits for more units of work to
+     * arrive before committing, and how many units at most go into one
+     * transaction (0 means no limit) */
+    double commit_window;
+    int commit_batch;
+
+    int closed;
+} pysqlite_AsyncConnection;
+
+extern PyTypeObject pysqlite_AsyncConnectionType;
+extern PyTypeObject pysqlite_AsyncResultType;
+
+int pysqlite_async_setup_types(void);
+
+#endif
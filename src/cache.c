@@ -41,6 +41,8 @@ pysqlite_Node* pysqlite_new_node(PyObject* key, PyObject* data)
     Py_INCREF(data);
     node->data = data;
 
+    node->count = 0;
+    node->cost = 0;
     node->prev = NULL;
     node->next = NULL;
 
@@ -59,10 +61,11 @@ int pysqlite_cache_init(pysqlite_Cache* self, PyObject* args, PyObject* kwargs)
 {
     PyObject* factory;
     int size = 10;
+    Py_ssize_t max_bytes = 0;
 
     self->factory = NULL;
 
-    if (!PyArg_ParseTuple(args, "O|i", &factory, &size)) {
+    if (!PyArg_ParseTuple(args, "O|in", &factory, &size, &max_bytes)) {
         return -1;
     }
 
@@ -71,6 +74,15 @@ int pysqlite_cache_init(pysqlite_Cache* self, PyObject* args, PyObject* kwargs)
         size = 5;
     }
     self->size = size;
+
+    if (max_bytes < 0) {
+        max_bytes = 0;
+    }
+    self->max_bytes = max_bytes;
+    self->bytes = 0;
+    self->cost_func = NULL;
+    self->create_func = NULL;
+
     self->first = NULL;
     self->last = NULL;
 
@@ -87,6 +99,72 @@ int pysqlite_cache_init(pysqlite_Cache* self, PyObject* args, PyObject* kwargs)
     return 0;
 }
 
+/* Throws a single entry out of the cache.
+ *
+ * Returns 0 on success, -1 on error. */
+int pysqlite_cache_remove(pysqlite_Cache* self, pysqlite_Node* node)
+{
+    if (PyDict_DelItem(self->mapping, node->key) != 0) {
+        return -1;
+    }
+
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        self->first = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    } else {
+        self->last = node->prev;
+    }
+    node->prev = NULL;
+    node->next = NULL;
+
+    self->bytes -= node->cost;
+
+    Py_DECREF(node);
+
+    return 0;
+}
+
+/* Measures the cost of an entry again after its data changed, and evicts the
+ * least used other entries until the byte budget fits again.
+ *
+ * Returns 0 on success, -1 on error. */
+int pysqlite_cache_refresh_cost(pysqlite_Cache* self, PyObject* data)
+{
+    pysqlite_Node* node;
+    Py_ssize_t cost;
+
+    if (!self->cost_func) {
+        return 0;
+    }
+
+    for (node = self->first; node; node = node->next) {
+        if (node->data == data) {
+            break;
+        }
+    }
+    if (!node) {
+        /* the entry was evicted already */
+        return 0;
+    }
+
+    cost = self->cost_func(data);
+    self->bytes += cost - node->cost;
+    node->cost = cost;
+
+    while (self->max_bytes > 0 && self->bytes > self->max_bytes
+            && self->last && self->last != node) {
+        if (pysqlite_cache_remove(self, self->last) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 void pysqlite_cache_dealloc(pysqlite_Cache* self)
 {
     pysqlite_Node* node;
@@ -161,39 +239,38 @@ PyObject* pysqlite_cache_get(pysqlite_Cache* self, PyObject* args)
     } else {
         /* There is no entry for this key in the cache, yet. We'll insert a new
          * entry in the cache, and make space if necessary by throwing the
-         * least used item out of the cache. */
-
-        if (PyDict_Size(self->mapping) == self->size) {
-            if (self->last) {
-                node = self->last;
-
-                if (PyDict_DelItem(self->mapping, self->last->key) != 0) {
-                    return NULL;
-                }
-
-                if (node->prev) {
-                    node->prev->next = NULL;
-                }
-                self->last = node->prev;
-                node->prev = NULL;
+         * least used items out of the cache until both the entry count and
+         * the byte budget fit again. */
 
-                Py_DECREF(node);
-            }
+        if (self->create_func) {
+            data = self->create_func(self->factory, key);
+        } else {
+            data = PyObject_CallFunction(self->factory, "O", key);
         }
 
-        data = PyObject_CallFunction(self->factory, "O", key);
-
         if (!data) {
             return NULL;
         }
 
         node = pysqlite_new_node(key, data);
+        Py_DECREF(data);
         if (!node) {
             return NULL;
         }
-        node->prev = self->last;
 
-        Py_DECREF(data);
+        if (self->cost_func) {
+            node->cost = self->cost_func(data);
+        }
+
+        while (self->last && (PyDict_Size(self->mapping) >= self->size
+                    || (self->max_bytes > 0 && self->bytes + node->cost > self->max_bytes))) {
+            if (pysqlite_cache_remove(self, self->last) != 0) {
+                Py_DECREF(node);
+                return NULL;
+            }
+        }
+
+        node->prev = self->last;
 
         if (PyDict_SetItem(self->mapping, key, (PyObject*)node) != 0) {
             Py_DECREF(node);
@@ -206,6 +283,7 @@ PyObject* pysqlite_cache_get(pysqlite_Cache* self, PyObject* args)
             self->first = node;
         }
         self->last = node;
+        self->bytes += node->cost;
     }
 
     Py_INCREF(node->data);
@@ -35,6 +35,10 @@ typedef struct _pysqlite_Node
     PyObject* key;
     PyObject* data;
     long count;
+
+    /* memory footprint of data as reported by the cache's cost function */
+    Py_ssize_t cost;
+
     struct _pysqlite_Node* prev;
     struct _pysqlite_Node* next;
 } pysqlite_Node;
@@ -44,6 +48,21 @@ typedef struct
     PyObject_HEAD
     int size;
 
+    /* upper bound for the summed cost of all cached entries; 0 means no
+     * limit */
+    Py_ssize_t max_bytes;
+
+    /* summed cost of all entries currently in the cache */
+    Py_ssize_t bytes;
+
+    /* if set, called for each newly created entry to determine its cost.
+     * Without a cost function, all entries are free and only size applies. */
+    Py_ssize_t (*cost_func)(PyObject* data);
+
+    /* if set, called instead of the factory callable to create the entry for
+     * a key; it gets the factory as its first argument */
+    PyObject* (*create_func)(PyObject* factory, PyObject* key);
+
     /* a dictionary mapping keys to Node entries */
     PyObject* mapping;
 
@@ -67,6 +86,8 @@ void pysqlite_node_dealloc(pysqlite_Node* self);
 int pysqlite_cache_init(pysqlite_Cache* self, PyObject* args, PyObject* kwargs);
 void pysqlite_cache_dealloc(pysqlite_Cache* self);
 PyObject* pysqlite_cache_get(pysqlite_Cache* self, PyObject* args);
+int pysqlite_cache_remove(pysqlite_Cache* self, pysqlite_Node* node);
+int pysqlite_cache_refresh_cost(pysqlite_Cache* self, PyObject* data);
 
 int pysqlite_cache_setup_types(void);
 
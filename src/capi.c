@@ -0,0 +1,121 @@
+/* capi.c - the C API for other extension modules
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "module.h"
+#include "connection.h"
+#include "capi.h"
+#include "util.h"
+#include "sqlitecompat.h"
+
+/* Checks that connection is a usable Connection. 0 => error; 1 => ok */
+static int check_capi_connection(PyObject* connection)
+{
+    if (!PyObject_TypeCheck(connection, &pysqlite_ConnectionType)) {
+        PyErr_SetString(PyExc_TypeError, "expected a Connection");
+        return 0;
+    }
+
+    return pysqlite_check_thread((pysqlite_Connection*)connection)
+        && pysqlite_check_connection((pysqlite_Connection*)connection);
+}
+
+static sqlite3* pysqlite_capi_get_db(PyObject* connection)
+{
+    if (!check_capi_connection(connection)) {
+        return NULL;
+    }
+
+    return ((pysqlite_Connection*)connection)->db;
+}
+
+static int pysqlite_capi_create_function(PyObject* connection, const char* name, int n_arg, int flags, void* user_data,
+                                         void (*func)(sqlite3_context*, int, sqlite3_value**),
+                                         void (*step)(sqlite3_context*, int, sqlite3_value**),
+                                         void (*final)(sqlite3_context*),
+                                         void (*destroy)(void*))
+{
+    sqlite3* db;
+    int rc;
+
+    if (!check_capi_connection(connection)) {
+        return -1;
+    }
+    db = ((pysqlite_Connection*)connection)->db;
+
+    if ((flags & 7) == 0) {
+        flags |= SQLITE_UTF8;
+    }
+
+#if SQLITE_VERSION_NUMBER >= 3007003
+    rc = sqlite3_create_function_v2(db, name, n_arg, flags, user_data, func, step, final, destroy);
+#else
+    if (destroy) {
+        PyErr_SetString(pysqlite_NotSupportedError, "function destructors need SQLite 3.7.3 or later");
+        return -1;
+    }
+    rc = sqlite3_create_function(db, name, n_arg, flags, user_data, func, step, final);
+#endif
+    if (rc != SQLITE_OK) {
+        _pysqlite_seterror(db, NULL);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int pysqlite_capi_create_collation(PyObject* connection, const char* name, void* user_data,
+                                          int (*compare)(void*, int, const void*, int, const void*),
+                                          void (*destroy)(void*))
+{
+    sqlite3* db;
+    int rc;
+
+    if (!check_capi_connection(connection)) {
+        return -1;
+    }
+    db = ((pysqlite_Connection*)connection)->db;
+
+    rc = sqlite3_create_collation_v2(db, name, SQLITE_UTF8, user_data, compare, destroy);
+    if (rc != SQLITE_OK) {
+        _pysqlite_seterror(db, NULL);
+        return -1;
+    }
+
+    return 0;
+}
+
+static pysqlite_CAPI pysqlite_capi = {
+    PYSQLITE_CAPI_VERSION,
+    pysqlite_capi_get_db,
+    pysqlite_capi_create_function,
+    pysqlite_capi_create_collation
+};
+
+PyObject* pysqlite_capi_new(void)
+{
+#if PY_VERSION_HEX >= 0x02070000
+    return PyCapsule_New((void*)&pysqlite_capi, PYSQLITE_CAPI_NAME, NULL);
+#else
+    return PyCObject_FromVoidPtr((void*)&pysqlite_capi, NULL);
+#endif
+}
@@ -0,0 +1,124 @@
+/* capi.h - the C API for other extension modules
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef PYSQLITE_CAPI_H
+#define PYSQLITE_CAPI_H
+#include "Python.h"
+
+#include "sqlite3.h"
+
+/*
+ * The C API of pysqlite, for other extension modules. It lets them register
+ * SQL functions, aggregates and collations implemented in C on a Connection
+ * object, which then run without any Python objects or the GIL.
+ *
+ * The API is a pysqlite_CAPI struct in a capsule, or a CObject before Python
+ * 2.7, the capi attribute of the pysqlite2._sqlite module:
+ *
+ *     pysqlite_CAPI* capi = pysqlite_import_capi();
+ *     if (!capi) {
+ *         return NULL;
+ *     }
+ *     if (capi->create_function(connection, "dot", 2, SQLITE_UTF8, NULL, dot, NULL, NULL, NULL) < 0) {
+ *         return NULL;
+ *     }
+ *
+ * The callbacks are plain SQLite callbacks. The extension has to call the
+ * same SQLite library pysqlite is linked against, so it should link against
+ * the shared SQLite library rather than a copy of its own.
+ *
+ * All functions return 0, or -1 with a Python exception set. They must be
+ * called with the GIL held, from the thread that created the connection.
+ */
+
+#define PYSQLITE_CAPI_NAME "pysqlite2._sqlite.capi"
+#define PYSQLITE_CAPI_VERSION 1
+
+typedef struct
+{
+    /* PYSQLITE_CAPI_VERSION of the module; new members are only appended */
+    int version;
+
+    /* Returns the SQLite handle of an open connection, or NULL with an
+     * exception set. The handle is owned by the connection. */
+    sqlite3* (*get_db)(PyObject* connection);
+
+    /* sqlite3_create_function_v2() on the connection. The text encoding in
+     * flags defaults to SQLITE_UTF8; destroy, if not NULL, is called on
+     * user_data when SQLite is done with the function. */
+    int (*create_function)(PyObject* connection, const char* name, int n_arg, int flags, void* user_data,
+                           void (*func)(sqlite3_context*, int, sqlite3_value**),
+                           void (*step)(sqlite3_context*, int, sqlite3_value**),
+                           void (*final)(sqlite3_context*),
+                           void (*destroy)(void*));
+
+    /* sqlite3_create_collation_v2() on the connection, with SQLITE_UTF8 */
+    int (*create_collation)(PyObject* connection, const char* name, void* user_data,
+                            int (*compare)(void*, int, const void*, int, const void*),
+                            void (*destroy)(void*));
+} pysqlite_CAPI;
+
+#ifdef MODULE_NAME
+/* pysqlite itself: creates the capsule for the module */
+PyObject* pysqlite_capi_new(void);
+#else
+/* Imports the C API, or returns NULL with an exception set. */
+static pysqlite_CAPI* pysqlite_import_capi(void)
+{
+    pysqlite_CAPI* capi;
+#if PY_VERSION_HEX >= 0x02070000
+
+    capi = (pysqlite_CAPI*)PyCapsule_Import(PYSQLITE_CAPI_NAME, 0);
+#else
+    PyObject* module;
+    PyObject* cobject;
+
+    module = PyImport_ImportModule("pysqlite2._sqlite");
+    if (!module) {
+        return NULL;
+    }
+    cobject = PyObject_GetAttrString(module, "capi");
+    Py_DECREF(module);
+    if (!cobject) {
+        return NULL;
+    }
+    if (!PyCObject_Check(cobject)) {
+        Py_DECREF(cobject);
+        PyErr_SetString(PyExc_ImportError, "pysqlite2._sqlite.capi is not a CObject");
+        return NULL;
+    }
+
+    /* the module keeps the CObject alive */
+    capi = (pysqlite_CAPI*)PyCObject_AsVoidPtr(cobject);
+    Py_DECREF(cobject);
+#endif
+    if (capi && capi->version < PYSQLITE_CAPI_VERSION) {
+        PyErr_SetString(PyExc_ImportError, "pysqlite C API version mismatch");
+        return NULL;
+    }
+
+    return capi;
+}
+#endif
+
+#endif
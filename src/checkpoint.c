@@ -0,0 +1,523 @@
+/* checkpoint.c - a background thread that checkpoints a WAL database
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "module.h"
+#include "connection.h"
+#include "checkpoint.h"
+#include "util.h"
+#include "sqlitecompat.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* the thread checks for close() at least this often, in milliseconds */
+#define CHECKPOINT_STOP_POLL 50
+
+/*
+ * The checkpointer thread runs without the GIL and only touches the fields of
+ * the checkpointer that don't change while it runs. Every interval it looks
+ * at PRAGMA data_version, which changes whenever another connection commits,
+ * and at the size of the WAL file:
+ *
+ * - if the WAL file has grown past max_wal_size, that may be space left over
+ *   from before the WAL was started over, which RESTART doesn't give back.
+ *   A PASSIVE checkpoint tells how many frames the WAL really holds. Only if
+ *   those exceed max_wal_size, the WAL is checkpointed with the configured
+ *   mode, which resets it (RESTART) or also truncates it (TRUNCATE);
+ * - if there were commits since the last checkpoint, but none during the
+ *   last interval, the database is idle and gets a PASSIVE checkpoint.
+ */
+
+#if SQLITE_VERSION_NUMBER >= 3008008
+
+static int checkpointer_stopped(pysqlite_WALCheckpointer* self)
+{
+    int stop;
+
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    stop = self->stop;
+    PyThread_release_lock(self->lock);
+
+    return stop;
+}
+
+static int checkpointer_data_version(sqlite3_stmt* st)
+{
+    int version = -1;
+
+    if (sqlite3_step(st) == SQLITE_ROW) {
+        version = sqlite3_column_int(st, 0);
+    }
+    (void)sqlite3_reset(st);
+
+    return version;
+}
+
+static sqlite3_int64 checkpointer_wal_size(pysqlite_WALCheckpointer* self)
+{
+    struct stat info;
+
+    if (stat(self->wal_path, &info) != 0) {
+        return 0;
+    }
+    return (sqlite3_int64)info.st_size;
+}
+
+/* Runs one checkpoint and adds it to the statistics. backfilled is the number
+ * of WAL frames that earlier checkpoints have already copied. If wal_frames
+ * isn't NULL, it is set to the number of frames in the WAL. Returns 1 if all
+ * of them have been copied to the database. */
+static int checkpointer_run(pysqlite_WALCheckpointer* self, int mode, int* backfilled, int* wal_frames)
+{
+    double started;
+    double elapsed;
+    int log = -1;
+    int ckpt = -1;
+    int moved = 0;
+    int rc;
+
+    started = pysqlite_time();
+    rc = sqlite3_wal_checkpoint_v2(self->db, NULL, mode, &log, &ckpt);
+    elapsed = pysqlite_time() - started;
+
+    /* the frame counts are those of the whole WAL file; a WAL that was
+     * started over has fewer frames than were copied before */
+    if (ckpt > 0) {
+        moved = (ckpt >= *backfilled) ? ckpt - *backfilled : ckpt;
+        *backfilled = ckpt;
+    }
+    if (mode != SQLITE_CHECKPOINT_PASSIVE && rc == SQLITE_OK) {
+        /* the next writer starts the WAL over */
+        *backfilled = 0;
+    }
+
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    self->checkpoints++;
+    if (rc == SQLITE_BUSY) {
+        self->busy_checkpoints++;
+    }
+    self->frames += moved;
+    self->checkpoint_time += elapsed;
+    self->last_checkpoint_time = elapsed;
+    PyThread_release_lock(self->lock);
+
+    if (wal_frames) {
+        *wal_frames = log;
+    }
+
+    return rc == SQLITE_OK && log == ckpt;
+}
+
+/* Returns the page size of the database, which is also the payload size of a
+ * WAL frame, or 0 on error. */
+static int checkpointer_page_size(sqlite3* db)
+{
+    sqlite3_stmt* st;
+    const char* tail;
+    int page_size = 0;
+
+    if (sqlite3_prepare_v2(db, "PRAGMA page_size", -1, &st, &tail) == SQLITE_OK) {
+        if (sqlite3_step(st) == SQLITE_ROW) {
+            page_size = sqlite3_column_int(st, 0);
+        }
+        (void)sqlite3_finalize(st);
+    }
+
+    return page_size;
+}
+
+static void checkpointer_thread(void* arg)
+{
+    pysqlite_WALCheckpointer* self = (pysqlite_WALCheckpointer*)arg;
+    sqlite3_stmt* st = NULL;
+    const char* tail;
+    int last_version;
+    int version;
+    int dirty = 0;
+    int idle;
+    int done;
+    int backfilled = 0;
+    int wal_frames;
+    int page_size;
+    int waited;
+    int step;
+
+    if (sqlite3_prepare_v2(self->db, "PRAGMA data_version", -1, &st, &tail) != SQLITE_OK) {
+        goto done;
+    }
+    last_version = checkpointer_data_version(st);
+    page_size = checkpointer_page_size(self->db);
+
+    for (;;) {
+        for (waited = 0; waited < (int)(self->interval * 1000); waited += step) {
+            if (checkpointer_stopped(self)) {
+                goto done;
+            }
+            step = (int)(self->interval * 1000) - waited;
+            if (step > CHECKPOINT_STOP_POLL) {
+                step = CHECKPOINT_STOP_POLL;
+            }
+            (void)sqlite3_sleep(step);
+        }
+        if (checkpointer_stopped(self)) {
+            goto done;
+        }
+
+        version = checkpointer_data_version(st);
+        idle = (version == last_version);
+        if (!idle) {
+            last_version = version;
+            dirty = 1;
+        }
+        if (!dirty) {
+            continue;
+        }
+
+        if (self->max_wal_size > 0 && checkpointer_wal_size(self) > self->max_wal_size) {
+            /* the file is never smaller than the frames in it, so this is
+             * only needed once it is too large */
+            done = checkpointer_run(self, SQLITE_CHECKPOINT_PASSIVE, &backfilled, &wal_frames);
+            if (page_size <= 0 || (sqlite3_int64)wal_frames * page_size > self->max_wal_size) {
+                if (self->mode == SQLITE_CHECKPOINT_TRUNCATE) {
+                    /* TRUNCATE doesn't report the frames it copies, so RESTART
+                     * copies them and TRUNCATE only cuts the file */
+                    done = checkpointer_run(self, SQLITE_CHECKPOINT_RESTART, &backfilled, NULL) &&
+                           checkpointer_run(self, SQLITE_CHECKPOINT_TRUNCATE, &backfilled, NULL);
+                } else {
+                    done = checkpointer_run(self, self->mode, &backfilled, NULL);
+                }
+            }
+            if (done) {
+                dirty = 0;
+            }
+        } else if (idle) {
+            if (checkpointer_run(self, SQLITE_CHECKPOINT_PASSIVE, &backfilled, NULL)) {
+                dirty = 0;
+            }
+        }
+    }
+
+done:
+    (void)sqlite3_finalize(st);
+    PyThread_release_lock(self->finished);
+}
+
+#endif
+
+static int check_wal_mode(sqlite3* db)
+{
+    sqlite3_stmt* st;
+    const char* tail;
+    const char* mode;
+    int is_wal = 0;
+    int rc;
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = sqlite3_prepare(db, "PRAGMA journal_mode", -1, &st, &tail);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_step(st);
+        if (rc == SQLITE_ROW) {
+            mode = (const char*)sqlite3_column_text(st, 0);
+            is_wal = mode && !sqlite3_stricmp(mode, "wal");
+        }
+        (void)sqlite3_finalize(st);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (rc != SQLITE_ROW) {
+        _pysqlite_seterror(db, NULL);
+        return 0;
+    }
+
+    if (!is_wal) {
+        PyErr_SetString(pysqlite_NotSupportedError, "the database is not in WAL mode");
+        return 0;
+    }
+
+    return 1;
+}
+
+static int pysqlite_checkpointer_init(pysqlite_WALCheckpointer* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"database", "interval", "max_wal_size", "mode", "autocheckpoint", "timeout", NULL};
+
+    PyObject* database;
+    PyObject* database_utf8;
+    double interval = 1.0;
+    PY_LONG_LONG max_wal_size = 0;
+    char* mode = "truncate";
+    int autocheckpoint = -1;
+    double timeout = 1.0;
+    int rc;
+
+    if (self->database) {
+        PyErr_SetString(pysqlite_ProgrammingError, "WALCheckpointer.__init__ can only be called once.");
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|dLsid", kwlist,
+                                     &database, &interval, &max_wal_size, &mode, &autocheckpoint, &timeout)) {
+        return -1;
+    }
+
+#if SQLITE_VERSION_NUMBER < 3008008
+    PyErr_SetString(pysqlite_NotSupportedError, "the WAL checkpointer needs SQLite 3.8.8 or later");
+    return -1;
+#else
+    if (interval < 0.001) {
+        /* the thread sleeps in whole milliseconds */
+        PyErr_SetString(PyExc_ValueError, "interval must be at least 0.001 seconds");
+        return -1;
+    }
+    if (max_wal_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_wal_size must not be negative");
+        return -1;
+    }
+
+    if (!sqlite3_stricmp(mode, "restart")) {
+        self->mode = SQLITE_CHECKPOINT_RESTART;
+    } else if (!sqlite3_stricmp(mode, "truncate")) {
+        self->mode = SQLITE_CHECKPOINT_TRUNCATE;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "mode must be 'restart' or 'truncate'");
+        return -1;
+    }
+
+    if (PyUnicode_Check(database)) {
+        database_utf8 = PyUnicode_AsUTF8String(database);
+    } else if (PyString_Check(database)) {
+        Py_INCREF(database);
+        database_utf8 = database;
+    } else {
+        PyErr_SetString(PyExc_TypeError, "the database name must be a string");
+        return -1;
+    }
+    if (!database_utf8) {
+        return -1;
+    }
+
+    Py_INCREF(database);
+    self->database = database;
+    self->interval = interval;
+    self->max_wal_size = (sqlite3_int64)max_wal_size;
+    self->autocheckpoint = autocheckpoint;
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = sqlite3_open(PyString_AsString(database_utf8), &self->db);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(database_utf8);
+
+    if (rc != SQLITE_OK) {
+        _pysqlite_seterror(self->db, NULL);
+        return -1;
+    }
+    (void)sqlite3_busy_timeout(self->db, (int)(timeout * 1000));
+
+    if (!check_wal_mode(self->db)) {
+        return -1;
+    }
+
+    self->wal_path = sqlite3_mprintf("%s-wal", sqlite3_db_filename(self->db, "main"));
+    self->lock = PyThread_allocate_lock();
+    self->finished = PyThread_allocate_lock();
+    if (!self->wal_path || !self->lock || !self->finished) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    PyThread_acquire_lock(self->finished, WAIT_LOCK);
+    if (PyThread_start_new_thread(checkpointer_thread, (void*)self) == -1) {
+        PyThread_release_lock(self->finished);
+        PyErr_SetString(pysqlite_OperationalError, "cannot start the checkpointer thread");
+        return -1;
+    }
+    self->running = 1;
+
+    return 0;
+#endif
+}
+
+/* Stops the thread, waits for it and closes the database. */
+static void checkpointer_close(pysqlite_WALCheckpointer* self)
+{
+    if (self->running) {
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        self->stop = 1;
+        PyThread_release_lock(self->lock);
+
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->finished, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+        PyThread_release_lock(self->finished);
+        self->running = 0;
+    }
+
+    if (self->db) {
+        Py_BEGIN_ALLOW_THREADS
+        sqlite3_close(self->db);
+        Py_END_ALLOW_THREADS
+        self->db = NULL;
+    }
+}
+
+static void pysqlite_checkpointer_dealloc(pysqlite_WALCheckpointer* self)
+{
+    checkpointer_close(self);
+
+    if (self->lock) {
+        PyThread_free_lock(self->lock);
+    }
+    if (self->finished) {
+        PyThread_free_lock(self->finished);
+    }
+    if (self->wal_path) {
+        sqlite3_free(self->wal_path);
+    }
+
+    Py_XDECREF(self->database);
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int check_checkpointer(pysqlite_WALCheckpointer* self)
+{
+    if (!self->database) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base WALCheckpointer.__init__ not called.");
+        return 0;
+    }
+
+    if (!self->db) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Cannot operate on a closed WALCheckpointer.");
+        return 0;
+    }
+
+    return 1;
+}
+
+static PyObject* pysqlite_checkpointer_register(pysqlite_WALCheckpointer* self, PyObject* args)
+{
+    pysqlite_Connection* connection;
+
+    if (!PyArg_ParseTuple(args, "O!", &pysqlite_ConnectionType, &connection)) {
+        return NULL;
+    }
+
+    if (!check_checkpointer(self) || !pysqlite_check_connection(connection)) {
+        return NULL;
+    }
+
+    if (self->autocheckpoint >= 0) {
+        pysqlite_connection_lock(connection);
+        (void)sqlite3_wal_autocheckpoint(connection->db, self->autocheckpoint);
+        pysqlite_connection_unlock(connection);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* pysqlite_checkpointer_close(pysqlite_WALCheckpointer* self, PyObject* args)
+{
+    if (!self->database) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base WALCheckpointer.__init__ not called.");
+        return NULL;
+    }
+
+    checkpointer_close(self);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyMethodDef checkpointer_methods[] = {
+    {"register", (PyCFunction)pysqlite_checkpointer_register, METH_VARARGS,
+        PyDoc_STR("Applies the autocheckpoint setting to a connection to the database.")},
+    {"close", (PyCFunction)pysqlite_checkpointer_close, METH_NOARGS,
+        PyDoc_STR("Stops the checkpointer thread and closes its connection.")},
+    {NULL, NULL}
+};
+
+static struct PyMemberDef checkpointer_members[] =
+{
+    {"database", T_OBJECT, offsetof(pysqlite_WALCheckpointer, database), RO},
+    {"interval", T_DOUBLE, offsetof(pysqlite_WALCheckpointer, interval), RO},
+    {"max_wal_size", T_LONGLONG, offsetof(pysqlite_WALCheckpointer, max_wal_size), RO},
+    {"autocheckpoint", T_INT, offsetof(pysqlite_WALCheckpointer, autocheckpoint), RO},
+    {"checkpoints", T_LONG, offsetof(pysqlite_WALCheckpointer, checkpoints), RO},
+    {"busy_checkpoints", T_LONG, offsetof(pysqlite_WALCheckpointer, busy_checkpoints), RO},
+    {"frames", T_LONG, offsetof(pysqlite_WALCheckpointer, frames), RO},
+    {"checkpoint_time", T_DOUBLE, offsetof(pysqlite_WALCheckpointer, checkpoint_time), RO},
+    {"last_checkpoint_time", T_DOUBLE, offsetof(pysqlite_WALCheckpointer, last_checkpoint_time), RO},
+    {NULL}
+};
+
+static char checkpointer_doc[] =
+PyDoc_STR("Checkpoints a WAL database from a background thread.");
+
+PyTypeObject pysqlite_WALCheckpointerType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        MODULE_NAME ".WALCheckpointer",                 /* tp_name */
+        sizeof(pysqlite_WALCheckpointer),               /* tp_basicsize */
+        0,                                              /* tp_itemsize */
+        (destructor)pysqlite_checkpointer_dealloc,      /* tp_dealloc */
+        0,                                              /* tp_print */
+        0,                                              /* tp_getattr */
+        0,                                              /* tp_setattr */
+        0,                                              /* tp_compare */
+        0,                                              /* tp_repr */
+        0,                                              /* tp_as_number */
+        0,                                              /* tp_as_sequence */
+        0,                                              /* tp_as_mapping */
+        0,                                              /* tp_hash */
+        0,                                              /* tp_call */
+        0,                                              /* tp_str */
+        0,                                              /* tp_getattro */
+        0,                                              /* tp_setattro */
+        0,                                              /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,         /* tp_flags */
+        checkpointer_doc,                               /* tp_doc */
+        0,                                              /* tp_traverse */
+        0,                                              /* tp_clear */
+        0,                                              /* tp_richcompare */
+        0,                                              /* tp_weaklistoffset */
+        0,                                              /* tp_iter */
+        0,                                              /* tp_iternext */
+        checkpointer_methods,                           /* tp_methods */
+        checkpointer_members,                           /* tp_members */
+        0,                                              /* tp_getset */
+        0,                                              /* tp_base */
+        0,                                              /* tp_dict */
+        0,                                              /* tp_descr_get */
+        0,                                              /* tp_descr_set */
+        0,                                              /* tp_dictoffset */
+        (initproc)pysqlite_checkpointer_init,           /* tp_init */
+        0,                                              /* tp_alloc */
+        0,                                              /* tp_new */
+        0                                               /* tp_free */
+};
+
+extern int pysqlite_checkpoint_setup_types(void)
+{
+    pysqlite_WALCheckpointerType.tp_new = PyType_GenericNew;
+    return PyType_Ready(&pysqlite_WALCheckpointerType);
+}
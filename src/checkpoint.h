@@ -0,0 +1,72 @@
+/* checkpoint.h - definitions for the background WAL checkpointer
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef PYSQLITE_CHECKPOINT_H
+#define PYSQLITE_CHECKPOINT_H
+#include "Python.h"
+
+#include "pythread.h"
+#include "sqlite3.h"
+
+typedef struct
+{
+    PyObject_HEAD
+
+    /* the checkpointer's own connection to the database */
+    sqlite3* db;
+
+    PyObject* database;
+
+    /* the name of the WAL file, allocated with sqlite3_malloc */
+    char* wal_path;
+
+    /* seconds between two looks at the database */
+    double interval;
+
+    /* a WAL file bigger than this many bytes is checkpointed with mode, even
+     * if the database isn't idle; 0 turns the size policy off */
+    sqlite3_int64 max_wal_size;
+    int mode;
+
+    /* the wal_autocheckpoint value register() sets, or -1 */
+    int autocheckpoint;
+
+    /* guards stop; finished is held by the thread as long as it runs */
+    PyThread_type_lock lock;
+    PyThread_type_lock finished;
+    int stop;
+    int running;
+
+    /* statistics, written by the thread */
+    long checkpoints;
+    long busy_checkpoints;
+    long frames;
+    double checkpoint_time;
+    double last_checkpoint_time;
+} pysqlite_WALCheckpointer;
+
+extern PyTypeObject pysqlite_WALCheckpointerType;
+
+int pysqlite_checkpoint_setup_types(void);
+
+#endif
@@ -34,10 +34,13 @@
 #include "backup.h"
 #endif
 
-#include "pythread.h"
+#include "savepoint.h"
+#include "loader.h"
+#include "vtable.h"
+#include "functions.h"
+#include "context.h"
 
-#define ACTION_FINALIZE 1
-#define ACTION_RESET 2
+#include "pythread.h"
 
 #if SQLITE_VERSION_NUMBER >= 3003008
 #ifndef SQLITE_OMIT_LOAD_EXTENSION
@@ -45,8 +48,16 @@
 #endif
 #endif
 
+/* a step budget looks at the clock at least every this many VM instructions */
+#define STEP_BUDGET_CHECK 1000
+
 static int pysqlite_connection_set_isolation_level(pysqlite_Connection* self, PyObject* isolation_level);
-static void _pysqlite_drop_unused_cursor_references(pysqlite_Connection* self);
+static int _pysqlite_busy_handler(void* user_arg, int count);
+static pysqlite_Cache* _pysqlite_new_statement_cache(pysqlite_Connection* self, int size, Py_ssize_t max_bytes);
+static PyObject* _pysqlite_connection_create_statement(PyObject* connection, PyObject* sql);
+static PyObject* _pysqlite_statement_cache_create(PyObject* connection, PyObject* key);
+static int _authorizer_callback(void* user_arg, int action, const char* arg1, const char* arg2 , const char* dbname, const char* access_attempt_source);
+static void _pysqlite_auth_rules_free(pysqlite_AuthRules* self);
 
 
 static void _sqlite3_result_error(sqlite3_context* ctx, const char* errmsg, int len)
@@ -63,14 +74,16 @@ static void _sqlite3_result_error(sqlite3_context* ctx, const char* errmsg, int
 
 int pysqlite_connection_init(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
 {
-    static char *kwlist[] = {"database", "timeout", "detect_types", "isolation_level", "check_same_thread", "factory", "cached_statements", NULL, NULL};
+    static char *kwlist[] = {"database", "timeout", "detect_types", "isolation_level", "check_same_thread", "factory", "cached_statements", "cached_statements_bytes", "serialized", NULL, NULL};
 
     PyObject* database;
     int detect_types = 0;
     PyObject* isolation_level = NULL;
     PyObject* factory = NULL;
     int check_same_thread = 1;
+    int serialized = 0;
     int cached_statements = 100;
+    Py_ssize_t cached_statements_bytes = 0;
     double timeout = 5.0;
     int rc;
     PyObject* class_attr = NULL;
@@ -78,8 +91,8 @@ int pysqlite_connection_init(pysqlite_Connection* self, PyObject* args, PyObject
     int is_apsw_connection = 0;
     PyObject* database_utf8;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|diOiOi", kwlist,
-                                     &database, &timeout, &detect_types, &isolation_level, &check_same_thread, &factory, &cached_statements))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|diOiOini", kwlist,
+                                     &database, &timeout, &detect_types, &isolation_level, &check_same_thread, &factory, &cached_statements, &cached_statements_bytes, &serialized))
     {
         return -1;
     }
@@ -87,11 +100,29 @@ int pysqlite_connection_init(pysqlite_Connection* self, PyObject* args, PyObject
     self->initialized = 1;
 
     self->begin_statement = NULL;
+    self->begin_st = NULL;
+    self->commit_st = NULL;
+    self->rollback_st = NULL;
+    self->savepoint_level = 0;
+    self->transaction_serial = 0;
+
+    self->savepoints = PyDict_New();
+    if (!self->savepoints) {
+        return -1;
+    }
 
     self->statement_cache = NULL;
     self->statements = NULL;
     self->cursors = NULL;
 
+    self->authorizer = NULL;
+    self->auth_rules = NULL;
+    self->auth_reads = NULL;
+    self->auth_writes = NULL;
+    self->auth_last_table = NULL;
+    self->auth_last_schema = NULL;
+    self->auth_last_source = NULL;
+
     Py_INCREF(Py_None);
     self->row_factory = Py_None;
 
@@ -147,6 +178,13 @@ int pysqlite_connection_init(pysqlite_Connection* self, PyObject* args, PyObject
         }
     }
 
+    if (!is_apsw_connection && cached_statements > 0) {
+        /* the authorizer records which tables each statement depends on, so
+         * that schema changes only invalidate the affected cached statements.
+         * Without a statement cache, there is nothing to invalidate. */
+        (void)sqlite3_set_authorizer(self->db, _authorizer_callback, (void*)self);
+    }
+
     if (!isolation_level) {
         isolation_level = PyString_FromString("");
         if (!isolation_level) {
@@ -159,43 +197,52 @@ int pysqlite_connection_init(pysqlite_Connection* self, PyObject* args, PyObject
     pysqlite_connection_set_isolation_level(self, isolation_level);
     Py_DECREF(isolation_level);
 
-    self->statement_cache = (pysqlite_Cache*)PyObject_CallFunction((PyObject*)&pysqlite_CacheType, "Oi", self, cached_statements);
-    if (PyErr_Occurred()) {
-        return -1;
-    }
-
-    self->created_statements = 0;
-    self->created_cursors = 0;
-
-    /* Create lists of weak references to statements/cursors */
-    self->statements = PyList_New(0);
-    self->cursors = PyList_New(0);
-    if (!self->statements || !self->cursors) {
+    self->statement_cache = _pysqlite_new_statement_cache(self, cached_statements, cached_statements_bytes);
+    if (!self->statement_cache) {
         return -1;
     }
 
-    /* By default, the Cache class INCREFs the factory in its initializer, and
-     * decrefs it in its deallocator method. Since this would create a circular
-     * reference here, we're breaking it by decrementing self, and telling the
-     * cache class to not decref the factory (self) in its deallocator.
-     */
-    self->statement_cache->decref_factory = 0;
-    Py_DECREF(self);
-
     self->inTransaction = 0;
     self->detect_types = detect_types;
     self->timeout = timeout;
-    (void)sqlite3_busy_timeout(self->db, (int)(timeout*1000));
+    self->timeout_started = 0.0;
+    self->transaction_timeout = -1.0;
+    self->busy_waits = 0;
+    self->busy_time = 0.0;
+    (void)sqlite3_busy_handler(self->db, _pysqlite_busy_handler, (void*)self);
+    self->step_budget = NULL;
 #ifdef WITH_THREAD
     self->thread_ident = PyThread_get_thread_ident();
 #endif
     self->check_same_thread = check_same_thread;
 
+    /* a serialized connection guards itself, so any thread may use it */
+    self->serialized = serialized;
+    self->lock = NULL;
+    self->lock_owner = 0;
+    self->lock_depth = 0;
+#ifdef WITH_THREAD
+    if (serialized) {
+        self->check_same_thread = 0;
+        self->lock = PyThread_allocate_lock();
+        if (!self->lock) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+#endif
+
     self->function_pinboard = PyDict_New();
     if (!self->function_pinboard) {
         return -1;
     }
 
+    self->function_caches = PyDict_New();
+    if (!self->function_caches) {
+        return -1;
+    }
+    self->executions = 0;
+
     self->collations = PyDict_New();
     if (!self->collations) {
         return -1;
@@ -215,11 +262,37 @@ int pysqlite_connection_init(pysqlite_Connection* self, PyObject* args, PyObject
     return 0;
 }
 
+/* Creates a statement cache that uses this connection as its factory and
+ * accounts for the memory of every statement it holds. */
+static pysqlite_Cache* _pysqlite_new_statement_cache(pysqlite_Connection* self, int size, Py_ssize_t max_bytes)
+{
+    pysqlite_Cache* cache;
+
+    cache = (pysqlite_Cache*)PyObject_CallFunction((PyObject*)&pysqlite_CacheType, "Oin", self, size, max_bytes);
+    if (!cache) {
+        return NULL;
+    }
+
+    /* By default, the Cache class INCREFs the factory in its initializer, and
+     * decrefs it in its deallocator method. Since this would create a circular
+     * reference here, we're breaking it by decrementing self, and telling the
+     * cache class to not decref the factory (self) in its deallocator.
+     */
+    cache->decref_factory = 0;
+    Py_DECREF(self);
+
+    cache->cost_func = pysqlite_statement_memory_used;
+    cache->create_func = _pysqlite_statement_cache_create;
+
+    return cache;
+}
+
 /* Empty the entire statement cache of this connection */
 void pysqlite_flush_statement_cache(pysqlite_Connection* self)
 {
     pysqlite_Node* node;
     pysqlite_Statement* statement;
+    pysqlite_Cache* new_cache;
 
     node = self->statement_cache->first;
 
@@ -229,48 +302,285 @@ void pysqlite_flush_statement_cache(pysqlite_Connection* self)
         node = node->next;
     }
 
+    new_cache = _pysqlite_new_statement_cache(self, self->statement_cache->size, self->statement_cache->max_bytes);
+    if (!new_cache) {
+        return;
+    }
+
     Py_DECREF(self->statement_cache);
-    self->statement_cache = (pysqlite_Cache*)PyObject_CallFunction((PyObject*)&pysqlite_CacheType, "O", self);
-    Py_DECREF(self);
-    self->statement_cache->decref_factory = 0;
+    self->statement_cache = new_cache;
 }
 
 /* action in (ACTION_RESET, ACTION_FINALIZE) */
 void pysqlite_do_all_statements(pysqlite_Connection* self, int action, int reset_cursors)
 {
-    int i;
-    PyObject* weakref;
-    PyObject* statement;
+    pysqlite_Statement* statement;
     pysqlite_Cursor* cursor;
 
-    for (i = 0; i < PyList_Size(self->statements); i++) {
-        weakref = PyList_GetItem(self->statements, i);
-        statement = PyWeakref_GetObject(weakref);
-        if (statement != Py_None) {
-            if (action == ACTION_RESET) {
-                (void)pysqlite_statement_reset((pysqlite_Statement*)statement);
-            } else {
-                (void)pysqlite_statement_finalize((pysqlite_Statement*)statement);
-            }
+    for (statement = self->statements; statement; statement = statement->next) {
+        if (action == ACTION_RESET) {
+            (void)pysqlite_statement_reset(statement);
+        } else {
+            (void)pysqlite_statement_finalize(statement);
         }
     }
 
     if (reset_cursors) {
-        for (i = 0; i < PyList_Size(self->cursors); i++) {
-            weakref = PyList_GetItem(self->cursors, i);
-            cursor = (pysqlite_Cursor*)PyWeakref_GetObject(weakref);
-            if ((PyObject*)cursor != Py_None) {
-                cursor->reset = 1;
+        for (cursor = self->cursors; cursor; cursor = cursor->next) {
+            cursor->reset = 1;
+        }
+    }
+}
+
+/* Hashes prefix + name case-insensitively (FNV-1a). */
+static unsigned int _pysqlite_name_hash(const char* prefix, const char* name)
+{
+    unsigned int hash = 2166136261U;
+
+    for (; *prefix; prefix++) {
+        hash = (hash ^ (unsigned char)tolower((unsigned char)*prefix)) * 16777619U;
+    }
+    for (; *name; name++) {
+        hash = (hash ^ (unsigned char)tolower((unsigned char)*name)) * 16777619U;
+    }
+
+    return hash;
+}
+
+/* Compares entry with prefix + name case-insensitively, like SQLite does for
+ * identifiers */
+static int _pysqlite_name_equal(const char* entry, const char* prefix, const char* name)
+{
+    while (*prefix && tolower((unsigned char)*entry) == tolower((unsigned char)*prefix)) {
+        entry++;
+        prefix++;
+    }
+    if (*prefix) {
+        return 0;
+    }
+
+    while (*name && tolower((unsigned char)*entry) == tolower((unsigned char)*name)) {
+        entry++;
+        name++;
+    }
+
+    return *entry == *name;
+}
+
+/* Returns the slot that holds prefix + name, or the empty slot where it
+ * belongs. The set must have slots. */
+static int _pysqlite_nameset_slot(pysqlite_NameSet* set, const char* prefix, const char* name, unsigned int hash)
+{
+    int mask = set->capacity - 1;
+    int slot = (int)(hash & (unsigned int)mask);
+    int index;
+
+    while (set->slots[slot]) {
+        index = set->slots[slot] - 1;
+        if (set->hashes[index] == hash && _pysqlite_name_equal(set->names[index], prefix, name)) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static int _pysqlite_nameset_contains(pysqlite_NameSet* set, const char* prefix, const char* name, unsigned int hash)
+{
+    if (set->count == 0) {
+        return 0;
+    }
+
+    return set->slots[_pysqlite_nameset_slot(set, prefix, name, hash)] != 0;
+}
+
+/* Doubles the capacity of the set, keeping it at most half full. */
+static int _pysqlite_nameset_grow(pysqlite_NameSet* set)
+{
+    int capacity = set->capacity ? set->capacity * 2 : 8;
+    char** names;
+    unsigned int* hashes;
+    int* slots;
+    int i;
+
+    names = (char**)sqlite3_realloc(set->names, (capacity / 2) * sizeof(char*));
+    if (!names) {
+        return 0;
+    }
+    set->names = names;
+
+    hashes = (unsigned int*)sqlite3_realloc(set->hashes, (capacity / 2) * sizeof(unsigned int));
+    if (!hashes) {
+        return 0;
+    }
+    set->hashes = hashes;
+
+    slots = (int*)sqlite3_malloc(capacity * sizeof(int));
+    if (!slots) {
+        return 0;
+    }
+    memset(slots, 0, capacity * sizeof(int));
+    sqlite3_free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+
+    for (i = 0; i < set->count; i++) {
+        set->slots[_pysqlite_nameset_slot(set, "", set->names[i], set->hashes[i])] = i + 1;
+    }
+
+    return 1;
+}
+
+/*
+ * Adds prefix + name to the set, unless it is already contained in it.
+ *
+ * 0 => error; 1 => ok
+ */
+int pysqlite_nameset_add(pysqlite_NameSet* set, const char* prefix, const char* name)
+{
+    unsigned int hash = _pysqlite_name_hash(prefix, name);
+    char* entry;
+    int slot;
+
+    if (_pysqlite_nameset_contains(set, prefix, name, hash)) {
+        return 1;
+    }
+
+    if ((set->count + 1) * 2 > set->capacity && !_pysqlite_nameset_grow(set)) {
+        return 0;
+    }
+
+    entry = sqlite3_mprintf("%s%s", prefix, name);
+    if (!entry) {
+        return 0;
+    }
+
+    slot = _pysqlite_nameset_slot(set, prefix, name, hash);
+    set->names[set->count] = entry;
+    set->hashes[set->count] = hash;
+    set->slots[slot] = ++set->count;
+
+    return 1;
+}
+
+/* Returns 1 if both sets have at least one name in common, 0 otherwise. The
+ * name "*" in b matches everything. */
+int pysqlite_nameset_intersects(pysqlite_NameSet* a, pysqlite_NameSet* b)
+{
+    int i;
+
+    if (a->count == 0 || b->count == 0) {
+        return 0;
+    }
+
+    if (_pysqlite_nameset_contains(b, "", "*", _pysqlite_name_hash("", "*"))) {
+        return 1;
+    }
+
+    for (i = 0; i < a->count; i++) {
+        if (_pysqlite_nameset_contains(b, "", a->names[i], a->hashes[i])) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void pysqlite_nameset_clear(pysqlite_NameSet* set)
+{
+    int i;
+
+    for (i = 0; i < set->count; i++) {
+        sqlite3_free(set->names[i]);
+    }
+    sqlite3_free(set->names);
+    sqlite3_free(set->hashes);
+    sqlite3_free(set->slots);
+
+    memset(set, 0, sizeof(pysqlite_NameSet));
+}
+
+/*
+ * Prepares sql with sqlite3_prepare, recording the tables and schemas the
+ * statement reads in reads and those it changes in writes; either may be
+ * NULL. The GIL is released, so the connection mutex of SQLite serializes
+ * the recording with prepares in other threads.
+ */
+int pysqlite_connection_prepare(pysqlite_Connection* self, const char* sql, sqlite3_stmt** st, const char** tail, pysqlite_NameSet* reads, pysqlite_NameSet* writes)
+{
+    sqlite3_mutex* mutex;
+    int rc;
+
+    Py_BEGIN_ALLOW_THREADS
+    mutex = sqlite3_db_mutex(self->db);
+    sqlite3_mutex_enter(mutex);
+
+    self->auth_reads = reads;
+    self->auth_writes = writes;
+    self->auth_last_table = NULL;
+    self->auth_last_schema = NULL;
+    self->auth_last_source = NULL;
+    rc = sqlite3_prepare(self->db, sql, -1, st, tail);
+    self->auth_reads = NULL;
+    self->auth_writes = NULL;
+
+    sqlite3_mutex_leave(mutex);
+    Py_END_ALLOW_THREADS
+
+    return rc;
+}
+
+/*
+ * Drops the cached statements that depend on any of the tables or schemas in
+ * changes, after a statement that created, dropped or altered them has run.
+ * The rest of the statement cache stays warm.
+ */
+void pysqlite_connection_invalidate_statements(pysqlite_Connection* self, pysqlite_NameSet* changes)
+{
+    pysqlite_Node* node;
+    pysqlite_Node* next_node;
+    pysqlite_Statement* statement;
+
+    if (!self->statement_cache || changes->count == 0) {
+        return;
+    }
+
+    node = self->statement_cache->first;
+    while (node) {
+        next_node = node->next;
+        statement = (pysqlite_Statement*)(node->data);
+
+        if (!statement->in_use && pysqlite_nameset_intersects(&statement->reads, changes)) {
+            if (pysqlite_cache_remove(self->statement_cache, node) != 0) {
+                PyErr_Clear();
+                return;
             }
         }
+
+        node = next_node;
     }
 }
 
 void pysqlite_connection_dealloc(pysqlite_Connection* self)
 {
     PyObject* ret = NULL;
+    pysqlite_Statement* statement;
 
     Py_XDECREF(self->statement_cache);
+    Py_XDECREF(self->begin_st);
+    Py_XDECREF(self->commit_st);
+    Py_XDECREF(self->rollback_st);
+    Py_XDECREF(self->savepoints);
+
+    /* statements handed out by Connection.__call__ may outlive us */
+    while (self->statements) {
+        statement = self->statements;
+        self->statements = statement->next;
+        statement->connection = NULL;
+        statement->prev = NULL;
+        statement->next = NULL;
+    }
 
     /* Clean up if user has not called .close() explicitly. */
     if (self->db) {
@@ -288,11 +598,19 @@ void pysqlite_connection_dealloc(pysqlite_Connection* self)
     }
     Py_XDECREF(self->isolation_level);
     Py_XDECREF(self->function_pinboard);
+    Py_XDECREF(self->function_caches);
     Py_XDECREF(self->row_factory);
     Py_XDECREF(self->text_factory);
     Py_XDECREF(self->collations);
-    Py_XDECREF(self->statements);
-    Py_XDECREF(self->cursors);
+    Py_XDECREF(self->authorizer);
+    _pysqlite_auth_rules_free(self->auth_rules);
+    Py_XDECREF(self->step_budget);
+
+#ifdef WITH_THREAD
+    if (self->lock) {
+        PyThread_free_lock(self->lock);
+    }
+#endif
 
     self->ob_type->tp_free((PyObject*)self);
 }
@@ -304,23 +622,81 @@ void pysqlite_connection_dealloc(pysqlite_Connection* self)
  */
 int pysqlite_connection_register_cursor(pysqlite_Connection* connection, PyObject* cursor)
 {
-    PyObject* weakref;
+    pysqlite_Cursor* cur = (pysqlite_Cursor*)cursor;
 
-    weakref = PyWeakref_NewRef((PyObject*)cursor, NULL);
-    if (!weakref) {
-        goto error;
+    if (cur->registered) {
+        return 1;
     }
 
-    if (PyList_Append(connection->cursors, weakref) != 0) {
-        Py_CLEAR(weakref);
-        goto error;
+    cur->prev = NULL;
+    cur->next = connection->cursors;
+    if (connection->cursors) {
+        connection->cursors->prev = cur;
     }
-
-    Py_DECREF(weakref);
+    connection->cursors = cur;
+    cur->registered = 1;
 
     return 1;
-error:
-    return 0;
+}
+
+/* Removes a cursor from its connection's list of live cursors */
+void pysqlite_connection_unregister_cursor(PyObject* cursor)
+{
+    pysqlite_Cursor* cur = (pysqlite_Cursor*)cursor;
+
+    if (!cur->registered) {
+        return;
+    }
+
+    if (cur->prev) {
+        cur->prev->next = cur->next;
+    } else {
+        cur->connection->cursors = cur->next;
+    }
+    if (cur->next) {
+        cur->next->prev = cur->prev;
+    }
+
+    cur->prev = NULL;
+    cur->next = NULL;
+    cur->registered = 0;
+}
+
+/* Adds a statement to the connection's list of live statements, so it can be
+ * reset on commit/rollback and finalized on close. */
+void pysqlite_connection_register_statement(pysqlite_Connection* connection, PyObject* statement)
+{
+    pysqlite_Statement* st = (pysqlite_Statement*)statement;
+
+    st->connection = connection;
+    st->prev = NULL;
+    st->next = connection->statements;
+    if (connection->statements) {
+        connection->statements->prev = st;
+    }
+    connection->statements = st;
+}
+
+void pysqlite_connection_unregister_statement(PyObject* statement)
+{
+    pysqlite_Statement* st = (pysqlite_Statement*)statement;
+
+    if (!st->connection) {
+        return;
+    }
+
+    if (st->prev) {
+        st->prev->next = st->next;
+    } else {
+        st->connection->statements = st->next;
+    }
+    if (st->next) {
+        st->next->prev = st->prev;
+    }
+
+    st->connection = NULL;
+    st->prev = NULL;
+    st->next = NULL;
 }
 
 PyObject* pysqlite_connection_cursor(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
@@ -342,9 +718,11 @@ PyObject* pysqlite_connection_cursor(pysqlite_Connection* self, PyObject* args,
         factory = (PyObject*)&pysqlite_CursorType;
     }
 
+    /* the cursor registers itself with the connection, whose list of cursors
+     * a commit in another thread may be walking */
+    pysqlite_connection_lock(self);
     cursor = PyObject_CallFunction(factory, "O", self);
-
-    _pysqlite_drop_unused_cursor_references(self);
+    pysqlite_connection_unlock(self);
 
     if (cursor && self->row_factory != Py_None) {
         Py_XDECREF(((pysqlite_Cursor*)cursor)->row_factory);
@@ -399,6 +777,8 @@ PyObject* pysqlite_connection_close(pysqlite_Connection* self, PyObject* args)
         return NULL;
     }
 
+    pysqlite_connection_lock(self);
+
     pysqlite_do_all_statements(self, ACTION_FINALIZE, 1);
 
     if (self->db) {
@@ -415,6 +795,7 @@ PyObject* pysqlite_connection_close(pysqlite_Connection* self, PyObject* args)
 
             if (rc != SQLITE_OK) {
                 _pysqlite_seterror(self->db, NULL);
+                pysqlite_connection_unlock(self);
                 return NULL;
             } else {
                 self->db = NULL;
@@ -422,6 +803,8 @@ PyObject* pysqlite_connection_close(pysqlite_Connection* self, PyObject* args)
         }
     }
 
+    pysqlite_connection_unlock(self);
+
     Py_INCREF(Py_None);
     return Py_None;
 }
@@ -446,83 +829,101 @@ int pysqlite_check_connection(pysqlite_Connection* con)
     }
 }
 
-PyObject* _pysqlite_connection_begin(pysqlite_Connection* self)
+/*
+ * Prepares a control statement that will be kept around for reuse.
+ *
+ * Returns a new reference, or NULL with an exception set.
+ */
+pysqlite_Statement* _pysqlite_connection_prepare_control(pysqlite_Connection* self, const char* sql)
 {
     int rc;
-    const char* tail;
-    sqlite3_stmt* statement;
-
-    Py_BEGIN_ALLOW_THREADS
-    rc = sqlite3_prepare(self->db, self->begin_statement, -1, &statement, &tail);
-    Py_END_ALLOW_THREADS
-
-    if (rc != SQLITE_OK) {
-        _pysqlite_seterror(self->db, statement);
-        goto error;
-    }
+    PyObject* sql_str;
+    pysqlite_Statement* statement;
 
-    rc = pysqlite_step(statement, self);
-    if (rc == SQLITE_DONE) {
-        self->inTransaction = 1;
-    } else {
-        _pysqlite_seterror(self->db, statement);
+    sql_str = PyString_FromString(sql);
+    if (!sql_str) {
+        return NULL;
     }
 
-    Py_BEGIN_ALLOW_THREADS
-    rc = sqlite3_finalize(statement);
-    Py_END_ALLOW_THREADS
-
-    if (rc != SQLITE_OK && !PyErr_Occurred()) {
-        _pysqlite_seterror(self->db, NULL);
+    statement = PyObject_New(pysqlite_Statement, &pysqlite_StatementType);
+    if (!statement) {
+        Py_DECREF(sql_str);
+        return NULL;
     }
 
-error:
-    if (PyErr_Occurred()) {
+    rc = pysqlite_statement_create(statement, self, sql_str);
+    Py_DECREF(sql_str);
+    if (rc != SQLITE_OK) {
+        Py_DECREF(statement);
+        if (rc == PYSQLITE_TOO_MUCH_SQL) {
+            PyErr_SetString(pysqlite_ProgrammingError, "You can only execute one statement at a time.");
+        } else {
+            _pysqlite_seterror(self->db, NULL);
+        }
         return NULL;
-    } else {
-        Py_INCREF(Py_None);
-        return Py_None;
     }
+
+    return statement;
 }
 
-PyObject* pysqlite_connection_commit(pysqlite_Connection* self, PyObject* args)
+/*
+ * Runs one of the connection's control statements (BEGIN, COMMIT, SAVEPOINT,
+ * ...). If *statement is NULL, sql is prepared first and the statement is kept
+ * there for the next call. Expired statements are recompiled.
+ *
+ * Returns SQLITE_DONE on success; otherwise an exception is set.
+ */
+int _pysqlite_connection_run_control(pysqlite_Connection* self, pysqlite_Statement** statement, const char* sql)
 {
     int rc;
-    const char* tail;
-    sqlite3_stmt* statement;
+    pysqlite_Statement* st;
 
-    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
-        return NULL;
-    }
+    pysqlite_connection_lock(self);
 
-    if (self->inTransaction) {
-        pysqlite_do_all_statements(self, ACTION_RESET, 0);
-
-        Py_BEGIN_ALLOW_THREADS
-        rc = sqlite3_prepare(self->db, "COMMIT", -1, &statement, &tail);
-        Py_END_ALLOW_THREADS
-        if (rc != SQLITE_OK) {
-            _pysqlite_seterror(self->db, NULL);
-            goto error;
+    if (!*statement) {
+        *statement = _pysqlite_connection_prepare_control(self, sql);
+        if (!*statement) {
+            pysqlite_connection_unlock(self);
+            return SQLITE_ERROR;
         }
+    }
 
-        rc = pysqlite_step(statement, self);
-        if (rc == SQLITE_DONE) {
-            self->inTransaction = 0;
-        } else {
-            _pysqlite_seterror(self->db, statement);
+    st = *statement;
+    pysqlite_statement_mark_dirty(st);
+
+    while (1) {
+        rc = pysqlite_step(st->st, self);
+        if (rc == SQLITE_DONE || rc == SQLITE_ROW) {
+            break;
         }
 
-        Py_BEGIN_ALLOW_THREADS
-        rc = sqlite3_finalize(statement);
-        Py_END_ALLOW_THREADS
-        if (rc != SQLITE_OK && !PyErr_Occurred()) {
-            _pysqlite_seterror(self->db, NULL);
+        rc = pysqlite_statement_reset(st);
+        if (rc == SQLITE_SCHEMA && pysqlite_statement_recompile(st, NULL) == SQLITE_OK) {
+            continue;
         }
 
+        _pysqlite_seterror(self->db, NULL);
+        (void)pysqlite_statement_reset(st);
+        pysqlite_connection_unlock(self);
+        return (rc == SQLITE_OK) ? SQLITE_ERROR : rc;
+    }
+
+    (void)pysqlite_statement_reset(st);
+    pysqlite_connection_unlock(self);
+
+    return SQLITE_DONE;
+}
+
+PyObject* _pysqlite_connection_begin(pysqlite_Connection* self)
+{
+    int rc;
+
+    rc = _pysqlite_connection_run_control(self, &self->begin_st,
+            self->begin_statement ? self->begin_statement : "BEGIN");
+    if (rc == SQLITE_DONE) {
+        self->inTransaction = 1;
     }
 
-error:
     if (PyErr_Occurred()) {
         return NULL;
     } else {
@@ -531,44 +932,58 @@ error:
     }
 }
 
-PyObject* pysqlite_connection_rollback(pysqlite_Connection* self, PyObject* args)
+PyObject* pysqlite_connection_commit(pysqlite_Connection* self, PyObject* args)
 {
     int rc;
-    const char* tail;
-    sqlite3_stmt* statement;
 
     if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
         return NULL;
     }
 
+    pysqlite_connection_lock(self);
     if (self->inTransaction) {
-        pysqlite_do_all_statements(self, ACTION_RESET, 1);
-
-        Py_BEGIN_ALLOW_THREADS
-        rc = sqlite3_prepare(self->db, "ROLLBACK", -1, &statement, &tail);
-        Py_END_ALLOW_THREADS
-        if (rc != SQLITE_OK) {
-            _pysqlite_seterror(self->db, NULL);
-            goto error;
-        }
+        pysqlite_do_all_statements(self, ACTION_RESET, 0);
 
-        rc = pysqlite_step(statement, self);
+        rc = _pysqlite_connection_run_control(self, &self->commit_st, "COMMIT");
         if (rc == SQLITE_DONE) {
             self->inTransaction = 0;
-        } else {
-            _pysqlite_seterror(self->db, statement);
+            self->savepoint_level = 0;
+            self->transaction_serial++;
+            self->transaction_timeout = -1.0;
         }
+    }
+    pysqlite_connection_unlock(self);
 
-        Py_BEGIN_ALLOW_THREADS
-        rc = sqlite3_finalize(statement);
-        Py_END_ALLOW_THREADS
-        if (rc != SQLITE_OK && !PyErr_Occurred()) {
-            _pysqlite_seterror(self->db, NULL);
-        }
+    if (PyErr_Occurred()) {
+        return NULL;
+    } else {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+}
+
+PyObject* pysqlite_connection_rollback(pysqlite_Connection* self, PyObject* args)
+{
+    int rc;
 
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
     }
 
-error:
+    pysqlite_connection_lock(self);
+    if (self->inTransaction) {
+        pysqlite_do_all_statements(self, ACTION_RESET, 1);
+
+        rc = _pysqlite_connection_run_control(self, &self->rollback_st, "ROLLBACK");
+        if (rc == SQLITE_DONE) {
+            self->inTransaction = 0;
+            self->savepoint_level = 0;
+            self->transaction_serial++;
+            self->transaction_timeout = -1.0;
+        }
+    }
+    pysqlite_connection_unlock(self);
+
     if (PyErr_Occurred()) {
         return NULL;
     } else {
@@ -600,11 +1015,11 @@ void _pysqlite_set_result(sqlite3_context* context, PyObject* py_val)
             sqlite3_result_blob(context, buffer, buflen, SQLITE_TRANSIENT);
         }
     } else if (PyString_Check(py_val)) {
-        sqlite3_result_text(context, PyString_AsString(py_val), -1, SQLITE_TRANSIENT);
+        sqlite3_result_text(context, PyString_AS_STRING(py_val), (int)PyString_GET_SIZE(py_val), SQLITE_TRANSIENT);
     } else if (PyUnicode_Check(py_val)) {
         stringval = PyUnicode_AsUTF8String(py_val);
         if (stringval) {
-            sqlite3_result_text(context, PyString_AsString(stringval), -1, SQLITE_TRANSIENT);
+            sqlite3_result_text(context, PyString_AS_STRING(stringval), (int)PyString_GET_SIZE(stringval), SQLITE_TRANSIENT);
             Py_DECREF(stringval);
         }
     } else {
@@ -612,78 +1027,228 @@ void _pysqlite_set_result(sqlite3_context* context, PyObject* py_val)
     }
 }
 
-PyObject* _pysqlite_build_py_params(sqlite3_context *context, int argc, sqlite3_value** argv)
+/* Converts an SQLite value to a Python object. Returns a new reference, or
+ * NULL with an exception set. */
+static PyObject* _pysqlite_value_to_object(sqlite3_value* value)
 {
-    PyObject* args;
-    int i;
-    sqlite3_value* cur_value;
-    PyObject* cur_py_value;
+    PyObject* obj;
     const char* val_str;
-    PY_LONG_LONG val_int;
     Py_ssize_t buflen;
     void* raw_buffer;
 
+    switch (sqlite3_value_type(value)) {
+        case SQLITE_INTEGER:
+            return PyInt_FromLong((long)sqlite3_value_int64(value));
+        case SQLITE_FLOAT:
+            return PyFloat_FromDouble(sqlite3_value_double(value));
+        case SQLITE_TEXT:
+            /* sqlite3_value_bytes must come after sqlite3_value_text, which
+             * may convert the value to UTF-8 */
+            val_str = (const char*)sqlite3_value_text(value);
+            obj = PyUnicode_DecodeUTF8(val_str, sqlite3_value_bytes(value), NULL);
+            /* TODO: have a way to show errors here */
+            if (!obj) {
+                PyErr_Clear();
+                Py_INCREF(Py_None);
+                obj = Py_None;
+            }
+            return obj;
+        case SQLITE_BLOB:
+            buflen = sqlite3_value_bytes(value);
+            obj = PyBuffer_New(buflen);
+            if (!obj) {
+                return NULL;
+            }
+            if (PyObject_AsWriteBuffer(obj, &raw_buffer, &buflen)) {
+                Py_DECREF(obj);
+                return NULL;
+            }
+            memcpy(raw_buffer, sqlite3_value_blob(value), buflen);
+            return obj;
+        case SQLITE_NULL:
+        default:
+            Py_INCREF(Py_None);
+            return Py_None;
+    }
+}
+
+/* Converts the arguments of a function call to the items of args from index
+ * offset on, which must all be unset. Returns 0, or -1 with an exception
+ * set. */
+static int _pysqlite_fill_py_params(PyObject* args, int offset, int argc, sqlite3_value** argv)
+{
+    PyObject* cur_py_value;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        cur_py_value = _pysqlite_value_to_object(argv[i]);
+        if (!cur_py_value) {
+            return -1;
+        }
+        PyTuple_SET_ITEM(args, offset + i, cur_py_value);
+    }
+
+    return 0;
+}
+
+PyObject* _pysqlite_build_py_params(sqlite3_context *context, int argc, sqlite3_value** argv)
+{
+    PyObject* args;
+
     args = PyTuple_New(argc);
     if (!args) {
         return NULL;
     }
 
-    for (i = 0; i < argc; i++) {
-        cur_value = argv[i];
-        switch (sqlite3_value_type(argv[i])) {
-            case SQLITE_INTEGER:
-                val_int = sqlite3_value_int64(cur_value);
-                cur_py_value = PyInt_FromLong((long)val_int);
-                break;
-            case SQLITE_FLOAT:
-                cur_py_value = PyFloat_FromDouble(sqlite3_value_double(cur_value));
-                break;
-            case SQLITE_TEXT:
-                val_str = (const char*)sqlite3_value_text(cur_value);
-                cur_py_value = PyUnicode_DecodeUTF8(val_str, strlen(val_str), NULL);
-                /* TODO: have a way to show errors here */
-                if (!cur_py_value) {
-                    PyErr_Clear();
-                    Py_INCREF(Py_None);
-                    cur_py_value = Py_None;
-                }
-                break;
-            case SQLITE_BLOB:
-                buflen = sqlite3_value_bytes(cur_value);
-                cur_py_value = PyBuffer_New(buflen);
-                if (!cur_py_value) {
-                    break;
-                }
-                if (PyObject_AsWriteBuffer(cur_py_value, &raw_buffer, &buflen)) {
-                    Py_DECREF(cur_py_value);
-                    cur_py_value = NULL;
-                    break;
-                }
-                memcpy(raw_buffer, sqlite3_value_blob(cur_value), buflen);
-                break;
-            case SQLITE_NULL:
-            default:
-                Py_INCREF(Py_None);
-                cur_py_value = Py_None;
+    if (_pysqlite_fill_py_params(args, 0, argc, argv) < 0) {
+        Py_DECREF(args);
+        return NULL;
+    }
+
+    return args;
+}
+
+/* The user data of a function created with create_function(). It is owned by
+ * a PyCObject in the function pinboard. */
+typedef struct
+{
+    PyObject* func;
+
+    /* the argument tuple of the last call, kept for the next one, or NULL.
+     * Its items are unset. */
+    PyObject* args;
+
+    /* for functions created with context=True: the FunctionContext passed as
+     * first argument, kept for the next call, or NULL */
+    int with_context;
+    pysqlite_FunctionContext* context;
+
+    /* for deterministic functions: a dictionary of argument key => result
+     * with at most cache_size entries, or NULL. See _pysqlite_call_key(). */
+    PyObject* cache;
+    int cache_size;
+    long hits;
+    long misses;
+
+    /* for a cache that only lives for one statement execution: the
+     * connection, and its execution count when the cache was last used */
+    pysqlite_Connection* connection;
+    long execution;
+} pysqlite_FunctionData;
+
+static void _pysqlite_function_data_free(void* ptr)
+{
+    pysqlite_FunctionData* data = (pysqlite_FunctionData*)ptr;
+
+    Py_XDECREF(data->func);
+    Py_XDECREF(data->args);
+    Py_XDECREF(data->context);
+    Py_XDECREF(data->cache);
+    PyMem_Free(data);
+}
+
+/* Returns the lowercase function name as a PyString. */
+static PyObject* _pysqlite_function_key(const char* name)
+{
+    PyObject* key;
+    char* p;
+
+    key = PyString_FromString(name);
+    if (!key) {
+        return NULL;
+    }
+    for (p = PyString_AS_STRING(key); *p; p++) {
+        if (*p >= 'A' && *p <= 'Z') {
+            *p += 'a' - 'A';
         }
+    }
 
-        if (!cur_py_value) {
-            Py_DECREF(args);
+    return key;
+}
+
+/* Builds the result cache key for the arguments of a call: a tuple of the
+ * SQLite type and the Python value of each argument. The values alone don't
+ * do, since 1 == 1.0 in Python while INTEGER and REAL arguments may give
+ * different results. */
+static PyObject* _pysqlite_call_key(PyObject* args, int offset, int argc, sqlite3_value** argv)
+{
+    PyObject* key;
+    PyObject* type;
+    PyObject* value;
+    int i;
+
+    key = PyTuple_New(2 * argc);
+    if (!key) {
+        return NULL;
+    }
+
+    for (i = 0; i < argc; i++) {
+        type = PyInt_FromLong(sqlite3_value_type(argv[i]));
+        if (!type) {
+            Py_DECREF(key);
             return NULL;
         }
+        value = PyTuple_GET_ITEM(args, offset + i);
+        Py_INCREF(value);
+        PyTuple_SET_ITEM(key, 2 * i, type);
+        PyTuple_SET_ITEM(key, 2 * i + 1, value);
+    }
+
+    return key;
+}
+
+/* Calls the function, or looks up its result in the cache. */
+static PyObject* _pysqlite_call_function(pysqlite_FunctionData* data, PyObject* args, int offset, int argc, sqlite3_value** argv)
+{
+    PyObject* py_retval;
+    PyObject* key;
 
-        PyTuple_SetItem(args, i, cur_py_value);
+    if (!data->cache) {
+        return PyObject_CallObject(data->func, args);
+    }
 
+    if (data->connection && data->connection->executions != data->execution) {
+        PyDict_Clear(data->cache);
+        data->execution = data->connection->executions;
     }
 
-    return args;
+    key = _pysqlite_call_key(args, offset, argc, argv);
+    if (!key) {
+        return NULL;
+    }
+
+    /* unhashable arguments, like blobs, are simply not found */
+    py_retval = PyDict_GetItem(data->cache, key);
+    if (py_retval) {
+        data->hits++;
+        Py_INCREF(py_retval);
+        Py_DECREF(key);
+        return py_retval;
+    }
+
+    data->misses++;
+    py_retval = PyObject_CallObject(data->func, args);
+    if (py_retval) {
+        if (PyDict_Size(data->cache) >= data->cache_size) {
+            PyDict_Clear(data->cache);
+        }
+        if (PyDict_SetItem(data->cache, key, py_retval) < 0) {
+            PyErr_Clear();
+        }
+    }
+    Py_DECREF(key);
+
+    return py_retval;
 }
 
 void _pysqlite_func_callback(sqlite3_context* context, int argc, sqlite3_value** argv)
 {
+    pysqlite_FunctionData* data;
+    pysqlite_FunctionContext* function_context = NULL;
     PyObject* args;
-    PyObject* py_func;
     PyObject* py_retval = NULL;
+    int offset;
+    int i;
 
 #ifdef WITH_THREAD
     PyGILState_STATE threadstate;
@@ -691,12 +1256,59 @@ void _pysqlite_func_callback(sqlite3_context* context, int argc, sqlite3_value**
     threadstate = PyGILState_Ensure();
 #endif
 
-    py_func = (PyObject*)sqlite3_user_data(context);
+    data = (pysqlite_FunctionData*)sqlite3_user_data(context);
+    offset = data->with_context ? 1 : 0;
+
+    /* Reuse the argument tuple and function context of the last call. They
+     * are taken from data while the function runs, so that a recursive call
+     * builds its own. */
+    args = data->args;
+    data->args = NULL;
+    if (!args || PyTuple_GET_SIZE(args) != offset + argc) {
+        Py_XDECREF(args);
+        args = PyTuple_New(offset + argc);
+    }
+
+    if (args && data->with_context) {
+        function_context = data->context;
+        data->context = NULL;
+        if (!function_context) {
+            function_context = (pysqlite_FunctionContext*)pysqlite_function_context_new();
+        }
+        if (function_context) {
+            function_context->context = context;
+            function_context->argc = argc;
+            Py_INCREF(function_context);
+            PyTuple_SET_ITEM(args, 0, (PyObject*)function_context);
+        } else {
+            Py_CLEAR(args);
+        }
+    }
 
-    args = _pysqlite_build_py_params(context, argc, argv);
     if (args) {
-        py_retval = PyObject_CallObject(py_func, args);
-        Py_DECREF(args);
+        if (_pysqlite_fill_py_params(args, offset, argc, argv) == 0) {
+            py_retval = _pysqlite_call_function(data, args, offset, argc, argv);
+        }
+
+        /* the tuple can only be reused if the function didn't keep it */
+        if (Py_REFCNT(args) == 1 && !data->args) {
+            for (i = 0; i < offset + argc; i++) {
+                Py_CLEAR(PyTuple_GET_ITEM(args, i));
+            }
+            data->args = args;
+        } else {
+            Py_DECREF(args);
+        }
+    }
+
+    if (function_context) {
+        /* the call is over, even if the function kept the context */
+        function_context->context = NULL;
+        if (Py_REFCNT(function_context) == 1 && !data->context) {
+            data->context = function_context;
+        } else {
+            Py_DECREF(function_context);
+        }
     }
 
     if (py_retval) {
@@ -716,64 +1328,98 @@ void _pysqlite_func_callback(sqlite3_context* context, int argc, sqlite3_value**
 #endif
 }
 
-static void _pysqlite_step_callback(sqlite3_context *context, int argc, sqlite3_value** params)
+/* The aggregate context of a user-defined aggregate or window function. The
+ * bound methods are looked up once per aggregate instance, not per row. */
+typedef struct
 {
-    PyObject* args;
-    PyObject* function_result = NULL;
-    PyObject* aggregate_class;
-    PyObject** aggregate_instance;
-    PyObject* stepmethod = NULL;
-
-#ifdef WITH_THREAD
-    PyGILState_STATE threadstate;
+    PyObject* instance;
+    PyObject* step;
 
-    threadstate = PyGILState_Ensure();
-#endif
+    /* only used by window functions, looked up on first use */
+    PyObject* inverse;
+} pysqlite_AggregateContext;
 
-    aggregate_class = (PyObject*)sqlite3_user_data(context);
+static void _pysqlite_aggregate_error(sqlite3_context* context, const char* message)
+{
+    if (_enable_callback_tracebacks) {
+        PyErr_Print();
+    } else {
+        PyErr_Clear();
+    }
+    _sqlite3_result_error(context, message, -1);
+}
 
-    aggregate_instance = (PyObject**)sqlite3_aggregate_context(context, sizeof(PyObject*));
+/* Returns the aggregate context of the current group or window, creating the
+ * aggregate instance on first use, or NULL with the error result set. */
+static pysqlite_AggregateContext* _pysqlite_get_aggregate(sqlite3_context* context)
+{
+    pysqlite_AggregateContext* aggregate;
+    PyObject* aggregate_class;
 
-    if (*aggregate_instance == 0) {
-        *aggregate_instance = PyObject_CallFunction(aggregate_class, "");
+    aggregate = (pysqlite_AggregateContext*)sqlite3_aggregate_context(context, sizeof(pysqlite_AggregateContext));
+    if (!aggregate) {
+        sqlite3_result_error_nomem(context);
+        return NULL;
+    }
 
-        if (PyErr_Occurred()) {
-            *aggregate_instance = 0;
-            if (_enable_callback_tracebacks) {
-                PyErr_Print();
-            } else {
-                PyErr_Clear();
-            }
-            _sqlite3_result_error(context, "user-defined aggregate's '__init__' method raised error", -1);
-            goto error;
+    if (!aggregate->instance) {
+        aggregate_class = (PyObject*)sqlite3_user_data(context);
+        aggregate->instance = PyObject_CallFunction(aggregate_class, "");
+        if (!aggregate->instance) {
+            _pysqlite_aggregate_error(context, "user-defined aggregate's '__init__' method raised error");
+            return NULL;
         }
     }
 
-    stepmethod = PyObject_GetAttrString(*aggregate_instance, "step");
-    if (!stepmethod) {
-        goto error;
+    return aggregate;
+}
+
+/* Calls a method of the aggregate instance with the function arguments. The
+ * bound method is looked up on the first call and kept in *method. */
+static void _pysqlite_call_aggregate(sqlite3_context* context, pysqlite_AggregateContext* aggregate, PyObject** method, const char* name, const char* message, int argc, sqlite3_value** params)
+{
+    PyObject* args;
+    PyObject* function_result;
+
+    if (!*method) {
+        /* a missing method leaves its AttributeError to the caller */
+        *method = PyObject_GetAttrString(aggregate->instance, name);
+        if (!*method) {
+            return;
+        }
     }
 
     args = _pysqlite_build_py_params(context, argc, params);
     if (!args) {
-        goto error;
+        _pysqlite_aggregate_error(context, message);
+        return;
     }
 
-    function_result = PyObject_CallObject(stepmethod, args);
+    function_result = PyObject_CallObject(*method, args);
     Py_DECREF(args);
 
     if (!function_result) {
-        if (_enable_callback_tracebacks) {
-            PyErr_Print();
-        } else {
-            PyErr_Clear();
-        }
-        _sqlite3_result_error(context, "user-defined aggregate's 'step' method raised error", -1);
+        _pysqlite_aggregate_error(context, message);
+        return;
     }
+    Py_DECREF(function_result);
+}
 
-error:
-    Py_XDECREF(stepmethod);
-    Py_XDECREF(function_result);
+static void _pysqlite_step_callback(sqlite3_context *context, int argc, sqlite3_value** params)
+{
+    pysqlite_AggregateContext* aggregate;
+
+#ifdef WITH_THREAD
+    PyGILState_STATE threadstate;
+
+    threadstate = PyGILState_Ensure();
+#endif
+
+    aggregate = _pysqlite_get_aggregate(context);
+    if (aggregate) {
+        _pysqlite_call_aggregate(context, aggregate, &aggregate->step, "step",
+                                 "user-defined aggregate's 'step' method raised error", argc, params);
+    }
 
 #ifdef WITH_THREAD
     PyGILState_Release(threadstate);
@@ -783,8 +1429,7 @@ error:
 void _pysqlite_final_callback(sqlite3_context* context)
 {
     PyObject* function_result = NULL;
-    PyObject** aggregate_instance;
-    PyObject* aggregate_class;
+    pysqlite_AggregateContext* aggregate;
 
 #ifdef WITH_THREAD
     PyGILState_STATE threadstate;
@@ -792,30 +1437,27 @@ void _pysqlite_final_callback(sqlite3_context* context)
     threadstate = PyGILState_Ensure();
 #endif
 
-    aggregate_class = (PyObject*)sqlite3_user_data(context);
-
-    aggregate_instance = (PyObject**)sqlite3_aggregate_context(context, sizeof(PyObject*));
-    if (!*aggregate_instance) {
+    aggregate = (pysqlite_AggregateContext*)sqlite3_aggregate_context(context, sizeof(pysqlite_AggregateContext));
+    if (!aggregate || !aggregate->instance) {
         /* this branch is executed if there was an exception in the aggregate's
          * __init__ */
 
         goto error;
     }
 
-    function_result = PyObject_CallMethod(*aggregate_instance, "finalize", "");
+    function_result = PyObject_CallMethod(aggregate->instance, "finalize", "");
     if (!function_result) {
-        if (_enable_callback_tracebacks) {
-            PyErr_Print();
-        } else {
-            PyErr_Clear();
-        }
-        _sqlite3_result_error(context, "user-defined aggregate's 'finalize' method raised error", -1);
+        _pysqlite_aggregate_error(context, "user-defined aggregate's 'finalize' method raised error");
     } else {
         _pysqlite_set_result(context, function_result);
     }
 
 error:
-    Py_XDECREF(*aggregate_instance);
+    if (aggregate) {
+        Py_XDECREF(aggregate->instance);
+        Py_XDECREF(aggregate->step);
+        Py_XDECREF(aggregate->inverse);
+    }
     Py_XDECREF(function_result);
 
 #ifdef WITH_THREAD
@@ -823,102 +1465,215 @@ error:
 #endif
 }
 
-static void _pysqlite_drop_unused_statement_references(pysqlite_Connection* self)
+#if SQLITE_VERSION_NUMBER >= 3025000
+static void _pysqlite_inverse_callback(sqlite3_context *context, int argc, sqlite3_value** params)
 {
-    PyObject* new_list;
-    PyObject* weakref;
-    int i;
-
-    /* we only need to do this once in a while */
-    if (self->created_statements++ < 200) {
-        return;
-    }
+    pysqlite_AggregateContext* aggregate;
 
-    self->created_statements = 0;
+#ifdef WITH_THREAD
+    PyGILState_STATE threadstate;
 
-    new_list = PyList_New(0);
-    if (!new_list) {
-        return;
-    }
+    threadstate = PyGILState_Ensure();
+#endif
 
-    for (i = 0; i < PyList_Size(self->statements); i++) {
-        weakref = PyList_GetItem(self->statements, i);
-        if (PyWeakref_GetObject(weakref) != Py_None) {
-            if (PyList_Append(new_list, weakref) != 0) {
-                Py_DECREF(new_list);
-                return;
-            }
-        }
+    aggregate = _pysqlite_get_aggregate(context);
+    if (aggregate) {
+        _pysqlite_call_aggregate(context, aggregate, &aggregate->inverse, "inverse",
+                                 "user-defined aggregate's 'inverse' method raised error", argc, params);
     }
 
-    Py_DECREF(self->statements);
-    self->statements = new_list;
+#ifdef WITH_THREAD
+    PyGILState_Release(threadstate);
+#endif
 }
 
-static void _pysqlite_drop_unused_cursor_references(pysqlite_Connection* self)
+static void _pysqlite_value_callback(sqlite3_context* context)
 {
-    PyObject* new_list;
-    PyObject* weakref;
-    int i;
-
-    /* we only need to do this once in a while */
-    if (self->created_cursors++ < 200) {
-        return;
-    }
+    PyObject* function_result;
+    pysqlite_AggregateContext* aggregate;
 
-    self->created_cursors = 0;
+#ifdef WITH_THREAD
+    PyGILState_STATE threadstate;
 
-    new_list = PyList_New(0);
-    if (!new_list) {
-        return;
-    }
+    threadstate = PyGILState_Ensure();
+#endif
 
-    for (i = 0; i < PyList_Size(self->cursors); i++) {
-        weakref = PyList_GetItem(self->cursors, i);
-        if (PyWeakref_GetObject(weakref) != Py_None) {
-            if (PyList_Append(new_list, weakref) != 0) {
-                Py_DECREF(new_list);
-                return;
-            }
+    aggregate = _pysqlite_get_aggregate(context);
+    if (aggregate) {
+        function_result = PyObject_CallMethod(aggregate->instance, "value", "");
+        if (!function_result) {
+            _pysqlite_aggregate_error(context, "user-defined aggregate's 'value' method raised error");
+        } else {
+            _pysqlite_set_result(context, function_result);
+            Py_DECREF(function_result);
         }
     }
 
-    Py_DECREF(self->cursors);
-    self->cursors = new_list;
+#ifdef WITH_THREAD
+    PyGILState_Release(threadstate);
+#endif
 }
+#endif
 
 PyObject* pysqlite_connection_create_function(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
 {
-    static char *kwlist[] = {"name", "narg", "func", NULL, NULL};
+    static char *kwlist[] = {"name", "narg", "func", "deterministic", "cache_size", "cache_scope", "context", NULL};
 
     PyObject* func;
+    PyObject* pin;
+    PyObject* key;
+    PyObject* pin_key;
+    pysqlite_FunctionData* data;
     char* name;
     int narg;
+    int deterministic = 0;
+    int cache_size = 0;
+    char* cache_scope = "statement";
+    int statement_scope;
+    int with_context = 0;
+    int flags = SQLITE_UTF8;
     int rc;
 
     if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
         return NULL;
     }
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "siO", kwlist,
-                                     &name, &narg, &func))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "siO|iisi", kwlist,
+                                     &name, &narg, &func, &deterministic, &cache_size, &cache_scope, &with_context))
     {
         return NULL;
     }
 
-    rc = sqlite3_create_function(self->db, name, narg, SQLITE_UTF8, (void*)func, _pysqlite_func_callback, NULL, NULL);
+    if (deterministic) {
+#if SQLITE_VERSION_NUMBER >= 3008003
+        flags |= SQLITE_DETERMINISTIC;
+#else
+        PyErr_SetString(pysqlite_NotSupportedError, "deterministic functions need SQLite 3.8.3 or later");
+        return NULL;
+#endif
+    }
+
+    if (cache_size < 0 || (cache_size > 0 && !deterministic)) {
+        PyErr_SetString(PyExc_ValueError, "only deterministic functions can have a result cache");
+        return NULL;
+    }
+
+    if (cache_size > 0 && with_context) {
+        PyErr_SetString(PyExc_ValueError, "functions with a context can't have a result cache");
+        return NULL;
+    }
+
+    if (!strcmp(cache_scope, "statement")) {
+        statement_scope = 1;
+    } else if (!strcmp(cache_scope, "connection")) {
+        statement_scope = 0;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "cache_scope must be 'statement' or 'connection'");
+        return NULL;
+    }
+
+    data = PyMem_Malloc(sizeof(pysqlite_FunctionData));
+    if (!data) {
+        return PyErr_NoMemory();
+    }
+    memset(data, 0, sizeof(pysqlite_FunctionData));
+    Py_INCREF(func);
+    data->func = func;
+    data->with_context = with_context ? 1 : 0;
+
+    pin = PyCObject_FromVoidPtr(data, _pysqlite_function_data_free);
+    if (!pin) {
+        _pysqlite_function_data_free(data);
+        return NULL;
+    }
+
+    if (cache_size > 0) {
+        data->cache = PyDict_New();
+        if (!data->cache) {
+            Py_DECREF(pin);
+            return NULL;
+        }
+        data->cache_size = cache_size;
+        data->connection = statement_scope ? self : NULL;
+        data->execution = self->executions;
+    }
+
+    /* the old data of the function is freed here, so no other thread may be
+     * running a statement */
+    pysqlite_connection_lock(self);
+    rc = sqlite3_create_function(self->db, name, narg, flags, (void*)data, _pysqlite_func_callback, NULL, NULL);
 
     if (rc != SQLITE_OK) {
+        pysqlite_connection_unlock(self);
+        Py_DECREF(pin);
         /* Workaround for SQLite bug: no error code or string is available here */
         PyErr_SetString(pysqlite_OperationalError, "Error creating function");
         return NULL;
+    }
+
+    /* The data must stay alive as long as SQLite may use it. SQLite function
+     * names are case-insensitive, and a function replaces the one with the
+     * same name and number of arguments, whose data is freed here: SQLite
+     * expires the statements that used it. */
+    key = _pysqlite_function_key(name);
+    pin_key = key ? Py_BuildValue("(Oi)", key, narg) : NULL;
+    if (!pin_key || PyDict_SetItem(self->function_pinboard, pin_key, pin) == -1) {
+        (void)sqlite3_create_function(self->db, name, narg, flags, NULL, NULL, NULL, NULL);
+        pysqlite_connection_unlock(self);
+        Py_XDECREF(pin_key);
+        Py_XDECREF(key);
+        Py_DECREF(pin);
+        return NULL;
+    }
+    Py_DECREF(pin_key);
+
+    /* remember the function for function_cache_info() */
+    if (cache_size > 0) {
+        rc = PyDict_SetItem(self->function_caches, key, pin);
+    } else if (PyDict_GetItem(self->function_caches, key)) {
+        rc = PyDict_DelItem(self->function_caches, key);
     } else {
-        if (PyDict_SetItem(self->function_pinboard, func, Py_None) == -1)
-            return NULL;
+        rc = 0;
+    }
+    pysqlite_connection_unlock(self);
+    Py_DECREF(key);
+    Py_DECREF(pin);
+    if (rc == -1) {
+        return NULL;
+    }
 
-        Py_INCREF(Py_None);
-        return Py_None;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* pysqlite_connection_function_cache_info(pysqlite_Connection* self, PyObject* args)
+{
+    char* name;
+    PyObject* key;
+    PyObject* pin;
+    pysqlite_FunctionData* data;
+
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTuple(args, "s:function_cache_info", &name)) {
+        return NULL;
+    }
+
+    key = _pysqlite_function_key(name);
+    if (!key) {
+        return NULL;
+    }
+    pin = PyDict_GetItem(self->function_caches, key);
+    Py_DECREF(key);
+    if (!pin) {
+        PyErr_SetString(pysqlite_ProgrammingError, "no function with a result cache has this name");
+        return NULL;
     }
+
+    data = (pysqlite_FunctionData*)PyCObject_AsVoidPtr(pin);
+    return Py_BuildValue("(lln)", data->hits, data->misses, PyDict_Size(data->cache));
 }
 
 PyObject* pysqlite_connection_create_aggregate(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
@@ -939,7 +1694,9 @@ PyObject* pysqlite_connection_create_aggregate(pysqlite_Connection* self, PyObje
         return NULL;
     }
 
+    pysqlite_connection_lock(self);
     rc = sqlite3_create_function(self->db, name, n_arg, SQLITE_UTF8, (void*)aggregate_class, 0, &_pysqlite_step_callback, &_pysqlite_final_callback);
+    pysqlite_connection_unlock(self);
     if (rc != SQLITE_OK) {
         /* Workaround for SQLite bug: no error code or string is available here */
         PyErr_SetString(pysqlite_OperationalError, "Error creating aggregate");
@@ -953,16 +1710,399 @@ PyObject* pysqlite_connection_create_aggregate(pysqlite_Connection* self, PyObje
     }
 }
 
+PyObject* pysqlite_connection_create_window_function(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* aggregate_class;
+
+    int n_arg;
+    char* name;
+    static char *kwlist[] = { "name", "n_arg", "aggregate_class", NULL };
+    int rc;
+
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "siO:create_window_function",
+                                      kwlist, &name, &n_arg, &aggregate_class)) {
+        return NULL;
+    }
+
+#if SQLITE_VERSION_NUMBER >= 3025000
+    if (PyDict_SetItem(self->function_pinboard, aggregate_class, Py_None) == -1) {
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self);
+    rc = sqlite3_create_window_function(self->db, name, n_arg, SQLITE_UTF8, (void*)aggregate_class,
+                                        &_pysqlite_step_callback, &_pysqlite_final_callback,
+                                        &_pysqlite_value_callback, &_pysqlite_inverse_callback, NULL);
+    pysqlite_connection_unlock(self);
+    if (rc != SQLITE_OK) {
+        /* Workaround for SQLite bug: no error code or string is available here */
+        PyErr_SetString(pysqlite_OperationalError, "Error creating window function");
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+#else
+    (void)rc;
+    PyErr_SetString(pysqlite_NotSupportedError, "window functions need SQLite 3.25.0 or later");
+    return NULL;
+#endif
+}
+
+/* Remembers the tables and schemas a statement touches while it is being
+ * prepared. Runs without the GIL. */
+static void _pysqlite_record_access(pysqlite_Connection* self, int action, const char* arg1, const char* arg2, const char* dbname, const char* access_attempt_source)
+{
+    switch (action) {
+        case SQLITE_READ:
+            /* the columns of a table are read one after another */
+            if (arg1 == self->auth_last_table && dbname == self->auth_last_schema
+                    && access_attempt_source == self->auth_last_source) {
+                break;
+            }
+            self->auth_last_table = arg1;
+            self->auth_last_schema = dbname;
+            self->auth_last_source = access_attempt_source;
+            /* fall through */
+        case SQLITE_INSERT:
+        case SQLITE_UPDATE:
+        case SQLITE_DELETE:
+            if (self->auth_reads && arg1) {
+                (void)pysqlite_nameset_add(self->auth_reads, "t:", arg1);
+            }
+            if (self->auth_reads && dbname) {
+                (void)pysqlite_nameset_add(self->auth_reads, "s:", dbname);
+            }
+            if (self->auth_reads && access_attempt_source) {
+                /* the view or trigger responsible for this access */
+                (void)pysqlite_nameset_add(self->auth_reads, "t:", access_attempt_source);
+            }
+            break;
+        case SQLITE_CREATE_TABLE:
+        case SQLITE_CREATE_TEMP_TABLE:
+        case SQLITE_CREATE_VIEW:
+        case SQLITE_CREATE_TEMP_VIEW:
+        case SQLITE_DROP_TABLE:
+        case SQLITE_DROP_TEMP_TABLE:
+        case SQLITE_DROP_VIEW:
+        case SQLITE_DROP_TEMP_VIEW:
+            if (self->auth_writes && arg1) {
+                (void)pysqlite_nameset_add(self->auth_writes, "t:", arg1);
+            }
+            break;
+#if SQLITE_VERSION_NUMBER >= 3002001
+        case SQLITE_ALTER_TABLE:
+            /* arg1 is the database name, arg2 the table name */
+            if (self->auth_writes && arg2) {
+                (void)pysqlite_nameset_add(self->auth_writes, "t:", arg2);
+            }
+            break;
+#endif
+        case SQLITE_DETACH:
+            if (self->auth_writes && arg1) {
+                (void)pysqlite_nameset_add(self->auth_writes, "s:", arg1);
+            }
+            break;
+        case SQLITE_ATTACH:
+            /* the schema name isn't known here, and SQLite expires all
+             * prepared statements on ATTACH anyway */
+            if (self->auth_writes) {
+                (void)pysqlite_nameset_add(self->auth_writes, "", "*");
+            }
+            break;
+    }
+}
+
+/*
+ * Authorizer rules are (action, name, decision) tuples. They are compiled
+ * into a table with the applicable rules for each action code, so that the
+ * authorizer finds a decision without the GIL and without calling Python.
+ */
+
+/* action codes are below this */
+#define AUTH_RULE_ACTIONS 64
+
+struct pysqlite_AuthRules
+{
+    /* the rules in the order they were given: the lowercase name, or NULL
+     * for any name, and the decision */
+    char** names;
+    int* decisions;
+    int count;
+
+    /* the rules for action code a are index[first[a]] up to
+     * index[first[a + 1]], in order */
+    int first[AUTH_RULE_ACTIONS + 1];
+    int* index;
+};
+
+static void _pysqlite_auth_rules_free(pysqlite_AuthRules* self)
+{
+    int i;
+
+    if (!self) {
+        return;
+    }
+
+    if (self->names) {
+        for (i = 0; i < self->count; i++) {
+            PyMem_Free(self->names[i]);
+        }
+        PyMem_Free(self->names);
+    }
+    PyMem_Free(self->decisions);
+    PyMem_Free(self->index);
+    PyMem_Free(self);
+}
+
+/* Copies a rule name as lowercase UTF-8. Returns NULL with an exception
+ * set on errors. */
+static char* _pysqlite_auth_rule_name(PyObject* name)
+{
+    PyObject* utf8;
+    char* copy;
+    char* p;
+
+    if (PyUnicode_Check(name)) {
+        utf8 = PyUnicode_AsUTF8String(name);
+        if (!utf8) {
+            return NULL;
+        }
+    } else if (PyString_Check(name)) {
+        Py_INCREF(name);
+        utf8 = name;
+    } else {
+        PyErr_SetString(PyExc_TypeError, "rule names must be strings or None");
+        return NULL;
+    }
+
+    copy = PyMem_Malloc(PyString_GET_SIZE(utf8) + 1);
+    if (copy) {
+        memcpy(copy, PyString_AS_STRING(utf8), PyString_GET_SIZE(utf8) + 1);
+        for (p = copy; *p; p++) {
+            if (*p >= 'A' && *p <= 'Z') {
+                *p += 'a' - 'A';
+            }
+        }
+    } else {
+        PyErr_NoMemory();
+    }
+    Py_DECREF(utf8);
+
+    return copy;
+}
+
+static pysqlite_AuthRules* _pysqlite_auth_rules_compile(PyObject* rules)
+{
+    pysqlite_AuthRules* self = NULL;
+    PyObject* sequence;
+    PyObject* rule;
+    PyObject* action_obj;
+    PyObject* name_obj;
+    int* actions = NULL;
+    int decision;
+    int count;
+    int total;
+    int action;
+    int i;
+
+    sequence = PySequence_Fast(rules, "rules must be a sequence");
+    if (!sequence) {
+        return NULL;
+    }
+    if (PySequence_Fast_GET_SIZE(sequence) > 1000000) {
+        PyErr_SetString(PyExc_ValueError, "too many authorizer rules");
+        goto error;
+    }
+    count = (int)PySequence_Fast_GET_SIZE(sequence);
+
+    self = PyMem_Malloc(sizeof(pysqlite_AuthRules));
+    if (!self) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    memset(self, 0, sizeof(pysqlite_AuthRules));
+    self->names = PyMem_Malloc(count * sizeof(char*) + 1);
+    self->decisions = PyMem_Malloc(count * sizeof(int) + 1);
+    actions = PyMem_Malloc(count * sizeof(int) + 1);
+    if (!self->names || !self->decisions || !actions) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    for (i = 0; i < count; i++) {
+        rule = PySequence_Fast_GET_ITEM(sequence, i);
+        if (!PyTuple_Check(rule) || !PyArg_ParseTuple(rule, "OOi", &action_obj, &name_obj, &decision)) {
+            PyErr_SetString(PyExc_TypeError, "rules must be (action, name, decision) tuples");
+            goto error;
+        }
+
+        if (action_obj == Py_None) {
+            action = -1;
+        } else {
+            action = (int)PyInt_AsLong(action_obj);
+            if (action == -1 && PyErr_Occurred()) {
+                goto error;
+            }
+            if (action < 0 || action >= AUTH_RULE_ACTIONS) {
+                PyErr_SetString(PyExc_ValueError, "unknown authorizer action");
+                goto error;
+            }
+        }
+
+        if (decision != SQLITE_OK && decision != SQLITE_DENY && decision != SQLITE_IGNORE) {
+            PyErr_SetString(PyExc_ValueError, "decision must be SQLITE_OK, SQLITE_DENY or SQLITE_IGNORE");
+            goto error;
+        }
+
+        if (name_obj == Py_None) {
+            self->names[i] = NULL;
+        } else {
+            self->names[i] = _pysqlite_auth_rule_name(name_obj);
+            if (!self->names[i]) {
+                goto error;
+            }
+        }
+        actions[i] = action;
+        self->decisions[i] = decision;
+        self->count = i + 1;
+    }
+
+    /* rules without an action apply to every action */
+    total = 0;
+    for (action = 0; action < AUTH_RULE_ACTIONS; action++) {
+        for (i = 0; i < count; i++) {
+            if (actions[i] == -1 || actions[i] == action) {
+                total++;
+            }
+        }
+    }
+    self->index = PyMem_Malloc(total * sizeof(int) + 1);
+    if (!self->index) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    total = 0;
+    for (action = 0; action < AUTH_RULE_ACTIONS; action++) {
+        self->first[action] = total;
+        for (i = 0; i < count; i++) {
+            if (actions[i] == -1 || actions[i] == action) {
+                self->index[total++] = i;
+            }
+        }
+    }
+    self->first[AUTH_RULE_ACTIONS] = total;
+
+    PyMem_Free(actions);
+    Py_DECREF(sequence);
+    return self;
+
+error:
+    PyMem_Free(actions);
+    _pysqlite_auth_rules_free(self);
+    Py_DECREF(sequence);
+    return NULL;
+}
+
+/* Returns the name an action is about, which rule names are matched with:
+ * the table for table and column accesses, also when an index or trigger is
+ * created or dropped, the function name for function calls, and the first
+ * argument of other actions, like the pragma name. */
+static const char* _pysqlite_auth_rule_subject(int action, const char* arg1, const char* arg2)
+{
+    switch (action) {
+        case SQLITE_CREATE_INDEX:
+        case SQLITE_CREATE_TEMP_INDEX:
+        case SQLITE_DROP_INDEX:
+        case SQLITE_DROP_TEMP_INDEX:
+        case SQLITE_CREATE_TRIGGER:
+        case SQLITE_CREATE_TEMP_TRIGGER:
+        case SQLITE_DROP_TRIGGER:
+        case SQLITE_DROP_TEMP_TRIGGER:
+#ifdef SQLITE_ALTER_TABLE
+        case SQLITE_ALTER_TABLE:
+#endif
+#ifdef SQLITE_FUNCTION
+        case SQLITE_FUNCTION:
+#endif
+            return arg2;
+        default:
+            return arg1;
+    }
+}
+
+static int _pysqlite_auth_name_equal(const char* lowercase, const char* name)
+{
+    char c;
+
+    for (; *lowercase; lowercase++, name++) {
+        c = *name;
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        if (c != *lowercase) {
+            return 0;
+        }
+    }
+
+    return *name == '\0';
+}
+
+/* Returns the decision of the first rule that matches, or -1 if none does.
+ * Runs without the GIL. */
+static int _pysqlite_auth_rules_check(pysqlite_AuthRules* self, int action, const char* arg1, const char* arg2)
+{
+    const char* name;
+    const char* rule_name;
+    int i;
+
+    if (action < 0 || action >= AUTH_RULE_ACTIONS) {
+        return -1;
+    }
+
+    name = _pysqlite_auth_rule_subject(action, arg1, arg2);
+    for (i = self->first[action]; i < self->first[action + 1]; i++) {
+        rule_name = self->names[self->index[i]];
+        if (!rule_name || (name && _pysqlite_auth_name_equal(rule_name, name))) {
+            return self->decisions[self->index[i]];
+        }
+    }
+
+    return -1;
+}
+
 static int _authorizer_callback(void* user_arg, int action, const char* arg1, const char* arg2 , const char* dbname, const char* access_attempt_source)
 {
+    pysqlite_Connection* self = (pysqlite_Connection*)user_arg;
     PyObject *ret;
     int rc;
 #ifdef WITH_THREAD
     PyGILState_STATE gilstate;
+#endif
+
+    if (self->auth_reads || self->auth_writes) {
+        _pysqlite_record_access(self, action, arg1, arg2, dbname, access_attempt_source);
+    }
+
+    if (self->auth_rules) {
+        rc = _pysqlite_auth_rules_check(self->auth_rules, action, arg1, arg2);
+        if (rc >= 0) {
+            return rc;
+        }
+    }
 
+    if (!self->authorizer) {
+        return SQLITE_OK;
+    }
+
+#ifdef WITH_THREAD
     gilstate = PyGILState_Ensure();
 #endif
-    ret = PyObject_CallFunction((PyObject*)user_arg, "issss", action, arg1, arg2, dbname, access_attempt_source);
+    ret = PyObject_CallFunction(self->authorizer, "issss", action, arg1, arg2, dbname, access_attempt_source);
 
     if (!ret) {
         if (_enable_callback_tracebacks) {
@@ -987,6 +2127,25 @@ static int _authorizer_callback(void* user_arg, int action, const char* arg1, co
     return rc;
 }
 
+/*
+ * Called by SQLite with count = 0, 1, 2, ... while another connection holds
+ * a lock we need; see pysqlite_busy_backoff().
+ *
+ * This runs within sqlite3_step with the GIL released, so it must not touch
+ * any Python objects.
+ *
+ * Returns 1 to retry, 0 to give up with SQLITE_BUSY.
+ */
+static int _pysqlite_busy_handler(void* user_arg, int count)
+{
+    pysqlite_Connection* self = (pysqlite_Connection*)user_arg;
+    double timeout;
+
+    timeout = (self->transaction_timeout >= 0.0) ? self->transaction_timeout : self->timeout;
+
+    return pysqlite_busy_backoff(count, timeout, &self->timeout_started, &self->busy_waits, &self->busy_time);
+}
+
 static int _progress_handler(void* user_arg)
 {
     int rc;
@@ -1034,7 +2193,7 @@ static PyObject* pysqlite_connection_set_authorizer(pysqlite_Connection* self, P
         return NULL;
     }
 
-    rc = sqlite3_set_authorizer(self->db, _authorizer_callback, (void*)authorizer_cb);
+    rc = sqlite3_set_authorizer(self->db, _authorizer_callback, (void*)self);
 
     if (rc != SQLITE_OK) {
         PyErr_SetString(pysqlite_OperationalError, "Error setting authorizer callback");
@@ -1043,11 +2202,81 @@ static PyObject* pysqlite_connection_set_authorizer(pysqlite_Connection* self, P
         if (PyDict_SetItem(self->function_pinboard, authorizer_cb, Py_None) == -1)
             return NULL;
 
+        Py_INCREF(authorizer_cb);
+        Py_XDECREF(self->authorizer);
+        self->authorizer = authorizer_cb;
+
+        /* the callable replaces any rules */
+        pysqlite_connection_lock(self);
+        _pysqlite_auth_rules_free(self->auth_rules);
+        self->auth_rules = NULL;
+        pysqlite_connection_unlock(self);
+
         Py_INCREF(Py_None);
         return Py_None;
     }
 }
 
+static PyObject* pysqlite_connection_set_authorizer_rules(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"rules", "fallback", NULL};
+
+    PyObject* rules;
+    PyObject* fallback = Py_None;
+    pysqlite_AuthRules* compiled;
+    pysqlite_AuthRules* old_rules;
+    int rc;
+
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O:set_authorizer_rules", kwlist, &rules, &fallback)) {
+        return NULL;
+    }
+
+    if (fallback != Py_None && !PyCallable_Check(fallback)) {
+        PyErr_SetString(PyExc_TypeError, "fallback must be callable or None");
+        return NULL;
+    }
+
+    compiled = _pysqlite_auth_rules_compile(rules);
+    if (!compiled) {
+        return NULL;
+    }
+
+    if (fallback != Py_None && PyDict_SetItem(self->function_pinboard, fallback, Py_None) == -1) {
+        _pysqlite_auth_rules_free(compiled);
+        return NULL;
+    }
+
+    /* setting the authorizer again expires the prepared statements, which
+     * were authorized by the old rules */
+    rc = sqlite3_set_authorizer(self->db, _authorizer_callback, (void*)self);
+    if (rc != SQLITE_OK) {
+        _pysqlite_auth_rules_free(compiled);
+        PyErr_SetString(pysqlite_OperationalError, "Error setting authorizer callback");
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self);
+    old_rules = self->auth_rules;
+    self->auth_rules = compiled;
+    pysqlite_connection_unlock(self);
+    _pysqlite_auth_rules_free(old_rules);
+
+    Py_XDECREF(self->authorizer);
+    if (fallback != Py_None) {
+        Py_INCREF(fallback);
+        self->authorizer = fallback;
+    } else {
+        self->authorizer = NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 static PyObject* pysqlite_connection_set_progress_handler(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
 {
     PyObject* progress_handler;
@@ -1064,15 +2293,137 @@ static PyObject* pysqlite_connection_set_progress_handler(pysqlite_Connection* s
         return NULL;
     }
 
+    pysqlite_connection_lock(self);
+
+    /* SQLite has only one progress handler, so this ends any step budget */
+    Py_CLEAR(self->step_budget);
+
     if (progress_handler == Py_None) {
         /* None clears the progress handler previously set */
         sqlite3_progress_handler(self->db, 0, 0, (void*)0);
     } else {
         sqlite3_progress_handler(self->db, n, _progress_handler, progress_handler);
-        if (PyDict_SetItem(self->function_pinboard, progress_handler, Py_None) == -1)
+        if (PyDict_SetItem(self->function_pinboard, progress_handler, Py_None) == -1) {
+            pysqlite_connection_unlock(self);
             return NULL;
+        }
+    }
+
+    pysqlite_connection_unlock(self);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/*
+ * The progress handler of a step budget. It runs within sqlite3_step with the
+ * GIL released, and only takes the GIL once the budget is used up.
+ *
+ * Returns nonzero to abort the statement.
+ */
+static int _step_budget_handler(void* user_arg)
+{
+    pysqlite_Connection* self = (pysqlite_Connection*)user_arg;
+    PyObject* callback;
+    PyObject* ret;
+    int rc;
+#ifdef WITH_THREAD
+    PyGILState_STATE gilstate;
+#endif
+
+    self->step_instructions += self->step_budget_check;
+    if ((self->step_budget_instructions <= 0 || self->step_instructions < self->step_budget_instructions) &&
+        (self->step_budget_time <= 0.0 || pysqlite_time() - self->step_started < self->step_budget_time)) {
+        return 0;
+    }
+
+#ifdef WITH_THREAD
+    gilstate = PyGILState_Ensure();
+#endif
+
+    /* the callback may replace the budget */
+    callback = self->step_budget;
+    Py_INCREF(callback);
+    ret = PyObject_CallFunction(callback, "");
+    Py_DECREF(callback);
+
+    if (!ret) {
+        if (_enable_callback_tracebacks) {
+            PyErr_Print();
+        } else {
+            PyErr_Clear();
+        }
+
+        /* abort query if error occurred */
+        rc = 1;
+    } else {
+        rc = (int)PyObject_IsTrue(ret);
+        Py_DECREF(ret);
+    }
+
+#ifdef WITH_THREAD
+    PyGILState_Release(gilstate);
+#endif
+
+    /* the next budget starts now */
+    self->step_instructions = 0;
+    self->step_started = pysqlite_time();
+
+    return rc;
+}
+
+static PyObject* pysqlite_connection_set_step_budget(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* callback;
+    int instructions = 0;
+    double milliseconds = 0.0;
+
+    static char *kwlist[] = { "callback", "instructions", "milliseconds", NULL };
+
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
     }
 
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|id:set_step_budget",
+                                      kwlist, &callback, &instructions, &milliseconds)) {
+        return NULL;
+    }
+
+    if (callback == Py_None) {
+        /* leave a handler from set_progress_handler() alone */
+        pysqlite_connection_lock(self);
+        if (self->step_budget) {
+            sqlite3_progress_handler(self->db, 0, 0, (void*)0);
+        }
+        Py_CLEAR(self->step_budget);
+        pysqlite_connection_unlock(self);
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    if (instructions < 0 || milliseconds < 0.0 || (instructions == 0 && milliseconds == 0.0)) {
+        PyErr_SetString(PyExc_ValueError, "a step budget needs a positive number of instructions or milliseconds");
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self);
+
+    Py_INCREF(callback);
+    Py_XDECREF(self->step_budget);
+    self->step_budget = callback;
+    self->step_budget_instructions = instructions;
+    self->step_budget_time = milliseconds / 1000.0;
+    self->step_budget_check = STEP_BUDGET_CHECK;
+    if (instructions > 0 && instructions < STEP_BUDGET_CHECK) {
+        self->step_budget_check = instructions;
+    }
+    self->step_instructions = 0;
+    self->step_started = pysqlite_time();
+
+    sqlite3_progress_handler(self->db, self->step_budget_check, _step_budget_handler, (void*)self);
+
+    pysqlite_connection_unlock(self);
+
     Py_INCREF(Py_None);
     return Py_None;
 }
@@ -1091,7 +2442,9 @@ static PyObject* pysqlite_enable_load_extension(pysqlite_Connection* self, PyObj
         return NULL;
     }
 
+    pysqlite_connection_lock(self);
     rc = sqlite3_enable_load_extension(self->db, onoff);
+    pysqlite_connection_unlock(self);
 
     if (rc != SQLITE_OK) {
         PyErr_SetString(pysqlite_OperationalError, "Error enabling load extension");
@@ -1102,52 +2455,145 @@ static PyObject* pysqlite_enable_load_extension(pysqlite_Connection* self, PyObj
     }
 }
 
-static PyObject* pysqlite_load_extension(pysqlite_Connection* self, PyObject* args)
+static PyObject* pysqlite_load_extension(pysqlite_Connection* self, PyObject* args)
+{
+    int rc;
+    char* extension_name;
+    char* errmsg;
+
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTuple(args, "s", &extension_name)) {
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self);
+    rc = sqlite3_load_extension(self->db, extension_name, 0, &errmsg);
+    pysqlite_connection_unlock(self);
+    if (rc != 0) {
+        PyErr_SetString(pysqlite_OperationalError, errmsg);
+        return NULL;
+    } else {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+}
+#endif
+
+int pysqlite_check_thread(pysqlite_Connection* self)
+{
+#ifdef WITH_THREAD
+    if (self->check_same_thread) {
+        if (PyThread_get_thread_ident() != self->thread_ident) {
+            PyErr_Format(pysqlite_ProgrammingError,
+                        "SQLite objects created in a thread can only be used in that same thread."
+                        "The object was created in thread id %ld and this is thread id %ld",
+                        self->thread_ident, PyThread_get_thread_ident());
+            return 0;
+        }
+
+    }
+#endif
+    return 1;
+}
+
+/*
+ * Acquires the lock of a serialized connection; does nothing for other
+ * connections. The thread that holds the lock may acquire it again, e. g.
+ * from within a user-defined function.
+ *
+ * Uncontended, this is a single non-blocking acquire. Otherwise we wait with
+ * the GIL released, so that the owner can get back to work.
+ */
+void pysqlite_connection_lock(pysqlite_Connection* self)
+{
+#ifdef WITH_THREAD
+    long ident;
+
+    if (!self || !self->lock) {
+        return;
+    }
+
+    ident = PyThread_get_thread_ident();
+    if (self->lock_depth > 0 && self->lock_owner == ident) {
+        self->lock_depth++;
+        return;
+    }
+
+    if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+    self->lock_owner = ident;
+    self->lock_depth = 1;
+#endif
+}
+
+void pysqlite_connection_unlock(pysqlite_Connection* self)
+{
+#ifdef WITH_THREAD
+    if (!self || !self->lock) {
+        return;
+    }
+
+    if (--self->lock_depth == 0) {
+        self->lock_owner = 0;
+        PyThread_release_lock(self->lock);
+    }
+#endif
+}
+
+static PyObject* pysqlite_connection_get_isolation_level(pysqlite_Connection* self, void* unused)
+{
+    Py_INCREF(self->isolation_level);
+    return self->isolation_level;
+}
+
+static PyObject* pysqlite_connection_get_in_transaction(pysqlite_Connection* self, void* unused)
 {
-    int rc;
-    char* extension_name;
-    char* errmsg;
-
-    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+    if (!pysqlite_check_connection(self)) {
         return NULL;
     }
+    return PyBool_FromLong(!sqlite3_get_autocommit(self->db));
+}
 
-    if (!PyArg_ParseTuple(args, "s", &extension_name)) {
-        return NULL;
-    }
+static PyObject* pysqlite_connection_get_serialized(pysqlite_Connection* self, void* unused)
+{
+    return PyBool_FromLong(self->serialized);
+}
 
-    rc = sqlite3_load_extension(self->db, extension_name, 0, &errmsg);
-    if (rc != 0) {
-        PyErr_SetString(pysqlite_OperationalError, errmsg);
-        return NULL;
-    } else {
+static PyObject* pysqlite_connection_get_transaction_timeout(pysqlite_Connection* self, void* unused)
+{
+    if (self->transaction_timeout < 0.0) {
         Py_INCREF(Py_None);
         return Py_None;
     }
+    return PyFloat_FromDouble(self->transaction_timeout);
 }
-#endif
 
-int pysqlite_check_thread(pysqlite_Connection* self)
+static int pysqlite_connection_set_transaction_timeout(pysqlite_Connection* self, PyObject* value)
 {
-#ifdef WITH_THREAD
-    if (self->check_same_thread) {
-        if (PyThread_get_thread_ident() != self->thread_ident) {
-            PyErr_Format(pysqlite_ProgrammingError,
-                        "SQLite objects created in a thread can only be used in that same thread."
-                        "The object was created in thread id %ld and this is thread id %ld",
-                        self->thread_ident, PyThread_get_thread_ident());
-            return 0;
-        }
+    double timeout;
 
+    if (!value || value == Py_None) {
+        self->transaction_timeout = -1.0;
+        return 0;
     }
-#endif
-    return 1;
-}
 
-static PyObject* pysqlite_connection_get_isolation_level(pysqlite_Connection* self, void* unused)
-{
-    Py_INCREF(self->isolation_level);
-    return self->isolation_level;
+    timeout = PyFloat_AsDouble(value);
+    if (timeout == -1.0 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (timeout < 0.0) {
+        PyErr_SetString(PyExc_ValueError, "transaction_timeout must not be negative");
+        return -1;
+    }
+
+    self->transaction_timeout = timeout;
+    return 0;
 }
 
 static PyObject* pysqlite_connection_get_total_changes(pysqlite_Connection* self, void* unused)
@@ -1171,6 +2617,7 @@ static int pysqlite_connection_set_isolation_level(pysqlite_Connection* self, Py
         PyMem_Free(self->begin_statement);
         self->begin_statement = NULL;
     }
+    Py_CLEAR(self->begin_st);
 
     if (isolation_level == Py_None) {
         Py_INCREF(Py_None);
@@ -1214,29 +2661,27 @@ static int pysqlite_connection_set_isolation_level(pysqlite_Connection* self, Py
     return 0;
 }
 
-PyObject* pysqlite_connection_call(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
+/* Prepares a statement for the statement cache. Unlike statements returned by
+ * calling the connection, it doesn't keep the connection alive, as the cache
+ * is owned by the connection. */
+static PyObject* _pysqlite_connection_create_statement(PyObject* connection, PyObject* sql)
 {
-    PyObject* sql;
+    pysqlite_Connection* self = (pysqlite_Connection*)connection;
     pysqlite_Statement* statement;
-    PyObject* weakref;
     int rc;
 
     if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
         return NULL;
     }
 
-    if (!PyArg_ParseTuple(args, "O", &sql)) {
-        return NULL;
-    }
-
-    _pysqlite_drop_unused_statement_references(self);
-
     statement = PyObject_New(pysqlite_Statement, &pysqlite_StatementType);
     if (!statement) {
         return NULL;
     }
 
+    pysqlite_connection_lock(self);
     rc = pysqlite_statement_create(statement, self, sql);
+    pysqlite_connection_unlock(self);
 
     if (rc != SQLITE_OK) {
         if (rc == PYSQLITE_TOO_MUCH_SQL) {
@@ -1249,22 +2694,43 @@ PyObject* pysqlite_connection_call(pysqlite_Connection* self, PyObject* args, Py
         }
 
         Py_CLEAR(statement);
-    } else {
-        weakref = PyWeakref_NewRef((PyObject*)statement, NULL);
-        if (!weakref) {
-            Py_CLEAR(statement);
-            goto error;
-        }
+    }
 
-        if (PyList_Append(self->statements, weakref) != 0) {
-            Py_CLEAR(weakref);
-            goto error;
-        }
+    return (PyObject*)statement;
+}
+
+/* statement cache keys are (sql,) tuples */
+static PyObject* _pysqlite_statement_cache_create(PyObject* connection, PyObject* key)
+{
+    if (!PyTuple_Check(key) || PyTuple_GET_SIZE(key) != 1) {
+        PyErr_SetString(PyExc_TypeError, "statement cache key must be a 1-tuple");
+        return NULL;
+    }
+
+    return _pysqlite_connection_create_statement(connection, PyTuple_GET_ITEM(key, 0));
+}
+
+PyObject* pysqlite_connection_call(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* sql;
+    pysqlite_Statement* statement;
 
-        Py_DECREF(weakref);
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTuple(args, "O", &sql)) {
+        return NULL;
+    }
+
+    statement = (pysqlite_Statement*)_pysqlite_connection_create_statement((PyObject*)self, sql);
+    if (statement) {
+        /* the statement can be executed directly, so it must keep the
+         * connection alive */
+        Py_INCREF(self);
+        statement->owns_connection = 1;
     }
 
-error:
     return (PyObject*)statement;
 }
 
@@ -1408,6 +2874,25 @@ finally:
     return result;
 }
 
+static PyObject *
+pysqlite_connection_savepoint(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"name", NULL, NULL};
+    PyObject* name = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &name)) {
+        return NULL;
+    }
+
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
+    }
+
+    /* without a name, the savepoint picks one for its nesting level when it
+     * is entered */
+    return PyObject_CallFunction((PyObject*)&pysqlite_SavepointType, "OO", self, name);
+}
+
 static PyObject *
 pysqlite_connection_interrupt(pysqlite_Connection* self, PyObject* args)
 {
@@ -1472,6 +2957,313 @@ finally:
     return retval;
 }
 
+/* Returns the uppercase collation name, or NULL with an exception set if the
+ * name is not valid. */
+static PyObject* _pysqlite_collation_name(PyObject* name)
+{
+    PyObject* uppercase_name;
+    char* chk;
+
+    uppercase_name = PyObject_CallMethod(name, "upper", "");
+    if (!uppercase_name) {
+        return NULL;
+    }
+
+    chk = PyString_AsString(uppercase_name);
+    while (*chk) {
+        if ((*chk >= '0' && *chk <= '9')
+         || (*chk >= 'A' && *chk <= 'Z')
+         || (*chk == '_'))
+        {
+            chk++;
+        } else {
+            PyErr_SetString(pysqlite_ProgrammingError, "invalid character in collation name");
+            Py_DECREF(uppercase_name);
+            return NULL;
+        }
+    }
+
+    return uppercase_name;
+}
+
+/*
+ * A collation that compares sort keys. The key function is called at most
+ * once per distinct text as long as the text stays in the cache, a two-way
+ * set-associative table of text => key entries. Comparisons of cached texts
+ * don't need the GIL and come down to a memcmp of the two keys.
+ *
+ * SQLite calls the collation with its connection mutex held, so the cache
+ * needs no lock of its own.
+ */
+
+#define KEY_COLLATION_CACHE_SIZE 4096
+
+typedef struct
+{
+    unsigned int hash;
+
+    /* the text followed by its sort key, in one block allocated with
+     * sqlite3_malloc, or NULL for an empty slot */
+    char* text;
+    int text_size;
+    char* key;
+    int key_size;
+} pysqlite_SortKey;
+
+typedef struct
+{
+    PyObject* key_function;
+    pysqlite_SortKey* slots;
+    unsigned int mask;
+} pysqlite_KeyCollation;
+
+static void _pysqlite_key_collation_free(void* ptr)
+{
+    pysqlite_KeyCollation* self = (pysqlite_KeyCollation*)ptr;
+    unsigned int i;
+
+    if (self->slots) {
+        for (i = 0; i <= self->mask; i++) {
+            sqlite3_free(self->slots[i].text);
+        }
+        sqlite3_free(self->slots);
+    }
+    Py_XDECREF(self->key_function);
+    PyMem_Free(self);
+}
+
+static unsigned int _pysqlite_key_collation_hash(const char* text, int size)
+{
+    unsigned int hash = 2166136261U;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+/* Calls the key function and stores the text and its key in entry. If the key
+ * function fails, the text is its own key. Returns 0, or -1 if out of
+ * memory. */
+static int _pysqlite_key_collation_compute(pysqlite_KeyCollation* self, pysqlite_SortKey* entry, unsigned int hash, const char* text, int size)
+{
+    PyObject* string;
+    PyObject* key = NULL;
+    PyObject* key_utf8;
+    const char* key_data = text;
+    int key_size = size;
+    char* block;
+#ifdef WITH_THREAD
+    PyGILState_STATE gilstate;
+
+    gilstate = PyGILState_Ensure();
+#endif
+
+    string = PyString_FromStringAndSize(text, size);
+    if (string) {
+        key = PyObject_CallFunctionObjArgs(self->key_function, string, NULL);
+        Py_DECREF(string);
+    }
+
+    if (key && PyUnicode_Check(key)) {
+        /* UTF-8 byte order is code point order */
+        key_utf8 = PyUnicode_AsUTF8String(key);
+        Py_DECREF(key);
+        key = key_utf8;
+    }
+    if (key && !PyString_Check(key)) {
+        PyErr_SetString(PyExc_TypeError, "sort keys must be strings");
+        Py_CLEAR(key);
+    }
+
+    if (key) {
+        key_data = PyString_AS_STRING(key);
+        key_size = (int)PyString_GET_SIZE(key);
+    } else if (_enable_callback_tracebacks) {
+        PyErr_Print();
+    } else {
+        PyErr_Clear();
+    }
+
+    block = sqlite3_malloc(size + key_size + 1);
+    if (block) {
+        memcpy(block, text, size);
+        memcpy(block + size, key_data, key_size);
+        sqlite3_free(entry->text);
+        entry->hash = hash;
+        entry->text = block;
+        entry->text_size = size;
+        entry->key = block + size;
+        entry->key_size = key_size;
+    }
+
+    Py_XDECREF(key);
+#ifdef WITH_THREAD
+    PyGILState_Release(gilstate);
+#endif
+
+    return block ? 0 : -1;
+}
+
+static int _pysqlite_key_collation_match(pysqlite_SortKey* entry, unsigned int hash, const char* text, int size)
+{
+    return entry->text && entry->hash == hash && entry->text_size == size && memcmp(entry->text, text, size) == 0;
+}
+
+/* Returns the cache entry for a text, filling it on a miss. The cache is
+ * two-way set-associative: a text lives in one of two neighbouring slots, the
+ * more recently filled one first. A miss never evicts the entry keep.
+ * Returns NULL if out of memory. */
+static pysqlite_SortKey* _pysqlite_key_collation_lookup(pysqlite_KeyCollation* self, const char* text, int size, pysqlite_SortKey* keep)
+{
+    pysqlite_SortKey* first;
+    pysqlite_SortKey* second;
+    pysqlite_SortKey swap;
+    unsigned int hash;
+
+    hash = _pysqlite_key_collation_hash(text, size);
+    first = &self->slots[hash & self->mask & ~1U];
+    second = first + 1;
+    if (_pysqlite_key_collation_match(first, hash, text, size)) {
+        return first;
+    }
+    if (_pysqlite_key_collation_match(second, hash, text, size)) {
+        return second;
+    }
+
+    if (keep == second) {
+        return _pysqlite_key_collation_compute(self, first, hash, text, size) < 0 ? NULL : first;
+    }
+
+    if (_pysqlite_key_collation_compute(self, second, hash, text, size) < 0) {
+        return NULL;
+    }
+    if (keep == first) {
+        return second;
+    }
+
+    /* the new entry moves first, so the older one is evicted next */
+    swap = *first;
+    *first = *second;
+    *second = swap;
+
+    return first;
+}
+
+static int
+pysqlite_key_collation_callback(
+        void* context,
+        int text1_length, const void* text1_data,
+        int text2_length, const void* text2_data)
+{
+    pysqlite_KeyCollation* self = (pysqlite_KeyCollation*)context;
+    pysqlite_SortKey* key1;
+    pysqlite_SortKey* key2 = NULL;
+    int result = 0;
+
+    key1 = _pysqlite_key_collation_lookup(self, (const char*)text1_data, text1_length, NULL);
+    if (key1) {
+        key2 = _pysqlite_key_collation_lookup(self, (const char*)text2_data, text2_length, key1);
+    }
+
+    if (key1 && key2) {
+        result = memcmp(key1->key, key2->key, key1->key_size < key2->key_size ? key1->key_size : key2->key_size);
+        if (result == 0) {
+            result = key1->key_size - key2->key_size;
+        }
+    }
+
+    return result;
+}
+
+static PyObject *
+pysqlite_connection_create_key_collation(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"name", "key", "cache_size", NULL};
+
+    PyObject* name;
+    PyObject* key_function;
+    PyObject* uppercase_name;
+    PyObject* pin;
+    pysqlite_KeyCollation* collation;
+    int cache_size = KEY_COLLATION_CACHE_SIZE;
+    unsigned int slots;
+    int rc;
+
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!O|i:create_key_collation", kwlist,
+                                     &PyString_Type, &name, &key_function, &cache_size)) {
+        return NULL;
+    }
+
+    if (!PyCallable_Check(key_function)) {
+        PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+        return NULL;
+    }
+    if (cache_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "cache_size must be positive");
+        return NULL;
+    }
+
+    /* the cache has a power of two slots, paired into sets of two */
+    for (slots = 2; slots < (unsigned int)cache_size && slots < 0x40000000U; slots <<= 1)
+        ;
+
+    collation = PyMem_Malloc(sizeof(pysqlite_KeyCollation));
+    if (!collation) {
+        return PyErr_NoMemory();
+    }
+    Py_INCREF(key_function);
+    collation->key_function = key_function;
+    collation->mask = slots - 1;
+    collation->slots = sqlite3_malloc(slots * sizeof(pysqlite_SortKey));
+    if (collation->slots) {
+        memset(collation->slots, 0, slots * sizeof(pysqlite_SortKey));
+    }
+
+    pin = PyCObject_FromVoidPtr(collation, _pysqlite_key_collation_free);
+    if (!pin) {
+        _pysqlite_key_collation_free(collation);
+        return NULL;
+    }
+    if (!collation->slots) {
+        Py_DECREF(pin);
+        return PyErr_NoMemory();
+    }
+
+    uppercase_name = _pysqlite_collation_name(name);
+    if (!uppercase_name) {
+        Py_DECREF(pin);
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self);
+    rc = sqlite3_create_collation(self->db, PyString_AsString(uppercase_name), SQLITE_UTF8,
+                                  (void*)collation, pysqlite_key_collation_callback);
+    if (rc != SQLITE_OK) {
+        _pysqlite_seterror(self->db, NULL);
+    } else if (PyDict_SetItem(self->collations, uppercase_name, pin) == -1) {
+        /* the dictionary keeps the cache alive as long as SQLite uses it */
+        (void)sqlite3_create_collation(self->db, PyString_AsString(uppercase_name), SQLITE_UTF8, NULL, NULL);
+    }
+    pysqlite_connection_unlock(self);
+
+    Py_DECREF(uppercase_name);
+    Py_DECREF(pin);
+
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 static PyObject *
 pysqlite_connection_create_collation(pysqlite_Connection* self, PyObject* args)
 {
@@ -1479,7 +3271,6 @@ pysqlite_connection_create_collation(pysqlite_Connection* self, PyObject* args)
     PyObject* uppercase_name = 0;
     PyObject* name;
     PyObject* retval;
-    char* chk;
     int rc;
 
     if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
@@ -1490,35 +3281,24 @@ pysqlite_connection_create_collation(pysqlite_Connection* self, PyObject* args)
         goto finally;
     }
 
-    uppercase_name = PyObject_CallMethod(name, "upper", "");
+    uppercase_name = _pysqlite_collation_name(name);
     if (!uppercase_name) {
         goto finally;
     }
 
-    chk = PyString_AsString(uppercase_name);
-    while (*chk) {
-        if ((*chk >= '0' && *chk <= '9')
-         || (*chk >= 'A' && *chk <= 'Z')
-         || (*chk == '_'))
-        {
-            chk++;
-        } else {
-            PyErr_SetString(pysqlite_ProgrammingError, "invalid character in collation name");
-            goto finally;
-        }
-    }
-
     if (callable != Py_None && !PyCallable_Check(callable)) {
         PyErr_SetString(PyExc_TypeError, "parameter must be callable");
         goto finally;
     }
 
+    pysqlite_connection_lock(self);
+
     if (callable != Py_None) {
         if (PyDict_SetItem(self->collations, uppercase_name, callable) == -1)
-            goto finally;
+            goto unlock;
     } else {
         if (PyDict_DelItem(self->collations, uppercase_name) == -1)
-            goto finally;
+            goto unlock;
     }
 
     rc = sqlite3_create_collation(self->db,
@@ -1529,9 +3309,11 @@ pysqlite_connection_create_collation(pysqlite_Connection* self, PyObject* args)
     if (rc != SQLITE_OK) {
         PyDict_DelItem(self->collations, uppercase_name);
         _pysqlite_seterror(self->db, NULL);
-        goto finally;
     }
 
+unlock:
+    pysqlite_connection_unlock(self);
+
 finally:
     Py_XDECREF(uppercase_name);
 
@@ -1589,6 +3371,9 @@ PyDoc_STR("SQLite database connection object.");
 static PyGetSetDef connection_getset[] = {
     {"isolation_level",  (getter)pysqlite_connection_get_isolation_level, (setter)pysqlite_connection_set_isolation_level},
     {"total_changes",  (getter)pysqlite_connection_get_total_changes, (setter)0},
+    {"in_transaction",  (getter)pysqlite_connection_get_in_transaction, (setter)0},
+    {"serialized",  (getter)pysqlite_connection_get_serialized, (setter)0},
+    {"transaction_timeout",  (getter)pysqlite_connection_get_transaction_timeout, (setter)pysqlite_connection_set_transaction_timeout},
     {NULL}
 };
 
@@ -1605,12 +3390,26 @@ static PyMethodDef connection_methods[] = {
         PyDoc_STR("Commit the current transaction.")},
     {"rollback", (PyCFunction)pysqlite_connection_rollback, METH_NOARGS,
         PyDoc_STR("Roll back the current transaction.")},
+    {"savepoint", (PyCFunction)pysqlite_connection_savepoint, METH_VARARGS|METH_KEYWORDS,
+        PyDoc_STR("Returns a savepoint for use in a with statement. Non-standard.")},
+    {"bulk_load", (PyCFunction)pysqlite_connection_bulk_load, METH_VARARGS|METH_KEYWORDS,
+        PyDoc_STR("Inserts rows into a table using several threads. Non-standard.")},
+    {"create_module", (PyCFunction)pysqlite_connection_create_module, METH_VARARGS|METH_KEYWORDS,
+        PyDoc_STR("Registers a Python class as a virtual table module. Non-standard.")},
     {"create_function", (PyCFunction)pysqlite_connection_create_function, METH_VARARGS|METH_KEYWORDS,
         PyDoc_STR("Creates a new function. Non-standard.")},
+    {"enable_native_functions", (PyCFunction)pysqlite_connection_enable_native_functions, METH_NOARGS,
+        PyDoc_STR("Registers the builtin library of native SQL functions. Non-standard.")},
     {"create_aggregate", (PyCFunction)pysqlite_connection_create_aggregate, METH_VARARGS|METH_KEYWORDS,
         PyDoc_STR("Creates a new aggregate. Non-standard.")},
+    {"create_window_function", (PyCFunction)pysqlite_connection_create_window_function, METH_VARARGS|METH_KEYWORDS,
+        PyDoc_STR("Creates a new aggregate window function. Non-standard.")},
+    {"function_cache_info", (PyCFunction)pysqlite_connection_function_cache_info, METH_VARARGS,
+        PyDoc_STR("Returns the hits, misses and size of a function's result cache. Non-standard.")},
     {"set_authorizer", (PyCFunction)pysqlite_connection_set_authorizer, METH_VARARGS|METH_KEYWORDS,
         PyDoc_STR("Sets authorizer callback. Non-standard.")},
+    {"set_authorizer_rules", (PyCFunction)pysqlite_connection_set_authorizer_rules, METH_VARARGS|METH_KEYWORDS,
+        PyDoc_STR("Sets native allow/deny rules for the authorizer. Non-standard.")},
     #ifdef HAVE_LOAD_EXTENSION
     {"enable_load_extension", (PyCFunction)pysqlite_enable_load_extension, METH_VARARGS,
         PyDoc_STR("Enable dynamic loading of SQLite extension modules. Non-standard.")},
@@ -1619,6 +3418,8 @@ static PyMethodDef connection_methods[] = {
     #endif
     {"set_progress_handler", (PyCFunction)pysqlite_connection_set_progress_handler, METH_VARARGS|METH_KEYWORDS,
         PyDoc_STR("Sets progress handler callback. Non-standard.")},
+    {"set_step_budget", (PyCFunction)pysqlite_connection_set_step_budget, METH_VARARGS|METH_KEYWORDS,
+        PyDoc_STR("Calls a function whenever a step has used up its budget. Non-standard.")},
     {"execute", (PyCFunction)pysqlite_connection_execute, METH_VARARGS,
         PyDoc_STR("Executes a SQL statement. Non-standard.")},
     {"executemany", (PyCFunction)pysqlite_connection_executemany, METH_VARARGS,
@@ -1627,6 +3428,8 @@ static PyMethodDef connection_methods[] = {
         PyDoc_STR("Executes a multiple SQL statements at once. Non-standard.")},
     {"create_collation", (PyCFunction)pysqlite_connection_create_collation, METH_VARARGS,
         PyDoc_STR("Creates a collation function. Non-standard.")},
+    {"create_key_collation", (PyCFunction)pysqlite_connection_create_key_collation, METH_VARARGS|METH_KEYWORDS,
+        PyDoc_STR("Creates a collation from a sort key function. Non-standard.")},
     {"interrupt", (PyCFunction)pysqlite_connection_interrupt, METH_NOARGS,
         PyDoc_STR("Abort any pending database operation. Non-standard.")},
     {"iterdump", (PyCFunction)pysqlite_connection_iterdump, METH_NOARGS,
@@ -1652,6 +3455,9 @@ static struct PyMemberDef connection_members[] =
     {"NotSupportedError", T_OBJECT, offsetof(pysqlite_Connection, NotSupportedError), RO},
     {"row_factory", T_OBJECT, offsetof(pysqlite_Connection, row_factory)},
     {"text_factory", T_OBJECT, offsetof(pysqlite_Connection, text_factory)},
+    {"timeout", T_DOUBLE, offsetof(pysqlite_Connection, timeout)},
+    {"busy_waits", T_LONG, offsetof(pysqlite_Connection, busy_waits)},
+    {"busy_time", T_DOUBLE, offsetof(pysqlite_Connection, busy_time)},
     {NULL}
 };
 
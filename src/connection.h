@@ -32,6 +32,29 @@
 
 #include "sqlite3.h"
 
+#define ACTION_FINALIZE 1
+#define ACTION_RESET 2
+
+/* A small hashed set of table and schema names. Entries are prefixed with
+ * "t:" for tables and views and with "s:" for schemas. The memory is managed
+ * with sqlite3_malloc, because the sets are filled from within the
+ * authorizer, where we don't hold the GIL. An all-zero set is empty. */
+typedef struct
+{
+    /* the names in the order they were added, and their hashes */
+    char** names;
+    unsigned int* hashes;
+    int count;
+
+    /* open addressing table of capacity slots, a power of two; each holds
+     * the index of a name plus one, or 0 */
+    int* slots;
+    int capacity;
+} pysqlite_NameSet;
+
+/* native authorizer rules, see set_authorizer_rules() */
+typedef struct pysqlite_AuthRules pysqlite_AuthRules;
+
 typedef struct
 {
     PyObject_HEAD
@@ -52,6 +75,26 @@ typedef struct
      * first get called with count=0? */
     double timeout_started;
 
+    /* if >= 0, overrides timeout until the current transaction ends */
+    double transaction_timeout;
+
+    /* how often the busy handler has waited for a lock, and for how many
+     * seconds in total */
+    long busy_waits;
+    double busy_time;
+
+    /* the callback of set_step_budget(), or NULL. It is called once a step
+     * has run step_budget_instructions VM instructions or for
+     * step_budget_time seconds, counted from the start of the step or from
+     * the last call. The progress handler looks at the clock every
+     * step_budget_check instructions. */
+    PyObject* step_budget;
+    int step_budget_instructions;
+    double step_budget_time;
+    int step_budget_check;
+    int step_instructions;
+    double step_started;
+
     /* None for autocommit, otherwise a PyString with the isolation level */
     PyObject* isolation_level;
 
@@ -59,6 +102,25 @@ typedef struct
      * freed in connection destructor */
     char* begin_statement;
 
+    /* The transaction control statements. They are prepared on first use and
+     * then kept for the lifetime of the connection, so that BEGIN, COMMIT and
+     * ROLLBACK don't need to be compiled again for every transaction. */
+    struct _pysqlite_Statement* begin_st;
+    struct _pysqlite_Statement* commit_st;
+    struct _pysqlite_Statement* rollback_st;
+
+    /* a dictionary of savepoint name => (SAVEPOINT, RELEASE, ROLLBACK TO)
+     * prepared statement tuples, shared by all Savepoint objects. It holds at
+     * most PYSQLITE_SAVEPOINT_CACHE_SIZE names. */
+    PyObject* savepoints;
+
+    /* the number of savepoints currently entered via Connection.savepoint() */
+    int savepoint_level;
+
+    /* incremented whenever commit() or rollback() end the transaction, and
+     * with it all savepoints entered before */
+    long transaction_serial;
+
     /* 1 if a check should be performed for each API call if the connection is
      * used from the same thread it was created in */
     int check_same_thread;
@@ -68,16 +130,23 @@ typedef struct
     /* thread identification of the thread the connection was created in */
     long thread_ident;
 
-    pysqlite_Cache* statement_cache;
+    /* 1 if the connection was opened with serialized=True. It can then be
+     * shared between threads, and lock is held around every call that uses
+     * the database. The lock is recursive: lock_owner is the thread that
+     * holds it and lock_depth counts how often it has acquired it. */
+    int serialized;
+    PyThread_type_lock lock;
+    long lock_owner;
+    int lock_depth;
 
-    /* Lists of weak references to statements and cursors used within this connection */
-    PyObject* statements;
-    PyObject* cursors;
+    pysqlite_Cache* statement_cache;
 
-    /* Counters for how many statements/cursors were created in the connection. May be
-     * reset to 0 at certain intervals */
-    int created_statements;
-    int created_cursors;
+    /* Intrusive lists of the statements and cursors that are alive within this
+     * connection. The objects link themselves in when they are created and
+     * unlink themselves in their destructors, so these lists never contain
+     * dead entries. */
+    struct _pysqlite_Statement* statements;
+    struct _pysqlite_Cursor* cursors;
 
     PyObject* row_factory;
 
@@ -93,12 +162,42 @@ typedef struct
     /* remember references to functions/classes used in
      * create_function/create/aggregate, use these as dictionary keys, so we
      * can keep the total system refcount constant by clearing that dictionary
-     * in connection_dealloc */
+     * in connection_dealloc. The data of create_function is stored under a
+     * (lowercase name, narg) key instead, so that registering a function
+     * again replaces it. */
     PyObject* function_pinboard;
 
+    /* a dictionary of lowercase function name => PyCObject with the
+     * pysqlite_FunctionData of the functions created with a result cache */
+    PyObject* function_caches;
+
+    /* counts the statement executions, so that statement-scoped function
+     * caches can tell when a new one has started */
+    long executions;
+
     /* a dictionary of registered collation name => collation callable mappings */
     PyObject* collations;
 
+    /* the callable registered with set_authorizer, or NULL */
+    PyObject* authorizer;
+
+    /* the rules registered with set_authorizer_rules, checked before the
+     * authorizer callable, or NULL */
+    pysqlite_AuthRules* auth_rules;
+
+    /* while a statement is being prepared by pysqlite_connection_prepare(),
+     * the authorizer records the tables it depends on in auth_reads and the
+     * schema objects it changes in auth_writes. Both are NULL outside of
+     * prepare, and only used while holding the SQLite connection mutex. */
+    pysqlite_NameSet* auth_reads;
+    pysqlite_NameSet* auth_writes;
+
+    /* the arguments of the last read recorded during this prepare; SQLite
+     * authorizes every column of a table separately */
+    const char* auth_last_table;
+    const char* auth_last_schema;
+    const char* auth_last_source;
+
     /* if our connection was created from a APSW connection, we keep a
      * reference to the APSW connection around and get rid of it in our
      * destructor */
@@ -124,15 +223,35 @@ void pysqlite_connection_dealloc(pysqlite_Connection* self);
 PyObject* pysqlite_connection_cursor(pysqlite_Connection* self, PyObject* args, PyObject* kwargs);
 PyObject* pysqlite_connection_close(pysqlite_Connection* self, PyObject* args);
 PyObject* _pysqlite_connection_begin(pysqlite_Connection* self);
+void pysqlite_do_all_statements(pysqlite_Connection* self, int action, int reset_cursors);
+struct _pysqlite_Statement* _pysqlite_connection_prepare_control(pysqlite_Connection* self, const char* sql);
+int _pysqlite_connection_run_control(pysqlite_Connection* self, struct _pysqlite_Statement** statement, const char* sql);
 PyObject* pysqlite_connection_commit(pysqlite_Connection* self, PyObject* args);
 PyObject* pysqlite_connection_rollback(pysqlite_Connection* self, PyObject* args);
 PyObject* pysqlite_connection_new(PyTypeObject* type, PyObject* args, PyObject* kw);
 int pysqlite_connection_init(pysqlite_Connection* self, PyObject* args, PyObject* kwargs);
 
 int pysqlite_connection_register_cursor(pysqlite_Connection* connection, PyObject* cursor);
+void pysqlite_connection_unregister_cursor(PyObject* cursor);
+void pysqlite_connection_register_statement(pysqlite_Connection* connection, PyObject* statement);
+void pysqlite_connection_unregister_statement(PyObject* statement);
+void pysqlite_connection_invalidate_statements(pysqlite_Connection* self, pysqlite_NameSet* changes);
+int pysqlite_connection_prepare(pysqlite_Connection* self, const char* sql, sqlite3_stmt** st, const char** tail, pysqlite_NameSet* reads, pysqlite_NameSet* writes);
+
+int pysqlite_nameset_add(pysqlite_NameSet* set, const char* prefix, const char* name);
+int pysqlite_nameset_intersects(pysqlite_NameSet* a, pysqlite_NameSet* b);
+void pysqlite_nameset_clear(pysqlite_NameSet* set);
 int pysqlite_check_thread(pysqlite_Connection* self);
+void pysqlite_connection_lock(pysqlite_Connection* self);
+void pysqlite_connection_unlock(pysqlite_Connection* self);
 int pysqlite_check_connection(pysqlite_Connection* con);
 
+/* Converts between SQLite values and Python objects in user-defined functions
+ * and virtual tables. The context argument of _pysqlite_build_py_params is
+ * unused. */
+void _pysqlite_set_result(sqlite3_context* context, PyObject* py_val);
+PyObject* _pysqlite_build_py_params(sqlite3_context *context, int argc, sqlite3_value** argv);
+
 int pysqlite_connection_setup_types(void);
 
 #endif
@@ -0,0 +1,194 @@
+/* context.c - the context of user-defined function calls
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "module.h"
+#include "context.h"
+#include "structmember.h"
+
+/*
+ * A FunctionContext is passed to functions created with
+ * create_function(..., context=True) for the duration of one call. It gives
+ * access to the auxiliary data SQLite keeps for constant arguments, so a
+ * function can store a parsed or compiled form of such an argument and reuse
+ * it for the rest of the statement.
+ */
+
+PyObject* pysqlite_function_context_new(void)
+{
+    pysqlite_FunctionContext* self;
+
+    self = PyObject_New(pysqlite_FunctionContext, &pysqlite_FunctionContextType);
+    if (self) {
+        self->context = NULL;
+        self->argc = 0;
+    }
+
+    return (PyObject*)self;
+}
+
+static void pysqlite_function_context_dealloc(pysqlite_FunctionContext* self)
+{
+    PyObject_Del(self);
+}
+
+/* Checks that the context belongs to a running call and index is one of its
+ * arguments. 0 => error; 1 => ok */
+static int check_function_context(pysqlite_FunctionContext* self, int index)
+{
+    if (!self->context) {
+        PyErr_SetString(pysqlite_ProgrammingError, "The function context can only be used during its function call.");
+        return 0;
+    }
+
+    if (index < 0 || index >= self->argc) {
+        PyErr_SetString(PyExc_IndexError, "argument index out of range");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* SQLite calls this when it discards auxiliary data, which may happen inside
+ * sqlite3_step() where the GIL is released. */
+static void _pysqlite_auxdata_free(void* value)
+{
+#ifdef WITH_THREAD
+    PyGILState_STATE gilstate;
+
+    gilstate = PyGILState_Ensure();
+#endif
+
+    Py_DECREF((PyObject*)value);
+
+#ifdef WITH_THREAD
+    PyGILState_Release(gilstate);
+#endif
+}
+
+static PyObject* pysqlite_function_context_get_auxdata(pysqlite_FunctionContext* self, PyObject* args)
+{
+    PyObject* value;
+    int index;
+
+    if (!PyArg_ParseTuple(args, "i:get_auxdata", &index)) {
+        return NULL;
+    }
+
+    if (!check_function_context(self, index)) {
+        return NULL;
+    }
+
+    value = (PyObject*)sqlite3_get_auxdata(self->context, index);
+    if (!value) {
+        value = Py_None;
+    }
+
+    Py_INCREF(value);
+    return value;
+}
+
+static PyObject* pysqlite_function_context_set_auxdata(pysqlite_FunctionContext* self, PyObject* args)
+{
+    PyObject* value;
+    int index;
+
+    if (!PyArg_ParseTuple(args, "iO:set_auxdata", &index, &value)) {
+        return NULL;
+    }
+
+    if (!check_function_context(self, index)) {
+        return NULL;
+    }
+
+    /* the reference is released by SQLite, possibly right away if the
+     * argument isn't constant */
+    Py_INCREF(value);
+    sqlite3_set_auxdata(self->context, index, (void*)value, _pysqlite_auxdata_free);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyMethodDef function_context_methods[] = {
+    {"get_auxdata", (PyCFunction)pysqlite_function_context_get_auxdata, METH_VARARGS,
+        PyDoc_STR("Returns the object stored for a constant argument, or None.")},
+    {"set_auxdata", (PyCFunction)pysqlite_function_context_set_auxdata, METH_VARARGS,
+        PyDoc_STR("Stores an object for a constant argument for the rest of the statement.")},
+    {NULL, NULL}
+};
+
+static struct PyMemberDef function_context_members[] =
+{
+    {"argc", T_INT, offsetof(pysqlite_FunctionContext, argc), RO},
+    {NULL}
+};
+
+static char function_context_doc[] =
+PyDoc_STR("The context of a user-defined function call.");
+
+PyTypeObject pysqlite_FunctionContextType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        MODULE_NAME ".FunctionContext",                 /* tp_name */
+        sizeof(pysqlite_FunctionContext),               /* tp_basicsize */
+        0,                                              /* tp_itemsize */
+        (destructor)pysqlite_function_context_dealloc,  /* tp_dealloc */
+        0,                                              /* tp_print */
+        0,                                              /* tp_getattr */
+        0,                                              /* tp_setattr */
+        0,                                              /* tp_compare */
+        0,                                              /* tp_repr */
+        0,                                              /* tp_as_number */
+        0,                                              /* tp_as_sequence */
+        0,                                              /* tp_as_mapping */
+        0,                                              /* tp_hash */
+        0,                                              /* tp_call */
+        0,                                              /* tp_str */
+        0,                                              /* tp_getattro */
+        0,                                              /* tp_setattro */
+        0,                                              /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT,                             /* tp_flags */
+        function_context_doc,                           /* tp_doc */
+        0,                                              /* tp_traverse */
+        0,                                              /* tp_clear */
+        0,                                              /* tp_richcompare */
+        0,                                              /* tp_weaklistoffset */
+        0,                                              /* tp_iter */
+        0,                                              /* tp_iternext */
+        function_context_methods,                       /* tp_methods */
+        function_context_members,                       /* tp_members */
+        0,                                              /* tp_getset */
+        0,                                              /* tp_base */
+        0,                                              /* tp_dict */
+        0,                                              /* tp_descr_get */
+        0,                                              /* tp_descr_set */
+        0,                                              /* tp_dictoffset */
+        0,                                              /* tp_init */
+        0,                                              /* tp_alloc */
+        0,                                              /* tp_new */
+        0                                               /* tp_free */
+};
+
+extern int pysqlite_function_context_setup_types(void)
+{
+    return PyType_Ready(&pysqlite_FunctionContextType);
+}
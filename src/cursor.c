@@ -38,10 +38,10 @@ PyObject* pysqlite_cursor_iternext(pysqlite_Cursor* self);
 
 static char* errmsg_fetch_across_rollback = "Cursor needed to be reset because of commit/rollback and can no longer be fetched from.";
 
-static pysqlite_StatementKind detect_statement_type(char* statement)
+pysqlite_StatementKind pysqlite_detect_statement_type(const char* statement)
 {
     char buf[20];
-    char* src;
+    const char* src;
     char* dst;
 
     src = statement;
@@ -85,7 +85,13 @@ static int pysqlite_cursor_init(pysqlite_Cursor* self, PyObject* args, PyObject*
         return -1;
     }
 
+    /* a second __init__ call moves the cursor to the new connection */
+    if (self->registered) {
+        pysqlite_connection_unregister_cursor((PyObject*)self);
+    }
+
     Py_INCREF(connection);
+    Py_XDECREF(self->connection);
     self->connection = connection;
     self->statement = NULL;
     self->next_row = NULL;
@@ -128,6 +134,8 @@ static void pysqlite_cursor_dealloc(pysqlite_Cursor* self)
 {
     int rc;
 
+    pysqlite_connection_unregister_cursor((PyObject*)self);
+
     /* Reset the statement if the user has not closed the cursor */
     if (self->statement) {
         rc = pysqlite_statement_reset(self->statement);
@@ -294,6 +302,80 @@ PyObject* pysqlite_unicode_from_string(const char* val_str, int optimize)
     }
 }
 
+/*
+ * Converts column i of the current result row of st to a Python object, using
+ * the connection's text_factory for TEXT values. Declared types and
+ * converters are not considered.
+ *
+ * Returns a new reference, or NULL with an exception set.
+ */
+PyObject* _pysqlite_column_value(pysqlite_Connection* connection, sqlite3_stmt* st, int i)
+{
+    int coltype;
+    PY_LONG_LONG intval;
+    PyObject* converted;
+    Py_ssize_t nbytes;
+    PyObject* buffer;
+    void* raw_buffer;
+    const char* val_str;
+    char buf[200];
+    const char* colname;
+
+    Py_BEGIN_ALLOW_THREADS
+    coltype = sqlite3_column_type(st, i);
+    Py_END_ALLOW_THREADS
+    if (coltype == SQLITE_NULL) {
+        Py_INCREF(Py_None);
+        converted = Py_None;
+    } else if (coltype == SQLITE_INTEGER) {
+        intval = sqlite3_column_int64(st, i);
+        if (intval < INT32_MIN || intval > INT32_MAX) {
+            converted = PyLong_FromLongLong(intval);
+        } else {
+            converted = PyInt_FromLong((long)intval);
+        }
+    } else if (coltype == SQLITE_FLOAT) {
+        converted = PyFloat_FromDouble(sqlite3_column_double(st, i));
+    } else if (coltype == SQLITE_TEXT) {
+        val_str = (const char*)sqlite3_column_text(st, i);
+        if ((connection->text_factory == (PyObject*)&PyUnicode_Type)
+            || (connection->text_factory == pysqlite_OptimizedUnicode)) {
+
+            converted = pysqlite_unicode_from_string(val_str,
+                connection->text_factory == pysqlite_OptimizedUnicode ? 1 : 0);
+
+            if (!converted) {
+                colname = sqlite3_column_name(st, i);
+                if (!colname) {
+                    colname = "<unknown column name>";
+                }
+                PyOS_snprintf(buf, sizeof(buf) - 1, "Could not decode to UTF-8 column '%s' with text '%s'",
+                             colname , val_str);
+                PyErr_SetString(pysqlite_OperationalError, buf);
+            }
+        } else if (connection->text_factory == (PyObject*)&PyString_Type) {
+            converted = PyString_FromString(val_str);
+        } else {
+            converted = PyObject_CallFunction(connection->text_factory, "s", val_str);
+        }
+    } else {
+        /* coltype == SQLITE_BLOB */
+        nbytes = sqlite3_column_bytes(st, i);
+        buffer = PyBuffer_New(nbytes);
+        if (!buffer) {
+            return NULL;
+        }
+        if (PyObject_AsWriteBuffer(buffer, &raw_buffer, &nbytes)) {
+            Py_DECREF(buffer);
+            return NULL;
+        }
+        memcpy(raw_buffer, sqlite3_column_blob(st, i), nbytes);
+        converted = buffer;
+    }
+
+    return converted;
+}
+
 /*
  * Returns a row from the currently active SQLite statement
  *
@@ -305,16 +387,10 @@ PyObject* _pysqlite_fetch_one_row(pysqlite_Cursor* self)
     int i, numcols;
     PyObject* row;
     PyObject* item = NULL;
-    int coltype;
-    PY_LONG_LONG intval;
     PyObject* converter;
     PyObject* converted;
     Py_ssize_t nbytes;
-    PyObject* buffer;
-    void* raw_buffer;
     const char* val_str;
-    char buf[200];
-    const char* colname;
 
     if (self->reset) {
         PyErr_SetString(pysqlite_InterfaceError, errmsg_fetch_across_rollback);
@@ -358,56 +434,7 @@ PyObject* _pysqlite_fetch_one_row(pysqlite_Cursor* self)
                 }
             }
         } else {
-            Py_BEGIN_ALLOW_THREADS
-            coltype = sqlite3_column_type(self->statement->st, i);
-            Py_END_ALLOW_THREADS
-            if (coltype == SQLITE_NULL) {
-                Py_INCREF(Py_None);
-                converted = Py_None;
-            } else if (coltype == SQLITE_INTEGER) {
-                intval = sqlite3_column_int64(self->statement->st, i);
-                if (intval < INT32_MIN || intval > INT32_MAX) {
-                    converted = PyLong_FromLongLong(intval);
-                } else {
-                    converted = PyInt_FromLong((long)intval);
-                }
-            } else if (coltype == SQLITE_FLOAT) {
-                converted = PyFloat_FromDouble(sqlite3_column_double(self->statement->st, i));
-            } else if (coltype == SQLITE_TEXT) {
-                val_str = (const char*)sqlite3_column_text(self->statement->st, i);
-                if ((self->connection->text_factory == (PyObject*)&PyUnicode_Type)
-                    || (self->connection->text_factory == pysqlite_OptimizedUnicode)) {
-
-                    converted = pysqlite_unicode_from_string(val_str,
-                        self->connection->text_factory == pysqlite_OptimizedUnicode ? 1 : 0);
-
-                    if (!converted) {
-                        colname = sqlite3_column_name(self->statement->st, i);
-                        if (!colname) {
-                            colname = "<unknown column name>";
-                        }
-                        PyOS_snprintf(buf, sizeof(buf) - 1, "Could not decode to UTF-8 column '%s' with text '%s'",
-                                     colname , val_str);
-                        PyErr_SetString(pysqlite_OperationalError, buf);
-                    }
-                } else if (self->connection->text_factory == (PyObject*)&PyString_Type) {
-                    converted = PyString_FromString(val_str);
-                } else {
-                    converted = PyObject_CallFunction(self->connection->text_factory, "s", val_str);
-                }
-            } else {
-                /* coltype == SQLITE_BLOB */
-                nbytes = sqlite3_column_bytes(self->statement->st, i);
-                buffer = PyBuffer_New(nbytes);
-                if (!buffer) {
-                    break;
-                }
-                if (PyObject_AsWriteBuffer(buffer, &raw_buffer, &nbytes)) {
-                    break;
-                }
-                memcpy(raw_buffer, sqlite3_column_blob(self->statement->st, i), nbytes);
-                converted = buffer;
-            }
+            converted = _pysqlite_column_value(self->connection, self->statement->st, i);
         }
 
         if (converted) {
@@ -446,7 +473,7 @@ static int check_cursor(pysqlite_Cursor* cur)
     }
 }
 
-PyObject* _pysqlite_query_execute(pysqlite_Cursor* self, int multiple, PyObject* args)
+static PyObject* _pysqlite_query_execute_locked(pysqlite_Cursor* self, int multiple, PyObject* args)
 {
     PyObject* operation;
     PyObject* operation_bytestr = NULL;
@@ -595,7 +622,7 @@ PyObject* _pysqlite_query_execute(pysqlite_Cursor* self, int multiple, PyObject*
     pysqlite_statement_reset(self->statement);
     pysqlite_statement_mark_dirty(self->statement);
 
-    statement_type = detect_statement_type(operation_cstr);
+    statement_type = pysqlite_detect_statement_type(operation_cstr);
     if (self->connection->begin_statement) {
         if (!self->connection->inTransaction) {
             result = _pysqlite_connection_begin(self->connection);
@@ -684,6 +711,11 @@ PyObject* _pysqlite_query_execute(pysqlite_Cursor* self, int multiple, PyObject*
             }
         }
 
+        if (self->statement->writes.count > 0) {
+            /* the statement changed the schema; throw out what depends on it */
+            pysqlite_connection_invalidate_statements(self->connection, &self->statement->writes);
+        }
+
         if (pysqlite_build_row_cast_map(self) != 0) {
             PyErr_SetString(pysqlite_OperationalError, "Error while building row_cast_map");
             goto error;
@@ -780,6 +812,21 @@ error:
     }
 }
 
+/*
+ * Runs execute() or executemany(). For a serialized connection, the whole
+ * call holds the connection lock.
+ */
+PyObject* _pysqlite_query_execute(pysqlite_Cursor* self, int multiple, PyObject* args)
+{
+    PyObject* result;
+
+    pysqlite_connection_lock(self->connection);
+    result = _pysqlite_query_execute_locked(self, multiple, args);
+    pysqlite_connection_unlock(self->connection);
+
+    return result;
+}
+
 PyObject* pysqlite_cursor_execute(pysqlite_Cursor* self, PyObject* args)
 {
     return _pysqlite_query_execute(self, 0, args);
@@ -798,6 +845,7 @@ PyObject* pysqlite_cursor_executescript(pysqlite_Cursor* self, PyObject* args)
     sqlite3_stmt* statement;
     int rc;
     PyObject* result;
+    pysqlite_NameSet schema_changes = {NULL, NULL, 0, NULL, 0};
 
     if (!PyArg_ParseTuple(args, "O", &script_obj)) {
         return NULL;
@@ -823,6 +871,8 @@ PyObject* pysqlite_cursor_executescript(pysqlite_Cursor* self, PyObject* args)
         return NULL;
     }
 
+    pysqlite_connection_lock(self->connection);
+
     /* commit first */
     result = pysqlite_connection_commit(self->connection, NULL);
     if (!result) {
@@ -831,13 +881,7 @@ PyObject* pysqlite_cursor_executescript(pysqlite_Cursor* self, PyObject* args)
     Py_DECREF(result);
 
     while (1) {
-        Py_BEGIN_ALLOW_THREADS
-        rc = sqlite3_prepare(self->connection->db,
-                             script_cstr,
-                             -1,
-                             &statement,
-                             &script_cstr);
-        Py_END_ALLOW_THREADS
+        rc = pysqlite_connection_prepare(self->connection, script_cstr, &statement, &script_cstr, NULL, &schema_changes);
         if (rc != SQLITE_OK) {
             _pysqlite_seterror(self->connection->db, NULL);
             goto error;
@@ -862,12 +906,17 @@ PyObject* pysqlite_cursor_executescript(pysqlite_Cursor* self, PyObject* args)
             goto error;
         }
 
+        pysqlite_connection_invalidate_statements(self->connection, &schema_changes);
+        pysqlite_nameset_clear(&schema_changes);
+
         if (*script_cstr == (char)0) {
             break;
         }
     }
 
 error:
+    pysqlite_connection_unlock(self->connection);
+    pysqlite_nameset_clear(&schema_changes);
     Py_XDECREF(script_str);
 
     if (PyErr_Occurred()) {
@@ -899,12 +948,15 @@ PyObject* pysqlite_cursor_iternext(pysqlite_Cursor *self)
         return NULL;
     }
 
+    pysqlite_connection_lock(self->connection);
+
     if (!self->next_row) {
          if (self->statement) {
             (void)pysqlite_statement_reset(self->statement);
             Py_DECREF(self->statement);
             self->statement = NULL;
         }
+        pysqlite_connection_unlock(self->connection);
         return NULL;
     }
 
@@ -918,12 +970,21 @@ PyObject* pysqlite_cursor_iternext(pysqlite_Cursor *self)
         next_row = next_row_tuple;
     }
 
+    /* a commit resets all statements; stepping it again would start the
+     * query over, and leave a running statement that looks unused in the
+     * statement cache. Fail the next fetch, like after a rollback. */
+    if (self->statement && !self->statement->in_use) {
+        Py_CLEAR(self->statement);
+        self->reset = 1;
+    }
+
     if (self->statement) {
         rc = pysqlite_step(self->statement->st, self->connection);
         if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
             (void)pysqlite_statement_reset(self->statement);
             Py_DECREF(next_row);
             _pysqlite_seterror(self->connection->db, NULL);
+            pysqlite_connection_unlock(self->connection);
             return NULL;
         }
 
@@ -932,6 +993,8 @@ PyObject* pysqlite_cursor_iternext(pysqlite_Cursor *self)
         }
     }
 
+    pysqlite_connection_unlock(self->connection);
+
     return next_row;
 }
 
@@ -1033,10 +1096,12 @@ PyObject* pysqlite_cursor_close(pysqlite_Cursor* self, PyObject* args)
         return NULL;
     }
 
+    pysqlite_connection_lock(self->connection);
     if (self->statement) {
         (void)pysqlite_statement_reset(self->statement);
         Py_CLEAR(self->statement);
     }
+    pysqlite_connection_unlock(self->connection);
 
     self->closed = 1;
 
@@ -29,7 +29,7 @@
 #include "connection.h"
 #include "module.h"
 
-typedef struct
+typedef struct _pysqlite_Cursor
 {
     PyObject_HEAD
     pysqlite_Connection* connection;
@@ -47,6 +47,11 @@ typedef struct
     /* the next row to be returned, NULL if no next row available */
     PyObject* next_row;
 
+    /* neighbours in the connection's list of live cursors */
+    struct _pysqlite_Cursor* prev;
+    struct _pysqlite_Cursor* next;
+    int registered;
+
     PyObject* in_weakreflist; /* List of weak references */
 } pysqlite_Cursor;
 
@@ -68,6 +73,9 @@ PyObject* pysqlite_cursor_fetchall(pysqlite_Cursor* self, PyObject* args);
 PyObject* pysqlite_noop(pysqlite_Connection* self, PyObject* args);
 PyObject* pysqlite_cursor_close(pysqlite_Cursor* self, PyObject* args);
 
+PyObject* _pysqlite_column_value(pysqlite_Connection* connection, sqlite3_stmt* st, int i);
+pysqlite_StatementKind pysqlite_detect_statement_type(const char* statement);
+
 int pysqlite_cursor_setup_types(void);
 
 #define UNKNOWN (-1)
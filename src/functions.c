@@ -0,0 +1,903 @@
+/* functions.c - native SQL functions
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "module.h"
+#include "connection.h"
+#include "functions.h"
+#include "util.h"
+#include "sqlitecompat.h"
+
+#include <math.h>
+#ifndef MS_WINDOWS
+#include <regex.h>
+#endif
+
+/*
+ * Scalar functions implemented in C. They work on SQLite values only and
+ * never touch Python objects, so they run without the GIL and statements
+ * using them on other threads proceed in parallel.
+ *
+ * Like the builtin SQL functions, they return NULL for NULL arguments and
+ * for arguments outside their domain.
+ */
+
+static int _pysqlite_has_null(int argc, sqlite3_value** argv)
+{
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        if (sqlite3_value_type(argv[i]) == SQLITE_NULL) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Sets a text result that was allocated with sqlite3_malloc, or reports that
+ * the allocation failed. */
+static void _pysqlite_result_text(sqlite3_context* context, char* text, int size)
+{
+    if (text) {
+        sqlite3_result_text(context, text, size, sqlite3_free);
+    } else {
+        sqlite3_result_error_nomem(context);
+    }
+}
+
+/* Checks a result size against the length limit of the connection. */
+static int _pysqlite_check_size(sqlite3_context* context, sqlite3_int64 size)
+{
+    if (size > sqlite3_limit(sqlite3_context_db_handle(context), SQLITE_LIMIT_LENGTH, -1)) {
+        sqlite3_result_error_toobig(context);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* ------------------------------------------------------------------------
+ * math
+ */
+
+static void _pysqlite_math_result(sqlite3_context* context, double result)
+{
+    /* NaN and infinities are domain errors */
+    if (result == result && result - result == 0.0) {
+        sqlite3_result_double(context, result);
+    }
+}
+
+#define PYSQLITE_MATH_FUNCTION(name, expression, domain) \
+static void _pysqlite_##name(sqlite3_context* context, int argc, sqlite3_value** argv) \
+{ \
+    double x; \
+    if (_pysqlite_has_null(argc, argv)) { \
+        return; \
+    } \
+    x = sqlite3_value_double(argv[0]); \
+    if (domain) { \
+        _pysqlite_math_result(context, expression); \
+    } \
+}
+
+PYSQLITE_MATH_FUNCTION(sqrt, sqrt(x), x >= 0.0)
+PYSQLITE_MATH_FUNCTION(exp, exp(x), 1)
+PYSQLITE_MATH_FUNCTION(ln, log(x), x > 0.0)
+PYSQLITE_MATH_FUNCTION(log10, log10(x), x > 0.0)
+
+static void _pysqlite_power(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    if (_pysqlite_has_null(argc, argv)) {
+        return;
+    }
+
+    _pysqlite_math_result(context, pow(sqlite3_value_double(argv[0]), sqlite3_value_double(argv[1])));
+}
+
+static void _pysqlite_pi(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    sqlite3_result_double(context, 3.14159265358979323846);
+}
+
+/* floor() and ceil() return integers unchanged */
+static void _pysqlite_round_to(sqlite3_context* context, sqlite3_value* value, int up)
+{
+    switch (sqlite3_value_numeric_type(value)) {
+        case SQLITE_INTEGER:
+            sqlite3_result_int64(context, sqlite3_value_int64(value));
+            break;
+        case SQLITE_FLOAT:
+            _pysqlite_math_result(context, up ? ceil(sqlite3_value_double(value)) : floor(sqlite3_value_double(value)));
+            break;
+        default:
+            break;
+    }
+}
+
+static void _pysqlite_floor(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    _pysqlite_round_to(context, argv[0], 0);
+}
+
+static void _pysqlite_ceil(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    _pysqlite_round_to(context, argv[0], 1);
+}
+
+static void _pysqlite_sign(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    double x;
+
+    if (_pysqlite_has_null(argc, argv)) {
+        return;
+    }
+
+    x = sqlite3_value_double(argv[0]);
+    sqlite3_result_int(context, x > 0.0 ? 1 : (x < 0.0 ? -1 : 0));
+}
+
+/* ------------------------------------------------------------------------
+ * strings
+ *
+ * Lengths and positions count characters, not bytes, of the UTF-8 text.
+ */
+
+static int _pysqlite_utf8_length(const unsigned char* text, int size)
+{
+    int length = 0;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        if ((text[i] & 0xC0) != 0x80) {
+            length++;
+        }
+    }
+
+    return length;
+}
+
+/* Returns the byte offset of the character at index, or size if the text is
+ * shorter. */
+static int _pysqlite_utf8_offset(const unsigned char* text, int size, sqlite3_int64 index)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        if ((text[i] & 0xC0) != 0x80 && index-- == 0) {
+            return i;
+        }
+    }
+
+    return size;
+}
+
+/* lpad(text, length[, fill]) and rpad(text, length[, fill]) pad text with
+ * repetitions of fill, a space by default, or cut it to length characters */
+static void _pysqlite_pad(sqlite3_context* context, int argc, sqlite3_value** argv, int left)
+{
+    const unsigned char* text;
+    const unsigned char* fill = (const unsigned char*)" ";
+    int text_size;
+    int fill_size = 1;
+    int text_length;
+    int fill_length;
+    sqlite3_int64 length;
+    sqlite3_int64 pad_length;
+    sqlite3_int64 pad_size;
+    sqlite3_int64 i;
+    char* result;
+    char* pad;
+
+    if (_pysqlite_has_null(argc, argv)) {
+        return;
+    }
+
+    text = sqlite3_value_text(argv[0]);
+    text_size = sqlite3_value_bytes(argv[0]);
+    length = sqlite3_value_int64(argv[1]);
+    if (argc == 3) {
+        fill = sqlite3_value_text(argv[2]);
+        fill_size = sqlite3_value_bytes(argv[2]);
+    }
+    if (!text || !fill) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    if (length < 0) {
+        length = 0;
+    }
+    text_length = _pysqlite_utf8_length(text, text_size);
+    /* a fill of only continuation bytes has no characters either */
+    fill_length = _pysqlite_utf8_length(fill, fill_size);
+    if (text_length >= length || fill_length == 0) {
+        sqlite3_result_text(context, (const char*)text, _pysqlite_utf8_offset(text, text_size, length), SQLITE_TRANSIENT);
+        return;
+    }
+
+    /* every character takes at least one byte */
+    if (!_pysqlite_check_size(context, length)) {
+        return;
+    }
+
+    pad_length = length - text_length;
+    pad_size = (pad_length / fill_length) * fill_size + _pysqlite_utf8_offset(fill, fill_size, pad_length % fill_length);
+    if (!_pysqlite_check_size(context, text_size + pad_size)) {
+        return;
+    }
+
+    result = sqlite3_malloc((int)(text_size + pad_size + 1));
+    if (result) {
+        pad = left ? result : result + text_size;
+        memcpy(left ? result + pad_size : result, text, text_size);
+        for (i = 0; i + fill_size <= pad_size; i += fill_size) {
+            memcpy(pad + i, fill, fill_size);
+        }
+        memcpy(pad + i, fill, (size_t)(pad_size - i));
+    }
+    _pysqlite_result_text(context, result, (int)(text_size + pad_size));
+}
+
+static void _pysqlite_lpad(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    _pysqlite_pad(context, argc, argv, 1);
+}
+
+static void _pysqlite_rpad(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    _pysqlite_pad(context, argc, argv, 0);
+}
+
+static const char* _pysqlite_memmem(const char* haystack, sqlite3_int64 size, const char* needle, int needle_size)
+{
+    sqlite3_int64 i;
+
+    for (i = 0; i + needle_size <= size; i++) {
+        if (haystack[i] == needle[0] && memcmp(haystack + i, needle, needle_size) == 0) {
+            return haystack + i;
+        }
+    }
+
+    return NULL;
+}
+
+/* split_part(text, separator, n) returns the n-th field of text, counting from
+ * 1, or from the end if n is negative; an empty string if there is none and
+ * NULL for n = 0 */
+static void _pysqlite_split_part(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    const char* text;
+    const char* separator;
+    const char* start;
+    const char* end;
+    const char* found;
+    int text_size;
+    int separator_size;
+    sqlite3_int64 n;
+    sqlite3_int64 fields;
+    sqlite3_int64 field;
+
+    if (_pysqlite_has_null(argc, argv)) {
+        return;
+    }
+
+    text = (const char*)sqlite3_value_text(argv[0]);
+    text_size = sqlite3_value_bytes(argv[0]);
+    separator = (const char*)sqlite3_value_text(argv[1]);
+    separator_size = sqlite3_value_bytes(argv[1]);
+    n = sqlite3_value_int64(argv[2]);
+    if (!text || !separator) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    if (n == 0) {
+        return;
+    }
+
+    /* the text is a single field if the separator is empty */
+    fields = 1;
+    if (separator_size > 0 && n < 0) {
+        for (start = text; (found = _pysqlite_memmem(start, text + text_size - start, separator, separator_size)); start = found + separator_size) {
+            fields++;
+        }
+    }
+    if (n < 0) {
+        n += fields + 1;
+    }
+
+    start = text;
+    end = text + text_size;
+    for (field = 1; separator_size > 0; field++) {
+        found = _pysqlite_memmem(start, end - start, separator, separator_size);
+        if (field == n) {
+            if (found) {
+                end = found;
+            }
+            break;
+        }
+        if (!found) {
+            break;
+        }
+        start = found + separator_size;
+    }
+
+    if (field == n) {
+        sqlite3_result_text(context, start, (int)(end - start), SQLITE_TRANSIENT);
+    } else {
+        sqlite3_result_text(context, "", 0, SQLITE_STATIC);
+    }
+}
+
+/* reverse(text) reverses the characters of text */
+static void _pysqlite_reverse(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    const unsigned char* text;
+    int size;
+    int i;
+    int j;
+    char* result;
+
+    if (_pysqlite_has_null(argc, argv)) {
+        return;
+    }
+
+    text = sqlite3_value_text(argv[0]);
+    size = sqlite3_value_bytes(argv[0]);
+    if (!text) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    result = sqlite3_malloc(size + 1);
+    if (result) {
+        for (i = 0; i < size; i = j) {
+            /* copy each character with its continuation bytes as a whole */
+            for (j = i + 1; j < size && (text[j] & 0xC0) == 0x80; j++)
+                ;
+            memcpy(result + size - j, text + i, j - i);
+        }
+    }
+    _pysqlite_result_text(context, result, size);
+}
+
+#ifndef MS_WINDOWS
+static void _pysqlite_regexp_free(void* regex)
+{
+    regfree((regex_t*)regex);
+    sqlite3_free(regex);
+}
+
+/* regexp(pattern, text), which implements "text REGEXP pattern" with POSIX
+ * extended regular expressions. The compiled pattern is kept as auxiliary
+ * data, so a constant pattern is compiled once per statement. */
+static void _pysqlite_regexp(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    regex_t* regex;
+    const char* pattern;
+    const char* text;
+    char message[256];
+    int rc;
+
+    if (_pysqlite_has_null(argc, argv)) {
+        return;
+    }
+
+    pattern = (const char*)sqlite3_value_text(argv[0]);
+    text = (const char*)sqlite3_value_text(argv[1]);
+    if (!pattern || !text) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    regex = sqlite3_get_auxdata(context, 0);
+    if (regex) {
+        sqlite3_result_int(context, regexec(regex, text, 0, NULL, 0) == 0);
+        return;
+    }
+
+    regex = sqlite3_malloc(sizeof(regex_t));
+    if (!regex) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    rc = regcomp(regex, pattern, REG_EXTENDED | REG_NOSUB);
+    if (rc != 0) {
+        (void)regerror(rc, regex, message, sizeof(message));
+        sqlite3_free(regex);
+        sqlite3_result_error(context, message, -1);
+        return;
+    }
+
+    sqlite3_result_int(context, regexec(regex, text, 0, NULL, 0) == 0);
+
+    /* SQLite may free the pattern right away if it isn't constant */
+    sqlite3_set_auxdata(context, 0, regex, _pysqlite_regexp_free);
+}
+#endif
+
+/* ------------------------------------------------------------------------
+ * hashing
+ *
+ * md5() and sha1() return the digest of the bytes of a text or blob as
+ * lowercase hex, like hexdigest() of the Python hash objects. crc32()
+ * returns the checksum as an unsigned integer.
+ */
+
+#define PYSQLITE_ROTATE(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+typedef void (*pysqlite_HashBlock)(unsigned int* state, const unsigned char* block);
+
+static const unsigned int _pysqlite_md5_sines[64] = {
+    0xd76aa478U, 0xe8c7b756U, 0x242070dbU, 0xc1bdceeeU,
+    0xf57c0fafU, 0x4787c62aU, 0xa8304613U, 0xfd469501U,
+    0x698098d8U, 0x8b44f7afU, 0xffff5bb1U, 0x895cd7beU,
+    0x6b901122U, 0xfd987193U, 0xa679438eU, 0x49b40821U,
+    0xf61e2562U, 0xc040b340U, 0x265e5a51U, 0xe9b6c7aaU,
+    0xd62f105dU, 0x02441453U, 0xd8a1e681U, 0xe7d3fbc8U,
+    0x21e1cde6U, 0xc33707d6U, 0xf4d50d87U, 0x455a14edU,
+    0xa9e3e905U, 0xfcefa3f8U, 0x676f02d9U, 0x8d2a4c8aU,
+    0xfffa3942U, 0x8771f681U, 0x6d9d6122U, 0xfde5380cU,
+    0xa4beea44U, 0x4bdecfa9U, 0xf6bb4b60U, 0xbebfbc70U,
+    0x289b7ec6U, 0xeaa127faU, 0xd4ef3085U, 0x04881d05U,
+    0xd9d4d039U, 0xe6db99e5U, 0x1fa27cf8U, 0xc4ac5665U,
+    0xf4292244U, 0x432aff97U, 0xab9423a7U, 0xfc93a039U,
+    0x655b59c3U, 0x8f0ccc92U, 0xffeff47dU, 0x85845dd1U,
+    0x6fa87e4fU, 0xfe2ce6e0U, 0xa3014314U, 0x4e0811a1U,
+    0xf7537e82U, 0xbd3af235U, 0x2ad7d2bbU, 0xeb86d391U,
+};
+
+static const unsigned char _pysqlite_md5_shifts[16] = {
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+};
+
+static void _pysqlite_md5_block(unsigned int* state, const unsigned char* block)
+{
+    unsigned int words[16];
+    unsigned int a, b, c, d, f, t;
+    int i, g;
+
+    for (i = 0; i < 16; i++) {
+        words[i] = (unsigned int)block[4 * i] | ((unsigned int)block[4 * i + 1] << 8)
+                 | ((unsigned int)block[4 * i + 2] << 16) | ((unsigned int)block[4 * i + 3] << 24);
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    for (i = 0; i < 64; i++) {
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        t = a + f + _pysqlite_md5_sines[i] + words[g];
+        a = d;
+        d = c;
+        c = b;
+        b += PYSQLITE_ROTATE(t, _pysqlite_md5_shifts[(i >> 4) * 4 + (i & 3)]);
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+static void _pysqlite_sha1_block(unsigned int* state, const unsigned char* block)
+{
+    unsigned int words[80];
+    unsigned int a, b, c, d, e, f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        words[i] = ((unsigned int)block[4 * i] << 24) | ((unsigned int)block[4 * i + 1] << 16)
+                 | ((unsigned int)block[4 * i + 2] << 8) | (unsigned int)block[4 * i + 3];
+    }
+    for (i = 16; i < 80; i++) {
+        t = words[i - 3] ^ words[i - 8] ^ words[i - 14] ^ words[i - 16];
+        words[i] = PYSQLITE_ROTATE(t, 1);
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    for (i = 0; i < 80; i++) {
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999U;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1U;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdcU;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6U;
+        }
+        t = PYSQLITE_ROTATE(a, 5) + f + e + k + words[i];
+        e = d;
+        d = c;
+        c = PYSQLITE_ROTATE(b, 30);
+        b = a;
+        a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+/* Runs the blocks of data through a hash function, padded with its bit length
+ * in the byte order of the hash, and returns the state words as hex in that
+ * byte order. */
+static void _pysqlite_hash(sqlite3_context* context, sqlite3_value* value, pysqlite_HashBlock hash_block,
+                           unsigned int* state, int words, int big_endian)
+{
+    const unsigned char* data;
+    unsigned char tail[128];
+    char hex[41];
+    sqlite3_uint64 bits;
+    int size;
+    int full;
+    int tail_size;
+    int i;
+    unsigned char byte;
+
+    if (sqlite3_value_type(value) == SQLITE_NULL) {
+        return;
+    }
+
+    if (sqlite3_value_type(value) == SQLITE_BLOB) {
+        data = sqlite3_value_blob(value);
+    } else {
+        data = sqlite3_value_text(value);
+    }
+    size = sqlite3_value_bytes(value);
+    if (!data && size > 0) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    full = size & ~63;
+    for (i = 0; i < full; i += 64) {
+        hash_block(state, data + i);
+    }
+
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + full, size - full);
+    tail[size - full] = 0x80;
+    tail_size = size - full < 56 ? 64 : 128;
+    bits = (sqlite3_uint64)size * 8;
+    for (i = 0; i < 8; i++) {
+        tail[big_endian ? tail_size - 1 - i : tail_size - 8 + i] = (unsigned char)(bits >> (8 * i));
+    }
+    for (i = 0; i < tail_size; i += 64) {
+        hash_block(state, tail + i);
+    }
+
+    for (i = 0; i < words * 4; i++) {
+        byte = (unsigned char)(state[i / 4] >> (big_endian ? 24 - 8 * (i % 4) : 8 * (i % 4)));
+        hex[2 * i] = "0123456789abcdef"[byte >> 4];
+        hex[2 * i + 1] = "0123456789abcdef"[byte & 15];
+    }
+
+    sqlite3_result_text(context, hex, words * 8, SQLITE_TRANSIENT);
+}
+
+static void _pysqlite_md5(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    unsigned int state[4] = {0x67452301U, 0xefcdab89U, 0x98badcfeU, 0x10325476U};
+
+    _pysqlite_hash(context, argv[0], _pysqlite_md5_block, state, 4, 0);
+}
+
+static void _pysqlite_sha1(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    unsigned int state[5] = {0x67452301U, 0xefcdab89U, 0x98badcfeU, 0x10325476U, 0xc3d2e1f0U};
+
+    _pysqlite_hash(context, argv[0], _pysqlite_sha1_block, state, 5, 1);
+}
+
+/* filled by the first enable_native_functions() call, which holds the GIL */
+static unsigned int _pysqlite_crc32_table[256];
+static int _pysqlite_crc32_ready = 0;
+
+static void _pysqlite_crc32_setup(void)
+{
+    unsigned int crc;
+    int i;
+    int bit;
+
+    for (i = 0; i < 256; i++) {
+        crc = (unsigned int)i;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320U : crc >> 1;
+        }
+        _pysqlite_crc32_table[i] = crc;
+    }
+    _pysqlite_crc32_ready = 1;
+}
+
+static void _pysqlite_crc32(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    const unsigned char* data;
+    unsigned int crc = 0xffffffffU;
+    int size;
+    int i;
+
+    if (_pysqlite_has_null(argc, argv)) {
+        return;
+    }
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_BLOB) {
+        data = sqlite3_value_blob(argv[0]);
+    } else {
+        data = sqlite3_value_text(argv[0]);
+    }
+    size = sqlite3_value_bytes(argv[0]);
+    if (!data && size > 0) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    for (i = 0; i < size; i++) {
+        crc = _pysqlite_crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    sqlite3_result_int64(context, (sqlite3_int64)(crc ^ 0xffffffffU));
+}
+
+/* ------------------------------------------------------------------------
+ * dates
+ *
+ * Dates are texts that start with YYYY-MM-DD, as produced by the date()
+ * and datetime() SQL functions. Whatever follows the date, like a time of
+ * day, is kept as it is.
+ */
+
+typedef struct
+{
+    int year;
+    int month;
+    int day;
+    const char* rest;
+} pysqlite_Date;
+
+static int _pysqlite_days_in_month(int year, int month)
+{
+    static const int days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+    if (month == 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)) {
+        return 29;
+    }
+
+    return days[month - 1];
+}
+
+static int _pysqlite_parse_date(sqlite3_value* value, pysqlite_Date* date)
+{
+    const char* text;
+    int i;
+
+    text = (const char*)sqlite3_value_text(value);
+    if (!text || sqlite3_value_bytes(value) < 10) {
+        return 0;
+    }
+
+    for (i = 0; i < 10; i++) {
+        if ((i == 4 || i == 7) ? text[i] != '-' : (text[i] < '0' || text[i] > '9')) {
+            return 0;
+        }
+    }
+
+    date->year = atoi(text);
+    date->month = atoi(text + 5);
+    date->day = atoi(text + 8);
+    date->rest = text + 10;
+
+    return date->month >= 1 && date->month <= 12 && date->day >= 1
+        && date->day <= _pysqlite_days_in_month(date->year, date->month);
+}
+
+/* days since 0000-03-01 of the proleptic Gregorian calendar */
+static sqlite3_int64 _pysqlite_date_to_days(int year, int month, int day)
+{
+    sqlite3_int64 shifted_year = month <= 2 ? year - 1 : year;
+    sqlite3_int64 era = (shifted_year >= 0 ? shifted_year : shifted_year - 399) / 400;
+    sqlite3_int64 year_of_era = shifted_year - era * 400;
+    sqlite3_int64 day_of_year = (153 * (month <= 2 ? month + 9 : month - 3) + 2) / 5 + day - 1;
+
+    return era * 146097 + year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+}
+
+static void _pysqlite_days_to_date(sqlite3_int64 days, pysqlite_Date* date)
+{
+    sqlite3_int64 era = (days >= 0 ? days : days - 146096) / 146097;
+    sqlite3_int64 day_of_era = days - era * 146097;
+    sqlite3_int64 year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    sqlite3_int64 day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int shifted_month = (int)((5 * day_of_year + 2) / 153);
+
+    date->day = (int)(day_of_year - (153 * shifted_month + 2) / 5 + 1);
+    date->month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+    date->year = (int)(year_of_era + era * 400 + (date->month <= 2));
+}
+
+static void _pysqlite_result_date(sqlite3_context* context, pysqlite_Date* date)
+{
+    if (date->year < 0 || date->year > 9999) {
+        return;
+    }
+
+    _pysqlite_result_text(context, sqlite3_mprintf("%04d-%02d-%02d%s", date->year, date->month, date->day, date->rest), -1);
+}
+
+/* add_days(date, n) */
+static void _pysqlite_add_days(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    pysqlite_Date date;
+    sqlite3_int64 days;
+
+    if (_pysqlite_has_null(argc, argv) || !_pysqlite_parse_date(argv[0], &date)) {
+        return;
+    }
+
+    days = sqlite3_value_int64(argv[1]);
+    if (days < -3660000 || days > 3660000) {
+        return;
+    }
+
+    _pysqlite_days_to_date(_pysqlite_date_to_days(date.year, date.month, date.day) + days, &date);
+    _pysqlite_result_date(context, &date);
+}
+
+/* add_months(date, n) keeps the day of the month, or moves it back to the end
+ * of a shorter month: add_months('2011-01-31', 1) is '2011-02-28' */
+static void _pysqlite_add_months(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    pysqlite_Date date;
+    sqlite3_int64 months;
+    int last_day;
+
+    if (_pysqlite_has_null(argc, argv) || !_pysqlite_parse_date(argv[0], &date)) {
+        return;
+    }
+
+    months = sqlite3_value_int64(argv[1]);
+    if (months < -120000 || months > 120000) {
+        return;
+    }
+
+    months += (sqlite3_int64)date.year * 12 + date.month - 1;
+    if (months < 0) {
+        return;
+    }
+    date.year = (int)(months / 12);
+    date.month = (int)(months % 12) + 1;
+    last_day = _pysqlite_days_in_month(date.year, date.month);
+    if (date.day > last_day) {
+        date.day = last_day;
+    }
+
+    _pysqlite_result_date(context, &date);
+}
+
+/* days_between(start, end) is the number of days from start to end */
+static void _pysqlite_days_between(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+    pysqlite_Date start;
+    pysqlite_Date end;
+
+    if (_pysqlite_has_null(argc, argv) || !_pysqlite_parse_date(argv[0], &start) || !_pysqlite_parse_date(argv[1], &end)) {
+        return;
+    }
+
+    sqlite3_result_int64(context, _pysqlite_date_to_days(end.year, end.month, end.day)
+                                  - _pysqlite_date_to_days(start.year, start.month, start.day));
+}
+
+/* ------------------------------------------------------------------------ */
+
+typedef struct
+{
+    const char* name;
+    int n_arg;
+    void (*function)(sqlite3_context*, int, sqlite3_value**);
+} pysqlite_NativeFunction;
+
+static pysqlite_NativeFunction native_functions[] = {
+    {"sqrt", 1, _pysqlite_sqrt},
+    {"exp", 1, _pysqlite_exp},
+    {"ln", 1, _pysqlite_ln},
+    {"log10", 1, _pysqlite_log10},
+    {"power", 2, _pysqlite_power},
+    {"pi", 0, _pysqlite_pi},
+    {"floor", 1, _pysqlite_floor},
+    {"ceil", 1, _pysqlite_ceil},
+    {"sign", 1, _pysqlite_sign},
+    {"lpad", 2, _pysqlite_lpad},
+    {"lpad", 3, _pysqlite_lpad},
+    {"rpad", 2, _pysqlite_rpad},
+    {"rpad", 3, _pysqlite_rpad},
+    {"split_part", 3, _pysqlite_split_part},
+    {"reverse", 1, _pysqlite_reverse},
+#ifndef MS_WINDOWS
+    {"regexp", 2, _pysqlite_regexp},
+#endif
+    {"md5", 1, _pysqlite_md5},
+    {"sha1", 1, _pysqlite_sha1},
+    {"crc32", 1, _pysqlite_crc32},
+    {"add_days", 2, _pysqlite_add_days},
+    {"add_months", 2, _pysqlite_add_months},
+    {"days_between", 2, _pysqlite_days_between},
+    {NULL, 0, NULL}
+};
+
+PyObject* pysqlite_connection_enable_native_functions(pysqlite_Connection* self, PyObject* args)
+{
+    pysqlite_NativeFunction* function;
+    int flags = SQLITE_UTF8;
+    int rc;
+
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
+    }
+
+    if (!_pysqlite_crc32_ready) {
+        _pysqlite_crc32_setup();
+    }
+
+#if SQLITE_VERSION_NUMBER >= 3008003
+    flags |= SQLITE_DETERMINISTIC;
+#endif
+
+    pysqlite_connection_lock(self);
+    for (function = native_functions; function->name; function++) {
+        rc = sqlite3_create_function(self->db, function->name, function->n_arg, flags, NULL, function->function, NULL, NULL);
+        if (rc != SQLITE_OK) {
+            pysqlite_connection_unlock(self);
+            PyErr_SetString(pysqlite_OperationalError, "Error creating function");
+            return NULL;
+        }
+    }
+    pysqlite_connection_unlock(self);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
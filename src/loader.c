@@ -0,0 +1,606 @@
+/* loader.c - the parallel bulk loader
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "module.h"
+#include "loader.h"
+#include "shard.h"
+#include "util.h"
+#include "sqlitecompat.h"
+
+/*
+ * Connection.bulk_load() converts the rows to pysqlite_ShardValues in the
+ * calling thread, in chunks of chunk_size rows. The chunks are handed round
+ * robin to the workers. Each worker inserts its chunks into its own
+ * temporary database without holding the GIL. In the end, the temporary
+ * databases are attached to the connection and copied into the target table
+ * in one transaction.
+ */
+
+typedef struct
+{
+    int nrows;
+    pysqlite_ShardValue* values;
+} loader_chunk;
+
+typedef struct _loader_state loader_state;
+
+typedef struct
+{
+    loader_state* owner;
+    char* path;
+
+    /* a one-chunk mailbox: the calling thread fills slot while holding free
+     * and then releases ready; the worker takes the chunk while holding
+     * ready and then releases free. A NULL chunk tells the worker to stop. */
+    PyThread_type_lock ready;
+    PyThread_type_lock free;
+    loader_chunk* slot;
+
+    /* SQLITE_OK, or the error that stopped the worker, and its message */
+    int rc;
+    char* errmsg;
+} loader_worker;
+
+struct _loader_state
+{
+    int ncols;
+    char* create_sql;
+    char* insert_sql;
+
+    loader_worker* workers;
+    int count;
+
+    /* guards running; done is released by the last worker to exit */
+    PyThread_type_lock lock;
+    PyThread_type_lock done;
+    int running;
+};
+
+static void loader_chunk_free(loader_chunk* chunk, int ncols)
+{
+    int i;
+
+    for (i = 0; i < chunk->nrows * ncols; i++) {
+        pysqlite_shard_value_clear(&chunk->values[i]);
+    }
+    sqlite3_free(chunk->values);
+    sqlite3_free(chunk);
+}
+
+/* Inserts the rows of a chunk. Returns an SQLite error code. */
+static int loader_insert(loader_state* self, sqlite3_stmt* st, loader_chunk* chunk)
+{
+    int rc = SQLITE_OK;
+    int i;
+
+    for (i = 0; i < chunk->nrows && rc == SQLITE_OK; i++) {
+        rc = pysqlite_shard_bind(st, chunk->values + i * self->ncols, self->ncols);
+        if (rc == SQLITE_OK) {
+            /* with sqlite3_prepare, reset tells us what went wrong */
+            (void)sqlite3_step(st);
+            rc = sqlite3_reset(st);
+        }
+    }
+
+    return rc;
+}
+
+static void loader_worker_main(void* arg)
+{
+    loader_worker* worker = (loader_worker*)arg;
+    loader_state* self = worker->owner;
+    sqlite3* db = NULL;
+    sqlite3_stmt* st = NULL;
+    loader_chunk* chunk;
+    int last;
+    int rc;
+
+    rc = sqlite3_open(worker->path, &db);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(db, self->create_sql, NULL, NULL, NULL);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare(db, self->insert_sql, -1, &st, NULL);
+    }
+
+    while (1) {
+        PyThread_acquire_lock(worker->ready, WAIT_LOCK);
+        chunk = worker->slot;
+        worker->slot = NULL;
+        PyThread_release_lock(worker->free);
+
+        if (!chunk) {
+            break;
+        }
+
+        /* after an error, chunks are only freed, so that the calling thread
+         * doesn't wait for us forever */
+        if (rc == SQLITE_OK) {
+            rc = loader_insert(self, st, chunk);
+        }
+        loader_chunk_free(chunk, self->ncols);
+    }
+
+    if (st) {
+        (void)sqlite3_finalize(st);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    }
+    if (rc != SQLITE_OK) {
+        worker->errmsg = sqlite3_mprintf("%s", db ? sqlite3_errmsg(db) : "out of memory");
+    }
+    worker->rc = rc;
+    (void)sqlite3_close(db);
+
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    last = (--self->running == 0);
+    PyThread_release_lock(self->lock);
+
+    if (last) {
+        PyThread_release_lock(self->done);
+    }
+}
+
+/* Waits for the mailbox of a worker to be empty, then puts a chunk into it. */
+static void loader_dispatch(loader_worker* worker, loader_chunk* chunk)
+{
+    if (!PyThread_acquire_lock(worker->free, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(worker->free, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+    worker->slot = chunk;
+    PyThread_release_lock(worker->ready);
+}
+
+static loader_chunk* loader_chunk_new(int chunk_size, int ncols)
+{
+    loader_chunk* chunk;
+
+    chunk = sqlite3_malloc(sizeof(loader_chunk));
+    if (!chunk) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    chunk->nrows = 0;
+    chunk->values = sqlite3_malloc(chunk_size * ncols * sizeof(pysqlite_ShardValue));
+    if (!chunk->values) {
+        sqlite3_free(chunk);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    return chunk;
+}
+
+/* Converts a row into the next free row of a chunk. Returns 0 or -1. */
+static int loader_add_row(loader_chunk* chunk, PyObject* row, int ncols)
+{
+    pysqlite_ShardValue* values = chunk->values + chunk->nrows * ncols;
+    PyObject* seq;
+    int i;
+
+    seq = PySequence_Fast(row, "rows must be sequences");
+    if (!seq) {
+        return -1;
+    }
+    if (PySequence_Fast_GET_SIZE(seq) != ncols) {
+        Py_DECREF(seq);
+        PyErr_Format(pysqlite_ProgrammingError, "Incorrect number of values in row, expected %d.", ncols);
+        return -1;
+    }
+
+    for (i = 0; i < ncols; i++) {
+        if (pysqlite_shard_value_from_object(&values[i], PySequence_Fast_GET_ITEM(seq, i), i) != 0) {
+            while (--i >= 0) {
+                pysqlite_shard_value_clear(&values[i]);
+            }
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+    Py_DECREF(seq);
+
+    chunk->nrows++;
+    return 0;
+}
+
+/* Builds "c0, c1, ..." or the list of quoted target column names. */
+static char* loader_column_list(PyObject* columns, int ncols)
+{
+    PyObject* name;
+    char* list;
+    char* next;
+    int i;
+
+    list = sqlite3_mprintf("");
+    for (i = 0; list && i < ncols; i++) {
+        if (columns) {
+            name = PySequence_Fast_GET_ITEM(columns, i);
+            if (PyUnicode_Check(name)) {
+                name = PyUnicode_AsUTF8String(name);
+            } else if (PyString_Check(name)) {
+                Py_INCREF(name);
+            } else {
+                PyErr_SetString(PyExc_TypeError, "column names must be strings");
+                name = NULL;
+            }
+            if (!name) {
+                sqlite3_free(list);
+                return NULL;
+            }
+            next = sqlite3_mprintf("%s%s\"%w\"", list, i ? ", " : "", PyString_AsString(name));
+            Py_DECREF(name);
+        } else {
+            next = sqlite3_mprintf("%s%sc%d", list, i ? ", " : "", i);
+        }
+        sqlite3_free(list);
+        list = next;
+    }
+
+    if (!list) {
+        PyErr_NoMemory();
+    }
+    return list;
+}
+
+/* Runs SQL on the connection without the GIL; sets an exception on error. */
+static int loader_exec(pysqlite_Connection* connection, const char* sql)
+{
+    int rc;
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = sqlite3_exec(connection->db, sql, NULL, NULL, NULL);
+    Py_END_ALLOW_THREADS
+
+    if (rc != SQLITE_OK) {
+        _pysqlite_seterror(connection->db, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+/* Copies the partitions into the target table in a single transaction. */
+static int loader_merge(pysqlite_Connection* connection, loader_state* self, const char* table, const char* target_columns)
+{
+    PyObject* ret;
+    char* sql;
+    int attached = 0;
+    int rc = 0;
+    int i;
+
+    /* ATTACH doesn't work within a transaction */
+    ret = pysqlite_connection_commit(connection, NULL);
+    if (!ret) {
+        return -1;
+    }
+    Py_DECREF(ret);
+
+    for (i = 0; i < self->count && rc == 0; i++) {
+        sql = sqlite3_mprintf("ATTACH %Q AS \"pysqlite_bulk%d\"", self->workers[i].path, i);
+        rc = sql ? loader_exec(connection, sql) : -1;
+        sqlite3_free(sql);
+        if (rc == 0) {
+            attached++;
+        }
+    }
+
+    if (rc == 0) {
+        rc = loader_exec(connection, "BEGIN");
+        for (i = 0; i < self->count && rc == 0; i++) {
+            if (target_columns) {
+                sql = sqlite3_mprintf("INSERT INTO main.\"%w\" (%s) SELECT * FROM \"pysqlite_bulk%d\".part",
+                                      table, target_columns, i);
+            } else {
+                sql = sqlite3_mprintf("INSERT INTO main.\"%w\" SELECT * FROM \"pysqlite_bulk%d\".part", table, i);
+            }
+            rc = sql ? loader_exec(connection, sql) : -1;
+            sqlite3_free(sql);
+        }
+        if (rc == 0) {
+            rc = loader_exec(connection, "COMMIT");
+        }
+        if (rc != 0 && !sqlite3_get_autocommit(connection->db)) {
+            (void)sqlite3_exec(connection->db, "ROLLBACK", NULL, NULL, NULL);
+        }
+    }
+
+    for (i = 0; i < attached; i++) {
+        sql = sqlite3_mprintf("DETACH \"pysqlite_bulk%d\"", i);
+        if (sql) {
+            (void)sqlite3_exec(connection->db, sql, NULL, NULL, NULL);
+            sqlite3_free(sql);
+        }
+    }
+
+    if (rc != 0 && !PyErr_Occurred()) {
+        PyErr_NoMemory();
+    }
+    return rc;
+}
+
+PyObject* pysqlite_connection_bulk_load(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"table", "rows", "columns", "workers", "chunk_size", NULL};
+
+    char* table;
+    PyObject* rows;
+    PyObject* columns = Py_None;
+    int workers = 4;
+    int chunk_size = 1000;
+    PyObject* iter = NULL;
+    PyObject* row = NULL;
+    PyObject* tempdir = NULL;
+    PyObject* ret;
+    char* columns_sql = NULL;
+    char* target_columns = NULL;
+    char* params_sql = NULL;
+    char* sql;
+    PyObject* exc_type, *exc_value, *exc_tb;
+    PyObject* module;
+    loader_chunk* chunk = NULL;
+    loader_worker* worker;
+    loader_state loader;
+    long total = 0;
+    int allocated = 0;
+    int started = 0;
+    int next = 0;
+    int limit;
+    int i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sO|Oii:bulk_load", kwlist,
+                                     &table, &rows, &columns, &workers, &chunk_size)) {
+        return NULL;
+    }
+
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
+    }
+
+    if (workers < 1 || chunk_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "workers and chunk_size must be positive");
+        return NULL;
+    }
+
+    /* the partitions are all attached at once for the final copy */
+    limit = sqlite3_limit(self->db, SQLITE_LIMIT_ATTACHED, -1);
+    if (workers > limit) {
+        workers = limit;
+    }
+
+    memset(&loader, 0, sizeof(loader));
+
+    iter = PyObject_GetIter(rows);
+    if (!iter) {
+        return NULL;
+    }
+
+    row = PyIter_Next(iter);
+    if (!row) {
+        Py_DECREF(iter);
+        return PyErr_Occurred() ? NULL : PyInt_FromLong(0);
+    }
+
+    if (columns != Py_None) {
+        columns = PySequence_Fast(columns, "columns must be a sequence");
+        if (!columns) {
+            goto error;
+        }
+        loader.ncols = (int)PySequence_Fast_GET_SIZE(columns);
+    } else {
+        columns = NULL;
+        loader.ncols = (int)PySequence_Size(row);
+        if (loader.ncols < 0) {
+            goto error;
+        }
+    }
+    if (loader.ncols < 1 || chunk_size > INT_MAX / loader.ncols / (int)sizeof(pysqlite_ShardValue)) {
+        PyErr_SetString(pysqlite_ProgrammingError, "invalid number of columns");
+        goto error;
+    }
+
+    /* without column names, the rows fill all columns of the table */
+    columns_sql = loader_column_list(NULL, loader.ncols);
+    if (!columns_sql) {
+        goto error;
+    }
+    if (columns) {
+        target_columns = loader_column_list(columns, loader.ncols);
+        if (!target_columns) {
+            goto error;
+        }
+    }
+
+    params_sql = sqlite3_mprintf("?");
+    for (i = 1; params_sql && i < loader.ncols; i++) {
+        sql = sqlite3_mprintf("%s, ?", params_sql);
+        sqlite3_free(params_sql);
+        params_sql = sql;
+    }
+    loader.create_sql = sqlite3_mprintf("PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF; "
+                                        "CREATE TABLE part(%s); BEGIN", columns_sql);
+    loader.insert_sql = sqlite3_mprintf("INSERT INTO part VALUES (%s)", params_sql);
+    if (!params_sql || !loader.create_sql || !loader.insert_sql) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    module = PyImport_ImportModule("tempfile");
+    if (!module) {
+        goto error;
+    }
+    tempdir = PyObject_CallMethod(module, "mkdtemp", "s", "pysqlite-bulk");
+    Py_DECREF(module);
+    if (!tempdir) {
+        goto error;
+    }
+
+    loader.lock = PyThread_allocate_lock();
+    loader.done = PyThread_allocate_lock();
+    loader.workers = PyMem_Malloc(workers * sizeof(loader_worker));
+    if (!loader.lock || !loader.done || !loader.workers) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    PyThread_acquire_lock(loader.done, NOWAIT_LOCK);
+    memset(loader.workers, 0, workers * sizeof(loader_worker));
+
+    for (i = 0; i < workers; i++) {
+        worker = &loader.workers[i];
+        worker->owner = &loader;
+        worker->path = sqlite3_mprintf("%s/part%d.db", PyString_AsString(tempdir), i);
+        worker->ready = PyThread_allocate_lock();
+        worker->free = PyThread_allocate_lock();
+        allocated = i + 1;
+        if (!worker->path || !worker->ready || !worker->free) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        PyThread_acquire_lock(worker->ready, NOWAIT_LOCK);
+    }
+    loader.count = workers;
+
+    PyEval_InitThreads();
+
+    loader.running = workers;
+    for (started = 0; started < workers; started++) {
+        if (PyThread_start_new_thread(loader_worker_main, (void*)&loader.workers[started]) == -1) {
+            break;
+        }
+    }
+    if (started < workers) {
+        PyThread_acquire_lock(loader.lock, WAIT_LOCK);
+        loader.running -= workers - started;
+        PyThread_release_lock(loader.lock);
+        if (started == 0) {
+            PyErr_SetString(pysqlite_OperationalError, "cannot start worker thread");
+            goto error;
+        }
+        /* only the partitions of the started workers are merged */
+        loader.count = started;
+    }
+
+    while (row) {
+        if (!chunk) {
+            chunk = loader_chunk_new(chunk_size, loader.ncols);
+            if (!chunk) {
+                break;
+            }
+        }
+        if (loader_add_row(chunk, row, loader.ncols) != 0) {
+            break;
+        }
+        Py_CLEAR(row);
+        total++;
+
+        if (chunk->nrows == chunk_size) {
+            loader_dispatch(&loader.workers[next++ % started], chunk);
+            chunk = NULL;
+        }
+
+        row = PyIter_Next(iter);
+    }
+
+    if (chunk && !PyErr_Occurred() && chunk->nrows > 0) {
+        loader_dispatch(&loader.workers[next++ % started], chunk);
+        chunk = NULL;
+    }
+
+error:
+    if (started > 0) {
+        /* stop the workers and wait until all of them are done */
+        for (i = 0; i < started; i++) {
+            loader_dispatch(&loader.workers[i], NULL);
+        }
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(loader.done, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+
+        for (i = 0; i < started && !PyErr_Occurred(); i++) {
+            if (loader.workers[i].rc != SQLITE_OK) {
+                PyErr_Format(pysqlite_OperationalError, "bulk load failed: %s", loader.workers[i].errmsg);
+            }
+        }
+
+        if (!PyErr_Occurred()) {
+            pysqlite_connection_lock(self);
+            (void)loader_merge(self, &loader, table, target_columns);
+            pysqlite_connection_unlock(self);
+        }
+    }
+
+    if (chunk) {
+        loader_chunk_free(chunk, loader.ncols);
+    }
+    if (loader.workers) {
+        for (i = 0; i < allocated; i++) {
+            worker = &loader.workers[i];
+            if (worker->path) {
+                (void)remove(worker->path);
+            }
+            sqlite3_free(worker->path);
+            sqlite3_free(worker->errmsg);
+            if (worker->ready) {
+                PyThread_free_lock(worker->ready);
+            }
+            if (worker->free) {
+                PyThread_free_lock(worker->free);
+            }
+        }
+        PyMem_Free(loader.workers);
+    }
+    if (loader.lock) {
+        PyThread_free_lock(loader.lock);
+    }
+    if (loader.done) {
+        PyThread_free_lock(loader.done);
+    }
+    if (tempdir) {
+        /* cleaning up must not hide the original error */
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        module = PyImport_ImportModule("os");
+        if (module) {
+            ret = PyObject_CallMethod(module, "rmdir", "O", tempdir);
+            Py_XDECREF(ret);
+            Py_DECREF(module);
+        }
+        PyErr_Clear();
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+    }
+
+    sqlite3_free(loader.create_sql);
+    sqlite3_free(loader.insert_sql);
+    sqlite3_free(columns_sql);
+    sqlite3_free(target_columns);
+    sqlite3_free(params_sql);
+    Py_XDECREF(tempdir);
+    Py_XDECREF(columns);
+    Py_XDECREF(row);
+    Py_XDECREF(iter);
+
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    return PyInt_FromLong(total);
+}
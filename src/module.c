@@ -28,6 +28,14 @@
 #include "prepare_protocol.h"
 #include "microprotocols.h"
 #include "row.h"
+#include "savepoint.h"
+#include "pool.h"
+#include "router.h"
+#include "async.h"
+#include "shard.h"
+#include "checkpoint.h"
+#include "context.h"
+#include "capi.h"
 
 #ifdef PYSQLITE_EXPERIMENTAL
 #include "backup.h"
@@ -54,19 +62,21 @@ static PyObject* module_connect(PyObject* self, PyObject* args, PyObject*
      * C-level, so this code is redundant with the one in connection_init in
      * connection.c and must always be copied from there ... */
 
-    static char *kwlist[] = {"database", "timeout", "detect_types", "isolation_level", "check_same_thread", "factory", "cached_statements", NULL, NULL};
+    static char *kwlist[] = {"database", "timeout", "detect_types", "isolation_level", "check_same_thread", "factory", "cached_statements", "cached_statements_bytes", "serialized", NULL, NULL};
     PyObject* database;
     int detect_types = 0;
     PyObject* isolation_level;
     PyObject* factory = NULL;
     int check_same_thread = 1;
+    int serialized;
     int cached_statements;
+    Py_ssize_t cached_statements_bytes;
     double timeout = 5.0;
 
     PyObject* result;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|diOiOi", kwlist,
-                                     &database, &timeout, &detect_types, &isolation_level, &check_same_thread, &factory, &cached_statements))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|diOiOini", kwlist,
+                                     &database, &timeout, &detect_types, &isolation_level, &check_same_thread, &factory, &cached_statements, &cached_statements_bytes, &serialized))
     {
         return NULL; 
     }
@@ -301,6 +311,12 @@ static IntConstantPair _int_constants[] = {
 #if SQLITE_VERSION_NUMBER >= 3003000
     {"SQLITE_ANALYZE", SQLITE_ANALYZE},
 #endif
+    {"SQLITE_INDEX_CONSTRAINT_EQ", SQLITE_INDEX_CONSTRAINT_EQ},
+    {"SQLITE_INDEX_CONSTRAINT_GT", SQLITE_INDEX_CONSTRAINT_GT},
+    {"SQLITE_INDEX_CONSTRAINT_LE", SQLITE_INDEX_CONSTRAINT_LE},
+    {"SQLITE_INDEX_CONSTRAINT_LT", SQLITE_INDEX_CONSTRAINT_LT},
+    {"SQLITE_INDEX_CONSTRAINT_GE", SQLITE_INDEX_CONSTRAINT_GE},
+    {"SQLITE_INDEX_CONSTRAINT_MATCH", SQLITE_INDEX_CONSTRAINT_MATCH},
     {(char*)NULL, 0}
 };
 
@@ -318,6 +334,13 @@ PyMODINIT_FUNC init_sqlite(void)
         (pysqlite_connection_setup_types() < 0) ||
         (pysqlite_cache_setup_types() < 0) ||
         (pysqlite_statement_setup_types() < 0) ||
+        (pysqlite_savepoint_setup_types() < 0) ||
+        (pysqlite_pool_setup_types() < 0) ||
+        (pysqlite_router_setup_types() < 0) ||
+        (pysqlite_async_setup_types() < 0) ||
+        (pysqlite_shard_setup_types() < 0) ||
+        (pysqlite_checkpoint_setup_types() < 0) ||
+        (pysqlite_function_context_setup_types() < 0) ||
         #ifdef PYSQLITE_EXPERIMENTAL
         (pysqlite_backup_setup_types() < 0) ||
         #endif
@@ -338,6 +361,24 @@ PyMODINIT_FUNC init_sqlite(void)
     PyModule_AddObject(module, "PrepareProtocol", (PyObject*) &pysqlite_PrepareProtocolType);
     Py_INCREF(&pysqlite_RowType);
     PyModule_AddObject(module, "Row", (PyObject*) &pysqlite_RowType);
+    Py_INCREF(&pysqlite_SavepointType);
+    PyModule_AddObject(module, "Savepoint", (PyObject*) &pysqlite_SavepointType);
+    Py_INCREF(&pysqlite_ConnectionPoolType);
+    PyModule_AddObject(module, "ConnectionPool", (PyObject*) &pysqlite_ConnectionPoolType);
+    Py_INCREF(&pysqlite_ConnectionRouterType);
+    PyModule_AddObject(module, "ConnectionRouter", (PyObject*) &pysqlite_ConnectionRouterType);
+    Py_INCREF(&pysqlite_AsyncConnectionType);
+    PyModule_AddObject(module, "AsyncConnection", (PyObject*) &pysqlite_AsyncConnectionType);
+    Py_INCREF(&pysqlite_ShardSetType);
+    PyModule_AddObject(module, "ShardSet", (PyObject*) &pysqlite_ShardSetType);
+    Py_INCREF(&pysqlite_ShardResultType);
+    PyModule_AddObject(module, "ShardResult", (PyObject*) &pysqlite_ShardResultType);
+    Py_INCREF(&pysqlite_WALCheckpointerType);
+    PyModule_AddObject(module, "WALCheckpointer", (PyObject*) &pysqlite_WALCheckpointerType);
+    Py_INCREF(&pysqlite_FunctionContextType);
+    PyModule_AddObject(module, "FunctionContext", (PyObject*) &pysqlite_FunctionContextType);
+    Py_INCREF(&pysqlite_AsyncResultType);
+    PyModule_AddObject(module, "AsyncResult", (PyObject*) &pysqlite_AsyncResultType);
 
     if (!(dict = PyModule_GetDict(module))) {
         goto error;
@@ -429,6 +470,13 @@ PyMODINIT_FUNC init_sqlite(void)
     PyDict_SetItemString(dict, "sqlite_version", tmp_obj);
     Py_DECREF(tmp_obj);
 
+    /* the C API for other extension modules, see capi.h */
+    if (!(tmp_obj = pysqlite_capi_new())) {
+        goto error;
+    }
+    PyDict_SetItemString(dict, "capi", tmp_obj);
+    Py_DECREF(tmp_obj);
+
     /* initialize microprotocols layer */
     pysqlite_microprotocols_init(dict);
 
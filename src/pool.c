@@ -0,0 +1,541 @@
+/* pool.c - the connection pool type
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "module.h"
+#include "pool.h"
+#include "util.h"
+#include "sqlitecompat.h"
+
+#include <time.h>
+
+/* the longest we sleep at once while waiting for a connection to be returned */
+#define POOL_MAX_DELAY 0.05
+
+static double pool_now(void)
+{
+    return (double)time(NULL);
+}
+
+/* Closes a pooled connection from whatever thread we are running in. Errors
+ * are ignored, the connection is discarded anyway. */
+static void pool_discard(pysqlite_Connection* connection)
+{
+    PyObject* ret;
+
+    if (!connection->db) {
+        return;
+    }
+
+    connection->thread_ident = PyThread_get_thread_ident();
+    ret = pysqlite_connection_close(connection, NULL);
+    if (ret) {
+        Py_DECREF(ret);
+    } else {
+        PyErr_Clear();
+    }
+}
+
+/* Closes the connections that have been idle for longer than max_idle. */
+static void pool_expire(pysqlite_ConnectionPool* self)
+{
+    PyObject* item;
+    double cutoff;
+
+    if (self->max_idle <= 0.0) {
+        return;
+    }
+
+    cutoff = pool_now() - self->max_idle;
+    while (PyList_GET_SIZE(self->idle) > 0) {
+        item = PyList_GET_ITEM(self->idle, 0);
+        if (PyFloat_AS_DOUBLE(PyTuple_GET_ITEM(item, 0)) > cutoff) {
+            break;
+        }
+
+        /* closing releases the GIL, so take the entry off the list first */
+        Py_INCREF(item);
+        if (PySequence_DelItem(self->idle, 0) != 0) {
+            Py_DECREF(item);
+            PyErr_Clear();
+            break;
+        }
+        pool_discard((pysqlite_Connection*)PyTuple_GET_ITEM(item, 1));
+        Py_DECREF(item);
+    }
+}
+
+/* Checks that an idle connection can still run a statement. Releases the
+ * GIL. */
+static int pool_check(pysqlite_Connection* connection)
+{
+    sqlite3_stmt* st;
+    int rc;
+
+    /* somebody may have closed it behind our back */
+    if (!connection->db || !connection->initialized) {
+        return 0;
+    }
+
+    /* a connection that failed to roll back is never put back, so an open
+     * transaction means something went wrong */
+    if (!sqlite3_get_autocommit(connection->db)) {
+        return 0;
+    }
+
+    /* reads the database header, so a database that can't be read fails */
+    Py_BEGIN_ALLOW_THREADS
+    rc = sqlite3_prepare(connection->db, "pragma schema_version", -1, &st, NULL);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_step(st);
+        (void)sqlite3_finalize(st);
+    }
+    Py_END_ALLOW_THREADS
+
+    return rc == SQLITE_ROW;
+}
+
+/*
+ * Takes a connection that passes pool_check() from the idle list; the others
+ * are closed. The connection the current thread used last is preferred, as
+ * its statement cache is likely to hold what the thread needs; otherwise the
+ * most recently released one is used.
+ *
+ * Returns a new reference, or NULL without an exception set if there is no
+ * idle connection.
+ */
+static pysqlite_Connection* pool_take_idle(pysqlite_ConnectionPool* self)
+{
+    pysqlite_Connection* connection;
+    long thread_ident = PyThread_get_thread_ident();
+    Py_ssize_t i;
+    Py_ssize_t pos;
+    int healthy;
+
+    while (PyList_GET_SIZE(self->idle) > 0) {
+        pos = PyList_GET_SIZE(self->idle) - 1;
+        for (i = pos; i >= 0; i--) {
+            connection = (pysqlite_Connection*)PyTuple_GET_ITEM(PyList_GET_ITEM(self->idle, i), 1);
+            if (connection->thread_ident == thread_ident) {
+                pos = i;
+                break;
+            }
+        }
+
+        connection = (pysqlite_Connection*)PyTuple_GET_ITEM(PyList_GET_ITEM(self->idle, pos), 1);
+        Py_INCREF(connection);
+        if (PySequence_DelItem(self->idle, pos) != 0) {
+            Py_DECREF(connection);
+            return NULL;
+        }
+
+        self->pending++;
+        healthy = pool_check(connection);
+        if (!healthy) {
+            pool_discard(connection);
+        }
+        self->pending--;
+
+        if (healthy) {
+            return connection;
+        }
+        Py_DECREF(connection);
+    }
+
+    return NULL;
+}
+
+static pysqlite_Connection* pool_open(pysqlite_ConnectionPool* self)
+{
+    PyObject* factory;
+    PyObject* connection;
+
+    factory = PyDict_GetItemString(self->connect_kwargs, "factory");
+    if (!factory) {
+        factory = (PyObject*)&pysqlite_ConnectionType;
+    }
+
+    connection = PyObject_Call(factory, self->connect_args, self->connect_kwargs);
+    if (connection && !PyObject_TypeCheck(connection, &pysqlite_ConnectionType)) {
+        Py_DECREF(connection);
+        PyErr_SetString(PyExc_TypeError, "factory must return a Connection");
+        return NULL;
+    }
+
+    return (pysqlite_Connection*)connection;
+}
+
+/* Puts a connection back onto the idle list. Steals the reference. */
+static int pool_put_idle(pysqlite_ConnectionPool* self, pysqlite_Connection* connection)
+{
+    PyObject* item;
+    int rc;
+
+    item = Py_BuildValue("(dN)", pool_now(), connection);
+    if (!item) {
+        return -1;
+    }
+    rc = PyList_Append(self->idle, item);
+    Py_DECREF(item);
+
+    return rc;
+}
+
+static int pysqlite_pool_init(pysqlite_ConnectionPool* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* database;
+    PyObject* item;
+    pysqlite_Connection* connection;
+
+    if (!PyArg_ParseTuple(args, "O", &database)) {
+        return -1;
+    }
+
+    Py_XDECREF(self->connect_kwargs);
+    self->connect_kwargs = kwargs ? PyDict_Copy(kwargs) : PyDict_New();
+    if (!self->connect_kwargs) {
+        return -1;
+    }
+
+    self->size = 5;
+    item = PyDict_GetItemString(self->connect_kwargs, "size");
+    if (item) {
+        self->size = (int)PyInt_AsLong(item);
+        if (PyErr_Occurred() || PyDict_DelItemString(self->connect_kwargs, "size") != 0) {
+            return -1;
+        }
+    }
+    if (self->size < 1) {
+        PyErr_SetString(PyExc_ValueError, "size must be at least 1");
+        return -1;
+    }
+
+    self->max_idle = 0.0;
+    item = PyDict_GetItemString(self->connect_kwargs, "max_idle");
+    if (item) {
+        self->max_idle = PyFloat_AsDouble(item);
+        if (PyErr_Occurred() || PyDict_DelItemString(self->connect_kwargs, "max_idle") != 0) {
+            return -1;
+        }
+    }
+
+    Py_INCREF(args);
+    Py_XDECREF(self->connect_args);
+    self->connect_args = args;
+
+    Py_XDECREF(self->idle);
+    Py_XDECREF(self->busy);
+    self->idle = PyList_New(0);
+    self->busy = PyList_New(0);
+    if (!self->idle || !self->busy) {
+        return -1;
+    }
+    self->closed = 0;
+    self->pending = 0;
+
+    /* open the first connection right away, so that bad arguments are
+     * reported here and not on the first acquire() */
+    connection = pool_open(self);
+    if (!connection) {
+        return -1;
+    }
+
+    return pool_put_idle(self, connection);
+}
+
+static void pysqlite_pool_dealloc(pysqlite_ConnectionPool* self)
+{
+    Py_XDECREF(self->connect_args);
+    Py_XDECREF(self->connect_kwargs);
+    Py_XDECREF(self->idle);
+    Py_XDECREF(self->busy);
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/*
+ * Checks if a pool object is usable.
+ *
+ * 0 => error; 1 => ok
+ */
+static int check_pool(pysqlite_ConnectionPool* self)
+{
+    if (!self->idle) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base ConnectionPool.__init__ not called.");
+        return 0;
+    }
+
+    if (self->closed) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Cannot operate on a closed connection pool.");
+        return 0;
+    }
+
+    return 1;
+}
+
+static PyObject* pysqlite_pool_acquire(pysqlite_ConnectionPool* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"timeout", NULL, NULL};
+    PyObject* timeout_obj = Py_None;
+    double timeout = -1.0;
+    double waited = 0.0;
+    double delay = 0.0005;
+    pysqlite_Connection* connection;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:acquire", kwlist, &timeout_obj)) {
+        return NULL;
+    }
+
+    if (timeout_obj != Py_None) {
+        timeout = PyFloat_AsDouble(timeout_obj);
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+
+    while (1) {
+        if (!check_pool(self)) {
+            return NULL;
+        }
+
+        pool_expire(self);
+
+        connection = pool_take_idle(self);
+        if (connection) {
+            break;
+        } else if (PyErr_Occurred()) {
+            return NULL;
+        }
+
+        /* opening releases the GIL, so reserve the slot first */
+        if (PyList_GET_SIZE(self->busy) + self->pending < self->size) {
+            self->pending++;
+            connection = pool_open(self);
+            self->pending--;
+            if (!connection) {
+                return NULL;
+            }
+            break;
+        }
+
+        if (timeout >= 0.0 && waited >= timeout) {
+            PyErr_SetString(pysqlite_OperationalError, "no connection available in the pool");
+            return NULL;
+        }
+
+        /* back off exponentially like threading.Condition.wait() does */
+        if (timeout >= 0.0 && delay > timeout - waited) {
+            delay = timeout - waited;
+        }
+        pysqlite_sleep(delay);
+        waited += delay;
+        delay *= 2;
+        if (delay > POOL_MAX_DELAY) {
+            delay = POOL_MAX_DELAY;
+        }
+
+        if (PyErr_CheckSignals() != 0) {
+            return NULL;
+        }
+    }
+
+    if (PyList_Append(self->busy, (PyObject*)connection) != 0) {
+        Py_DECREF(connection);
+        return NULL;
+    }
+
+    /* hand the connection over to the calling thread */
+    connection->thread_ident = PyThread_get_thread_ident();
+
+    return (PyObject*)connection;
+}
+
+static PyObject* pysqlite_pool_release(pysqlite_ConnectionPool* self, PyObject* args)
+{
+    pysqlite_Connection* connection;
+    PyObject* ret;
+    Py_ssize_t pos;
+
+    if (!PyArg_ParseTuple(args, "O!:release", &pysqlite_ConnectionType, &connection)) {
+        return NULL;
+    }
+
+    if (!self->busy) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base ConnectionPool.__init__ not called.");
+        return NULL;
+    }
+
+    pos = PySequence_Index(self->busy, (PyObject*)connection);
+    if (pos < 0) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Connection was not acquired from this pool.");
+        return NULL;
+    }
+
+    Py_INCREF(connection);
+    if (PySequence_DelItem(self->busy, pos) != 0) {
+        Py_DECREF(connection);
+        return NULL;
+    }
+
+    connection->thread_ident = PyThread_get_thread_ident();
+
+    if (!self->closed && connection->db && !sqlite3_get_autocommit(connection->db)) {
+        /* don't pass a pending transaction on to the next user; the rollback
+         * releases the GIL, so the connection still takes up its slot */
+        self->pending++;
+        ret = pysqlite_connection_rollback(connection, NULL);
+        if (ret) {
+            Py_DECREF(ret);
+        } else {
+            PyErr_Clear();
+            pool_discard(connection);
+        }
+        self->pending--;
+    }
+
+    if (self->closed || !connection->db) {
+        pool_discard(connection);
+        Py_DECREF(connection);
+    } else if (pool_put_idle(self, connection) != 0) {
+        return NULL;
+    }
+
+    pool_expire(self);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* pysqlite_pool_close(pysqlite_ConnectionPool* self, PyObject* args)
+{
+    PyObject* idle;
+    Py_ssize_t i;
+
+    if (!self->idle) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base ConnectionPool.__init__ not called.");
+        return NULL;
+    }
+
+    self->closed = 1;
+
+    /* closing releases the GIL, so empty the idle list first; checked out
+     * connections are closed when they are released */
+    idle = PyList_GetSlice(self->idle, 0, PyList_GET_SIZE(self->idle));
+    if (!idle) {
+        return NULL;
+    }
+    if (PyList_SetSlice(self->idle, 0, PyList_GET_SIZE(self->idle), NULL) != 0) {
+        Py_DECREF(idle);
+        return NULL;
+    }
+    for (i = 0; i < PyList_GET_SIZE(idle); i++) {
+        pool_discard((pysqlite_Connection*)PyTuple_GET_ITEM(PyList_GET_ITEM(idle, i), 1));
+    }
+    Py_DECREF(idle);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* pysqlite_pool_get_idle(pysqlite_ConnectionPool* self, void* unused)
+{
+    return PyInt_FromSsize_t(self->idle ? PyList_GET_SIZE(self->idle) : 0);
+}
+
+static PyObject* pysqlite_pool_get_in_use(pysqlite_ConnectionPool* self, void* unused)
+{
+    return PyInt_FromSsize_t(self->busy ? PyList_GET_SIZE(self->busy) : 0);
+}
+
+static PyMethodDef pool_methods[] = {
+    {"acquire", (PyCFunction)pysqlite_pool_acquire, METH_VARARGS|METH_KEYWORDS,
+        PyDoc_STR("Checks a connection out of the pool.")},
+    {"release", (PyCFunction)pysqlite_pool_release, METH_VARARGS,
+        PyDoc_STR("Returns a connection to the pool.")},
+    {"close", (PyCFunction)pysqlite_pool_close, METH_NOARGS,
+        PyDoc_STR("Closes all idle connections and the pool.")},
+    {NULL, NULL}
+};
+
+static struct PyMemberDef pool_members[] =
+{
+    {"size", T_INT, offsetof(pysqlite_ConnectionPool, size), RO},
+    {"max_idle", T_DOUBLE, offsetof(pysqlite_ConnectionPool, max_idle), RO},
+    {NULL}
+};
+
+static PyGetSetDef pool_getset[] = {
+    {"idle",  (getter)pysqlite_pool_get_idle, (setter)0},
+    {"in_use",  (getter)pysqlite_pool_get_in_use, (setter)0},
+    {NULL}
+};
+
+static char pool_doc[] =
+PyDoc_STR("A pool of connections to the same database.");
+
+PyTypeObject pysqlite_ConnectionPoolType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        MODULE_NAME ".ConnectionPool",                  /* tp_name */
+        sizeof(pysqlite_ConnectionPool),                /* tp_basicsize */
+        0,                                              /* tp_itemsize */
+        (destructor)pysqlite_pool_dealloc,              /* tp_dealloc */
+        0,                                              /* tp_print */
+        0,                                              /* tp_getattr */
+        0,                                              /* tp_setattr */
+        0,                                              /* tp_compare */
+        0,                                              /* tp_repr */
+        0,                                              /* tp_as_number */
+        0,                                              /* tp_as_sequence */
+        0,                                              /* tp_as_mapping */
+        0,                                              /* tp_hash */
+        0,                                              /* tp_call */
+        0,                                              /* tp_str */
+        0,                                              /* tp_getattro */
+        0,                                              /* tp_setattro */
+        0,                                              /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,         /* tp_flags */
+        pool_doc,                                       /* tp_doc */
+        0,                                              /* tp_traverse */
+        0,                                              /* tp_clear */
+        0,                                              /* tp_richcompare */
+        0,                                              /* tp_weaklistoffset */
+        0,                                              /* tp_iter */
+        0,                                              /* tp_iternext */
+        pool_methods,                                   /* tp_methods */
+        pool_members,                                   /* tp_members */
+        pool_getset,                                    /* tp_getset */
+        0,                                              /* tp_base */
+        0,                                              /* tp_dict */
+        0,                                              /* tp_descr_get */
+        0,                                              /* tp_descr_set */
+        0,                                              /* tp_dictoffset */
+        (initproc)pysqlite_pool_init,                   /* tp_init */
+        0,                                              /* tp_alloc */
+        0,                                              /* tp_new */
+        0                                               /* tp_free */
+};
+
+extern int pysqlite_pool_setup_types(void)
+{
+    pysqlite_ConnectionPoolType.tp_new = PyType_GenericNew;
+    return PyType_Ready(&pysqlite_ConnectionPoolType);
+}
@@ -0,0 +1,62 @@
+/* pool.h - definitions for the connection pool type
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef PYSQLITE_POOL_H
+#define PYSQLITE_POOL_H
+#include "Python.h"
+
+#include "connection.h"
+
+typedef struct
+{
+    PyObject_HEAD
+
+    /* the arguments the pooled connections are opened with */
+    PyObject* connect_args;
+    PyObject* connect_kwargs;
+
+    /* the maximum number of connections the pool opens */
+    int size;
+
+    /* idle connections are closed after this many seconds; 0 keeps them */
+    double max_idle;
+
+    /* (release time, connection) tuples of the idle connections, the most
+     * recently released one last */
+    PyObject* idle;
+
+    /* the connections that are currently checked out */
+    PyObject* busy;
+
+    /* connections that are in neither list while the GIL is released: being
+     * opened, checked or rolled back. They count towards size. */
+    int pending;
+
+    int closed;
+} pysqlite_ConnectionPool;
+
+extern PyTypeObject pysqlite_ConnectionPoolType;
+
+int pysqlite_pool_setup_types(void);
+
+#endif
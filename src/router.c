@@ -0,0 +1,504 @@
+/* router.c - routes statements to a writer or to reader connections
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "module.h"
+#include "router.h"
+#include "cursor.h"
+#include "util.h"
+#include "sqlitecompat.h"
+
+/* the read-only classification is remembered for this many distinct SQL
+ * strings; then the dictionary is cleared */
+#define ROUTER_MAX_CLASSIFIED 1000
+
+/*
+ * Switches the database to WAL mode. This bypasses the cursor, which would
+ * open a transaction first, and journal_mode cannot be changed inside one.
+ *
+ * 0 => error; 1 => ok
+ */
+static int router_enable_wal(pysqlite_Connection* connection)
+{
+    sqlite3_stmt* st;
+    const char* tail;
+    const char* mode;
+    int is_wal = 0;
+    int rc;
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = sqlite3_prepare(connection->db, "PRAGMA journal_mode=WAL", -1, &st, &tail);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_step(st);
+        if (rc == SQLITE_ROW) {
+            /* in-memory databases, for example, keep their journal mode */
+            mode = (const char*)sqlite3_column_text(st, 0);
+            is_wal = mode && !sqlite3_stricmp(mode, "wal");
+        }
+        (void)sqlite3_finalize(st);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (rc != SQLITE_ROW) {
+        _pysqlite_seterror(connection->db, NULL);
+        return 0;
+    }
+
+    if (!is_wal) {
+        PyErr_SetString(pysqlite_NotSupportedError, "the database cannot be switched to WAL mode");
+        return 0;
+    }
+
+    return 1;
+}
+
+static int pysqlite_router_init(pysqlite_ConnectionRouter* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* database;
+    PyObject* item;
+    PyObject* connect_args = NULL;
+    PyObject* connect_kwargs = NULL;
+    PyObject* factory;
+    int nreaders = 4;
+    int rc = -1;
+
+    if (!PyArg_ParseTuple(args, "O", &database)) {
+        return -1;
+    }
+
+    connect_kwargs = kwargs ? PyDict_Copy(kwargs) : PyDict_New();
+    if (!connect_kwargs) {
+        goto error;
+    }
+
+    item = PyDict_GetItemString(connect_kwargs, "readers");
+    if (item) {
+        nreaders = (int)PyInt_AsLong(item);
+        if (PyErr_Occurred() || PyDict_DelItemString(connect_kwargs, "readers") != 0) {
+            goto error;
+        }
+    }
+    if (nreaders < 1) {
+        PyErr_SetString(PyExc_ValueError, "readers must be at least 1");
+        goto error;
+    }
+
+    connect_args = PyTuple_Pack(1, database);
+    if (!connect_args) {
+        goto error;
+    }
+
+    /* the writer */
+    factory = PyDict_GetItemString(connect_kwargs, "factory");
+    if (!factory) {
+        factory = (PyObject*)&pysqlite_ConnectionType;
+    }
+    Py_CLEAR(self->writer);
+    self->writer = (pysqlite_Connection*)PyObject_Call(factory, connect_args, connect_kwargs);
+    if (!self->writer) {
+        goto error;
+    }
+    if (!PyObject_TypeCheck(self->writer, &pysqlite_ConnectionType)) {
+        PyErr_SetString(PyExc_TypeError, "factory must return a Connection");
+        goto error;
+    }
+
+    if (!router_enable_wal(self->writer)) {
+        goto error;
+    }
+
+    /* Readers run every statement in autocommit mode, so that they never
+     * hold on to an old snapshot. */
+    if (PyDict_SetItemString(connect_kwargs, "isolation_level", Py_None) != 0) {
+        goto error;
+    }
+    item = PyInt_FromLong(nreaders);
+    if (!item) {
+        goto error;
+    }
+    if (PyDict_SetItemString(connect_kwargs, "size", item) != 0) {
+        Py_DECREF(item);
+        goto error;
+    }
+    Py_DECREF(item);
+
+    Py_CLEAR(self->readers);
+    self->readers = (pysqlite_ConnectionPool*)PyObject_Call((PyObject*)&pysqlite_ConnectionPoolType, connect_args, connect_kwargs);
+    if (!self->readers) {
+        goto error;
+    }
+
+    Py_XDECREF(self->readonly);
+    self->readonly = PyDict_New();
+    if (!self->readonly) {
+        goto error;
+    }
+
+    if (!self->writer_lock) {
+        self->writer_lock = PyThread_allocate_lock();
+        if (!self->writer_lock) {
+            PyErr_SetString(pysqlite_OperationalError, "cannot allocate lock");
+            goto error;
+        }
+    }
+
+    self->closed = 0;
+    rc = 0;
+
+error:
+    Py_XDECREF(connect_args);
+    Py_XDECREF(connect_kwargs);
+
+    return rc;
+}
+
+static void pysqlite_router_dealloc(pysqlite_ConnectionRouter* self)
+{
+    Py_XDECREF(self->writer);
+    Py_XDECREF(self->readers);
+    Py_XDECREF(self->readonly);
+
+    if (self->writer_lock) {
+        PyThread_free_lock(self->writer_lock);
+    }
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/*
+ * Checks if a router object is usable.
+ *
+ * 0 => error; 1 => ok
+ */
+static int check_router(pysqlite_ConnectionRouter* self)
+{
+    if (!self->readonly) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base ConnectionRouter.__init__ not called.");
+        return 0;
+    }
+
+    if (self->closed) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Cannot operate on a closed connection router.");
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Decides whether sql only reads. The statement is compiled on the reader,
+ * which puts it into the reader's statement cache for the actual execution,
+ * and SQLite tells us whether it writes. Only if it cannot be compiled there
+ * do we guess from the leading keyword.
+ *
+ * Returns 1 for read-only statements, 0 for the others, -1 on error.
+ */
+static int router_is_readonly(pysqlite_ConnectionRouter* self, pysqlite_Connection* reader, PyObject* sql)
+{
+    PyObject* known;
+    PyObject* key;
+    PyObject* sql_bytes;
+    pysqlite_Statement* statement;
+    int readonly;
+
+    known = PyDict_GetItem(self->readonly, sql);
+    if (known) {
+        return known == Py_True;
+    }
+
+#if SQLITE_VERSION_NUMBER >= 3007004
+    key = PyTuple_Pack(1, sql);
+    if (!key) {
+        return -1;
+    }
+    statement = (pysqlite_Statement*)pysqlite_cache_get(reader->statement_cache, key);
+    Py_DECREF(key);
+
+    if (statement) {
+        readonly = statement->st ? sqlite3_stmt_readonly(statement->st) != 0 : 1;
+        Py_DECREF(statement);
+
+        if (PyDict_Size(self->readonly) >= ROUTER_MAX_CLASSIFIED) {
+            PyDict_Clear(self->readonly);
+        }
+        if (PyDict_SetItem(self->readonly, sql, readonly ? Py_True : Py_False) != 0) {
+            return -1;
+        }
+        return readonly;
+    }
+
+    /* e. g. a table that only the writer can see yet; don't remember this */
+    PyErr_Clear();
+#endif
+
+    if (PyUnicode_Check(sql)) {
+        sql_bytes = PyUnicode_AsUTF8String(sql);
+    } else if (PyString_Check(sql)) {
+        Py_INCREF(sql);
+        sql_bytes = sql;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "operation parameter must be str or unicode");
+        return -1;
+    }
+    if (!sql_bytes) {
+        return -1;
+    }
+
+    readonly = pysqlite_detect_statement_type(PyString_AsString(sql_bytes)) == STATEMENT_SELECT;
+    Py_DECREF(sql_bytes);
+
+    return readonly;
+}
+
+/*
+ * Runs sql on connection and fetches all rows.
+ *
+ * Returns a new reference, or NULL with an exception set.
+ */
+static PyObject* router_run(pysqlite_Connection* connection, const char* method, PyObject* sql, PyObject* parameters)
+{
+    PyObject* cursor;
+    PyObject* rows;
+
+    if (parameters) {
+        cursor = PyObject_CallMethod((PyObject*)connection, (char*)method, "OO", sql, parameters);
+    } else {
+        cursor = PyObject_CallMethod((PyObject*)connection, (char*)method, "O", sql);
+    }
+    if (!cursor) {
+        return NULL;
+    }
+
+    rows = PyObject_CallMethod(cursor, "fetchall", "");
+    Py_DECREF(cursor);
+
+    return rows;
+}
+
+/* Runs a statement on the writer, then commits. Writes from all threads are
+ * serialized by writer_lock. */
+static PyObject* router_write(pysqlite_ConnectionRouter* self, const char* method, PyObject* sql, PyObject* parameters)
+{
+    PyObject* rows;
+    PyObject* ret;
+    PyObject* exc_type, *exc_value, *exc_tb;
+
+    if (!PyThread_acquire_lock(self->writer_lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->writer_lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+
+    self->writer->thread_ident = PyThread_get_thread_ident();
+
+    rows = router_run(self->writer, method, sql, parameters);
+    if (rows) {
+        ret = pysqlite_connection_commit(self->writer, NULL);
+        if (!ret) {
+            Py_CLEAR(rows);
+        }
+        Py_XDECREF(ret);
+    }
+
+    if (!rows) {
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        ret = pysqlite_connection_rollback(self->writer, NULL);
+        Py_XDECREF(ret);
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+    }
+
+    PyThread_release_lock(self->writer_lock);
+
+    return rows;
+}
+
+static PyObject* pysqlite_router_execute(pysqlite_ConnectionRouter* self, PyObject* args)
+{
+    PyObject* sql;
+    PyObject* parameters = NULL;
+    PyObject* reader;
+    PyObject* rows = NULL;
+    PyObject* ret;
+    PyObject* exc_type, *exc_value, *exc_tb;
+    int readonly;
+
+    if (!PyArg_ParseTuple(args, "O|O:execute", &sql, &parameters)) {
+        return NULL;
+    }
+
+    if (!check_router(self)) {
+        return NULL;
+    }
+
+    reader = PyObject_CallMethod((PyObject*)self->readers, "acquire", "");
+    if (!reader) {
+        return NULL;
+    }
+
+    readonly = router_is_readonly(self, (pysqlite_Connection*)reader, sql);
+    if (readonly == 1) {
+        /* pysqlite_step releases the GIL, so reads on different threads
+         * run in parallel */
+        rows = router_run((pysqlite_Connection*)reader, "execute", sql, parameters);
+    }
+
+    /* always give the reader back, even if the statement failed */
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    ret = PyObject_CallMethod((PyObject*)self->readers, "release", "O", reader);
+    Py_DECREF(reader);
+    if (ret) {
+        Py_DECREF(ret);
+    } else if (exc_type) {
+        PyErr_Clear();
+    } else {
+        Py_XDECREF(rows);
+        return NULL;
+    }
+    if (exc_type) {
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+    }
+
+    if (readonly == 0) {
+        rows = router_write(self, "execute", sql, parameters);
+    }
+
+    return rows;
+}
+
+static PyObject* pysqlite_router_executemany(pysqlite_ConnectionRouter* self, PyObject* args)
+{
+    PyObject* sql;
+    PyObject* seq;
+    PyObject* rows;
+
+    if (!PyArg_ParseTuple(args, "OO:executemany", &sql, &seq)) {
+        return NULL;
+    }
+
+    if (!check_router(self)) {
+        return NULL;
+    }
+
+    rows = router_write(self, "executemany", sql, seq);
+    if (!rows) {
+        return NULL;
+    }
+    Py_DECREF(rows);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* pysqlite_router_close(pysqlite_ConnectionRouter* self, PyObject* args)
+{
+    PyObject* ret;
+
+    if (!check_router(self)) {
+        return NULL;
+    }
+
+    self->closed = 1;
+
+    ret = PyObject_CallMethod((PyObject*)self->readers, "close", "");
+    if (!ret) {
+        return NULL;
+    }
+    Py_DECREF(ret);
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->writer_lock, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+
+    self->writer->thread_ident = PyThread_get_thread_ident();
+    ret = pysqlite_connection_close(self->writer, NULL);
+
+    PyThread_release_lock(self->writer_lock);
+
+    return ret;
+}
+
+static PyMethodDef router_methods[] = {
+    {"execute", (PyCFunction)pysqlite_router_execute, METH_VARARGS,
+        PyDoc_STR("Executes a statement on a reader or on the writer and returns all rows.")},
+    {"executemany", (PyCFunction)pysqlite_router_executemany, METH_VARARGS,
+        PyDoc_STR("Repeatedly executes a statement on the writer.")},
+    {"close", (PyCFunction)pysqlite_router_close, METH_NOARGS,
+        PyDoc_STR("Closes all connections.")},
+    {NULL, NULL}
+};
+
+static struct PyMemberDef router_members[] =
+{
+    {"readers", T_OBJECT, offsetof(pysqlite_ConnectionRouter, readers), RO},
+    {NULL}
+};
+
+static char router_doc[] =
+PyDoc_STR("Routes statements to one writer and a pool of reader connections.");
+
+PyTypeObject pysqlite_ConnectionRouterType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        MODULE_NAME ".ConnectionRouter",                /* tp_name */
+        sizeof(pysqlite_ConnectionRouter),              /* tp_basicsize */
+        0,                                              /* tp_itemsize */
+        (destructor)pysqlite_router_dealloc,            /* tp_dealloc */
+        0,                                              /* tp_print */
+        0,                                              /* tp_getattr */
+        0,                                              /* tp_setattr */
+        0,                                              /* tp_compare */
+        0,                                              /* tp_repr */
+        0,                                              /* tp_as_number */
+        0,                                              /* tp_as_sequence */
+        0,                                              /* tp_as_mapping */
+        0,                                              /* tp_hash */
+        0,                                              /* tp_call */
+        0,                                              /* tp_str */
+        0,                                              /* tp_getattro */
+        0,                                              /* tp_setattro */
+        0,                                              /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,         /* tp_flags */
+        router_doc,                                     /* tp_doc */
+        0,                                              /* tp_traverse */
+        0,                                              /* tp_clear */
+        0,                                              /* tp_richcompare */
+        0,                                              /* tp_weaklistoffset */
+        0,                                              /* tp_iter */
+        0,                                              /* tp_iternext */
+        router_methods,                                 /* tp_methods */
+        router_members,                                 /* tp_members */
+        0,                                              /* tp_getset */
+        0,                                              /* tp_base */
+        0,                                              /* tp_dict */
+        0,                                              /* tp_descr_get */
+        0,                                              /* tp_descr_set */
+        0,                                              /* tp_dictoffset */
+        (initproc)pysqlite_router_init,                 /* tp_init */
+        0,                                              /* tp_alloc */
+        0,                                              /* tp_new */
+        0                                               /* tp_free */
+};
+
+extern int pysqlite_router_setup_types(void)
+{
+    pysqlite_ConnectionRouterType.tp_new = PyType_GenericNew;
+    return PyType_Ready(&pysqlite_ConnectionRouterType);
+}
@@ -0,0 +1,53 @@
+/* router.h - definitions for the reader/writer connection router
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef PYSQLITE_ROUTER_H
+#define PYSQLITE_ROUTER_H
+#include "Python.h"
+
+#include "pythread.h"
+#include "connection.h"
+#include "pool.h"
+
+typedef struct
+{
+    PyObject_HEAD
+
+    /* the only connection that writes; guarded by writer_lock */
+    pysqlite_Connection* writer;
+    PyThread_type_lock writer_lock;
+
+    /* the pool of read-only connections */
+    pysqlite_ConnectionPool* readers;
+
+    /* SQL string => True/False: whether the statement only reads */
+    PyObject* readonly;
+
+    int closed;
+} pysqlite_ConnectionRouter;
+
+extern PyTypeObject pysqlite_ConnectionRouterType;
+
+int pysqlite_router_setup_types(void);
+
+#endif
@@ -0,0 +1,426 @@
+/* savepoint.c - the savepoint type
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#include "module.h"
+#include "savepoint.h"
+#include "util.h"
+#include "sqlitecompat.h"
+
+static int pysqlite_savepoint_init(pysqlite_Savepoint* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"connection", "name", NULL, NULL};
+    pysqlite_Connection* connection;
+    PyObject* name = Py_None;
+    char* chk;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|O", kwlist,
+                                     &pysqlite_ConnectionType, &connection, &name)) {
+        return -1;
+    }
+
+    if (!pysqlite_check_thread(connection) || !pysqlite_check_connection(connection)) {
+        return -1;
+    }
+
+    if (name != Py_None) {
+        if (!PyString_Check(name)) {
+            PyErr_SetString(PyExc_TypeError, "savepoint name must be a string");
+            return -1;
+        }
+
+        chk = PyString_AsString(name);
+        if (*chk == 0) {
+            PyErr_SetString(pysqlite_ProgrammingError, "savepoint name must not be empty");
+            return -1;
+        }
+        while (*chk) {
+            if ((*chk >= '0' && *chk <= '9')
+             || (*chk >= 'A' && *chk <= 'Z')
+             || (*chk >= 'a' && *chk <= 'z')
+             || (*chk == '_'))
+            {
+                chk++;
+            } else {
+                PyErr_SetString(pysqlite_ProgrammingError, "invalid character in savepoint name");
+                return -1;
+            }
+        }
+    }
+
+    Py_INCREF(connection);
+    Py_XDECREF(self->connection);
+    self->connection = connection;
+
+    Py_CLEAR(self->name);
+    if (name != Py_None) {
+        Py_INCREF(name);
+        self->name = name;
+    }
+    self->default_name = (name == Py_None);
+
+    self->active = 0;
+    self->started_transaction = 0;
+    self->transaction_serial = 0;
+
+    return 0;
+}
+
+/*
+ * Looks up the SAVEPOINT, RELEASE and ROLLBACK TO statements for the
+ * savepoint's name, preparing them if the connection has none yet.
+ *
+ * 0 => error; 1 => ok
+ */
+static int pysqlite_savepoint_get_statements(pysqlite_Savepoint* self)
+{
+    pysqlite_Connection* connection = self->connection;
+    PyObject* statements;
+    PyObject* sql;
+    int i;
+
+    /* the statements for a given name are prepared only once per connection */
+    statements = PyDict_GetItem(connection->savepoints, self->name);
+    if (statements) {
+        Py_INCREF(statements);
+    } else {
+        statements = PyTuple_New(3);
+        if (!statements) {
+            return 0;
+        }
+
+        for (i = 0; i < 3; i++) {
+            sql = PyString_FromFormat(i == 0 ? "SAVEPOINT \"%s\"" : (i == 1 ? "RELEASE \"%s\"" : "ROLLBACK TO \"%s\""),
+                                      PyString_AsString(self->name));
+            if (!sql) {
+                Py_DECREF(statements);
+                return 0;
+            }
+            PyTuple_SET_ITEM(statements, i, (PyObject*)_pysqlite_connection_prepare_control(connection, PyString_AsString(sql)));
+            Py_DECREF(sql);
+            if (!PyTuple_GET_ITEM(statements, i)) {
+                Py_DECREF(statements);
+                return 0;
+            }
+        }
+
+        /* the default names are bounded by the nesting depth, but there may
+         * be any number of given names; those beyond the limit are prepared
+         * for this savepoint only */
+        if (PyDict_Size(connection->savepoints) < PYSQLITE_SAVEPOINT_CACHE_SIZE) {
+            if (PyDict_SetItem(connection->savepoints, self->name, statements) != 0) {
+                Py_DECREF(statements);
+                return 0;
+            }
+        }
+    }
+
+    Py_XDECREF(self->savepoint_st);
+    Py_XDECREF(self->release_st);
+    Py_XDECREF(self->rollback_st);
+    self->savepoint_st = (pysqlite_Statement*)PyTuple_GET_ITEM(statements, 0);
+    self->release_st = (pysqlite_Statement*)PyTuple_GET_ITEM(statements, 1);
+    self->rollback_st = (pysqlite_Statement*)PyTuple_GET_ITEM(statements, 2);
+    Py_INCREF(self->savepoint_st);
+    Py_INCREF(self->release_st);
+    Py_INCREF(self->rollback_st);
+    Py_DECREF(statements);
+
+    return 1;
+}
+
+static void pysqlite_savepoint_dealloc(pysqlite_Savepoint* self)
+{
+    Py_XDECREF(self->savepoint_st);
+    Py_XDECREF(self->release_st);
+    Py_XDECREF(self->rollback_st);
+    Py_XDECREF(self->name);
+    Py_XDECREF(self->connection);
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/*
+ * Checks if a savepoint object is usable.
+ *
+ * 0 => error; 1 => ok
+ */
+static int check_savepoint(pysqlite_Savepoint* self)
+{
+    if (!self->connection) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base Savepoint.__init__ not called.");
+        return 0;
+    }
+
+    return pysqlite_check_thread(self->connection) && pysqlite_check_connection(self->connection);
+}
+
+/* Returns 1 if the savepoint is entered and its transaction hasn't ended
+ * since, 0 otherwise. */
+static int pysqlite_savepoint_is_active(pysqlite_Savepoint* self)
+{
+    return self->active && self->transaction_serial == self->connection->transaction_serial;
+}
+
+static PyObject* pysqlite_savepoint_enter(pysqlite_Savepoint* self, PyObject* args)
+{
+    PyObject* result;
+    int rc;
+
+    if (!check_savepoint(self)) {
+        return NULL;
+    }
+
+    if (pysqlite_savepoint_is_active(self)) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Savepoint is already active.");
+        return NULL;
+    }
+    self->active = 0;
+
+    if (self->default_name) {
+        /* nested savepoints get distinct names, and the prepared statements
+         * for each nesting level are reused across transactions */
+        Py_CLEAR(self->name);
+        self->name = PyString_FromFormat("pysqlite_savepoint_%d", self->connection->savepoint_level);
+        if (!self->name) {
+            return NULL;
+        }
+    }
+
+    if (!pysqlite_savepoint_get_statements(self)) {
+        return NULL;
+    }
+
+    /* Open the surrounding transaction ourselves, so that it honours the
+     * isolation level and pysqlite knows about it. */
+    self->started_transaction = 0;
+    if (!self->connection->inTransaction) {
+        result = _pysqlite_connection_begin(self->connection);
+        if (!result) {
+            return NULL;
+        }
+        Py_DECREF(result);
+        self->started_transaction = 1;
+    }
+
+    rc = _pysqlite_connection_run_control(self->connection, &self->savepoint_st, NULL);
+    if (rc != SQLITE_DONE) {
+        if (self->started_transaction) {
+            pysqlite_do_all_statements(self->connection, ACTION_RESET, 1);
+            (void)_pysqlite_connection_run_control(self->connection, &self->connection->rollback_st, "ROLLBACK");
+            self->connection->inTransaction = !sqlite3_get_autocommit(self->connection->db);
+        }
+        return NULL;
+    }
+
+    self->active = 1;
+    self->transaction_serial = self->connection->transaction_serial;
+    self->connection->savepoint_level++;
+
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+/* Marks the savepoint as left. Returns 0 and sets an exception if it was not
+ * active. */
+static int pysqlite_savepoint_leave(pysqlite_Savepoint* self)
+{
+    if (!pysqlite_savepoint_is_active(self)) {
+        self->active = 0;
+        PyErr_SetString(pysqlite_ProgrammingError, "Savepoint is not active.");
+        return 0;
+    }
+
+    self->active = 0;
+    if (self->connection->savepoint_level > 0) {
+        self->connection->savepoint_level--;
+    }
+
+    return 1;
+}
+
+static PyObject* pysqlite_savepoint_release(pysqlite_Savepoint* self, PyObject* args)
+{
+    PyObject* result;
+    int rc;
+
+    if (!check_savepoint(self) || !pysqlite_savepoint_leave(self)) {
+        return NULL;
+    }
+
+    rc = _pysqlite_connection_run_control(self->connection, &self->release_st, NULL);
+    if (rc != SQLITE_DONE) {
+        return NULL;
+    }
+
+    if (self->started_transaction) {
+        result = pysqlite_connection_commit(self->connection, NULL);
+        if (!result) {
+            return NULL;
+        }
+        Py_DECREF(result);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* pysqlite_savepoint_rollback(pysqlite_Savepoint* self, PyObject* args)
+{
+    PyObject* result;
+    int rc;
+
+    if (!check_savepoint(self) || !pysqlite_savepoint_leave(self)) {
+        return NULL;
+    }
+
+    pysqlite_do_all_statements(self->connection, ACTION_RESET, 1);
+
+    /* ROLLBACK TO keeps the savepoint on the stack, so release it, too */
+    rc = _pysqlite_connection_run_control(self->connection, &self->rollback_st, NULL);
+    if (rc == SQLITE_DONE) {
+        rc = _pysqlite_connection_run_control(self->connection, &self->release_st, NULL);
+    }
+
+    if (self->started_transaction) {
+        if (rc == SQLITE_DONE) {
+            result = pysqlite_connection_rollback(self->connection, NULL);
+            Py_XDECREF(result);
+        } else {
+            (void)_pysqlite_connection_run_control(self->connection, &self->connection->rollback_st, "ROLLBACK");
+            self->connection->inTransaction = !sqlite3_get_autocommit(self->connection->db);
+        }
+    }
+
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/** Called when the savepoint is used as a context manager. If there was any
+ * exception, we roll back to the savepoint; otherwise it is released. */
+static PyObject* pysqlite_savepoint_exit(pysqlite_Savepoint* self, PyObject* args)
+{
+    PyObject* exc_type, *exc_value, *exc_tb;
+    PyObject* result;
+
+    if (!PyArg_ParseTuple(args, "OOO", &exc_type, &exc_value, &exc_tb)) {
+        return NULL;
+    }
+
+    if (exc_type == Py_None && exc_value == Py_None && exc_tb == Py_None) {
+        result = pysqlite_savepoint_release(self, NULL);
+    } else {
+        result = pysqlite_savepoint_rollback(self, NULL);
+    }
+    if (!result) {
+        return NULL;
+    }
+    Py_DECREF(result);
+
+    Py_INCREF(Py_False);
+    return Py_False;
+}
+
+static PyMethodDef savepoint_methods[] = {
+    {"release", (PyCFunction)pysqlite_savepoint_release, METH_NOARGS,
+        PyDoc_STR("Releases the savepoint, keeping its changes.")},
+    {"rollback", (PyCFunction)pysqlite_savepoint_rollback, METH_NOARGS,
+        PyDoc_STR("Undoes all changes made since the savepoint was entered.")},
+    {"__enter__", (PyCFunction)pysqlite_savepoint_enter, METH_NOARGS,
+        PyDoc_STR("Enters the savepoint.")},
+    {"__exit__", (PyCFunction)pysqlite_savepoint_exit, METH_VARARGS,
+        PyDoc_STR("Releases the savepoint or rolls back to it.")},
+    {NULL, NULL}
+};
+
+static struct PyMemberDef savepoint_members[] =
+{
+    {"connection", T_OBJECT, offsetof(pysqlite_Savepoint, connection), RO},
+    {"name", T_OBJECT, offsetof(pysqlite_Savepoint, name), RO},
+    {NULL}
+};
+
+static PyObject* pysqlite_savepoint_get_active(pysqlite_Savepoint* self, void* unused)
+{
+    return PyBool_FromLong(self->connection && pysqlite_savepoint_is_active(self));
+}
+
+static PyGetSetDef savepoint_getset[] = {
+    {"active",  (getter)pysqlite_savepoint_get_active, (setter)0},
+    {NULL}
+};
+
+static char savepoint_doc[] =
+PyDoc_STR("A named savepoint within a transaction.");
+
+PyTypeObject pysqlite_SavepointType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        MODULE_NAME ".Savepoint",                       /* tp_name */
+        sizeof(pysqlite_Savepoint),                     /* tp_basicsize */
+        0,                                              /* tp_itemsize */
+        (destructor)pysqlite_savepoint_dealloc,         /* tp_dealloc */
+        0,                                              /* tp_print */
+        0,                                              /* tp_getattr */
+        0,                                              /* tp_setattr */
+        0,                                              /* tp_compare */
+        0,                                              /* tp_repr */
+        0,                                              /* tp_as_number */
+        0,                                              /* tp_as_sequence */
+        0,                                              /* tp_as_mapping */
+        0,                                              /* tp_hash */
+        0,                                              /* tp_call */
+        0,                                              /* tp_str */
+        0,                                              /* tp_getattro */
+        0,                                              /* tp_setattro */
+        0,                                              /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,         /* tp_flags */
+        savepoint_doc,                                  /* tp_doc */
+        0,                                              /* tp_traverse */
+        0,                                              /* tp_clear */
+        0,                                              /* tp_richcompare */
+        0,                                              /* tp_weaklistoffset */
+        0,                                              /* tp_iter */
+        0,                                              /* tp_iternext */
+        savepoint_methods,                              /* tp_methods */
+        savepoint_members,                              /* tp_members */
+        savepoint_getset,                               /* tp_getset */
+        0,                                              /* tp_base */
+        0,                                              /* tp_dict */
+        0,                                              /* tp_descr_get */
+        0,                                              /* tp_descr_set */
+        0,                                              /* tp_dictoffset */
+        (initproc)pysqlite_savepoint_init,              /* tp_init */
+        0,                                              /* tp_alloc */
+        0,                                              /* tp_new */
+        0                                               /* tp_free */
+};
+
+extern int pysqlite_savepoint_setup_types(void)
+{
+    pysqlite_SavepointType.tp_new = PyType_GenericNew;
+    return PyType_Ready(&pysqlite_SavepointType);
+}
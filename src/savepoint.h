@@ -0,0 +1,68 @@
+/* savepoint.h - definitions for the savepoint type
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef PYSQLITE_SAVEPOINT_H
+#define PYSQLITE_SAVEPOINT_H
+#include "Python.h"
+
+#include "connection.h"
+#include "statement.h"
+
+/* how many savepoint names a connection keeps prepared statements for */
+#define PYSQLITE_SAVEPOINT_CACHE_SIZE 16
+
+typedef struct
+{
+    PyObject_HEAD
+    pysqlite_Connection* connection;
+
+    /* the savepoint name as a PyString, or NULL until a savepoint without a
+     * given name is entered */
+    PyObject* name;
+
+    /* 1 if the name is derived from the nesting level on every enter */
+    int default_name;
+
+    /* the prepared SAVEPOINT, RELEASE and ROLLBACK TO statements; they are
+     * shared with the connection's savepoints dictionary */
+    pysqlite_Statement* savepoint_st;
+    pysqlite_Statement* release_st;
+    pysqlite_Statement* rollback_st;
+
+    /* 1 between entering and leaving the savepoint, unless the transaction
+     * has ended since; see transaction_serial */
+    int active;
+
+    /* the connection's transaction_serial when the savepoint was entered */
+    long transaction_serial;
+
+    /* 1 if entering the savepoint had to start a transaction, which will then
+     * be committed or rolled back together with the savepoint */
+    int started_transaction;
+} pysqlite_Savepoint;
+
+extern PyTypeObject pysqlite_SavepointType;
+
+int pysqlite_savepoint_setup_types(void);
+
+#endif
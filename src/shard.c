@@ -0,0 +1,1044 @@
+/* shard.c - the same query over a set of database files
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "module.h"
+#include "shard.h"
+#include "util.h"
+#include "sqlitecompat.h"
+
+/* how many rows of a shard are copied at a time */
+#define SHARD_BATCH_ROWS 256
+
+/*
+ * The workers run without the GIL from start to finish: they prepare the
+ * statements, step them and copy the first batch of result rows into
+ * pysqlite_ShardValue buffers. The Python objects are only created when the
+ * rows are fetched from the ShardResult, which also copies further batches of
+ * a shard, with the GIL released, once it has used up the previous one. So a
+ * query never holds more than SHARD_BATCH_ROWS rows per shard in memory.
+ */
+
+void pysqlite_shard_value_clear(pysqlite_ShardValue* value)
+{
+    if (value->data) {
+        sqlite3_free(value->data);
+        value->data = NULL;
+    }
+    value->type = SQLITE_NULL;
+}
+
+/* Frees the values of the current batch, but keeps the buffer. */
+static void shard_clear_batch(pysqlite_Shard* shard)
+{
+    int i;
+
+    for (i = 0; i < shard->nrows * shard->ncols; i++) {
+        pysqlite_shard_value_clear(&shard->values[i]);
+    }
+
+    shard->nrows = 0;
+    shard->position = 0;
+}
+
+static void shard_clear_rows(pysqlite_Shard* shard)
+{
+    shard_clear_batch(shard);
+    sqlite3_free(shard->values);
+
+    shard->values = NULL;
+    shard->capacity = 0;
+    shard->ncols = 0;
+}
+
+/* Copies a column of the current row. Returns SQLITE_OK or SQLITE_NOMEM. */
+static int shard_copy_column(pysqlite_ShardValue* value, sqlite3_stmt* st, int i)
+{
+    const void* data;
+
+    value->type = sqlite3_column_type(st, i);
+    value->data = NULL;
+    value->size = 0;
+
+    switch (value->type) {
+        case SQLITE_INTEGER:
+            value->i = sqlite3_column_int64(st, i);
+            break;
+        case SQLITE_FLOAT:
+            value->d = sqlite3_column_double(st, i);
+            break;
+        case SQLITE_TEXT:
+        case SQLITE_BLOB:
+            if (value->type == SQLITE_TEXT) {
+                data = sqlite3_column_text(st, i);
+            } else {
+                data = sqlite3_column_blob(st, i);
+            }
+            value->size = sqlite3_column_bytes(st, i);
+            value->data = sqlite3_malloc(value->size + 1);
+            if (!value->data) {
+                value->type = SQLITE_NULL;
+                return SQLITE_NOMEM;
+            }
+            if (value->size > 0) {
+                memcpy(value->data, data, value->size);
+            }
+            value->data[value->size] = 0;
+            break;
+    }
+
+    return SQLITE_OK;
+}
+
+int pysqlite_shard_bind(sqlite3_stmt* st, pysqlite_ShardValue* parameters, int nparams)
+{
+    int rc = SQLITE_OK;
+    int i;
+
+    for (i = 0; i < nparams && rc == SQLITE_OK; i++) {
+        switch (parameters[i].type) {
+            case SQLITE_INTEGER:
+                rc = sqlite3_bind_int64(st, i + 1, parameters[i].i);
+                break;
+            case SQLITE_FLOAT:
+                rc = sqlite3_bind_double(st, i + 1, parameters[i].d);
+                break;
+            case SQLITE_TEXT:
+                rc = sqlite3_bind_text(st, i + 1, parameters[i].data, parameters[i].size, SQLITE_STATIC);
+                break;
+            case SQLITE_BLOB:
+                rc = sqlite3_bind_blob(st, i + 1, parameters[i].data, parameters[i].size, SQLITE_STATIC);
+                break;
+            default:
+                rc = sqlite3_bind_null(st, i + 1);
+                break;
+        }
+    }
+
+    return rc;
+}
+
+void pysqlite_shard_value_result(sqlite3_context* context, pysqlite_ShardValue* value)
+{
+    switch (value->type) {
+        case SQLITE_INTEGER:
+            sqlite3_result_int64(context, value->i);
+            break;
+        case SQLITE_FLOAT:
+            sqlite3_result_double(context, value->d);
+            break;
+        case SQLITE_TEXT:
+            sqlite3_result_text(context, value->data, value->size, SQLITE_TRANSIENT);
+            break;
+        case SQLITE_BLOB:
+            sqlite3_result_blob(context, value->data, value->size, SQLITE_TRANSIENT);
+            break;
+        default:
+            sqlite3_result_null(context);
+            break;
+    }
+}
+
+/* Ends the query on a shard: finalizes the statement and returns its result
+ * code if the last step failed, or rc otherwise. */
+static int shard_finalize(pysqlite_Shard* shard, int rc)
+{
+    int finalize_rc;
+
+    if (shard->st) {
+        /* with sqlite3_prepare, the real error code comes from finalize */
+        finalize_rc = sqlite3_finalize(shard->st);
+        shard->st = NULL;
+        if (rc == SQLITE_ERROR && finalize_rc != SQLITE_OK) {
+            rc = finalize_rc;
+        }
+    }
+
+    return rc;
+}
+
+/* Copies the next batch of rows of the shard's statement. Doesn't need the
+ * GIL. */
+static void shard_fetch(pysqlite_Shard* shard)
+{
+    pysqlite_ShardValue* values;
+    int rc = SQLITE_ROW;
+    int i;
+
+    shard_clear_batch(shard);
+
+    if (shard->capacity == 0) {
+        values = sqlite3_malloc(SHARD_BATCH_ROWS * (shard->ncols ? shard->ncols : 1) * sizeof(pysqlite_ShardValue));
+        if (!values) {
+            shard->rc = shard_finalize(shard, SQLITE_NOMEM);
+            return;
+        }
+        shard->values = values;
+        shard->capacity = SHARD_BATCH_ROWS;
+    }
+
+    while (shard->nrows < shard->capacity) {
+        rc = sqlite3_step(shard->st);
+        if (rc != SQLITE_ROW) {
+            break;
+        }
+
+        values = shard->values + shard->nrows * shard->ncols;
+        shard->nrows++;
+        for (i = 0; i < shard->ncols; i++) {
+            values[i].data = NULL;
+        }
+        for (i = 0; i < shard->ncols && rc == SQLITE_ROW; i++) {
+            if (shard_copy_column(&values[i], shard->st, i) != SQLITE_OK) {
+                rc = SQLITE_NOMEM;
+            }
+        }
+        if (rc != SQLITE_ROW) {
+            break;
+        }
+    }
+
+    if (rc != SQLITE_ROW) {
+        rc = shard_finalize(shard, rc);
+        if (rc != SQLITE_DONE) {
+            shard_clear_batch(shard);
+        }
+    }
+    shard->rc = rc;
+}
+
+/* Starts the current query on one shard and copies its first batch of rows. */
+static void shard_start(pysqlite_ShardSet* self, pysqlite_Shard* shard)
+{
+    int rc;
+
+    shard_clear_rows(shard);
+
+    rc = sqlite3_prepare(shard->db, self->sql, -1, &shard->st, NULL);
+    if (rc == SQLITE_OK && shard->st) {
+        if (sqlite3_bind_parameter_count(shard->st) != self->nparams) {
+            rc = SQLITE_RANGE;
+        } else {
+            rc = pysqlite_shard_bind(shard->st, self->parameters, self->nparams);
+        }
+    }
+
+    if (rc == SQLITE_OK && shard->st) {
+        shard->ncols = sqlite3_column_count(shard->st);
+        shard_fetch(shard);
+    } else if (rc == SQLITE_OK) {
+        /* the SQL consisted only of whitespace or comments */
+        shard->rc = SQLITE_DONE;
+    } else {
+        shard->rc = shard_finalize(shard, rc);
+    }
+}
+
+/* Takes shards off the task list until none are left. */
+static void shard_worker(void* arg)
+{
+    pysqlite_ShardSet* self = (pysqlite_ShardSet*)arg;
+    int i;
+    int last;
+
+    while (1) {
+        PyThread_acquire_lock(self->tasks, WAIT_LOCK);
+        i = self->next_shard++;
+        PyThread_release_lock(self->tasks);
+
+        if (i >= self->count) {
+            break;
+        }
+        shard_start(self, &self->shards[i]);
+    }
+
+    PyThread_acquire_lock(self->tasks, WAIT_LOCK);
+    last = (--self->running == 0);
+    PyThread_release_lock(self->tasks);
+
+    if (last) {
+        PyThread_release_lock(self->done);
+    }
+}
+
+/* Converts a query parameter. Returns 0, or -1 with an exception set. */
+int pysqlite_shard_value_from_object(pysqlite_ShardValue* value, PyObject* obj, int pos)
+{
+    PyObject* utf8 = NULL;
+    const char* data;
+    Py_ssize_t size;
+
+    value->data = NULL;
+    value->size = 0;
+
+    if (obj == Py_None) {
+        value->type = SQLITE_NULL;
+        return 0;
+    } else if (PyInt_Check(obj)) {
+        value->type = SQLITE_INTEGER;
+        value->i = PyInt_AsLong(obj);
+        return 0;
+    } else if (PyLong_Check(obj)) {
+        value->type = SQLITE_INTEGER;
+        value->i = PyLong_AsLongLong(obj);
+        return PyErr_Occurred() ? -1 : 0;
+    } else if (PyFloat_Check(obj)) {
+        value->type = SQLITE_FLOAT;
+        value->d = PyFloat_AsDouble(obj);
+        return 0;
+    } else if (PyString_Check(obj)) {
+        value->type = SQLITE_TEXT;
+        data = PyString_AsString(obj);
+        size = PyString_Size(obj);
+    } else if (PyUnicode_Check(obj)) {
+        value->type = SQLITE_TEXT;
+        utf8 = PyUnicode_AsUTF8String(obj);
+        if (!utf8) {
+            return -1;
+        }
+        data = PyString_AsString(utf8);
+        size = PyString_Size(utf8);
+    } else if (PyBuffer_Check(obj)) {
+        value->type = SQLITE_BLOB;
+        if (PyObject_AsCharBuffer(obj, &data, &size) != 0) {
+            return -1;
+        }
+    } else {
+        PyErr_Format(pysqlite_InterfaceError, "Error binding parameter %d - probably unsupported type.", pos);
+        return -1;
+    }
+
+    if (size >= INT_MAX) {
+        Py_XDECREF(utf8);
+        PyErr_SetString(pysqlite_DataError, "parameter too large");
+        return -1;
+    }
+
+    value->data = sqlite3_malloc((int)size + 1);
+    if (!value->data) {
+        Py_XDECREF(utf8);
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(value->data, data, size);
+    value->data[size] = 0;
+    value->size = (int)size;
+
+    Py_XDECREF(utf8);
+    return 0;
+}
+
+static PyObject* shard_value_to_object(pysqlite_ShardValue* value)
+{
+    PyObject* buffer;
+    void* raw_buffer;
+    Py_ssize_t nbytes;
+
+    switch (value->type) {
+        case SQLITE_INTEGER:
+            if (value->i < INT32_MIN || value->i > INT32_MAX) {
+                return PyLong_FromLongLong(value->i);
+            } else {
+                return PyInt_FromLong((long)value->i);
+            }
+        case SQLITE_FLOAT:
+            return PyFloat_FromDouble(value->d);
+        case SQLITE_TEXT:
+            return PyUnicode_DecodeUTF8(value->data, value->size, NULL);
+        case SQLITE_BLOB:
+            buffer = PyBuffer_New(value->size);
+            if (!buffer) {
+                return NULL;
+            }
+            if (PyObject_AsWriteBuffer(buffer, &raw_buffer, &nbytes)) {
+                Py_DECREF(buffer);
+                return NULL;
+            }
+            memcpy(raw_buffer, value->data, value->size);
+            return buffer;
+        default:
+            Py_INCREF(Py_None);
+            return Py_None;
+    }
+}
+
+/* Ranks the storage classes the way SQLite sorts them */
+static int shard_type_rank(int type)
+{
+    switch (type) {
+        case SQLITE_NULL:
+            return 0;
+        case SQLITE_INTEGER:
+        case SQLITE_FLOAT:
+            return 1;
+        case SQLITE_TEXT:
+            return 2;
+        default:
+            return 3;
+    }
+}
+
+/* Compares two values like ORDER BY does with the BINARY collation. */
+static int shard_value_compare(pysqlite_ShardValue* a, pysqlite_ShardValue* b)
+{
+    int rank_a = shard_type_rank(a->type);
+    int rank_b = shard_type_rank(b->type);
+    double da, db;
+    int rc;
+
+    if (rank_a != rank_b) {
+        return rank_a < rank_b ? -1 : 1;
+    }
+
+    switch (rank_a) {
+        case 0:
+            return 0;
+        case 1:
+            if (a->type == SQLITE_INTEGER && b->type == SQLITE_INTEGER) {
+                return (a->i < b->i) ? -1 : (a->i > b->i);
+            }
+            da = (a->type == SQLITE_INTEGER) ? (double)a->i : a->d;
+            db = (b->type == SQLITE_INTEGER) ? (double)b->i : b->d;
+            return (da < db) ? -1 : (da > db);
+        default:
+            rc = memcmp(a->data, b->data, a->size < b->size ? a->size : b->size);
+            if (rc == 0) {
+                rc = a->size - b->size;
+            }
+            return rc;
+    }
+}
+
+static int shard_busy_handler(void* data, int count)
+{
+    pysqlite_Shard* shard = (pysqlite_Shard*)data;
+
+    return pysqlite_busy_backoff(count, shard->timeout, &shard->busy_started, &shard->busy_waits, &shard->busy_time);
+}
+
+static int pysqlite_shard_set_init(pysqlite_ShardSet* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"databases", "threads", "timeout", NULL};
+
+    PyObject* databases;
+    PyObject* database;
+    PyObject* database_utf8;
+    int threads = 0;
+    double timeout = 5.0;
+    int count;
+    int rc;
+    int i;
+
+    if (self->databases) {
+        PyErr_SetString(pysqlite_ProgrammingError, "ShardSet.__init__ can only be called once.");
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|id", kwlist, &databases, &threads, &timeout)) {
+        return -1;
+    }
+
+    databases = PySequence_Tuple(databases);
+    if (!databases) {
+        return -1;
+    }
+    self->databases = databases;
+
+    count = (int)PyTuple_GET_SIZE(databases);
+    if (count < 1) {
+        PyErr_SetString(PyExc_ValueError, "a ShardSet needs at least one database");
+        return -1;
+    }
+
+    self->busy = PyThread_allocate_lock();
+    self->tasks = PyThread_allocate_lock();
+    self->done = PyThread_allocate_lock();
+    self->shards = PyMem_Malloc(count * sizeof(pysqlite_Shard));
+    if (!self->busy || !self->tasks || !self->done || !self->shards) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    PyThread_acquire_lock(self->done, NOWAIT_LOCK);
+    memset(self->shards, 0, count * sizeof(pysqlite_Shard));
+
+    self->threads = (threads > 0 && threads < count) ? threads : count;
+
+    for (i = 0; i < count; i++) {
+        database = PyTuple_GET_ITEM(databases, i);
+        if (PyUnicode_Check(database)) {
+            database_utf8 = PyUnicode_AsUTF8String(database);
+        } else if (PyString_Check(database)) {
+            Py_INCREF(database);
+            database_utf8 = database;
+        } else {
+            PyErr_SetString(PyExc_TypeError, "database names must be strings");
+            return -1;
+        }
+        if (!database_utf8) {
+            return -1;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        rc = sqlite3_open(PyString_AsString(database_utf8), &self->shards[i].db);
+        Py_END_ALLOW_THREADS
+        Py_DECREF(database_utf8);
+
+        /* the shard is closed in dealloc, even if opening it failed */
+        self->count = i + 1;
+
+        if (rc != SQLITE_OK) {
+            _pysqlite_seterror(self->shards[i].db, NULL);
+            return -1;
+        }
+        self->shards[i].timeout = timeout;
+        (void)sqlite3_busy_handler(self->shards[i].db, shard_busy_handler, (void*)&self->shards[i]);
+    }
+
+    return 0;
+}
+
+/* Ends the current query: finalizes the statements of all shards and frees
+ * their rows and the parameters. Its ShardResult becomes stale. */
+static void shard_end_query(pysqlite_ShardSet* self)
+{
+    int i;
+
+    for (i = 0; i < self->count; i++) {
+        (void)shard_finalize(&self->shards[i], SQLITE_OK);
+        shard_clear_rows(&self->shards[i]);
+        self->shards[i].rc = SQLITE_DONE;
+    }
+
+    if (self->parameters) {
+        for (i = 0; i < self->nparams; i++) {
+            pysqlite_shard_value_clear(&self->parameters[i]);
+        }
+        PyMem_Free(self->parameters);
+        self->parameters = NULL;
+    }
+    self->nparams = 0;
+
+    self->query_serial++;
+}
+
+static void shard_close_all(pysqlite_ShardSet* self)
+{
+    int i;
+
+    shard_end_query(self);
+
+    for (i = 0; i < self->count; i++) {
+        if (self->shards[i].db) {
+            Py_BEGIN_ALLOW_THREADS
+            sqlite3_close(self->shards[i].db);
+            Py_END_ALLOW_THREADS
+            self->shards[i].db = NULL;
+        }
+    }
+    self->closed = 1;
+}
+
+static void pysqlite_shard_set_dealloc(pysqlite_ShardSet* self)
+{
+    if (self->shards) {
+        shard_close_all(self);
+        PyMem_Free(self->shards);
+    }
+
+    if (self->busy) {
+        PyThread_free_lock(self->busy);
+    }
+    if (self->tasks) {
+        PyThread_free_lock(self->tasks);
+    }
+    if (self->done) {
+        PyThread_free_lock(self->done);
+    }
+
+    Py_XDECREF(self->databases);
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int check_shard_set(pysqlite_ShardSet* self)
+{
+    if (!self->databases) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base ShardSet.__init__ not called.");
+        return 0;
+    }
+
+    if (self->closed) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Cannot operate on a closed ShardSet.");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Runs the current query on all shards and waits for them. */
+static void shard_run_all(pysqlite_ShardSet* self)
+{
+    int i;
+
+    self->next_shard = 0;
+    self->running = self->threads;
+
+    /* the calling thread is one of the workers */
+    for (i = 1; i < self->threads; i++) {
+        if (PyThread_start_new_thread(shard_worker, (void*)self) == -1) {
+            PyThread_acquire_lock(self->tasks, WAIT_LOCK);
+            self->running -= self->threads - i;
+            PyThread_release_lock(self->tasks);
+            break;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    shard_worker((void*)self);
+    PyThread_acquire_lock(self->done, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+}
+
+/* Waits for the shard set to be free. */
+static void shard_acquire(pysqlite_ShardSet* self)
+{
+    if (!PyThread_acquire_lock(self->busy, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->busy, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+/* Sets the exception for a shard whose last batch failed. */
+static void shard_seterror(pysqlite_Shard* shard)
+{
+    if (shard->rc == SQLITE_NOMEM) {
+        PyErr_NoMemory();
+    } else if (shard->rc == SQLITE_RANGE) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Incorrect number of bindings supplied.");
+    } else {
+        _pysqlite_seterror(shard->db, NULL);
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(pysqlite_OperationalError, "shard query failed");
+        }
+    }
+}
+
+static PyObject* pysqlite_shard_set_execute(pysqlite_ShardSet* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"sql", "parameters", "key", NULL};
+
+    PyObject* sql;
+    PyObject* sql_utf8 = NULL;
+    PyObject* parameters = NULL;
+    PyObject* key_obj = Py_None;
+    PyObject* result = NULL;
+    pysqlite_ShardResult* result_obj;
+    pysqlite_Shard* shard;
+    int key = -1;
+    int nparams = 0;
+    int i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OO:execute", kwlist, &sql, &parameters, &key_obj)) {
+        return NULL;
+    }
+
+    if (!check_shard_set(self)) {
+        return NULL;
+    }
+
+    if (PyUnicode_Check(sql)) {
+        sql_utf8 = PyUnicode_AsUTF8String(sql);
+    } else if (PyString_Check(sql)) {
+        Py_INCREF(sql);
+        sql_utf8 = sql;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "operation parameter must be str or unicode");
+        return NULL;
+    }
+    if (!sql_utf8) {
+        return NULL;
+    }
+
+    if (key_obj != Py_None) {
+        key = (int)PyInt_AsLong(key_obj);
+        if (PyErr_Occurred()) {
+            Py_DECREF(sql_utf8);
+            return NULL;
+        }
+        if (key < 0) {
+            Py_DECREF(sql_utf8);
+            PyErr_SetString(PyExc_ValueError, "key must be a column index");
+            return NULL;
+        }
+    }
+
+    if (parameters) {
+        parameters = PySequence_Fast(parameters, "parameters are of unsupported type");
+        if (!parameters) {
+            Py_DECREF(sql_utf8);
+            return NULL;
+        }
+        nparams = (int)PySequence_Fast_GET_SIZE(parameters);
+    }
+
+    /* only one query at a time; if another thread runs one, wait for it */
+    shard_acquire(self);
+
+    if (self->closed) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Cannot operate on a closed ShardSet.");
+        goto error;
+    }
+
+    /* a result that is still being iterated ends here */
+    shard_end_query(self);
+
+    self->sql = PyString_AsString(sql_utf8);
+    self->nparams = 0;
+    self->parameters = PyMem_Malloc((nparams ? nparams : 1) * sizeof(pysqlite_ShardValue));
+    if (!self->parameters) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i = 0; i < nparams; i++) {
+        if (pysqlite_shard_value_from_object(&self->parameters[i], PySequence_Fast_GET_ITEM(parameters, i), i) != 0) {
+            goto error;
+        }
+        self->nparams++;
+    }
+
+    shard_run_all(self);
+    self->sql = NULL;
+
+    for (i = 0; i < self->count; i++) {
+        shard = &self->shards[i];
+        if (shard->rc != SQLITE_ROW && shard->rc != SQLITE_DONE) {
+            shard_seterror(shard);
+            goto error;
+        }
+        if (key >= shard->ncols && shard->nrows > 0) {
+            PyErr_SetString(pysqlite_ProgrammingError, "key column index out of range");
+            goto error;
+        }
+    }
+
+    result_obj = PyObject_New(pysqlite_ShardResult, &pysqlite_ShardResultType);
+    if (result_obj) {
+        Py_INCREF(self);
+        result_obj->set = self;
+        result_obj->serial = self->query_serial;
+        result_obj->key = key;
+        result_obj->finished = 0;
+        result = (PyObject*)result_obj;
+    }
+
+error:
+    self->sql = NULL;
+    if (!result) {
+        shard_end_query(self);
+    }
+
+    PyThread_release_lock(self->busy);
+
+    Py_XDECREF(parameters);
+    Py_DECREF(sql_utf8);
+
+    return result;
+}
+
+static PyObject* pysqlite_shard_set_close(pysqlite_ShardSet* self, PyObject* args)
+{
+    if (!self->databases) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Base ShardSet.__init__ not called.");
+        return NULL;
+    }
+
+    if (!self->closed) {
+        shard_acquire(self);
+        shard_close_all(self);
+        PyThread_release_lock(self->busy);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static void pysqlite_shard_result_dealloc(pysqlite_ShardResult* self)
+{
+    pysqlite_ShardSet* set = self->set;
+
+    /* a result that is dropped early frees the statements of its query */
+    if (!self->finished) {
+        shard_acquire(set);
+        if (self->serial == set->query_serial) {
+            shard_end_query(set);
+        }
+        PyThread_release_lock(set->busy);
+    }
+    Py_DECREF(set);
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Copies the next batch of every shard that has used up its rows but whose
+ * query has more. Doesn't need the GIL. */
+static void shard_refill(pysqlite_ShardSet* set)
+{
+    pysqlite_Shard* shard;
+    int i;
+
+    for (i = 0; i < set->count; i++) {
+        shard = &set->shards[i];
+        if (shard->position >= shard->nrows && shard->rc == SQLITE_ROW) {
+            shard_fetch(shard);
+        }
+    }
+}
+
+static PyObject* pysqlite_shard_result_iternext(pysqlite_ShardResult* self)
+{
+    pysqlite_ShardSet* set = self->set;
+    pysqlite_Shard* shard;
+    pysqlite_ShardValue* row;
+    pysqlite_ShardValue* best_row = NULL;
+    PyObject* tuple = NULL;
+    PyObject* item;
+    int best = -1;
+    int i;
+
+    if (self->finished) {
+        return NULL;
+    }
+
+    shard_acquire(set);
+
+    if (set->closed || self->serial != set->query_serial) {
+        PyErr_SetString(pysqlite_ProgrammingError, "The ShardSet ran another query or was closed since this result was created.");
+        self->finished = 1;
+        goto error;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    shard_refill(set);
+    Py_END_ALLOW_THREADS
+
+    for (i = 0; i < set->count; i++) {
+        shard = &set->shards[i];
+        if (shard->rc != SQLITE_ROW && shard->rc != SQLITE_DONE) {
+            shard_seterror(shard);
+            self->finished = 1;
+            shard_end_query(set);
+            goto error;
+        }
+        if (shard->position >= shard->nrows) {
+            continue;
+        }
+
+        row = shard->values + shard->position * shard->ncols;
+        if (self->key < 0) {
+            best = i;
+            best_row = row;
+            break;
+        }
+
+        /* on equal keys, the shard that comes first wins */
+        if (best < 0 || shard_value_compare(&row[self->key], &best_row[self->key]) < 0) {
+            best = i;
+            best_row = row;
+        }
+    }
+
+    if (best < 0) {
+        self->finished = 1;
+        shard_end_query(set);
+        goto error;
+    }
+
+    shard = &set->shards[best];
+    tuple = PyTuple_New(shard->ncols);
+    if (!tuple) {
+        goto error;
+    }
+    for (i = 0; i < shard->ncols; i++) {
+        item = shard_value_to_object(&best_row[i]);
+        if (!item) {
+            Py_DECREF(tuple);
+            tuple = NULL;
+            goto error;
+        }
+        PyTuple_SET_ITEM(tuple, i, item);
+    }
+
+    shard->position++;
+
+error:
+    PyThread_release_lock(set->busy);
+
+    return tuple;
+}
+
+static PyObject* pysqlite_shard_set_get_busy_waits(pysqlite_ShardSet* self, void* unused)
+{
+    long waits = 0;
+    int i;
+
+    for (i = 0; i < self->count; i++) {
+        waits += self->shards[i].busy_waits;
+    }
+
+    return PyInt_FromLong(waits);
+}
+
+static PyObject* pysqlite_shard_set_get_busy_time(pysqlite_ShardSet* self, void* unused)
+{
+    double waited = 0.0;
+    int i;
+
+    for (i = 0; i < self->count; i++) {
+        waited += self->shards[i].busy_time;
+    }
+
+    return PyFloat_FromDouble(waited);
+}
+
+static PyGetSetDef shard_set_getset[] = {
+    {"busy_waits",  (getter)pysqlite_shard_set_get_busy_waits, (setter)0},
+    {"busy_time",  (getter)pysqlite_shard_set_get_busy_time, (setter)0},
+    {NULL}
+};
+
+static PyMethodDef shard_set_methods[] = {
+    {"execute", (PyCFunction)pysqlite_shard_set_execute, METH_VARARGS|METH_KEYWORDS,
+        PyDoc_STR("Runs a statement on all shards and returns an iterator over the merged rows.")},
+    {"close", (PyCFunction)pysqlite_shard_set_close, METH_NOARGS,
+        PyDoc_STR("Closes all shards.")},
+    {NULL, NULL}
+};
+
+static struct PyMemberDef shard_set_members[] =
+{
+    {"databases", T_OBJECT, offsetof(pysqlite_ShardSet, databases), RO},
+    {"threads", T_INT, offsetof(pysqlite_ShardSet, threads), RO},
+    {NULL}
+};
+
+static char shard_set_doc[] =
+PyDoc_STR("Runs the same queries on a set of database files in parallel.");
+
+static char shard_result_doc[] =
+PyDoc_STR("The rows of a ShardSet query.");
+
+PyTypeObject pysqlite_ShardSetType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        MODULE_NAME ".ShardSet",                        /* tp_name */
+        sizeof(pysqlite_ShardSet),                      /* tp_basicsize */
+        0,                                              /* tp_itemsize */
+        (destructor)pysqlite_shard_set_dealloc,         /* tp_dealloc */
+        0,                                              /* tp_print */
+        0,                                              /* tp_getattr */
+        0,                                              /* tp_setattr */
+        0,                                              /* tp_compare */
+        0,                                              /* tp_repr */
+        0,                                              /* tp_as_number */
+        0,                                              /* tp_as_sequence */
+        0,                                              /* tp_as_mapping */
+        0,                                              /* tp_hash */
+        0,                                              /* tp_call */
+        0,                                              /* tp_str */
+        0,                                              /* tp_getattro */
+        0,                                              /* tp_setattro */
+        0,                                              /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,         /* tp_flags */
+        shard_set_doc,                                  /* tp_doc */
+        0,                                              /* tp_traverse */
+        0,                                              /* tp_clear */
+        0,                                              /* tp_richcompare */
+        0,                                              /* tp_weaklistoffset */
+        0,                                              /* tp_iter */
+        0,                                              /* tp_iternext */
+        shard_set_methods,                              /* tp_methods */
+        shard_set_members,                              /* tp_members */
+        shard_set_getset,                               /* tp_getset */
+        0,                                              /* tp_base */
+        0,                                              /* tp_dict */
+        0,                                              /* tp_descr_get */
+        0,                                              /* tp_descr_set */
+        0,                                              /* tp_dictoffset */
+        (initproc)pysqlite_shard_set_init,              /* tp_init */
+        0,                                              /* tp_alloc */
+        0,                                              /* tp_new */
+        0                                               /* tp_free */
+};
+
+PyTypeObject pysqlite_ShardResultType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        MODULE_NAME ".ShardResult",                     /* tp_name */
+        sizeof(pysqlite_ShardResult),                   /* tp_basicsize */
+        0,                                              /* tp_itemsize */
+        (destructor)pysqlite_shard_result_dealloc,      /* tp_dealloc */
+        0,                                              /* tp_print */
+        0,                                              /* tp_getattr */
+        0,                                              /* tp_setattr */
+        0,                                              /* tp_compare */
+        0,                                              /* tp_repr */
+        0,                                              /* tp_as_number */
+        0,                                              /* tp_as_sequence */
+        0,                                              /* tp_as_mapping */
+        0,                                              /* tp_hash */
+        0,                                              /* tp_call */
+        0,                                              /* tp_str */
+        0,                                              /* tp_getattro */
+        0,                                              /* tp_setattro */
+        0,                                              /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_ITER,        /* tp_flags */
+        shard_result_doc,                               /* tp_doc */
+        0,                                              /* tp_traverse */
+        0,                                              /* tp_clear */
+        0,                                              /* tp_richcompare */
+        0,                                              /* tp_weaklistoffset */
+        PyObject_SelfIter,                              /* tp_iter */
+        (iternextfunc)pysqlite_shard_result_iternext,   /* tp_iternext */
+        0,                                              /* tp_methods */
+        0,                                              /* tp_members */
+        0,                                              /* tp_getset */
+        0,                                              /* tp_base */
+        0,                                              /* tp_dict */
+        0,                                              /* tp_descr_get */
+        0,                                              /* tp_descr_set */
+        0,                                              /* tp_dictoffset */
+        (initproc)0,                                    /* tp_init */
+        0,                                              /* tp_alloc */
+        0,                                              /* tp_new */
+        0                                               /* tp_free */
+};
+
+extern int pysqlite_shard_setup_types(void)
+{
+    int rc;
+
+    pysqlite_ShardSetType.tp_new = PyType_GenericNew;
+    rc = PyType_Ready(&pysqlite_ShardSetType);
+    if (rc < 0) {
+        return rc;
+    }
+    return PyType_Ready(&pysqlite_ShardResultType);
+}
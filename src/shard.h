@@ -0,0 +1,145 @@
+/* shard.h - definitions for queries over sets of database files
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef PYSQLITE_SHARD_H
+#define PYSQLITE_SHARD_H
+#include "Python.h"
+
+#include "pythread.h"
+#include "sqlite3.h"
+
+/* A copy of an SQLite value that can be made and kept without the GIL. The
+ * memory for text and blobs is managed with sqlite3_malloc. Text is
+ * zero-terminated. */
+typedef struct
+{
+    int type;
+    sqlite3_int64 i;
+    double d;
+    char* data;
+    int size;
+} pysqlite_ShardValue;
+
+/* One database file of a shard set and the current batch of rows of its
+ * query */
+typedef struct
+{
+    sqlite3* db;
+
+    /* the statement of the current query while it may have more rows, or
+     * NULL */
+    sqlite3_stmt* st;
+
+    /* the outcome of the last batch: SQLITE_ROW if more rows may follow,
+     * SQLITE_DONE, or an error code */
+    int rc;
+
+    /* the rows of the batch, ncols values per row, and the next one to
+     * return; there is room for capacity rows */
+    int ncols;
+    int nrows;
+    int capacity;
+    int position;
+    pysqlite_ShardValue* values;
+
+    /* the lock timeout, and the state and statistics of the busy handler */
+    double timeout;
+    double busy_started;
+    long busy_waits;
+    double busy_time;
+} pysqlite_Shard;
+
+typedef struct
+{
+    PyObject_HEAD
+
+    /* a tuple of the database file names */
+    PyObject* databases;
+
+    pysqlite_Shard* shards;
+    int count;
+
+    /* the most worker threads a query uses, including the calling thread */
+    int threads;
+
+    /* held while a query runs, so that only one thread at a time can use
+     * the shard set */
+    PyThread_type_lock busy;
+
+    /* the query that is being started, and the next shard that needs a
+     * worker. The parameters stay bound until the query ends. */
+    const char* sql;
+    pysqlite_ShardValue* parameters;
+    int nparams;
+    int next_shard;
+
+    /* incremented whenever a query ends, which makes its ShardResult stale */
+    long query_serial;
+
+    /* guards next_shard and running; done is released by the last worker */
+    PyThread_type_lock tasks;
+    PyThread_type_lock done;
+    int running;
+
+    int closed;
+} pysqlite_ShardSet;
+
+/* The rows of a query over a shard set, merged into a single iterator. The
+ * rows are fetched from the shards in batches as the iterator advances. */
+typedef struct
+{
+    PyObject_HEAD
+
+    /* the shard set, and its query_serial while the query runs */
+    pysqlite_ShardSet* set;
+    long serial;
+
+    /* set once all rows were returned or an error ended the query */
+    int finished;
+
+    /* the column the shards are ordered by, or -1 to return the rows of one
+     * shard after another */
+    int key;
+} pysqlite_ShardResult;
+
+extern PyTypeObject pysqlite_ShardSetType;
+extern PyTypeObject pysqlite_ShardResultType;
+
+/* Converts a Python object to a pysqlite_ShardValue. Needs the GIL. Returns 0,
+ * or -1 with an exception set; pos is the parameter index for the message. */
+int pysqlite_shard_value_from_object(pysqlite_ShardValue* value, PyObject* obj, int pos);
+
+/* Frees the memory of a value. Doesn't need the GIL. */
+void pysqlite_shard_value_clear(pysqlite_ShardValue* value);
+
+/* Binds nparams values to the first parameters of a statement. Doesn't need
+ * the GIL. The values must outlive the statement execution. */
+int pysqlite_shard_bind(sqlite3_stmt* st, pysqlite_ShardValue* parameters, int nparams);
+
+/* Sets the result of a function or virtual table column to a copy of a
+ * value. Doesn't need the GIL. */
+void pysqlite_shard_value_result(sqlite3_context* context, pysqlite_ShardValue* value);
+
+int pysqlite_shard_setup_types(void);
+
+#endif
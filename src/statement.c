@@ -26,6 +26,7 @@
 #include "connection.h"
 #include "microprotocols.h"
 #include "prepare_protocol.h"
+#include "util.h"
 #include "sqlitecompat.h"
 
 /* prototypes */
@@ -59,6 +60,15 @@ int pysqlite_statement_create(pysqlite_Statement* self, pysqlite_Connection* con
 
     self->st = NULL;
     self->in_use = 0;
+    self->sql = NULL;
+    self->in_weakreflist = NULL;
+    self->connection = NULL;
+    self->prev = NULL;
+    self->next = NULL;
+    memset(&self->reads, 0, sizeof(pysqlite_NameSet));
+    memset(&self->writes, 0, sizeof(pysqlite_NameSet));
+    self->owns_connection = 0;
+    self->has_row = 0;
 
     if (PyString_Check(sql)) {
         sql_str = sql;
@@ -74,18 +84,14 @@ int pysqlite_statement_create(pysqlite_Statement* self, pysqlite_Connection* con
         return rc;
     }
 
-    self->in_weakreflist = NULL;
     self->sql = sql_str;
 
+    pysqlite_connection_register_statement(connection, (PyObject*)self);
+
     sql_cstr = PyString_AsString(sql_str);
 
-    Py_BEGIN_ALLOW_THREADS
-    rc = sqlite3_prepare(connection->db,
-                         sql_cstr,
-                         -1,
-                         &self->st,
-                         &tail);
-    Py_END_ALLOW_THREADS
+    /* let the authorizer tell us which tables this statement uses */
+    rc = pysqlite_connection_prepare(connection, sql_cstr, &self->st, &tail, &self->reads, &self->writes);
 
     self->db = connection->db;
 
@@ -327,16 +333,23 @@ int pysqlite_statement_recompile(pysqlite_Statement* self, PyObject* params)
     int rc;
     char* sql_cstr;
     sqlite3_stmt* new_st;
+    pysqlite_NameSet reads = {NULL, NULL, 0, NULL, 0};
+    pysqlite_NameSet writes = {NULL, NULL, 0, NULL, 0};
 
     sql_cstr = PyString_AsString(self->sql);
 
-    Py_BEGIN_ALLOW_THREADS
-    rc = sqlite3_prepare(self->db,
-                         sql_cstr,
-                         -1,
-                         &new_st,
-                         &tail);
-    Py_END_ALLOW_THREADS
+    if (self->connection) {
+        /* the schema changed, so the statement may depend on other tables */
+        rc = pysqlite_connection_prepare(self->connection, sql_cstr, &new_st, &tail, &reads, &writes);
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        rc = sqlite3_prepare(self->db,
+                             sql_cstr,
+                             -1,
+                             &new_st,
+                             &tail);
+        Py_END_ALLOW_THREADS
+    }
 
     if (rc == SQLITE_OK) {
         /* The efficient sqlite3_transfer_bindings is only available in SQLite
@@ -357,8 +370,25 @@ int pysqlite_statement_recompile(pysqlite_Statement* self, PyObject* params)
 
         (void)sqlite3_finalize(self->st);
         self->st = new_st;
+
+        if (self->connection) {
+            pysqlite_nameset_clear(&self->reads);
+            pysqlite_nameset_clear(&self->writes);
+            self->reads = reads;
+            self->writes = writes;
+
+            /* the new program may need more or less memory than the old one */
+            if (self->connection->statement_cache
+                    && pysqlite_cache_refresh_cost(self->connection->statement_cache, (PyObject*)self) != 0) {
+                PyErr_Clear();
+            }
+            return rc;
+        }
     }
 
+    pysqlite_nameset_clear(&reads);
+    pysqlite_nameset_clear(&writes);
+
     return rc;
 }
 
@@ -403,9 +433,32 @@ void pysqlite_statement_mark_dirty(pysqlite_Statement* self)
     self->in_use = 1;
 }
 
+/*
+ * Returns the approximate number of heap bytes used by the prepared statement.
+ * Used as the cost function of the connection's statement cache.
+ */
+Py_ssize_t pysqlite_statement_memory_used(PyObject* self)
+{
+    pysqlite_Statement* statement = (pysqlite_Statement*)self;
+
+#if SQLITE_VERSION_NUMBER >= 3020000
+    if (statement->st) {
+        return (Py_ssize_t)sqlite3_stmt_status(statement->st, SQLITE_STMTSTATUS_MEMUSED, 0);
+    }
+#endif
+
+    /* older SQLite versions can't tell us, so the SQL length has to do */
+    return statement->sql ? PyString_GET_SIZE(statement->sql) : 0;
+}
+
 void pysqlite_statement_dealloc(pysqlite_Statement* self)
 {
     int rc;
+    pysqlite_Connection* owner;
+
+    owner = self->owns_connection ? self->connection : NULL;
+
+    pysqlite_connection_unregister_statement((PyObject*)self);
 
     if (self->st) {
         Py_BEGIN_ALLOW_THREADS
@@ -415,6 +468,12 @@ void pysqlite_statement_dealloc(pysqlite_Statement* self)
 
     self->st = NULL;
 
+    /* only now, as finalizing needs the database handle */
+    Py_XDECREF(owner);
+
+    pysqlite_nameset_clear(&self->reads);
+    pysqlite_nameset_clear(&self->writes);
+
     Py_XDECREF(self->sql);
 
     if (self->in_weakreflist != NULL) {
@@ -424,6 +483,341 @@ void pysqlite_statement_dealloc(pysqlite_Statement* self)
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
+/*
+ * Checks if a statement can be used directly from Python.
+ *
+ * 0 => error; 1 => ok
+ */
+static int check_statement(pysqlite_Statement* self)
+{
+    if (!self->owns_connection || !self->connection) {
+        PyErr_SetString(pysqlite_ProgrammingError, "Only statements created by calling a connection can be used directly.");
+        return 0;
+    }
+
+    return pysqlite_check_thread(self->connection) && pysqlite_check_connection(self->connection);
+}
+
+/*
+ * Resets the statement, optionally binds new parameters and steps it once.
+ * Unlike Cursor.execute(), this doesn't consult the statement cache, sniff the
+ * kind of statement or build a description.
+ *
+ * Returns SQLITE_ROW or SQLITE_DONE; -1 with an exception set on error.
+ */
+static int _pysqlite_statement_run(pysqlite_Statement* self, PyObject* parameters)
+{
+    pysqlite_Connection* connection = self->connection;
+    PyObject* result;
+    int allow_8bit_chars;
+    int rc;
+
+    (void)pysqlite_statement_reset(self);
+    self->has_row = 0;
+
+    if (!self->st) {
+        /* the SQL consisted only of whitespace or comments */
+        return SQLITE_DONE;
+    }
+
+    if (parameters) {
+        allow_8bit_chars = ((connection->text_factory != (PyObject*)&PyUnicode_Type) &&
+            (connection->text_factory != pysqlite_OptimizedUnicode));
+
+        pysqlite_statement_bind_parameters(self, parameters, allow_8bit_chars);
+        if (PyErr_Occurred()) {
+            return -1;
+        }
+    }
+
+    /* read-only statements don't need a transaction */
+    if (connection->begin_statement && !connection->inTransaction
+#if SQLITE_VERSION_NUMBER >= 3007004
+            && !sqlite3_stmt_readonly(self->st)
+#endif
+       ) {
+        result = _pysqlite_connection_begin(connection);
+        if (!result) {
+            return -1;
+        }
+        Py_DECREF(result);
+    }
+
+    pysqlite_statement_mark_dirty(self);
+
+    while (1) {
+        rc = pysqlite_step(self->st, connection);
+        if (rc == SQLITE_DONE || rc == SQLITE_ROW) {
+            break;
+        }
+
+        rc = pysqlite_statement_reset(self);
+        if (rc == SQLITE_SCHEMA && pysqlite_statement_recompile(self, parameters) == SQLITE_OK) {
+            pysqlite_statement_mark_dirty(self);
+            continue;
+        }
+
+        if (PyErr_Occurred()) {
+            /* there was an error that occurred in a user-defined callback */
+            if (_enable_callback_tracebacks) {
+                PyErr_Print();
+            } else {
+                PyErr_Clear();
+            }
+        }
+        (void)pysqlite_statement_reset(self);
+        _pysqlite_seterror(connection->db, NULL);
+        connection->inTransaction = !sqlite3_get_autocommit(connection->db);
+        return -1;
+    }
+
+    if (self->writes.count > 0) {
+        pysqlite_connection_invalidate_statements(connection, &self->writes);
+    }
+
+    if (rc == SQLITE_ROW) {
+        self->has_row = 1;
+    } else {
+        (void)pysqlite_statement_reset(self);
+    }
+
+    connection->inTransaction = !sqlite3_get_autocommit(connection->db);
+
+    return rc;
+}
+
+/*
+ * Converts the pending result row and steps to the next one.
+ *
+ * Returns a new reference; NULL without an exception set if there is no
+ * pending row.
+ */
+static PyObject* _pysqlite_statement_next_row(pysqlite_Statement* self)
+{
+    PyObject* row;
+    PyObject* item;
+    int numcols;
+    int i;
+    int rc;
+
+    if (!self->has_row) {
+        return NULL;
+    }
+
+    /* a commit or rollback resets all statements; the rest of the result set
+     * is lost, so don't pretend it was complete */
+    if (!self->in_use) {
+        self->has_row = 0;
+        PyErr_SetString(pysqlite_InterfaceError, "Statement needed to be reset because of commit/rollback and can no longer be fetched from.");
+        return NULL;
+    }
+
+    numcols = sqlite3_data_count(self->st);
+    row = PyTuple_New(numcols);
+    if (!row) {
+        return NULL;
+    }
+
+    for (i = 0; i < numcols; i++) {
+        item = _pysqlite_column_value(self->connection, self->st, i);
+        if (!item) {
+            Py_DECREF(row);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(row, i, item);
+    }
+
+    rc = pysqlite_step(self->st, self->connection);
+    if (rc == SQLITE_DONE) {
+        self->has_row = 0;
+        (void)pysqlite_statement_reset(self);
+    } else if (rc != SQLITE_ROW) {
+        self->has_row = 0;
+        Py_DECREF(row);
+        (void)pysqlite_statement_reset(self);
+        _pysqlite_seterror(self->connection->db, NULL);
+        return NULL;
+    }
+
+    return row;
+}
+
+static PyObject* pysqlite_statement_py_bind(pysqlite_Statement* self, PyObject* args)
+{
+    PyObject* parameters;
+    int allow_8bit_chars;
+
+    if (!PyArg_ParseTuple(args, "O:bind", &parameters)) {
+        return NULL;
+    }
+
+    if (!check_statement(self)) {
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self->connection);
+    (void)pysqlite_statement_reset(self);
+    self->has_row = 0;
+
+    if (self->st) {
+        allow_8bit_chars = ((self->connection->text_factory != (PyObject*)&PyUnicode_Type) &&
+            (self->connection->text_factory != pysqlite_OptimizedUnicode));
+
+        pysqlite_statement_bind_parameters(self, parameters, allow_8bit_chars);
+    }
+    pysqlite_connection_unlock(self->connection);
+
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject* pysqlite_statement_py_execute(pysqlite_Statement* self, PyObject* args)
+{
+    PyObject* parameters = NULL;
+    int rc;
+
+    if (!PyArg_ParseTuple(args, "|O:execute", &parameters)) {
+        return NULL;
+    }
+
+    if (!check_statement(self)) {
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self->connection);
+    rc = _pysqlite_statement_run(self, parameters);
+    pysqlite_connection_unlock(self->connection);
+    if (rc < 0) {
+        return NULL;
+    }
+
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject* pysqlite_statement_py_executemany(pysqlite_Statement* self, PyObject* args)
+{
+    PyObject* seq;
+    PyObject* iter;
+    PyObject* parameters;
+    int rc = SQLITE_DONE;
+
+    if (!PyArg_ParseTuple(args, "O:executemany", &seq)) {
+        return NULL;
+    }
+
+    if (!check_statement(self)) {
+        return NULL;
+    }
+
+    iter = PyObject_GetIter(seq);
+    if (!iter) {
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self->connection);
+    while ((parameters = PyIter_Next(iter))) {
+        rc = _pysqlite_statement_run(self, parameters);
+        Py_DECREF(parameters);
+        if (rc == SQLITE_ROW) {
+            (void)pysqlite_statement_reset(self);
+            self->has_row = 0;
+            PyErr_SetString(pysqlite_ProgrammingError, "executemany() can only execute DML statements.");
+            break;
+        } else if (rc < 0) {
+            break;
+        }
+    }
+    pysqlite_connection_unlock(self->connection);
+    Py_DECREF(iter);
+
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject* pysqlite_statement_iternext(pysqlite_Statement* self)
+{
+    PyObject* row;
+
+    if (!check_statement(self)) {
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self->connection);
+    row = _pysqlite_statement_next_row(self);
+    pysqlite_connection_unlock(self->connection);
+
+    return row;
+}
+
+static PyObject* pysqlite_statement_fetchone(pysqlite_Statement* self, PyObject* args)
+{
+    PyObject* row;
+
+    row = pysqlite_statement_iternext(self);
+    if (!row && !PyErr_Occurred()) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    return row;
+}
+
+static PyObject* pysqlite_statement_fetchall(pysqlite_Statement* self, PyObject* args)
+{
+    PyObject* row;
+    PyObject* list;
+
+    if (!check_statement(self)) {
+        return NULL;
+    }
+
+    list = PyList_New(0);
+    if (!list) {
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self->connection);
+    while ((row = _pysqlite_statement_next_row(self))) {
+        if (PyList_Append(list, row) != 0) {
+            Py_DECREF(row);
+            break;
+        }
+        Py_DECREF(row);
+    }
+    pysqlite_connection_unlock(self->connection);
+
+    if (PyErr_Occurred()) {
+        Py_DECREF(list);
+        return NULL;
+    }
+
+    return list;
+}
+
+static PyObject* pysqlite_statement_py_reset(pysqlite_Statement* self, PyObject* args)
+{
+    if (!check_statement(self)) {
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self->connection);
+    (void)pysqlite_statement_reset(self);
+    self->has_row = 0;
+    pysqlite_connection_unlock(self->connection);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 /*
  * Checks if there is anything left in an SQL string after SQLite compiled it.
  * This is used to check if somebody tried to execute more than one SQL command
@@ -494,6 +888,31 @@ static int pysqlite_check_remaining_sql(const char* tail)
     return 0;
 }
 
+static PyMethodDef statement_methods[] = {
+    {"bind", (PyCFunction)pysqlite_statement_py_bind, METH_VARARGS,
+        PyDoc_STR("Binds parameters without executing the statement.")},
+    {"execute", (PyCFunction)pysqlite_statement_py_execute, METH_VARARGS,
+        PyDoc_STR("Executes the statement, optionally with new parameters.")},
+    {"executemany", (PyCFunction)pysqlite_statement_py_executemany, METH_VARARGS,
+        PyDoc_STR("Repeatedly executes the statement.")},
+    {"fetchone", (PyCFunction)pysqlite_statement_fetchone, METH_NOARGS,
+        PyDoc_STR("Fetches one row from the resultset.")},
+    {"fetchall", (PyCFunction)pysqlite_statement_fetchall, METH_NOARGS,
+        PyDoc_STR("Fetches all rows from the resultset.")},
+    {"reset", (PyCFunction)pysqlite_statement_py_reset, METH_NOARGS,
+        PyDoc_STR("Resets the statement, discarding any pending rows.")},
+    {NULL, NULL}
+};
+
+static struct PyMemberDef statement_members[] =
+{
+    {"sql", T_OBJECT, offsetof(pysqlite_Statement, sql), RO},
+    {NULL}
+};
+
+static char statement_doc[] =
+PyDoc_STR("A prepared SQL statement.");
+
 PyTypeObject pysqlite_StatementType = {
         PyVarObject_HEAD_INIT(NULL, 0)
         MODULE_NAME ".Statement",                       /* tp_name */
@@ -515,15 +934,15 @@ PyTypeObject pysqlite_StatementType = {
         0,                                              /* tp_setattro */
         0,                                              /* tp_as_buffer */
         Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_WEAKREFS,  /* tp_flags */
-        0,                                              /* tp_doc */
+        statement_doc,                                  /* tp_doc */
         0,                                              /* tp_traverse */
         0,                                              /* tp_clear */
         0,                                              /* tp_richcompare */
         offsetof(pysqlite_Statement, in_weakreflist),   /* tp_weaklistoffset */
-        0,                                              /* tp_iter */
-        0,                                              /* tp_iternext */
-        0,                                              /* tp_methods */
-        0,                                              /* tp_members */
+        PyObject_SelfIter,                              /* tp_iter */
+        (iternextfunc)pysqlite_statement_iternext,      /* tp_iternext */
+        statement_methods,                              /* tp_methods */
+        statement_members,                              /* tp_members */
         0,                                              /* tp_getset */
         0,                                              /* tp_base */
         0,                                              /* tp_dict */
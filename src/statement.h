@@ -31,13 +31,33 @@
 #define PYSQLITE_TOO_MUCH_SQL (-100)
 #define PYSQLITE_SQL_WRONG_TYPE (-101)
 
-typedef struct
+typedef struct _pysqlite_Statement
 {
     PyObject_HEAD
     sqlite3* db;
     sqlite3_stmt* st;
     PyObject* sql;
     int in_use;
+
+    /* the connection whose list of live statements this statement is linked
+     * into (a borrowed reference), and its neighbours in that list */
+    pysqlite_Connection* connection;
+    struct _pysqlite_Statement* prev;
+    struct _pysqlite_Statement* next;
+
+    /* the tables the statement depends on, and the tables and schemas it
+     * creates, drops or alters */
+    pysqlite_NameSet reads;
+    pysqlite_NameSet writes;
+
+    /* 1 if the statement was created by calling the connection; it then holds
+     * a reference to the connection and can be executed directly */
+    int owns_connection;
+
+    /* 1 while a directly executed statement has a result row that has not
+     * been fetched yet */
+    int has_row;
+
     PyObject* in_weakreflist; /* List of weak references */
 } pysqlite_Statement;
 
@@ -53,6 +73,7 @@ int pysqlite_statement_recompile(pysqlite_Statement* self, PyObject* parameters)
 int pysqlite_statement_finalize(pysqlite_Statement* self);
 int pysqlite_statement_reset(pysqlite_Statement* self);
 void pysqlite_statement_mark_dirty(pysqlite_Statement* self);
+Py_ssize_t pysqlite_statement_memory_used(PyObject* self);
 
 int pysqlite_statement_setup_types(void);
 
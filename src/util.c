@@ -23,6 +23,17 @@
 
 #include "module.h"
 #include "connection.h"
+#include "util.h"
+
+#ifdef MS_WINDOWS
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+#endif
 
 int pysqlite_step(sqlite3_stmt* statement, pysqlite_Connection* connection)
 {
@@ -33,6 +44,20 @@ int pysqlite_step(sqlite3_stmt* statement, pysqlite_Connection* connection)
          * returns NULL for "no-operation" statements */
         rc = SQLITE_OK;
     } else {
+        if (connection) {
+            if (connection->step_budget) {
+                /* every step gets a fresh budget */
+                connection->step_instructions = 0;
+                connection->step_started = pysqlite_time();
+            }
+#if SQLITE_VERSION_NUMBER >= 3007010
+            if (!sqlite3_stmt_busy(statement)) {
+                /* a new execution starts, which ends statement-scoped function caches */
+                connection->executions++;
+            }
+#endif
+        }
+
         Py_BEGIN_ALLOW_THREADS
         rc = sqlite3_step(statement);
         Py_END_ALLOW_THREADS
@@ -104,3 +129,92 @@ int _pysqlite_seterror(sqlite3* db, sqlite3_stmt* st)
     return errorcode;
 }
 
+/* Sleeps with the GIL released. */
+void pysqlite_sleep(double seconds)
+{
+#ifndef MS_WINDOWS
+    struct timeval tv;
+
+    tv.tv_sec = (long)seconds;
+    tv.tv_usec = (long)((seconds - (double)tv.tv_sec) * 1000000.0);
+#endif
+
+    Py_BEGIN_ALLOW_THREADS
+#ifdef MS_WINDOWS
+    Sleep((DWORD)(seconds * 1000.0));
+#else
+    (void)select(0, NULL, NULL, NULL, &tv);
+#endif
+    Py_END_ALLOW_THREADS
+}
+
+/* The time is only used for intervals, so it comes from a monotonic clock
+ * where there is one: setting the system clock must not end a step budget or
+ * a busy wait early, or make it last forever. */
+double pysqlite_time(void)
+{
+#ifdef MS_WINDOWS
+#if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0600
+    return (double)GetTickCount64() / 1000.0;
+#else
+    /* wraps around after 49.7 days */
+    return (double)GetTickCount() / 1000.0;
+#endif
+#else
+    struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+    }
+#endif
+
+    /* the kernel lacks CLOCK_MONOTONIC, so it fails every time */
+    (void)gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+#endif
+}
+
+/* the busy handler's first wait takes BUSY_MIN_DELAY seconds; each further
+ * wait takes twice as long as the previous one, up to BUSY_MAX_DELAY */
+#define BUSY_MIN_DELAY 0.001
+#define BUSY_MAX_DELAY 0.1
+
+/*
+ * Each wait is twice as long as the previous one, and up to half of it is cut
+ * off at random, so that connections waiting for the same lock don't all
+ * retry at the same moment.
+ */
+int pysqlite_busy_backoff(int count, double timeout, double* started, long* waits, double* waited)
+{
+    double now;
+    double delay;
+    unsigned int jitter;
+
+    now = pysqlite_time();
+    if (count == 0) {
+        *started = now;
+    }
+
+    if (now - *started >= timeout) {
+        return 0;
+    }
+
+    delay = BUSY_MIN_DELAY * (double)(1 << (count < 10 ? count : 10));
+    if (delay > BUSY_MAX_DELAY) {
+        delay = BUSY_MAX_DELAY;
+    }
+    sqlite3_randomness(sizeof(jitter), &jitter);
+    delay -= delay * (double)(jitter % 1000) / 2000.0;
+    if (delay > timeout - (now - *started)) {
+        delay = timeout - (now - *started);
+    }
+
+    (void)sqlite3_sleep(delay < 0.001 ? 1 : (int)(delay * 1000.0));
+
+    (*waits)++;
+    *waited += pysqlite_time() - now;
+
+    return 1;
+}
@@ -35,4 +35,16 @@ int pysqlite_step(sqlite3_stmt* statement, pysqlite_Connection* connection);
  * Returns the error code (0 means no error occurred).
  */
 int _pysqlite_seterror(sqlite3* db, sqlite3_stmt* st);
+
+/* Sleeps for the given number of seconds with the GIL released. */
+void pysqlite_sleep(double seconds);
+
+/* Returns the time in seconds since an arbitrary point, for measuring
+ * intervals. Doesn't need the GIL. */
+double pysqlite_time(void);
+
+/* The body of an adaptive SQLite busy handler: waits a little longer for each
+ * retry count, up to timeout seconds after *started. Adds the waits to *waits
+ * and *waited. Doesn't need the GIL. Returns 1 to retry, 0 to give up. */
+int pysqlite_busy_backoff(int count, double timeout, double* started, long* waits, double* waited);
 #endif
@@ -0,0 +1,696 @@
+/* vtable.c - virtual tables implemented in Python
+ *
+ * Copyright (C) 2010 Gerhard Hring <gh@ghaering.de>
+ *
+ * This file is part of pysqlite.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "module.h"
+#include "connection.h"
+#include "vtable.h"
+#include "shard.h"
+#include "util.h"
+#include "sqlitecompat.h"
+
+/* the estimated cost of a full scan, for tables without best_index() */
+#define VTABLE_FULL_SCAN_COST 1000000.0
+
+/* the most rows that are pulled from the iterator of a scan at a time */
+#define VTABLE_BATCH_ROWS 64
+
+/*
+ * A virtual table module is a Python class. SQLite calls into it from
+ * sqlite3_prepare and sqlite3_step, where the GIL is released, so every
+ * callback takes the GIL first. Exceptions become the SQLite error message
+ * of the statement.
+ *
+ * The rows of a scan are pulled from the iterable that the cursor's filter()
+ * returns, up to VTABLE_BATCH_ROWS at a time, and copied into
+ * pysqlite_ShardValue buffers. xNext only takes the GIL when it has used up a
+ * batch, and xColumn and xEof never do, so stepping through a batch doesn't
+ * contend with other Python threads.
+ */
+
+typedef struct
+{
+    sqlite3_vtab base;
+    PyObject* table;
+} pysqlite_VTable;
+
+typedef struct
+{
+    sqlite3_vtab_cursor base;
+    PyObject* cursor;
+
+    /* the rows of the current scan; NULL once they were all pulled */
+    PyObject* iterator;
+
+    /* the current batch of rows, ncols values per row, and the current row;
+     * there is room for capacity values. The scan is at its end when
+     * position reaches nrows. */
+    pysqlite_ShardValue* values;
+    int capacity;
+    int ncols;
+    int nrows;
+    int position;
+    sqlite3_int64 rowid;
+} pysqlite_VTableCursor;
+
+/* Turns the current Python exception into an error message allocated with
+ * sqlite3_mprintf, stored in *message. Returns SQLITE_ERROR. */
+static int vtable_error(char** message)
+{
+    PyObject* exc_type;
+    PyObject* exc_value;
+    PyObject* exc_tb;
+    PyObject* text = NULL;
+
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    if (exc_value) {
+        text = PyObject_Str(exc_value);
+    }
+
+    sqlite3_free(*message);
+    if (text && PyString_Check(text)) {
+        *message = sqlite3_mprintf("%s", PyString_AsString(text));
+    } else {
+        *message = sqlite3_mprintf("virtual table method raised an exception");
+    }
+    Py_XDECREF(text);
+
+    if (_enable_callback_tracebacks) {
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+        PyErr_Print();
+    } else {
+        Py_XDECREF(exc_type);
+        Py_XDECREF(exc_value);
+        Py_XDECREF(exc_tb);
+        PyErr_Clear();
+    }
+
+    return SQLITE_ERROR;
+}
+
+/* Calls an optional method without arguments. Returns 0, or -1 with an
+ * exception set. */
+static int vtable_call_optional(PyObject* obj, const char* name)
+{
+    PyObject* ret;
+
+    if (!PyObject_HasAttrString(obj, name)) {
+        return 0;
+    }
+    ret = PyObject_CallMethod(obj, (char*)name, "");
+    if (!ret) {
+        return -1;
+    }
+    Py_DECREF(ret);
+    return 0;
+}
+
+static int vtable_connect(sqlite3* db, void* aux, int argc, const char* const* argv, sqlite3_vtab** vtab, char** err)
+{
+    pysqlite_VTable* self = NULL;
+    PyObject* args = NULL;
+    PyObject* table = NULL;
+    PyObject* schema = NULL;
+    PyObject* schema_utf8 = NULL;
+    PyObject* arg;
+    int rc = SQLITE_ERROR;
+    int i;
+#ifdef WITH_THREAD
+    PyGILState_STATE threadstate;
+
+    threadstate = PyGILState_Ensure();
+#endif
+
+    /* argv holds the module name, the database name and the table name,
+     * followed by the module arguments */
+    args = PyTuple_New(argc > 3 ? argc - 3 : 0);
+    if (!args) {
+        goto error;
+    }
+    for (i = 3; i < argc; i++) {
+        arg = PyUnicode_DecodeUTF8(argv[i], strlen(argv[i]), NULL);
+        if (!arg) {
+            goto error;
+        }
+        PyTuple_SET_ITEM(args, i - 3, arg);
+    }
+
+    table = PyObject_CallObject((PyObject*)aux, args);
+    if (!table) {
+        goto error;
+    }
+
+    schema = PyObject_GetAttrString(table, "schema");
+    if (!schema) {
+        goto error;
+    }
+    if (PyUnicode_Check(schema)) {
+        schema_utf8 = PyUnicode_AsUTF8String(schema);
+    } else if (PyString_Check(schema)) {
+        Py_INCREF(schema);
+        schema_utf8 = schema;
+    } else {
+        PyErr_SetString(PyExc_TypeError, "the schema of a virtual table must be a string");
+    }
+    if (!schema_utf8) {
+        goto error;
+    }
+
+    rc = sqlite3_declare_vtab(db, PyString_AsString(schema_utf8));
+    if (rc != SQLITE_OK) {
+        sqlite3_free(*err);
+        *err = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+        goto finally;
+    }
+
+    self = sqlite3_malloc(sizeof(pysqlite_VTable));
+    if (!self) {
+        rc = SQLITE_NOMEM;
+        goto finally;
+    }
+    memset(self, 0, sizeof(pysqlite_VTable));
+    self->table = table;
+    table = NULL;
+    *vtab = &self->base;
+    rc = SQLITE_OK;
+    goto finally;
+
+error:
+    rc = vtable_error(err);
+
+finally:
+    Py_XDECREF(args);
+    Py_XDECREF(table);
+    Py_XDECREF(schema);
+    Py_XDECREF(schema_utf8);
+
+#ifdef WITH_THREAD
+    PyGILState_Release(threadstate);
+#endif
+    return rc;
+}
+
+/* Frees a virtual table; destroy is 1 for DROP TABLE. */
+static int vtable_release(sqlite3_vtab* vtab, int destroy)
+{
+    pysqlite_VTable* self = (pysqlite_VTable*)vtab;
+    int rc = SQLITE_OK;
+#ifdef WITH_THREAD
+    PyGILState_STATE threadstate;
+
+    threadstate = PyGILState_Ensure();
+#endif
+
+    if (vtable_call_optional(self->table, destroy ? "destroy" : "disconnect") < 0) {
+        rc = vtable_error(&vtab->zErrMsg);
+        if (destroy) {
+            /* the table stays */
+            goto finally;
+        }
+    }
+
+    Py_DECREF(self->table);
+    sqlite3_free(self->base.zErrMsg);
+    sqlite3_free(self);
+
+finally:
+#ifdef WITH_THREAD
+    PyGILState_Release(threadstate);
+#endif
+    return rc;
+}
+
+static int vtable_disconnect(sqlite3_vtab* vtab)
+{
+    return vtable_release(vtab, 0);
+}
+
+static int vtable_destroy(sqlite3_vtab* vtab)
+{
+    return vtable_release(vtab, 1);
+}
+
+/*
+ * Passes the usable constraints as a list of (column, operator) tuples and
+ * the ORDER BY terms as a list of (column, descending) tuples to
+ * best_index(), which returns (used, index_num, index_str, orderby_consumed,
+ * estimated_cost). used has a true item for each constraint that filter()
+ * should get the value of, in the same order.
+ */
+static int vtable_best_index(sqlite3_vtab* vtab, sqlite3_index_info* info)
+{
+    pysqlite_VTable* self = (pysqlite_VTable*)vtab;
+    PyObject* constraints = NULL;
+    PyObject* orderbys = NULL;
+    PyObject* item;
+    PyObject* result = NULL;
+    PyObject* used;
+    PyObject* used_fast = NULL;
+    int* positions = NULL;
+    int count = 0;
+    int index_num;
+    char* index_str;
+    int consumed;
+    double cost;
+    int argv_index = 0;
+    int rc = SQLITE_OK;
+    int i;
+#ifdef WITH_THREAD
+    PyGILState_STATE threadstate;
+
+    threadstate = PyGILState_Ensure();
+#endif
+
+    if (!PyObject_HasAttrString(self->table, "best_index")) {
+        info->estimatedCost = VTABLE_FULL_SCAN_COST;
+        goto finally;
+    }
+
+    /* positions maps the items of the constraints list to aConstraint */
+    positions = PyMem_Malloc((info->nConstraint + 1) * sizeof(int));
+    constraints = PyList_New(0);
+    orderbys = PyList_New(0);
+    if (!positions || !constraints || !orderbys) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    for (i = 0; i < info->nConstraint; i++) {
+        if (!info->aConstraint[i].usable) {
+            continue;
+        }
+        item = Py_BuildValue("(ii)", info->aConstraint[i].iColumn, (int)info->aConstraint[i].op);
+        if (!item || PyList_Append(constraints, item) < 0) {
+            Py_XDECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+        positions[count++] = i;
+    }
+
+    for (i = 0; i < info->nOrderBy; i++) {
+        item = Py_BuildValue("(iN)", info->aOrderBy[i].iColumn, PyBool_FromLong(info->aOrderBy[i].desc));
+        if (!item || PyList_Append(orderbys, item) < 0) {
+            Py_XDECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+    }
+
+    result = PyObject_CallMethod(self->table, "best_index", "OO", constraints, orderbys);
+    if (!result) {
+        goto error;
+    }
+
+    if (result == Py_None) {
+        info->estimatedCost = VTABLE_FULL_SCAN_COST;
+        goto finally;
+    }
+
+    if (!PyTuple_Check(result)) {
+        PyErr_SetString(PyExc_TypeError, "best_index() must return a tuple or None");
+        goto error;
+    }
+    if (!PyArg_ParseTuple(result, "Oizid:best_index", &used, &index_num, &index_str, &consumed, &cost)) {
+        goto error;
+    }
+
+    used_fast = PySequence_Fast(used, "the used constraints must be a sequence");
+    if (!used_fast) {
+        goto error;
+    }
+    if (PySequence_Fast_GET_SIZE(used_fast) != count) {
+        PyErr_SetString(PyExc_ValueError, "best_index() must return one used flag per constraint");
+        goto error;
+    }
+
+    for (i = 0; i < count; i++) {
+        switch (PyObject_IsTrue(PySequence_Fast_GET_ITEM(used_fast, i))) {
+            case -1:
+                goto error;
+            case 1:
+                info->aConstraintUsage[positions[i]].argvIndex = ++argv_index;
+                break;
+        }
+    }
+
+    info->idxNum = index_num;
+    if (index_str) {
+        info->idxStr = sqlite3_mprintf("%s", index_str);
+        info->needToFreeIdxStr = 1;
+    }
+    info->orderByConsumed = consumed;
+    info->estimatedCost = cost;
+    goto finally;
+
+error:
+    rc = vtable_error(&vtab->zErrMsg);
+
+finally:
+    PyMem_Free(positions);
+    Py_XDECREF(constraints);
+    Py_XDECREF(orderbys);
+    Py_XDECREF(result);
+    Py_XDECREF(used_fast);
+
+#ifdef WITH_THREAD
+    PyGILState_Release(threadstate);
+#endif
+    return rc;
+}
+
+/* Frees the values of the current batch, but keeps the buffer. Doesn't need
+ * the GIL. */
+static void vtable_clear_batch(pysqlite_VTableCursor* self)
+{
+    int i;
+
+    for (i = 0; i < self->nrows * self->ncols; i++) {
+        pysqlite_shard_value_clear(&self->values[i]);
+    }
+
+    self->nrows = 0;
+    self->position = 0;
+}
+
+static int vtable_open(sqlite3_vtab* vtab, sqlite3_vtab_cursor** cursor)
+{
+    pysqlite_VTable* table = (pysqlite_VTable*)vtab;
+    pysqlite_VTableCursor* self;
+    PyObject* py_cursor;
+    int rc = SQLITE_OK;
+#ifdef WITH_THREAD
+    PyGILState_STATE threadstate;
+
+    threadstate = PyGILState_Ensure();
+#endif
+
+    py_cursor = PyObject_CallMethod(table->table, "open", "");
+    if (!py_cursor) {
+        rc = vtable_error(&vtab->zErrMsg);
+        goto finally;
+    }
+
+    self = sqlite3_malloc(sizeof(pysqlite_VTableCursor));
+    if (!self) {
+        Py_DECREF(py_cursor);
+        rc = SQLITE_NOMEM;
+        goto finally;
+    }
+    memset(self, 0, sizeof(pysqlite_VTableCursor));
+    self->cursor = py_cursor;
+    *cursor = &self->base;
+
+finally:
+#ifdef WITH_THREAD
+    PyGILState_Release(threadstate);
+#endif
+    return rc;
+}
+
+static int vtable_close(sqlite3_vtab_cursor* cursor)
+{
+    pysqlite_VTableCursor* self = (pysqlite_VTableCursor*)cursor;
+    int rc = SQLITE_OK;
+#ifdef WITH_THREAD
+    PyGILState_STATE threadstate;
+
+    threadstate = PyGILState_Ensure();
+#endif
+
+    if (vtable_call_optional(self->cursor, "close") < 0) {
+        rc = vtable_error(&cursor->pVtab->zErrMsg);
+    }
+
+    Py_XDECREF(self->iterator);
+    Py_DECREF(self->cursor);
+
+#ifdef WITH_THREAD
+    PyGILState_Release(threadstate);
+#endif
+
+    vtable_clear_batch(self);
+    sqlite3_free(self->values);
+    sqlite3_free(self);
+    return rc;
+}
+
+/* Pulls the next batch of rows from the iterator and copies their values.
+ * Rows shorter than the longest one of the batch are padded with NULLs. Needs
+ * the GIL. */
+static int vtable_fill(pysqlite_VTableCursor* self)
+{
+    PyObject* rows[VTABLE_BATCH_ROWS];
+    PyObject* item;
+    pysqlite_ShardValue* values;
+    pysqlite_ShardValue* value;
+    Py_ssize_t size;
+    int count = 0;
+    int ncols = 0;
+    int rc = SQLITE_OK;
+    int i;
+    int j;
+
+    vtable_clear_batch(self);
+
+    while (self->iterator && count < VTABLE_BATCH_ROWS) {
+        item = PyIter_Next(self->iterator);
+        if (!item) {
+            if (PyErr_Occurred()) {
+                goto error;
+            }
+            /* the end of the scan; the next xNext won't need the GIL */
+            Py_CLEAR(self->iterator);
+            break;
+        }
+
+        rows[count] = PySequence_Fast(item, "the rows of a virtual table must be sequences");
+        Py_DECREF(item);
+        if (!rows[count]) {
+            goto error;
+        }
+
+        size = PySequence_Fast_GET_SIZE(rows[count]);
+        count++;
+        if (size > INT_MAX / (VTABLE_BATCH_ROWS * (int)sizeof(pysqlite_ShardValue))) {
+            PyErr_SetString(pysqlite_DataError, "virtual table row too long");
+            goto error;
+        }
+        if (size > ncols) {
+            ncols = (int)size;
+        }
+    }
+
+    if (count * ncols > self->capacity) {
+        values = sqlite3_realloc(self->values, count * ncols * sizeof(pysqlite_ShardValue));
+        if (!values) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        self->values = values;
+        self->capacity = count * ncols;
+    }
+    if (count * ncols > 0) {
+        memset(self->values, 0, count * ncols * sizeof(pysqlite_ShardValue));
+    }
+    self->ncols = ncols;
+    self->nrows = count;
+
+    for (i = 0; i < count; i++) {
+        size = PySequence_Fast_GET_SIZE(rows[i]);
+        for (j = 0; j < ncols; j++) {
+            value = &self->values[i * ncols + j];
+            if (j >= size) {
+                value->type = SQLITE_NULL;
+            } else if (pysqlite_shard_value_from_object(value, PySequence_Fast_GET_ITEM(rows[i], j), j) != 0) {
+                if (PyErr_ExceptionMatches(pysqlite_InterfaceError)) {
+                    PyErr_Format(pysqlite_InterfaceError, "unsupported type in column %d of a virtual table row", j);
+                }
+                goto error;
+            }
+        }
+    }
+    goto finally;
+
+error:
+    vtable_clear_batch(self);
+    rc = vtable_error(&self->base.pVtab->zErrMsg);
+
+finally:
+    for (i = 0; i < count; i++) {
+        Py_DECREF(rows[i]);
+    }
+    return rc;
+}
+
+static int vtable_filter(sqlite3_vtab_cursor* cursor, int index_num, const char* index_str, int argc, sqlite3_value** argv)
+{
+    pysqlite_VTableCursor* self = (pysqlite_VTableCursor*)cursor;
+    PyObject* args;
+    PyObject* rows = NULL;
+    int rc;
+#ifdef WITH_THREAD
+    PyGILState_STATE threadstate;
+
+    threadstate = PyGILState_Ensure();
+#endif
+
+    Py_CLEAR(self->iterator);
+    vtable_clear_batch(self);
+    self->rowid = 1;
+
+    args = _pysqlite_build_py_params(NULL, argc, argv);
+    if (args) {
+        rows = PyObject_CallMethod(self->cursor, "filter", "izO", index_num, index_str, args);
+        Py_DECREF(args);
+    }
+    if (rows) {
+        self->iterator = PyObject_GetIter(rows);
+        Py_DECREF(rows);
+    }
+
+    if (!self->iterator) {
+        rc = vtable_error(&cursor->pVtab->zErrMsg);
+    } else {
+        rc = vtable_fill(self);
+    }
+
+#ifdef WITH_THREAD
+    PyGILState_Release(threadstate);
+#endif
+    return rc;
+}
+
+static int vtable_next(sqlite3_vtab_cursor* cursor)
+{
+    pysqlite_VTableCursor* self = (pysqlite_VTableCursor*)cursor;
+    int rc;
+#ifdef WITH_THREAD
+    PyGILState_STATE threadstate;
+#endif
+
+    self->rowid++;
+    if (++self->position < self->nrows || !self->iterator) {
+        /* the next row of the batch, or the end of the scan */
+        return SQLITE_OK;
+    }
+
+#ifdef WITH_THREAD
+    threadstate = PyGILState_Ensure();
+#endif
+
+    rc = vtable_fill(self);
+
+#ifdef WITH_THREAD
+    PyGILState_Release(threadstate);
+#endif
+    return rc;
+}
+
+static int vtable_eof(sqlite3_vtab_cursor* cursor)
+{
+    pysqlite_VTableCursor* self = (pysqlite_VTableCursor*)cursor;
+
+    return self->position >= self->nrows;
+}
+
+static int vtable_column(sqlite3_vtab_cursor* cursor, sqlite3_context* context, int i)
+{
+    pysqlite_VTableCursor* self = (pysqlite_VTableCursor*)cursor;
+
+    /* the values were converted by vtable_fill, so this doesn't need the GIL
+     * and can't fail */
+    if (i < self->ncols) {
+        pysqlite_shard_value_result(context, &self->values[self->position * self->ncols + i]);
+    } else {
+        sqlite3_result_null(context);
+    }
+
+    return SQLITE_OK;
+}
+
+static int vtable_rowid(sqlite3_vtab_cursor* cursor, sqlite3_int64* rowid)
+{
+    *rowid = ((pysqlite_VTableCursor*)cursor)->rowid;
+    return SQLITE_OK;
+}
+
+static sqlite3_module vtable_module = {
+    1,                      /* iVersion */
+    vtable_connect,         /* xCreate */
+    vtable_connect,         /* xConnect */
+    vtable_best_index,      /* xBestIndex */
+    vtable_disconnect,      /* xDisconnect */
+    vtable_destroy,         /* xDestroy */
+    vtable_open,            /* xOpen */
+    vtable_close,           /* xClose */
+    vtable_filter,          /* xFilter */
+    vtable_next,            /* xNext */
+    vtable_eof,             /* xEof */
+    vtable_column,          /* xColumn */
+    vtable_rowid,           /* xRowid */
+    NULL,                   /* xUpdate */
+    NULL,                   /* xBegin */
+    NULL,                   /* xSync */
+    NULL,                   /* xCommit */
+    NULL,                   /* xRollback */
+    NULL,                   /* xFindFunction */
+    NULL                    /* xRename */
+};
+
+PyObject* pysqlite_connection_create_module(pysqlite_Connection* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"name", "cls", NULL};
+
+    char* name;
+    PyObject* cls;
+    int rc;
+
+    if (!pysqlite_check_thread(self) || !pysqlite_check_connection(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sO:create_module", kwlist, &name, &cls)) {
+        return NULL;
+    }
+
+    if (!PyCallable_Check(cls)) {
+        PyErr_SetString(PyExc_TypeError, "the virtual table class must be callable");
+        return NULL;
+    }
+
+    /* the class must stay alive as long as SQLite may use it */
+    if (PyDict_SetItem(self->function_pinboard, cls, Py_None) == -1) {
+        return NULL;
+    }
+
+    pysqlite_connection_lock(self);
+    rc = sqlite3_create_module(self->db, name, &vtable_module, (void*)cls);
+    pysqlite_connection_unlock(self);
+    if (rc != SQLITE_OK) {
+        _pysqlite_seterror(self->db, NULL);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}